@@ -5,6 +5,66 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+// Devuelve H0-Hm y H1-Hm, siendo Hm = min(H0,H1)
+__device__ float2 calcularDifH(float H0, float H1)
+{
+	float Hm = fminf(H0,H1);
+
+	return make_float2(H0-Hm, H1-Hm);
+}
+
+// Devuelve H0-Hm y H1-Hm de la arista que separa los volúmenes (x0,y0) y (x1,y1) de la
+// textura. Si ARISTAS_PRECALCULADAS está definido, se leen de d_difHAristas[pos_arista]
+__device__ float2 obtenerDifHArista(float2 *d_difHAristas, int pos_arista, int x0, int y0, int x1, int y1)
+{
+#ifdef ARISTAS_PRECALCULADAS
+	return d_difHAristas[pos_arista];
+#else
+	return calcularDifH(tex2D(texBatimetria, x0, y0), tex2D(texBatimetria, x1, y1));
+#endif
+}
+
+// Devuelve 1 si hay que procesar la arista que separa los volúmenes (x0,y0) y (x1,y1) de la
+// textura, es decir, si alguno de los dos está en un bloque activo o en una fila de comunicación.
+// En las aristas frontera, el volumen que se sale de la malla se sustituye por el otro.
+// Si OMITIR_BLOQUES_SECOS no está definido, no se tienen en cuenta los bloques activos.
+// En dt_arista devuelve el paso de tiempo con el que se procesa la arista: delta_T o, si
+// PASO_TIEMPO_LOCAL está definido, 2^k*delta_T, siendo k la menor clase de los bloques de sus
+// dos volúmenes. En ese caso la arista sólo se procesa en los subpasos múltiplos de 2^k
+__device__ int aristaActiva(int *d_bloquesActivos, int *d_clasesBloques, int paso_local, float delta_T,
+				float *dt_arista, int x0, int y0, int x1, int y1, int num_volx, int num_voly)
+{
+	int num_bloques_x = iDivUp(num_volx, NUM_HEBRAS_ANCHO_EST);
+	int comunicacion = ((y0 < 1) || (y1 > num_voly));
+	int bloque0, bloque1;
+#ifdef PASO_TIEMPO_LOCAL
+	int clase;
+#endif
+
+	*dt_arista = delta_T;
+	if (x0 < 0)  x0 = x1;
+	if (x1 >= num_volx)  x1 = x0;
+	if (y0 < 1)  y0 = y1;
+	if (y1 > num_voly)  y1 = y0;
+	// Restamos 1 a las coordenadas y porque la primera fila de la textura corresponde
+	// a volúmenes de comunicación de otro cluster
+	bloque0 = ((y0-1)/NUM_HEBRAS_ALTO_EST)*num_bloques_x + x0/NUM_HEBRAS_ANCHO_EST;
+	bloque1 = ((y1-1)/NUM_HEBRAS_ALTO_EST)*num_bloques_x + x1/NUM_HEBRAS_ANCHO_EST;
+#ifdef PASO_TIEMPO_LOCAL
+	// Los bloques que tocan otro cluster tienen clase 0, por lo que las aristas de comunicación
+	// se procesan en todos los subpasos
+	clase = min(d_clasesBloques[bloque0], d_clasesBloques[bloque1]);
+	if ((paso_local & ((1 << clase) - 1)) != 0)
+		return 0;
+	*dt_arista = (1 << clase)*delta_T;
+#endif
+#ifdef OMITIR_BLOQUES_SECOS
+	return (comunicacion || d_bloquesActivos[bloque0] || d_bloquesActivos[bloque1]);
+#else
+	return 1;
+#endif
+}
+
 #ifdef COULOMB
 
 // Ley de Coulomb
@@ -91,20 +151,29 @@ __device__ TVec4 getFlujo_1dC(TVec4 *W, float epsilon_h)
 	return F;
 }
 
-__device__ TVec4 terminosPresion1D(float h1ij, float h2ij, TVec4 *W0_rot, TVec4 *W1_rot,
-								  float H0, float H1, float r, float gravedad)
+// Devuelve en x e y los saltos de eta de las capas 1 y 2 en la arista (deta1 y deta2).
+// dH0 = H0-Hm y dH1 = H1-Hm, siendo Hm = min(H0,H1)
+__device__ float2 obtenerSaltosEta(TVec4 *W0_rot, TVec4 *W1_rot, float dH0, float dH1)
 {
-	TVec4 tp;
-	float Hm, h0, h1, deta1, deta2;
+	float2 deta;
+	float h0, h1;
 
-	Hm = fminf(H0,H1);
-	h0 = fmaxf(W0_rot->x + W0_rot->z - H0 + Hm, 0.0);
-	h1 = fmaxf(W1_rot->x + W1_rot->z - H1 + Hm, 0.0);
-	deta1 = h1-h0;
+	h0 = fmaxf(W0_rot->x + W0_rot->z - dH0, 0.0);
+	h1 = fmaxf(W1_rot->x + W1_rot->z - dH1, 0.0);
+	deta.x = h1-h0;
+
+	h0 = fmaxf(W0_rot->z - dH0, 0.0);
+	h1 = fmaxf(W1_rot->z - dH1, 0.0);
+	deta.y = h1-h0;
+
+	return deta;
+}
 
-	h0 = fmaxf(W0_rot->z - H0 + Hm, 0.0);
-	h1 = fmaxf(W1_rot->z - H1 + Hm, 0.0);
-	deta2 = h1-h0;
+__device__ TVec4 terminosPresion1D(float h1ij, float h2ij, float2 deta, float r, float gravedad)
+{
+	TVec4 tp;
+	float deta1 = deta.x;
+	float deta2 = deta.y;
 
 	tp.x = 0.0;
 	tp.y = gravedad*h1ij*deta1;
@@ -115,28 +184,20 @@ __device__ TVec4 terminosPresion1D(float h1ij, float h2ij, TVec4 *W0_rot, TVec4
 }
 
 __device__ TVec4 terminosPresion1DMod(float h1ij, float h2ij, float u1ij_n, float u2ij_n,
-					TVec4 *W0_rot, TVec4 *W1_rot, float H0, float H1, float r, float delta_T,
-					float angulo1, float angulo2, float angulo3, float angulo4, float peso,
-					float gravedad, float epsilon_h, float L, float H)
+					float2 deta, float r, float delta_T, float angulo1, float angulo2, float angulo3,
+					float angulo4, float peso, float gravedad, float epsilon_h, float L, float H)
 {
 	TVec4 tp;
-	float Hm, h0, h1, deta1, deta2;
+	float deta1 = deta.x;
+	float deta2 = deta.y;
 	float muc, fsc, sc;
 	int coulomb;
 
-	Hm = fminf(H0,H1);
-	h0 = fmaxf(W0_rot->x + W0_rot->z - H0 + Hm, 0.0);
-	h1 = fmaxf(W1_rot->x + W1_rot->z - H1 + Hm, 0.0);
-	deta1 = h1-h0;
-
-	h0 = fmaxf(W0_rot->z - H0 + Hm, 0.0);
-	h1 = fmaxf(W1_rot->z - H1 + Hm, 0.0);
 	muc = defTerminoFriccion(angulo1, angulo2, angulo3, angulo4, h1ij, u1ij_n, h2ij, u2ij_n,
 			r, gravedad, epsilon_h, L, H);
 	fsc = 1.0 - r*(1.0 - expf(-powf(10.0*h1ij/epsilon_h,2.0)));
 	sc = fsc*muc*gravedad*h2ij;
 	coulomb = (fabsf(h2ij*u2ij_n) < peso*sc*delta_T) ? 1 : 0;
-	deta2 = h1-h0;
 
 	tp.x = 0.0;
 	tp.y = gravedad*h1ij*deta1;
@@ -237,25 +298,16 @@ __device__ TVec4 aproximarAutovalores1D(TVec4 *f0, float r, float gravedad, floa
 }
 
 __device__ TVec4 identityModification(float h1ij, float h2ij, float u1ij_n, float u2ij_n, TVec4 *W0_rot,
-					TVec4 *W1_rot, float H0, float H1, float dif_q1, float dif_q2, float r, float delta_T,
+					TVec4 *W1_rot, float2 deta, float dif_q1, float dif_q2, float r, float delta_T,
 					float angulo1, float angulo2, float angulo3, float angulo4, float peso,
 					float gravedad, float epsilon_h, float L, float H)
 {
 	TVec4 I2;
-	float Hm, h0, h1;
-	float deta1, deta2;
+	float deta1 = deta.x;
+	float deta2 = deta.y;
 	float muc, fsc, sc;
 	int coulomb;
 
-	Hm = fminf(H0,H1);
-	h0 = fmaxf(W0_rot->x + W0_rot->z - H0 + Hm, 0.0);
-	h1 = fmaxf(W1_rot->x + W1_rot->z - H1 + Hm, 0.0);
-	deta1 = h1-h0;
-
-	h0 = fmaxf(W0_rot->z - H0 + Hm, 0.0);
-	h1 = fmaxf(W1_rot->z - H1 + Hm, 0.0);
-	deta2 = h1-h0;
-
 	muc = defTerminoFriccion(angulo1, angulo2, angulo3, angulo4, h1ij, u1ij_n, h2ij, u2ij_n,
 			r, gravedad, epsilon_h, L, H);
 	fsc = 1.0 - r*(1.0 - expf(-powf(10.0*h1ij/epsilon_h,2.0)));
@@ -276,52 +328,54 @@ __device__ TVec4 identityModification(float h1ij, float h2ij, float u1ij_n, floa
 }
 
 // Tratamiento seco-mojado distinto
-/*__device__ void tratamientoSecoMojado(TVec4 *W0_rot, TVec4 *W1_rot, float *H0, float *H1, float epsilon_h)
+/*__device__ void tratamientoSecoMojado(TVec4 *W0_rot, TVec4 *W1_rot, float dH0, float dH1, float epsilon_h)
 {
-	if ((W0_rot->z < epsilon_h) && (*H1 - W1_rot->z > *H0))
+	if ((W0_rot->z < epsilon_h) && (dH1 - W1_rot->z > dH0))
 		W1_rot->w *= 0.0*(W1_rot->w <= 0) + 1.0*(W1_rot->w > 0);
-	if ((W1_rot->z < epsilon_h) && (*H0 - W0_rot->z > *H1))
+	if ((W1_rot->z < epsilon_h) && (dH0 - W0_rot->z > dH1))
 		W0_rot->w *= 0.0*(W0_rot->w >= 0) + 1.0*(W0_rot->w < 0);
 
-	if ((W0_rot->x < epsilon_h) && (*H1 - W1_rot->x - W1_rot->z > *H0 - W0_rot->z))
+	if ((W0_rot->x < epsilon_h) && (dH1 - W1_rot->x - W1_rot->z > dH0 - W0_rot->z))
 		W1_rot->y *= 0.0*(W1_rot->y <= 0) + 1.0*(W1_rot->y > 0);
-	if ((W1_rot->x < epsilon_h) && (*H0 - W0_rot->x - W0_rot->z > *H1 - W1_rot->z))
+	if ((W1_rot->x < epsilon_h) && (dH0 - W0_rot->x - W0_rot->z > dH1 - W1_rot->z))
 		W0_rot->y *= 0.0*(W0_rot->y >= 0) + 1.0*(W0_rot->y < 0);
 
-	if ((W0_rot->z + W0_rot->x < epsilon_h) && (*H1 - W1_rot->x - W1_rot->z > *H0)) {
+	if ((W0_rot->z + W0_rot->x < epsilon_h) && (dH1 - W1_rot->x - W1_rot->z > dH0)) {
 		W1_rot->y *= 0.0*(W1_rot->y <= 0) + 1.0*(W1_rot->y > 0);
 		W1_rot->w *= 0.0*(W1_rot->w <= 0) + 1.0*(W1_rot->w > 0);
 	}
-	if ((W1_rot->z + W1_rot->x < epsilon_h) && (*H0 - W0_rot->x - W0_rot->z > *H1)) {
+	if ((W1_rot->z + W1_rot->x < epsilon_h) && (dH0 - W0_rot->x - W0_rot->z > dH1)) {
 		W0_rot->y *= 0.0*(W0_rot->y >= 0) + 1.0*(W0_rot->y < 0);
 		W0_rot->w *= 0.0*(W0_rot->w >= 0) + 1.0*(W0_rot->w < 0);
 	}
 }*/
 
-__device__ void tratamientoSecoMojado(TVec4 *W0_rot, TVec4 *W1_rot, float *H0, float *H1, float epsilon_h)
+// dH0 = H0-Hm y dH1 = H1-Hm, siendo Hm = min(H0,H1)
+__device__ void tratamientoSecoMojado(TVec4 *W0_rot, TVec4 *W1_rot, float dH0, float dH1, float epsilon_h)
 {
-	if ((W0_rot->z < epsilon_h) && (*H1 - W1_rot->z > *H0))
+	if ((W0_rot->z < epsilon_h) && (dH1 - W1_rot->z > dH0))
 		W1_rot->w = 0.0;
-	if ((W1_rot->z < epsilon_h) && (*H0 - W0_rot->z > *H1))
+	if ((W1_rot->z < epsilon_h) && (dH0 - W0_rot->z > dH1))
 		W0_rot->w = 0.0;
 
-	if ((W0_rot->x < epsilon_h) && (*H1 - W1_rot->x - W1_rot->z > *H0 - W0_rot->z))
+	if ((W0_rot->x < epsilon_h) && (dH1 - W1_rot->x - W1_rot->z > dH0 - W0_rot->z))
 		W1_rot->y = 0.0;
-	if ((W1_rot->x < epsilon_h) && (*H0 - W0_rot->x - W0_rot->z > *H1 - W1_rot->z))
+	if ((W1_rot->x < epsilon_h) && (dH0 - W0_rot->x - W0_rot->z > dH1 - W1_rot->z))
 		W0_rot->y = 0.0;
 
-	if ((W0_rot->z + W0_rot->x < epsilon_h) && (*H1 - W1_rot->x - W1_rot->z > *H0)) {
+	if ((W0_rot->z + W0_rot->x < epsilon_h) && (dH1 - W1_rot->x - W1_rot->z > dH0)) {
 		W1_rot->y = 0.0;
 		W1_rot->w = 0.0;
 	}
-	if ((W1_rot->z + W1_rot->x < epsilon_h) && (*H0 - W0_rot->x - W0_rot->z > *H1)) {
+	if ((W1_rot->z + W1_rot->x < epsilon_h) && (dH0 - W0_rot->x - W0_rot->z > dH1)) {
 		W0_rot->y = 0.0;
 		W0_rot->w = 0.0;
 	}
 }
 
-// pos_vol0 y pos_vol1 son las posiciones de los acumuladores donde la arista escribirá sus contribuciones
-__device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float normal_x, float normal_y,
+// pos_vol0 y pos_vol1 son las posiciones de los acumuladores donde la arista escribirá sus contribuciones.
+// dH0 = H0-Hm y dH1 = H1-Hm, siendo Hm = min(H0,H1) (en las aristas frontera son 0)
+__device__ void procesarArista(TVec *W0, TVec *W1, float dH0, float dH1, float normal_x, float normal_y,
 				float longitud, float area, float r, float delta_T, float angulo1, float angulo2,
 				float angulo3, float angulo4, float peso, float beta, float4 *d_acumulador_1,
 				float4 *d_acumulador_2, int pos_vol0, int pos_vol1, float gravedad, float epsilon_h,
@@ -352,6 +406,8 @@ __device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float nor
 	float h0, h1, sqrt_h0, sqrt_h1;
 	// Estados rotados de los volúmenes 0 y 1
 	TVec4 W0_rot, W1_rot;
+	// Saltos de eta de las capas 1 y 2
+	float2 deta;
 	float4 acum0_1, acum0_2;
 	float4 acum1_1, acum1_2;
 
@@ -370,7 +426,7 @@ __device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float nor
 	W1_rot.z = v_get_val(W1,3);
 	W1_rot.w = v_get_val(W1,4)*normal1.x + v_get_val(W1,5)*normal1.y;
 
-	tratamientoSecoMojado(&W0_rot, &W1_rot, &H0, &H1, epsilon_h);
+	tratamientoSecoMojado(&W0_rot, &W1_rot, dH0, dH1, epsilon_h);
 
 	// Capa 1
 	h0 = W0_rot.x;
@@ -420,9 +476,10 @@ __device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float nor
 		}
 
 		// Obtenemos los términos de presión
-		tp = terminosPresion1D(h1ij, h2ij, &W0_rot, &W1_rot, H0, H1, r, gravedad);
-		tp2 = terminosPresion1DMod(h1ij, h2ij, u1ij_n, u2ij_n, &W0_rot, &W1_rot, H0, H1, r,
-				delta_T, angulo1, angulo2, angulo3, angulo4, peso, gravedad, epsilon_h, L, H);
+		deta = obtenerSaltosEta(&W0_rot, &W1_rot, dH0, dH1);
+		tp = terminosPresion1D(h1ij, h2ij, deta, r, gravedad);
+		tp2 = terminosPresion1DMod(h1ij, h2ij, u1ij_n, u2ij_n, deta, r, delta_T, angulo1, angulo2,
+				angulo3, angulo4, peso, gravedad, epsilon_h, L, H);
 
 		// Obtenemos los autovalores de A
 		DES.x = h1ij;
@@ -482,7 +539,7 @@ __device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float nor
 		Fmas4.w = r*b*tp2.x + (b - u2ij_n*u2ij_n)*tp2.z + 2*u2ij_n*tp2.w;
 
 		// DES = I2
-		DES = identityModification(h1ij, h2ij, u1ij_n, u2ij_n, &W0_rot, &W1_rot, H0, H1, W1_rot.y-W0_rot.y,
+		DES = identityModification(h1ij, h2ij, u1ij_n, u2ij_n, &W0_rot, &W1_rot, deta, W1_rot.y-W0_rot.y,
 			W1_rot.w-W0_rot.w, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, gravedad, epsilon_h, L, H);
 
 		// DES = 0.5*(a0*DES + a1*tp2 + a2*Fmas4);
@@ -560,7 +617,12 @@ __device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float nor
 		float hp0_0, hp0_1, hp1_0, hp1_1;
 
 		// Asignamos hp0_0, hp0_1, hp1_0 y hp1_1
+#ifdef PASO_TIEMPO_LOCAL
+		// Los acumuladores tienen los flujos ya multiplicados por su paso de tiempo
+		b = 1.0/area;
+#else
 		b = delta_T/area;
+#endif
 		hp0_0 = v_get_val(W0,0) + b*acum0_1.x;
 		hp0_1 = v_get_val(W0,3) + b*acum0_2.x;
 		if (pos_vol1 != -1) {
@@ -612,6 +674,13 @@ __device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float nor
 			max_autovalor += epsilon_h;
 
 		c = longitud*max_autovalor/peso;
+#ifdef PASO_TIEMPO_LOCAL
+		// Acumulamos los flujos y la contribución al delta T multiplicados por el paso de la arista,
+		// ya que los volúmenes de clases distintas acumulan pasos de distinta longitud
+		sv_mlt6(delta_T, &Fmenos6, &Fmenos6);
+		sv_mlt6(delta_T, &Fmas6, &Fmas6);
+		c *= delta_T;
+#endif
 		if (pos_vol0 >= 0) {
 			// Actualizamos el valor del acumulador del volumen 0 para la capa 1
 			acum0_1.x -= peso*v_get_val(&Fmenos6,0);
@@ -650,10 +719,15 @@ __device__ void procesarArista(TVec *W0, TVec *W1, float H0, float H1, float nor
 // Si es una arista horizontal => borde1 = borde_sup, borde2 = borde_inf
 __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes, float borde1, float borde2, float longitud,
 				float area, float r, float delta_T, float angulo1, float angulo2, float angulo3, float angulo4,
-				float peso, float beta, float4 *d_acumulador_1, float4 *d_acumulador_2, float gravedad,
-				float epsilon_h, float L, float H, int tipo, int id_hebra, int ultima_hebra)
+				float peso, float beta, float4 *d_acumulador_1, float4 *d_acumulador_2, float2 *d_difHAristas,
+				int *d_bloquesActivos, int *d_clasesBloques, int paso_local, float gravedad, float epsilon_h, float L, float H,
+				int tipo, int id_hebra, int ultima_hebra)
 {
 	float4 datos_vol0, datos_vol1;
+	// Paso de tiempo con el que se procesa la arista (ver aristaActiva)
+	float dt_arista;
+	// H0-Hm y H1-Hm de la arista
+	float2 difH;
 	// Posición (x,y) de la malla asociada a la hebra
 	int pos_x_hebra, pos_y_hebra;
 	int pos_vol0, pos_vol1;
@@ -667,8 +741,9 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 		pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_ARI + threadIdx.y;
 		if (tipo == 2) pos_x_hebra++;
 
-		// Comprobamos si la hebra (arista) está dentro de los límites de la malla
-		if ((pos_x_hebra <= num_volx) && (pos_y_hebra < num_voly)) {
+		// Comprobamos si la hebra (arista) está dentro de los límites de la malla y si hay que procesarla
+		if ((pos_x_hebra <= num_volx) && (pos_y_hebra < num_voly) && aristaActiva(d_bloquesActivos,
+				d_clasesBloques, paso_local, delta_T, &dt_arista, pos_x_hebra-1, pos_y_hebra+1, pos_x_hebra, pos_y_hebra+1, num_volx, num_voly)) {
 			// Procesamos la arista vertical
 			// Obtenemos los datos de los volúmenes 0 y 1
 			if (pos_x_hebra == 0) {
@@ -695,8 +770,8 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 				v_set_val(&W1, 5, v_get_val(&W0,5));
 
 				pos_vol0 = pos_y_hebra*num_volx;
-				procesarArista(&W0, &W1, datos_vol0.w, datos_vol0.w, -longitud, 0.0, longitud, area, r,
-					delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+				procesarArista(&W0, &W1, 0.0, 0.0, -longitud, 0.0, longitud, area, r,
+					dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 					pos_vol0, -1, gravedad, epsilon_h, L, H, num_volumenes);
 			}
 			else {
@@ -722,8 +797,8 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 					v_set_val(&W1, 5, v_get_val(&W0,5));
 
 					pos_vol0 = (pos_y_hebra+1)*num_volx - 1;
-					procesarArista(&W0, &W1, datos_vol0.w, datos_vol0.w, longitud, 0.0, longitud, area, r,
-						delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+					procesarArista(&W0, &W1, 0.0, 0.0, longitud, 0.0, longitud, area, r,
+						dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 						pos_vol0, -1, gravedad, epsilon_h, L, H, num_volumenes);
 				}
 				else {
@@ -741,8 +816,10 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 					v_set_val(&W1, 5, datos_vol1.z);
 
 					pos_vol0 = pos_y_hebra*num_volx + pos_x_hebra-1;
-					procesarArista(&W0, &W1, datos_vol0.w, datos_vol1.w, longitud, 0.0, longitud, area, r,
-						delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+					difH = obtenerDifHArista(d_difHAristas, pos_y_hebra*(num_volx+1) + pos_x_hebra,
+						pos_x_hebra-1, pos_y_hebra+1, pos_x_hebra, pos_y_hebra+1);
+					procesarArista(&W0, &W1, difH.x, difH.y, longitud, 0.0, longitud, area, r,
+						dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 						pos_vol0, pos_vol0+1, gravedad, epsilon_h, L, H, num_volumenes);
 				}
 			}
@@ -755,8 +832,9 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 		pos_y_hebra = 2*(blockIdx.y*NUM_HEBRAS_ALTO_ARI + threadIdx.y);
 		if (tipo == 4) pos_y_hebra++;
 
-		// Comprobamos si la hebra (arista) está dentro de los límites de la malla
-		if ((pos_x_hebra < num_volx) && (pos_y_hebra <= num_voly)) {
+		// Comprobamos si la hebra (arista) está dentro de los límites de la malla y si hay que procesarla
+		if ((pos_x_hebra < num_volx) && (pos_y_hebra <= num_voly) && aristaActiva(d_bloquesActivos,
+				d_clasesBloques, paso_local, delta_T, &dt_arista, pos_x_hebra, pos_y_hebra, pos_x_hebra, pos_y_hebra+1, num_volx, num_voly)) {
 			// Procesamos la arista horizontal
 			// Obtenemos los datos de los volúmenes 0 y 1
 			if ((pos_y_hebra == 0) && (id_hebra == 0)) {
@@ -781,8 +859,8 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 				v_set_val(&W1, 4, v_get_val(&W0,4));
 				v_set_val(&W1, 5, v_get_val(&W0,5)*borde1);
 
-				procesarArista(&W0, &W1, datos_vol0.w, datos_vol0.w, 0.0, -longitud, longitud, area, r,
-					delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+				procesarArista(&W0, &W1, 0.0, 0.0, 0.0, -longitud, longitud, area, r,
+					dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 					pos_x_hebra, -1, gravedad, epsilon_h, L, H, num_volumenes);
 			}
 			else {
@@ -808,8 +886,8 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 					v_set_val(&W1, 5, v_get_val(&W0,5)*borde2);
 
 					pos_vol0 = (pos_y_hebra-1)*num_volx + pos_x_hebra;
-					procesarArista(&W0, &W1, datos_vol0.w, datos_vol0.w, 0.0, longitud, longitud, area, r,
-						delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+					procesarArista(&W0, &W1, 0.0, 0.0, 0.0, longitud, longitud, area, r,
+						dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 						pos_vol0, -1, gravedad, epsilon_h, L, H, num_volumenes);
 				}
 				else {
@@ -828,8 +906,10 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 
 					pos_vol0 = (pos_y_hebra-1)*num_volx + pos_x_hebra;
 					pos_vol1 = pos_vol0 + num_volx;
-					procesarArista(&W0, &W1, datos_vol0.w, datos_vol1.w, 0.0, longitud, longitud, area, r,
-						delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+					difH = obtenerDifHArista(d_difHAristas, pos_y_hebra*num_volx + pos_x_hebra,
+						pos_x_hebra, pos_y_hebra, pos_x_hebra, pos_y_hebra+1);
+					procesarArista(&W0, &W1, difH.x, difH.y, 0.0, longitud, longitud, area, r,
+						dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 						pos_vol0, pos_vol1, gravedad, epsilon_h, L, H, num_volumenes);
 				}
 			}
@@ -840,10 +920,15 @@ __global__ void procesarAristasGPU(int num_volx, int num_voly, int num_volumenes
 // tipo debe ser 3 (primer grupo de aristas horizontales)
 __global__ void procesarAristasNoComGPU(int num_volx, int num_voly, int num_volumenes, float borde1, float borde2,
 				float longitud, float area, float r, float delta_T, float angulo1, float angulo2, float angulo3,
-				float angulo4, float peso, float beta, float4 *d_acumulador_1, float4 *d_acumulador_2, float gravedad,
-				float epsilon_h, float L, float H, int tipo, int id_hebra, int ultima_hebra)
+				float angulo4, float peso, float beta, float4 *d_acumulador_1, float4 *d_acumulador_2, float2 *d_difHAristas,
+				int *d_bloquesActivos, int *d_clasesBloques, int paso_local, float gravedad, float epsilon_h, float L, float H,
+				int tipo, int id_hebra, int ultima_hebra)
 {
 	float4 datos_vol0, datos_vol1;
+	// Paso de tiempo con el que se procesa la arista (ver aristaActiva)
+	float dt_arista;
+	// H0-Hm y H1-Hm de la arista
+	float2 difH;
 	// Posición (x,y) de la malla asociada a la hebra
 	int pos_x_hebra, pos_y_hebra;
 	int pos_vol0, pos_vol1;
@@ -855,8 +940,9 @@ __global__ void procesarAristasNoComGPU(int num_volx, int num_voly, int num_volu
 	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_ARI + threadIdx.x;
 	pos_y_hebra = 2*(blockIdx.y*NUM_HEBRAS_ALTO_ARI + threadIdx.y);
 
-	// Comprobamos si la hebra (arista) está dentro de los límites de la malla
-	if ((pos_x_hebra < num_volx) && (pos_y_hebra <= num_voly)) {
+	// Comprobamos si la hebra (arista) está dentro de los límites de la malla y si hay que procesarla
+	if ((pos_x_hebra < num_volx) && (pos_y_hebra <= num_voly) && aristaActiva(d_bloquesActivos,
+			d_clasesBloques, paso_local, delta_T, &dt_arista, pos_x_hebra, pos_y_hebra, pos_x_hebra, pos_y_hebra+1, num_volx, num_voly)) {
 		// Procesamos la arista horizontal
 		if ((pos_y_hebra == 0) && (id_hebra == 0)) {
 			// Frontera superior
@@ -880,8 +966,8 @@ __global__ void procesarAristasNoComGPU(int num_volx, int num_voly, int num_volu
 			v_set_val(&W1, 4, v_get_val(&W0,4));
 			v_set_val(&W1, 5, v_get_val(&W0,5)*borde1);
 
-			procesarArista(&W0, &W1, datos_vol0.w, datos_vol0.w, 0.0, -longitud, longitud, area, r,
-				delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+			procesarArista(&W0, &W1, 0.0, 0.0, 0.0, -longitud, longitud, area, r,
+				dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 				pos_x_hebra, -1, gravedad, epsilon_h, L, H, num_volumenes);
 		}
 		else {
@@ -909,8 +995,8 @@ __global__ void procesarAristasNoComGPU(int num_volx, int num_voly, int num_volu
 				v_set_val(&W1, 5, v_get_val(&W0,5)*borde2);
 
 				pos_vol0 = (pos_y_hebra-1)*num_volx + pos_x_hebra;
-				procesarArista(&W0, &W1, datos_vol0.w, datos_vol0.w, 0.0, longitud, longitud, area, r,
-					delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+				procesarArista(&W0, &W1, 0.0, 0.0, 0.0, longitud, longitud, area, r,
+					dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 					pos_vol0, -1, gravedad, epsilon_h, L, H, num_volumenes);
 			}
 			else if ((pos_y_hebra > 0) && (pos_y_hebra < num_voly)) {
@@ -940,8 +1026,10 @@ __global__ void procesarAristasNoComGPU(int num_volx, int num_voly, int num_volu
 
 				pos_vol0 = (pos_y_hebra-1)*num_volx + pos_x_hebra;
 				pos_vol1 = pos_vol0 + num_volx;
-				procesarArista(&W0, &W1, datos_vol0.w, datos_vol1.w, 0.0, longitud, longitud, area, r,
-					delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
+				difH = obtenerDifHArista(d_difHAristas, pos_y_hebra*num_volx + pos_x_hebra,
+					pos_x_hebra, pos_y_hebra, pos_x_hebra, pos_y_hebra+1);
+				procesarArista(&W0, &W1, difH.x, difH.y, 0.0, longitud, longitud, area, r,
+					dt_arista, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 					pos_vol0, pos_vol1, gravedad, epsilon_h, L, H, num_volumenes);
 			}
 		}
@@ -951,10 +1039,12 @@ __global__ void procesarAristasNoComGPU(int num_volx, int num_voly, int num_volu
 // tipo debe ser 3 (primer grupo de aristas horizontales)
 __global__ void procesarAristasComGPU(int num_volx, int num_voly, int num_volumenes, float borde1, float borde2,
 				float longitud, float area, float r, float delta_T, float angulo1, float angulo2, float angulo3,
-				float angulo4, float peso, float beta, float4 *d_acumulador_1, float4 *d_acumulador_2, float gravedad,
-				float epsilon_h, float L, float H, int tipo, int id_hebra, int ultima_hebra)
+				float angulo4, float peso, float beta, float4 *d_acumulador_1, float4 *d_acumulador_2, float2 *d_difHAristas,
+				float gravedad, float epsilon_h, float L, float H, int tipo, int id_hebra, int ultima_hebra)
 {
 	float4 datos_vol0, datos_vol1;
+	// H0-Hm y H1-Hm de la arista
+	float2 difH;
 	// Posición x de la malla asociada a la hebra
 	int pos_x_hebra;
 	int pos_vol0, pos_vol1;
@@ -994,7 +1084,9 @@ __global__ void procesarAristasComGPU(int num_volx, int num_voly, int num_volume
 
 			pos_vol0 = -num_volx + pos_x_hebra;
 			pos_vol1 = pos_vol0 + num_volx;
-			procesarArista(&W0, &W1, datos_vol0.w, datos_vol1.w, 0.0, longitud, longitud, area, r,
+			difH = obtenerDifHArista(d_difHAristas, pos_x_hebra,
+				pos_x_hebra, 0, pos_x_hebra, 1);
+			procesarArista(&W0, &W1, difH.x, difH.y, 0.0, longitud, longitud, area, r,
 				delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 				pos_vol0, pos_vol1, gravedad, epsilon_h, L, H, num_volumenes);
 		}
@@ -1025,19 +1117,60 @@ __global__ void procesarAristasComGPU(int num_volx, int num_voly, int num_volume
 
 			pos_vol0 = (num_voly-1)*num_volx + pos_x_hebra;
 			pos_vol1 = pos_vol0 + num_volx;
-			procesarArista(&W0, &W1, datos_vol0.w, datos_vol1.w, 0.0, longitud, longitud, area, r,
+			difH = obtenerDifHArista(d_difHAristas, num_voly*num_volx + pos_x_hebra,
+				pos_x_hebra, num_voly, pos_x_hebra, num_voly+1);
+			procesarArista(&W0, &W1, difH.x, difH.y, 0.0, longitud, longitud, area, r,
 				delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta, d_acumulador_1, d_acumulador_2,
 				pos_vol0, pos_vol1, gravedad, epsilon_h, L, H, num_volumenes);
 		}
 	}
 }
 
+#ifdef ARISTAS_PRECALCULADAS
+
+// Calcula H0-Hm y H1-Hm de las aristas verticales (tipo < 3) u horizontales (tipo >= 3)
+// del cluster y los guarda en d_difHAristas. Se llama una vez al inicio porque H no cambia.
+// La arista vertical (x,y) separa los volúmenes x-1 y x de la fila y, y se guarda en la
+// posición y*(num_volx+1)+x. La arista horizontal (x,y) separa las filas y e y+1 de la textura
+// (incluyendo las filas de comunicación), y se guarda en la posición y*num_volx+x.
+// En las aristas frontera se guarda 0
+__global__ void calcularDifHAristasGPU(float2 *d_difHAristas, int num_volx, int num_voly, int tipo)
+{
+	int pos_x_hebra, pos_y_hebra;
+	float2 difH;
+
+	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_ARI + threadIdx.x;
+	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_ARI + threadIdx.y;
+
+	if (tipo < 3) {
+		// Aristas verticales
+		if ((pos_x_hebra <= num_volx) && (pos_y_hebra < num_voly)) {
+			if ((pos_x_hebra == 0) || (pos_x_hebra == num_volx))
+				difH = make_float2(0.0f, 0.0f);
+			else
+				difH = calcularDifH(tex2D(texBatimetria, pos_x_hebra-1, pos_y_hebra+1),
+						tex2D(texBatimetria, pos_x_hebra, pos_y_hebra+1));
+			d_difHAristas[pos_y_hebra*(num_volx+1) + pos_x_hebra] = difH;
+		}
+	}
+	else {
+		// Aristas horizontales
+		if ((pos_x_hebra < num_volx) && (pos_y_hebra <= num_voly)) {
+			difH = calcularDifH(tex2D(texBatimetria, pos_x_hebra, pos_y_hebra),
+					tex2D(texBatimetria, pos_x_hebra, pos_y_hebra+1));
+			d_difHAristas[pos_y_hebra*num_volx + pos_x_hebra] = difH;
+		}
+	}
+}
+
+#endif
+
 /************************************************/
 /* Funciones para el cálculo del deltaT inicial */
 /************************************************/
 
 // pos_vol0 y pos_vol1 son las posiciones de los acumuladores donde la arista escribirá sus contribuciones
-__device__ void procesarAristaDeltaTInicial(TVec *W0, TVec *W1, float H0, float H1,
+__device__ void procesarAristaDeltaTInicial(TVec *W0, TVec *W1,
 				float normal_x, float normal_y, float longitud, float r, float4 *d_acumulador_1,
 				int pos_vol0, int pos_vol1, float gravedad, float epsilon_h, int num_volumenes)
 {
@@ -1171,7 +1304,7 @@ __global__ void procesarAristasDeltaTInicialGPU(int num_volx, int num_voly, int
 				v_set_val(&W1, 5, v_get_val(&W0,5));
 
 				pos_vol0 = pos_y_hebra*num_volx;
-				procesarAristaDeltaTInicial(&W0, &W1, datos_vol0.w, datos_vol0.w, -longitud, 0.0,
+				procesarAristaDeltaTInicial(&W0, &W1, -longitud, 0.0,
 					longitud, r, d_acumulador_1, pos_vol0, -1, gravedad, epsilon_h, num_volumenes);
 			}
 			else {
@@ -1197,7 +1330,7 @@ __global__ void procesarAristasDeltaTInicialGPU(int num_volx, int num_voly, int
 					v_set_val(&W1, 5, v_get_val(&W0,5));
 
 					pos_vol0 = (pos_y_hebra+1)*num_volx - 1;
-					procesarAristaDeltaTInicial(&W0, &W1, datos_vol0.w, datos_vol0.w, longitud, 0.0,
+					procesarAristaDeltaTInicial(&W0, &W1, longitud, 0.0,
 						longitud, r, d_acumulador_1, pos_vol0, -1, gravedad, epsilon_h, num_volumenes);
 				}
 				else {
@@ -1215,7 +1348,7 @@ __global__ void procesarAristasDeltaTInicialGPU(int num_volx, int num_voly, int
 					v_set_val(&W1, 5, datos_vol1.z);
 
 					pos_vol0 = pos_y_hebra*num_volx + pos_x_hebra-1;
-					procesarAristaDeltaTInicial(&W0, &W1, datos_vol0.w, datos_vol1.w, longitud, 0.0,
+					procesarAristaDeltaTInicial(&W0, &W1, longitud, 0.0,
 						longitud, r, d_acumulador_1, pos_vol0, pos_vol0+1, gravedad, epsilon_h, num_volumenes);
 				}
 			}
@@ -1254,7 +1387,7 @@ __global__ void procesarAristasDeltaTInicialGPU(int num_volx, int num_voly, int
 				v_set_val(&W1, 4, v_get_val(&W0,4));
 				v_set_val(&W1, 5, v_get_val(&W0,5)*borde1);
 
-				procesarAristaDeltaTInicial(&W0, &W1, datos_vol0.w, datos_vol0.w, 0.0, -longitud,
+				procesarAristaDeltaTInicial(&W0, &W1, 0.0, -longitud,
 					longitud, r, d_acumulador_1, pos_x_hebra, -1, gravedad, epsilon_h, num_volumenes);
 			}
 			else {
@@ -1280,7 +1413,7 @@ __global__ void procesarAristasDeltaTInicialGPU(int num_volx, int num_voly, int
 					v_set_val(&W1, 5, v_get_val(&W0,5)*borde2);
 
 					pos_vol0 = (pos_y_hebra-1)*num_volx + pos_x_hebra;
-					procesarAristaDeltaTInicial(&W0, &W1, datos_vol0.w, datos_vol0.w, 0.0, longitud,
+					procesarAristaDeltaTInicial(&W0, &W1, 0.0, longitud,
 						longitud, r, d_acumulador_1, pos_vol0, -1, gravedad, epsilon_h, num_volumenes);
 				}
 				else {
@@ -1299,7 +1432,7 @@ __global__ void procesarAristasDeltaTInicialGPU(int num_volx, int num_voly, int
 
 					pos_vol0 = (pos_y_hebra-1)*num_volx + pos_x_hebra;
 					pos_vol1 = pos_vol0 + num_volx;
-					procesarAristaDeltaTInicial(&W0, &W1, datos_vol0.w, datos_vol1.w, 0.0, longitud,
+					procesarAristaDeltaTInicial(&W0, &W1, 0.0, longitud,
 						longitud, r, d_acumulador_1, pos_vol0, pos_vol1, gravedad, epsilon_h, num_volumenes);
 				}
 			}
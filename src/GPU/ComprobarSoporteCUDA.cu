@@ -1,4 +1,11 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sched.h>
+#include "Constantes.hxx"
 
 // Funcin que devuelve 0 si la tarjeta grfica soporta CUDA, 1 si no hay tarjeta grfica,
 // y 2 si hay pero no soporta CUDA
@@ -23,3 +30,76 @@ extern "C" int comprobarSoporteCUDA()
 	}
 	return valor;
 }
+
+// Devuelve el nodo NUMA al que est conectado el dispositivo PCI pci_bus_id, o -1 si no se conoce
+int obtenerNodoNUMA(char *pci_bus_id)
+{
+	char fich[256];
+	FILE *fp;
+	int i, nodo = -1;
+
+	// En sysfs el identificador PCI est en minsculas
+	sprintf(fich, "/sys/bus/pci/devices/%s/numa_node", pci_bus_id);
+	for (i=0; fich[i] != '\0'; i++)
+		fich[i] = tolower(fich[i]);
+	fp = fopen(fich, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%d", &nodo) != 1)
+			nodo = -1;
+		fclose(fp);
+	}
+	return nodo;
+}
+
+// Liga el proceso a las CPUs del nodo NUMA nodo. Devuelve 0 si todo ha ido bien y 1 si no
+int ligarProcesoANodoNUMA(int nodo)
+{
+	char fich[256], lista[1024];
+	char *p, *q;
+	FILE *fp;
+	cpu_set_t cpus;
+	int i, ini, fin;
+
+	sprintf(fich, "/sys/devices/system/node/node%d/cpulist", nodo);
+	fp = fopen(fich, "r");
+	if (fp == NULL)
+		return 1;
+	if (fgets(lista, 1024, fp) == NULL) {
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	// La lista tiene la forma "0-13,28-41"
+	CPU_ZERO(&cpus);
+	p = lista;
+	while ((*p >= '0') && (*p <= '9')) {
+		ini = fin = (int) strtol(p, &q, 10);
+		if (*q == '-')
+			fin = (int) strtol(q+1, &q, 10);
+		for (i=ini; i<=fin; i++)
+			CPU_SET(i, &cpus);
+		p = (*q == ',') ? q+1 : q;
+	}
+	return ((sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == 0) ? 0 : 1);
+}
+
+// Asigna al proceso la GPU id_hebra_nodo % (nmero de GPUs), siendo id_hebra_nodo el nmero
+// del proceso dentro de su nodo. Devuelve en dev la GPU asignada, en pci_bus_id su identificador
+// PCI y en nodo_numa el nodo NUMA al que est conectada (-1 si no se conoce). Si AFINIDAD_GPU
+// est definido, tambin liga el proceso a las CPUs de ese nodo NUMA. Hay que llamarla antes de
+// reservar la memoria de CPU, para que se ubique en el nodo NUMA de la GPU
+extern "C" void asignarGPU(int id_hebra_nodo, int *dev, char *pci_bus_id, int *nodo_numa)
+{
+	int deviceCount;
+
+	cudaGetDeviceCount(&deviceCount);
+	*dev = id_hebra_nodo % deviceCount;
+	cudaSetDevice(*dev);
+	cudaDeviceGetPCIBusId(pci_bus_id, 32, *dev);
+	*nodo_numa = obtenerNodoNUMA(pci_bus_id);
+#ifdef AFINIDAD_GPU
+	if (*nodo_numa >= 0)
+		ligarProcesoANodoNUMA(*nodo_numa);
+#endif
+}
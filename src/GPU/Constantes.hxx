@@ -19,6 +19,227 @@
 // Tipo escalar usado en CPU
 typedef double Scalar;
 
+// PRECISION_SIMPLE / PRECISION_MIXTA
+// Precision de la simulacion:
+//   PRECISION_SIMPLE: estado, acumuladores y tiempo de simulacion en float
+//   PRECISION_MIXTA:  estado y acumuladores en float. El tiempo de simulacion, el delta T
+//                     y los tiempos de guardado se acumulan en double para que no haya
+//                     deriva en los tiempos de salida en simulaciones largas
+#define PRECISION_MIXTA
+
+#ifdef PRECISION_MIXTA
+typedef double TTiempo;
+#define MPI_TIEMPO  MPI_DOUBLE
+#else
+typedef float TTiempo;
+#define MPI_TIEMPO  MPI_FLOAT
+#endif
+
+// ALMACENAMIENTO_HALF
+// Si esta definido, el estado de las capas 1 y 2 se almacena en GPU en media precision
+// (half, 16 bits por componente). El hardware de texturas convierte a float al leer, por lo
+// que los kernels operan en float igual que en el modo normal. H se guarda aparte en una
+// textura float (texBatimetria). Reduce a la mitad la memoria del estado, el ancho de banda
+// de las lecturas de texturas y el tamano de los mensajes MPI de los volumenes de comunicacion.
+// El error de masa introducido por el redondeo se muestra en cada guardado
+//#define ALMACENAMIENTO_HALF
+
+// ARISTAS_PRECALCULADAS
+// Si esta definido, al inicio se calculan en GPU, para cada arista, H0-Hm y H1-Hm (siendo
+// Hm = min(H0,H1)) y se guardan en arrays por arista. Los kernels de aristas los leen en vez
+// de leer H de los dos volumenes. Usa 16 bytes mas de memoria GPU por volumen
+//#define ARISTAS_PRECALCULADAS
+
+// OMITIR_BLOQUES_SECOS
+// Si esta definido, el kernel de actualizacion del estado marca como inactivo cada bloque de
+// NUM_HEBRAS_ANCHO_EST x NUM_HEBRAS_ALTO_EST volumenes en el que h1 y h2 son menores que
+// EPSILON en todos los volumenes. En el siguiente paso, los kernels de aristas no procesan las
+// aristas cuyos dos volumenes estan en bloques inactivos (esas aristas no aportan nada, por lo
+// que el resultado no cambia). En cada guardado se muestra el numero medio de bloques activos
+// por proceso y el desequilibrio entre procesos
+#define OMITIR_BLOQUES_SECOS
+
+// AFINIDAD_GPU
+// Si esta definido, cada proceso se liga a las CPUs del nodo NUMA al que esta conectada su
+// GPU antes de reservar la memoria de CPU. Asi la memoria del estado y de los volumenes de
+// comunicacion (que se reserva bloqueada en memoria) queda en el mismo socket que la GPU, y las
+// copias CPU-GPU no cruzan el enlace entre sockets. Conviene no definirlo si la afinidad ya la
+// fija el lanzador de MPI
+#define AFINIDAD_GPU
+
+// PASO_TIEMPO_LOCAL
+// Si esta definido, se usa paso de tiempo local por bloques de NUM_HEBRAS_ANCHO_EST x
+// NUM_HEBRAS_ALTO_EST volumenes. Cada macropaso se divide en SUBPASOS_PASO_LOCAL subpasos del
+// delta T global. Al principio del macropaso, cada bloque recibe una clase k < NIVELES_PASO_LOCAL
+// (la mayor tal que 2^k*delta_T no supera el delta T local de sus volumenes, y como mucho 1 mas
+// que la de sus bloques vecinos) y se actualiza cada 2^k subpasos. Cada arista se procesa con la
+// menor clase de sus dos bloques y suma en los acumuladores sus flujos multiplicados por su paso,
+// por lo que se conserva la masa. Los bloques que tocan otro cluster tienen siempre clase 0, asi
+// que los volumenes de comunicacion se intercambian en cada subpaso como en el modo normal. La
+// reduccion del delta T (y el MPI_Allreduce) solo se hace una vez por macropaso
+//#define PASO_TIEMPO_LOCAL
+#define NIVELES_PASO_LOCAL 4
+#define SUBPASOS_PASO_LOCAL (1 << (NIVELES_PASO_LOCAL-1))
+
+// PASOS_HALO
+// Numero de pasos entre dos intercambios de volumenes de comunicacion (k). Con k > 1, cada
+// proceso recibe FILAS_HALO = 2k-1 filas de cada cluster adyacente en vez de una, y calcula en la
+// GPU sus filas junto con las 2k-2 filas siguientes de cada cluster adyacente (filas fantasma),
+// de forma redundante. Cada paso invalida hasta dos filas desde el borde, ya que el tratamiento de
+// positividad de una arista usa los acumuladores de sus volumenes, que ya tienen los flujos de
+// las aristas procesadas antes. Asi, durante los k pasos las filas propias dependen de las filas
+// recibidas igual que con k = 1. El delta T de cada paso sigue siendo el minimo global del delta T
+// local de los volumenes propios, sin las filas fantasma (las mas externas dejan de ser validas),
+// por lo que es el mismo que con k = 1 y todos los procesos lo comparten. Los mensajes se dividen
+// por k a cambio de calcular 2*(FILAS_HALO-1) filas mas por proceso; al final se muestran las dos
+// cosas para poder ajustar k. Cada cluster debe tener al menos FILAS_HALO filas. No se puede usar
+// con PASO_TIEMPO_LOCAL
+#define PASOS_HALO 1
+#define FILAS_HALO (2*PASOS_HALO-1)
+
+#if defined(PASO_TIEMPO_LOCAL) && (PASOS_HALO > 1)
+#error PASO_TIEMPO_LOCAL no se puede usar con PASOS_HALO > 1
+#endif
+
+// HALOS_MEMORIA_COMPARTIDA
+// Si esta definido, los procesos del mismo nodo (segun MPI_Comm_split_type con
+// MPI_COMM_TYPE_SHARED) dejan sus volumenes de comunicacion en una ventana de memoria compartida
+// de MPI (MPI_Win_allocate_shared) en vez de enviarlos con mensajes. Cada proceso copia sus filas
+// de comunicacion de la GPU a su segmento de la ventana, y los clusters adyacentes del mismo nodo
+// las copian directamente de ahi a su GPU. Se sincronizan con contadores de pasos en los
+// segmentos, sin barreras. Con los clusters de otros nodos se siguen usando mensajes
+//#define HALOS_MEMORIA_COMPARTIDA
+
+// HEBRA_COMUNICACION
+// Si esta definido, cada proceso crea una hebra de comunicacion que envia y recibe los volumenes
+// de comunicacion de cada paso mientras la hebra principal lanza los kernels, de forma que MPI
+// progresa aunque la hebra principal este bloqueada en una copia con la GPU. Las dos hebras no
+// llaman a MPI a la vez, por lo que basta MPI_THREAD_SERIALIZED (MPI_THREAD_MULTIPLE con
+// HALOS_MEMORIA_COMPARTIDA, porque la hebra principal sincroniza la ventana). Si la biblioteca
+// MPI no da ese nivel, los mensajes los envia la hebra principal como siempre. Sin la hebra basta
+// MPI_THREAD_FUNNELED (solo la hebra principal llama a MPI; las hebras OpenMP de la carga de
+// datos no). Permite lanzar un proceso por socket con AFINIDAD_GPU
+//#define HEBRA_COMUNICACION
+
+// Nivel de hebras que se pide a MPI_Init_thread
+#if defined(HEBRA_COMUNICACION) && defined(HALOS_MEMORIA_COMPARTIDA)
+#define NIVEL_HEBRAS_MPI MPI_THREAD_MULTIPLE
+#elif defined(HEBRA_COMUNICACION)
+#define NIVEL_HEBRAS_MPI MPI_THREAD_SERIALIZED
+#else
+#define NIVEL_HEBRAS_MPI MPI_THREAD_FUNNELED
+#endif
+
+// Numero de procesos MPI que se reservan como servidores de E/S (los ultimos PROCESOS_ES). Los
+// procesos de calculo envian con MPI no bloqueante al servidor que les toca los campos
+// empaquetados de los ficheros NetCDF, los bloques de muestras de los puntos y la eta1 maxima,
+// y siguen calculando; los servidores los reunen y escriben los ficheros entre ellos con PnetCDF
+// (ver ServidorES.hxx). Un proceso de calculo solo espera al sistema de ficheros si tiene
+// ocupados sus BUFFERS_ES buffers de envio, cada uno del tamano de su cluster en float. Debe
+// haber al menos tantos procesos de calculo como servidores. Las regiones de interes las siguen
+// escribiendo los procesos de calculo. Con 0 no hay servidores y los procesos de calculo
+// escriben todos los ficheros
+#define PROCESOS_ES 0
+#define BUFFERS_ES  4
+
+// Tipo de un volumen del estado en GPU
+#ifdef ALMACENAMIENTO_HALF
+typedef ushort4 TEstadoGPU;
+#else
+typedef float4 TEstadoGPU;
+#endif
+
+// Alineamiento en bytes de los buffers de la arena
+#define ALINEAMIENTO_ARENA 64
+
+// Arena de memoria de CPU de una ejecucion. Todos los buffers de CPU proporcionales a la malla
+// se reservan al inicio en un unico bloque de tam bytes (bloqueado en memoria), alineados a
+// ALINEAMIENTO_ARENA bytes. usado son los bytes ya asignados. Si memoria es NULL, la arena solo
+// mide: reservarEnArena devuelve NULL y acumula en usado el tamano necesario
+typedef struct TArena {
+	char *memoria;
+	size_t tam, usado;
+} TArena;
+
+// Longitud maxima de las opciones de tipo cadena
+#define TAM_OPCION 256
+
+// Numero maximo de regiones de interes (ver la opcion region)
+#define MAX_REGIONES 16
+
+// Region de interes que se guarda a resolucion completa en su propio fichero NetCDF.
+// Se guardan los volumenes cuyo centro esta dentro de [xmin,xmax] x [ymin,ymax] cada
+// intervalo segundos (0: en cada paso)
+typedef struct TRegion {
+	double xmin, xmax, ymin, ymax;
+	double intervalo;
+} TRegion;
+
+// Recorte de la malla (ver la opcion recorte_margen): la malla simulada es el rectangulo de
+// num_volx x num_voly volumenes de la malla del fichero (de num_volx_orig x num_voly_orig) que
+// empieza en la columna col_ini y la fila fila_ini. Sin recorte es toda la malla del fichero.
+// col_ini y fila_ini son multiplos del diezmado de todas las variables, por lo que los ficheros
+// NetCDF, que tienen la malla original, guardan los mismos volumenes que sin recorte
+typedef struct TRecorte {
+	int col_ini, fila_ini;
+	int num_volx, num_voly;
+	int num_volx_orig, num_voly_orig;
+} TRecorte;
+
+// Opciones adicionales de la ejecucion. Son opcionales y se leen al final del fichero de datos,
+// una por linea con el formato "nombre valor" (ver leerOpciones en Problema.cxx)
+typedef struct TOpciones {
+	// memoria_compartida: nombre del segmento de memoria compartida (si empieza por '/') o del
+	// fichero proyectado en memoria donde cada proceso publica eta1, q1x, q1y y la eta1 maxima
+	// en cada guardado (ver MemoriaCompartida.hxx). Si es vacio no se publican
+	char memoria_compartida[TAM_OPCION];
+	// intervalo_puntos: tiempo entre muestras de los puntos de guardado (seg). Si es 0 se guardan
+	// en cada paso, y si es negativo (por defecto) se usa el tiempo de guardado
+	double intervalo_puntos;
+	// diezmado: factor de diezmado espacial de cada variable de los ficheros NetCDF, en el orden
+	// eta1, q1x, q1y, eta2, q2x, q2y (se guarda uno de cada diezmado volumenes en x e y). Por defecto 1
+	int diezmado[NUM_VARIABLES];
+	// guardar_variable: indica si se guarda cada variable NetCDF (en el mismo orden). Por defecto 1.
+	// Si eta1 no se guarda, tampoco se guardan la batimetria ni la eta1 maxima
+	int guardar_variable[NUM_VARIABLES];
+	// intervalo_variable: tiempo entre guardados de cada variable NetCDF (seg). Si es 0 se guarda
+	// en cada paso, y si es negativo (por defecto) se usa el tiempo de guardado
+	double intervalo_variable[NUM_VARIABLES];
+	// precision_variable: si es positivo, cada variable NetCDF se guarda cuantizada con esa precision
+	// absoluta (en sus unidades) en enteros de 16 bits con los atributos scale_factor y add_offset.
+	// Si es 0 (por defecto) se guarda en float
+	double precision_variable[NUM_VARIABLES];
+	// intervalo_diagnostico: tiempo entre diagnosticos del delta T (seg): el volumen que lo limita y
+	// el histograma de los delta T locales, en <prefijo>_diagnostico.txt. Si es 0 se hacen en cada
+	// paso, y si es negativo (por defecto) no se hacen
+	double intervalo_diagnostico;
+	// parada_velocidad, parada_energia: la simulacion termina antes del tiempo final cuando, despues
+	// de que el flujo se haya puesto en movimiento, la velocidad maxima de las dos capas (m/s) y su
+	// energia cinetica por unidad de densidad (m5/s2) son menores que estos umbrales. Un umbral menor
+	// o igual que 0 (por defecto) no se comprueba; si los dos lo son, nunca se termina antes.
+	// parada_intervalo: tiempo entre comprobaciones (seg). Si es negativo (por defecto) se usa el
+	// tiempo de guardado. parada_tiempo_minimo: no se termina antes de este tiempo (seg)
+	double parada_velocidad, parada_energia;
+	double parada_intervalo, parada_tiempo_minimo;
+	// regiones: regiones de interes que se guardan aparte a resolucion completa
+	int num_regiones;
+	TRegion regiones[MAX_REGIONES];
+	// malla_anidada: fichero binario (ver FicheroBinario.hxx) con la topografia y el estado inicial
+	// de una malla mas fina que se anida en la malla principal (ver TMallaAnidada). Si es vacio
+	// (por defecto) no hay malla anidada. No se puede usar con PASO_TIEMPO_LOCAL
+	char malla_anidada[TAM_OPCION];
+	// esponja: ancho (en volumenes) de la capa de absorcion de los bordes abiertos, donde el estado
+	// de las dos capas se relaja hacia el estado inicial en reposo (ver relajarEsponja). Si es 0
+	// (por defecto) no hay capa. esponja_tiempo: tiempo de relajacion en el borde (seg, por defecto 60)
+	int esponja;
+	double esponja_tiempo;
+	// recorte_margen: si es mayor o igual que 0, al cargar el fichero binario se quitan las filas y
+	// columnas de los bordes que nunca se pueden mojar: volumenes secos cuyo fondo esta mas de
+	// recorte_margen metros por encima de la maxima superficie libre inicial, o no conectados con
+	// los volumenes mojados por volumenes mas bajos (ver TRecorte). Por defecto -1 (sin recorte)
+	double recorte_margen;
+} TOpciones;
+
 // Tipo de los datos que se utilizan en un cluster (se utiliza en MultiGPU)
 typedef struct TDatoCluster {
 	// Nmero de volmenes en x e y que tiene el cluster
@@ -40,12 +261,78 @@ typedef struct TDatoCluster {
 	float4 *puntero_datosVolumenesComOtroClusterSup_2;
 	float4 *puntero_datosVolumenesComOtroClusterInf_1;
 	float4 *puntero_datosVolumenesComOtroClusterInf_2;
+#if PASOS_HALO > 1
+	// Buffer con los volmenes de comunicacin anteriores (8 bloques de FILAS_HALO filas), que con
+	// PASOS_HALO > 1 no caben en las filas de comunicacin de datosVolumenes_1 y datosVolumenes_2
+	float4 *datosVolumenesCom;
+#endif
+
+	// Arena donde se reservan todos los buffers de CPU del cluster
+	TArena arena;
+	// Buffer para los datos que se guardan en NetCDF (num_volumenes)
+	float *vec_guardado;
+	// H de los volumenes, incluyendo las filas de comunicacion (num_volumenes + 2*num_volx)
+	float *batimetria;
+#ifdef ALMACENAMIENTO_HALF
+	// Buffer para convertir el estado entre float y half (num_volumenes + 2*num_volx)
+	TEstadoGPU *estadoHalf;
+#endif
 } TDatoCluster;
 
+// Malla anidada de la opcion malla_anidada (ver MallaAnidada.cu). Cubre un rectangulo de
+// volumenes de la malla padre, cada uno dividido en razon x razon volumenes. Solo la tiene el
+// proceso cuyo cluster la contiene (activa = 1)
+typedef struct TMallaAnidada {
+	int activa;
+	// Razon de refinamiento (entera, mayor que 1)
+	int razon;
+	// Columna y fila (local al cluster) del primer volumen de la malla padre que cubre, y numero
+	// de volumenes de la malla padre que cubre en x e y
+	int col_ini, fila_ini;
+	int num_volx_padre, num_voly_padre;
+	// Tamano de los volumenes finos (adimensionalizado)
+	double ancho_vol, alto_vol;
+	// Datos de CPU de la malla anidada. Tiene un marco de razon volumenes finos en cada lado (el
+	// anillo de volumenes de la malla padre que la rodea), por lo que tiene
+	// (num_volx_padre+2)*razon x (num_voly_padre+2)*razon volumenes
+	TDatoCluster datos;
+} TMallaAnidada;
+
 typedef struct TSW_Cuda {
-	// Array d_datosVolumenes (donde se almacenarn W y H).
+	// Array d_datosVolumenes (donde se almacenar W).
 	cudaArray *d_datosVolumenes_1, *d_datosVolumenes_2;
+	// Array con H, que no cambia durante la simulacin, y buffer de CPU para leerlo
+	// (apunta a datos_cluster->batimetria)
+	cudaArray *d_batimetria;
+	float *batimetria;
+	// H0-Hm y H1-Hm de las aristas verticales y horizontales (ver ARISTAS_PRECALCULADAS)
+	float2 *d_difHAristasVer, *d_difHAristasHor;
+	// Indica para cada bloque de volumenes si esta activo, y numero de bloques activos acumulado
+	// en los pasos desde el ultimo guardado (NULL si no se define OMITIR_BLOQUES_SECOS)
+	int *d_bloquesActivos, *d_numBloquesActivos;
+	// Clase de paso de tiempo de cada bloque de volumenes (2 arrays de un entero por bloque; el
+	// segundo es auxiliar). NULL si no se define PASO_TIEMPO_LOCAL
+	int *d_clasesBloques;
+	// Resultados parciales de los bloques de las reducciones del delta T y sus posiciones
+	// (MAX_BLOQUES_REDUCCION elementos)
+	float *d_minimosBloques;
+	int *d_posMinimosBloques;
+	// Histograma de los delta T locales (NUM_INTERVALOS_HISTOGRAMA_DT+1 enteros)
+	int *d_histogramaDeltaT;
+	// Resultados parciales de los bloques de la reduccion de la energia cinetica y la velocidad
+	// maxima (MAX_BLOQUES_REDUCCION elementos)
+	float2 *d_energiaBloques;
+	// Suma del error de redondeo a half de h1+h2 en todos los volumenes (NULL si no se
+	// define ALMACENAMIENTO_HALF)
+	float *d_errorMasa;
+#ifdef ALMACENAMIENTO_HALF
+	// Buffer de CPU para convertir el estado entre float y half (apunta a datos_cluster->estadoHalf)
+	TEstadoGPU *estadoHalf;
+#endif
 	float2 *d_eta1_maxima;
+	// h1 y h2 iniciales de los volumenes, hacia los que se relaja el estado en la capa de absorcion
+	// (NULL si no hay capa, ver TOpciones)
+	float2 *d_estadoReferencia;
 	// Punteros que apuntan al principio de los volmenes de comunicacin del cluster
 	// y de los clusters adyacentes.
 	float4 *d_datosVolumenesComClusterSup_1, *d_datosVolumenesComClusterSup_2;
@@ -61,6 +348,12 @@ typedef struct TSW_Cuda {
 	// de comunicacin estn al final del array
 	float *d_deltaTVolumenes;
 
+	// Nmero de filas del cluster en GPU (las suyas y las fantasma, ver PASOS_HALO) y primera fila
+	// de los arrays de la GPU con volmenes del cluster. En la textura, la fila 0 es de volmenes
+	// de comunicacin, por lo que la primera fila del cluster es fila_ini_gpu. En los arrays de
+	// volmenes (acumuladores, delta T, eta1 mxima), es la fila fila_ini_gpu-1
+	int num_voly_gpu, fila_ini_gpu;
+
 	// Tamao del grid y de bloque en el procesamiento de aristas que no son de comunicacin
 	// (al procesar las aristas Hor1, se procesan las mismas aristas que en el caso sin solapamiento
 	// menos la primera y ltima fila. El resto de procesamientos de aristas es igual)
@@ -89,11 +382,21 @@ typedef struct TSW_Cuda {
 // Tamao de un bloque en el clculo del nuevo estado
 #define NUM_HEBRAS_ANCHO_EST 8
 #define NUM_HEBRAS_ALTO_EST  8
+// Nmero mximo de bloques de los kernels de reduccin
+#define MAX_BLOQUES_REDUCCION 64
+// Intervalos del histograma de los delta T locales (ver histogramaDeltaTGPU)
+#define NUM_INTERVALOS_HISTOGRAMA_DT 12
 
 // Texturas que contienen los datos de los volmenes para las capas
-// 1 y 2. H est en ambas texturas
+// 1 y 2. La componente w no se usa
 texture<float4, 2, cudaReadModeElementType> texDatosVolumenes_1;
 texture<float4, 2, cudaReadModeElementType> texDatosVolumenes_2;
+// Textura de slo lectura con H
+texture<float, 2, cudaReadModeElementType> texBatimetria;
+
+// El nuevo estado se escribe en los arrays de las texturas mediante surfaces
+surface<void, 2> surfDatosVolumenes_1;
+surface<void, 2> surfDatosVolumenes_2;
 
 // Redondea a / b al mayor entero ms cercano
 #define iDivUp(a,b)  (((a)%(b) != 0) ? ((a)/(b) + 1) : ((a)/(b)))
@@ -0,0 +1,36 @@
+#ifndef _FICHERO_BINARIO_H_
+#define _FICHERO_BINARIO_H_
+
+/*************************************************************/
+/* Formato binario de la topografa y el estado inicial */
+/*************************************************************/
+
+// Alternativa a los ficheros de texto de topografa y estado inicial (se usa poniendo 2 en
+// "Leer condiciones iniciales de fichero"). Se genera con convertir_binario a partir de ellos.
+// El fichero empieza con un TCabeceraBinario, seguido de un ndice con el desplazamiento en
+// bytes de cada bloque de filas (num_bloques unsigned long long). Cada bloque tiene
+// filas_bloque filas de la malla (el ltimo puede tener menos), y cada volumen
+// num_variables floats en el orden de TVariableBinario, por filas. Cada proceso slo proyecta
+// en memoria los bloques que contienen sus filas
+
+#define MAGICO_BINARIO   0x4E49484C  // "LHIN"
+#define VERSION_BINARIO  1
+
+// Variables de cada volumen
+enum TVariableBinario {VAR_H = 0, VAR_H1, VAR_Q1X, VAR_Q1Y, VAR_H2, VAR_Q2X, VAR_Q2Y, NUM_VARIABLES_BINARIO};
+
+typedef struct TCabeceraBinario {
+	// MAGICO_BINARIO y VERSION_BINARIO
+	unsigned int magico, version;
+	// Dimensiones de la malla, como en el fichero de texto de topografa
+	double xmin, xmax, ymin, ymax;
+	int num_volx, num_voly;
+	// Filas de cada bloque y nmero de bloques
+	int filas_bloque, num_bloques;
+	int num_variables;
+	// Factores por los que se multiplican los valores guardados para obtener las profundidades
+	// y alturas (m) y los caudales (m2/s), antes de adimensionalizar
+	double escala_H, escala_Q;
+} TCabeceraBinario;
+
+#endif
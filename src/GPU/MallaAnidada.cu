@@ -0,0 +1,326 @@
+#ifndef _MALLA_ANIDADA_H_
+#define _MALLA_ANIDADA_H_
+
+/*****************/
+/* Malla anidada */
+/*****************/
+
+// Una malla anidada (opcin malla_anidada, ver TMallaAnidada) es una malla razon veces ms fina
+// que cubre un rectngulo de volmenes de la malla padre (C). La simula el proceso que la contiene
+// con otra TSimulacion en la misma GPU, acoplada en los dos sentidos con la malla padre en cada
+// paso de sta (ver avanzarMallaAnidada):
+// - La malla anidada tiene un marco de razon volmenes finos en cada lado que cubre el anillo de
+//   volmenes de la malla padre que rodea a C (N). Su H es la de la malla padre, y antes de cada
+//   subpaso se le asigna el estado de su volumen de la malla padre, interpolado linealmente en
+//   tiempo entre el principio y el final del paso de la malla padre. Como la H del marco es la de
+//   la malla padre, la interpolacin mantiene el reposo.
+// - La malla anidada da los subpasos necesarios para llegar al tiempo de la malla padre, con su
+//   propio delta T (repartido en subpasos iguales para no dar un ltimo subpaso muy pequeo).
+// - Despus, el estado de cada volumen de C se sustituye por la media de sus volmenes finos. La
+//   H de C ya es la media de la H de sus volmenes finos (ver cargarMallaAnidada), por lo que eta
+//   es coherente en las dos mallas.
+// - Correccin conservativa: la masa de cada capa en C, antes de sustituirla, menos la masa de
+//   sus volmenes finos es la diferencia entre lo que ha salido de C por su contorno con los
+//   flujos de la malla padre y con los de la malla anidada. Esa diferencia se aade a N
+//   escalando el estado de sus volmenes (proporcionalmente a su altura, por lo que las alturas
+//   no se hacen negativas y se mantienen las velocidades), y as la masa total se conserva.
+// El estado de C y N se mantiene en GPU en un parche de (num_volx_padre+2) x (num_voly_padre+2)
+// volmenes de la malla padre, por lo que el nico coste de la malla padre es copiarlo de su
+// textura y a su textura en cada paso. Las texturas y surfaces de los kernels son globales, por lo
+// que se enlazan a los arrays de la malla anidada mientras se simula y se vuelven a enlazar a los
+// de la malla padre al terminar
+
+typedef struct TSimulacionAnidada {
+	// Simulacin de la malla anidada (un proceso, en MPI_COMM_SELF) y datos de CPU
+	TSimulacion sim;
+	TMallaAnidada *malla;
+	// Parches de C y N con el estado de las capas 1 y 2 de la malla padre al principio
+	// (d_parche_ant_*) y al final (d_parche_*) de su paso
+	TEstadoGPU *d_parche_ant_1, *d_parche_ant_2;
+	TEstadoGPU *d_parche_1, *d_parche_2;
+	int nx_parche, ny_parche;
+	// Columna y fila de la textura de la malla padre donde empieza el parche
+	int col_parche, fila_parche;
+	// Diferencias de masa en C de las capas 1 y 2 y masas en N de las capas 1 y 2
+	float *d_masas;
+	dim3 blockGridParche, threadBlockParche;
+	// Pasos de la malla padre y subpasos de la malla anidada dados
+	long pasos, subpasos;
+} TSimulacionAnidada;
+
+__device__ inline float4 estadoAFloat4(TEstadoGPU e)
+{
+#ifdef ALMACENAMIENTO_HALF
+	return make_float4(__half2float(e.x), __half2float(e.y), __half2float(e.z), 0.0f);
+#else
+	return e;
+#endif
+}
+
+__device__ inline TEstadoGPU float4AEstado(float4 v)
+{
+#ifdef ALMACENAMIENTO_HALF
+	return make_ushort4(__float2half_rn(v.x), __float2half_rn(v.y), __float2half_rn(v.z), 0);
+#else
+	return make_float4(v.x, v.y, v.z, 0.0f);
+#endif
+}
+
+// Asigna a los volmenes del marco de la malla anidada (num_volx x num_voly volmenes, empezando
+// en la fila fila_ini de la textura) el estado de su volumen del parche, interpolado entre
+// d_parche_ant_* (alfa = 0) y d_parche_* (alfa = 1). Se lanza con blockGridEst y threadBlockEst de
+// la malla anidada, con sus surfaces enlazadas. Marca como activos los bloques con volmenes
+// del marco mojados (ver OMITIR_BLOQUES_SECOS)
+__global__ void imponerMarcoAnidadaGPU(TEstadoGPU *d_parche_ant_1, TEstadoGPU *d_parche_ant_2, TEstadoGPU *d_parche_1,
+			TEstadoGPU *d_parche_2, int nx_parche, int razon, int num_volx, int num_voly, int fila_ini, float alfa,
+			int *d_bloquesActivos)
+{
+	float4 W_ant, W1, W2;
+	int pos, pos_x_hebra, pos_y_hebra;
+
+	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
+	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_EST + threadIdx.y;
+	if ((pos_x_hebra < num_volx) && (pos_y_hebra < num_voly) && ((pos_x_hebra < razon) || (pos_x_hebra >= num_volx-razon)
+			|| (pos_y_hebra < razon) || (pos_y_hebra >= num_voly-razon))) {
+		pos = (pos_y_hebra/razon)*nx_parche + pos_x_hebra/razon;
+		W_ant = estadoAFloat4(d_parche_ant_1[pos]);
+		W1 = estadoAFloat4(d_parche_1[pos]);
+		W1.x = W_ant.x + alfa*(W1.x - W_ant.x);
+		W1.y = W_ant.y + alfa*(W1.y - W_ant.y);
+		W1.z = W_ant.z + alfa*(W1.z - W_ant.z);
+		W_ant = estadoAFloat4(d_parche_ant_2[pos]);
+		W2 = estadoAFloat4(d_parche_2[pos]);
+		W2.x = W_ant.x + alfa*(W2.x - W_ant.x);
+		W2.y = W_ant.y + alfa*(W2.y - W_ant.y);
+		W2.z = W_ant.z + alfa*(W2.z - W_ant.z);
+		surf2Dwrite(float4AEstado(W1), surfDatosVolumenes_1, pos_x_hebra*sizeof(TEstadoGPU), pos_y_hebra + fila_ini);
+		surf2Dwrite(float4AEstado(W2), surfDatosVolumenes_2, pos_x_hebra*sizeof(TEstadoGPU), pos_y_hebra + fila_ini);
+#ifdef OMITIR_BLOQUES_SECOS
+		if ((W1.x >= EPSILON) || (W2.x >= EPSILON))
+			d_bloquesActivos[blockIdx.y*gridDim.x + blockIdx.x] = 1;
+#endif
+	}
+}
+
+// Pone en los volmenes de C del parche (todos menos el anillo exterior) la media de sus
+// razon x razon volmenes finos, que se leen de las texturas de la malla anidada (su fila 0 es la
+// fila fila_ini de la textura). Suma en d_masas[0] y d_masas[1] la masa de las capas 1 y 2 de C
+// antes de sustituirla menos la de la media, y en d_masas[2] y d_masas[3] la masa de N
+__global__ void restringirMallaAnidadaGPU(TEstadoGPU *d_parche_1, TEstadoGPU *d_parche_2, int nx_parche, int ny_parche,
+			int razon, int fila_ini, float *d_masas)
+{
+	float4 W1c, W2c, W, W1, W2;
+	float val;
+	int pos, pos_x_hebra, pos_y_hebra;
+	int i, j, x, y;
+
+	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
+	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_EST + threadIdx.y;
+	if ((pos_x_hebra < nx_parche) && (pos_y_hebra < ny_parche)) {
+		pos = pos_y_hebra*nx_parche + pos_x_hebra;
+		W1c = estadoAFloat4(d_parche_1[pos]);
+		W2c = estadoAFloat4(d_parche_2[pos]);
+		if ((pos_x_hebra == 0) || (pos_x_hebra == nx_parche-1) || (pos_y_hebra == 0) || (pos_y_hebra == ny_parche-1)) {
+			atomicAdd(d_masas+2, W1c.x);
+			atomicAdd(d_masas+3, W2c.x);
+		}
+		else {
+			W1 = W2 = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+			for (j=0; j<razon; j++) {
+				y = pos_y_hebra*razon + j + fila_ini;
+				for (i=0; i<razon; i++) {
+					x = pos_x_hebra*razon + i;
+					W = tex2D(texDatosVolumenes_1, x, y);
+					W1.x += W.x;  W1.y += W.y;  W1.z += W.z;
+					W = tex2D(texDatosVolumenes_2, x, y);
+					W2.x += W.x;  W2.y += W.y;  W2.z += W.z;
+				}
+			}
+			val = 1.0f/(razon*razon);
+			W1.x *= val;  W1.y *= val;  W1.z *= val;
+			W2.x *= val;  W2.y *= val;  W2.z *= val;
+			atomicAdd(d_masas, W1c.x - W1.x);
+			atomicAdd(d_masas+1, W2c.x - W2.x);
+			d_parche_1[pos] = float4AEstado(W1);
+			d_parche_2[pos] = float4AEstado(W2);
+		}
+	}
+}
+
+// Aade a N la diferencia de masa de cada capa (d_masas, ver restringirMallaAnidadaGPU)
+// escalando el estado de sus volmenes. Si la capa est seca en todo N no se corrige. Marca como
+// activos los bloques de la malla padre con volmenes del parche mojados (el parche empieza en la
+// columna col_parche y la fila fila_parche de los arrays de volmenes de la malla padre)
+__global__ void corregirMasaAnidadaGPU(TEstadoGPU *d_parche_1, TEstadoGPU *d_parche_2, int nx_parche, int ny_parche,
+			float *d_masas, int *d_bloquesActivos, int num_bloques_x, int col_parche, int fila_parche)
+{
+	float4 W1, W2;
+	float fac;
+	int pos, pos_x_hebra, pos_y_hebra;
+
+	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
+	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_EST + threadIdx.y;
+	if ((pos_x_hebra < nx_parche) && (pos_y_hebra < ny_parche)) {
+		pos = pos_y_hebra*nx_parche + pos_x_hebra;
+		W1 = estadoAFloat4(d_parche_1[pos]);
+		W2 = estadoAFloat4(d_parche_2[pos]);
+		if ((pos_x_hebra == 0) || (pos_x_hebra == nx_parche-1) || (pos_y_hebra == 0) || (pos_y_hebra == ny_parche-1)) {
+			if (d_masas[2] > EPSILON) {
+				fac = fmaxf(1.0f + d_masas[0]/d_masas[2], 0.0f);
+				W1.x *= fac;  W1.y *= fac;  W1.z *= fac;
+				d_parche_1[pos] = float4AEstado(W1);
+			}
+			if (d_masas[3] > EPSILON) {
+				fac = fmaxf(1.0f + d_masas[1]/d_masas[3], 0.0f);
+				W2.x *= fac;  W2.y *= fac;  W2.z *= fac;
+				d_parche_2[pos] = float4AEstado(W2);
+			}
+		}
+#ifdef OMITIR_BLOQUES_SECOS
+		if ((W1.x >= EPSILON) || (W2.x >= EPSILON)) {
+			d_bloquesActivos[((fila_parche + pos_y_hebra)/NUM_HEBRAS_ALTO_EST)*num_bloques_x +
+				(col_parche + pos_x_hebra)/NUM_HEBRAS_ANCHO_EST] = 1;
+		}
+#endif
+	}
+}
+
+// Enlaza las texturas y surfaces de los kernels a los arrays de la simulacin sim
+static void enlazarTexturasSimulacion(TSimulacion *sim)
+{
+	TSW_Cuda *datos_SW_Cuda = &(sim->datos_SW_Cuda);
+
+	cudaBindTextureToArray(texBatimetria, datos_SW_Cuda->d_batimetria);
+	cudaBindTextureToArray(texDatosVolumenes_1, datos_SW_Cuda->d_datosVolumenes_1);
+	cudaBindTextureToArray(texDatosVolumenes_2, datos_SW_Cuda->d_datosVolumenes_2);
+	cudaBindSurfaceToArray(surfDatosVolumenes_1, datos_SW_Cuda->d_datosVolumenes_1);
+	cudaBindSurfaceToArray(surfDatosVolumenes_2, datos_SW_Cuda->d_datosVolumenes_2);
+}
+
+// Copia de las texturas de la malla padre a d_parche_1 y d_parche_2 el estado de C y N
+static void copiarParcheDePadre(TSimulacionAnidada *an, TSimulacion *padre, TEstadoGPU *d_parche_1, TEstadoGPU *d_parche_2)
+{
+	size_t ancho = an->nx_parche*sizeof(TEstadoGPU);
+
+	cudaMemcpy2DFromArray(d_parche_1, ancho, padre->datos_SW_Cuda.d_datosVolumenes_1, an->col_parche*sizeof(TEstadoGPU),
+		an->fila_parche, ancho, an->ny_parche, cudaMemcpyDeviceToDevice);
+	cudaMemcpy2DFromArray(d_parche_2, ancho, padre->datos_SW_Cuda.d_datosVolumenes_2, an->col_parche*sizeof(TEstadoGPU),
+		an->fila_parche, ancho, an->ny_parche, cudaMemcpyDeviceToDevice);
+}
+
+// Inicializa la simulacin de la malla anidada malla, acoplada a la simulacin padre (ya
+// inicializada). Slo la llama el proceso que tiene la malla anidada. Devuelve 0 si todo ha ido
+// bien y 1 si no hay memoria GPU suficiente (en ese caso no hay que llamar a liberarMallaAnidada)
+int inicializarMallaAnidada(TSimulacionAnidada *an, TMallaAnidada *malla, TSimulacion *padre)
+{
+	TParametrosSW param = padre->param;
+	int tam_parche;
+
+	an->malla = malla;
+	an->nx_parche = malla->num_volx_padre + 2;
+	an->ny_parche = malla->num_voly_padre + 2;
+	an->col_parche = malla->col_ini - 1;
+	an->fila_parche = padre->datos_SW_Cuda.fila_ini_gpu + malla->fila_ini - 1;
+	an->pasos = an->subpasos = 0;
+	tam_parche = an->nx_parche*an->ny_parche*sizeof(TEstadoGPU);
+
+	// Mismos parmetros que la malla padre salvo el tamao de los volmenes. Los bordes son
+	// abiertos, aunque no importa porque el estado del marco se impone en cada subpaso
+	param.ancho_vol = malla->ancho_vol;
+	param.alto_vol = malla->alto_vol;
+	param.area = param.ancho_vol*param.alto_vol;
+	param.borde_sup = param.borde_inf = param.borde_izq = param.borde_der = 1.0;
+	param.num_voly_total = malla->datos.num_voly;
+	param.num_procs = 1;
+	param.id_hebra = 0;
+	param.comm = MPI_COMM_SELF;
+	param.esponja = 0;
+	param.fila_ini_global = 0;
+
+	fprintf(stdout, "Malla anidada en hebra %d: %d x %d volumenes (razon %d, con el marco)\n", padre->param.id_hebra,
+		malla->datos.num_volx, malla->datos.num_voly, malla->razon);
+	if (inicializarSimulacion(&(an->sim), &(malla->datos), &param) != 0) {
+		enlazarTexturasSimulacion(padre);
+		return 1;
+	}
+	cudaMalloc((void **) &(an->d_parche_ant_1), tam_parche);
+	cudaMalloc((void **) &(an->d_parche_ant_2), tam_parche);
+	cudaMalloc((void **) &(an->d_parche_1), tam_parche);
+	cudaMalloc((void **) &(an->d_parche_2), tam_parche);
+	cudaMalloc((void **) &(an->d_masas), 4*sizeof(float));
+	an->threadBlockParche = dim3(NUM_HEBRAS_ANCHO_EST, NUM_HEBRAS_ALTO_EST);
+	an->blockGridParche = dim3(iDivUp(an->nx_parche, NUM_HEBRAS_ANCHO_EST), iDivUp(an->ny_parche, NUM_HEBRAS_ALTO_EST));
+
+	// inicializarSimulacion ha enlazado las texturas a la malla anidada
+	enlazarTexturasSimulacion(padre);
+	copiarParcheDePadre(an, padre, an->d_parche_1, an->d_parche_2);
+
+	return 0;
+}
+
+// Da un paso de la simulacin padre y los subpasos de la malla anidada hasta su mismo tiempo, y
+// actualiza C y N (ver el principio del fichero). Es una llamada colectiva de MPI (por el paso
+// de la malla padre)
+void avanzarMallaAnidada(TSimulacionAnidada *an, TSimulacion *padre)
+{
+	TSimulacion *sim = &(an->sim);
+	TSW_Cuda *datos_SW_Cuda = &(sim->datos_SW_Cuda);
+	TMallaAnidada *malla = an->malla;
+	TEstadoGPU *aux;
+	TTiempo tiempo_ini, tiempo_fin, resto;
+	size_t ancho = an->nx_parche*sizeof(TEstadoGPU);
+	long n;
+
+	// El estado de C y N al final del paso anterior est en d_parche_*
+	aux = an->d_parche_ant_1;  an->d_parche_ant_1 = an->d_parche_1;  an->d_parche_1 = aux;
+	aux = an->d_parche_ant_2;  an->d_parche_ant_2 = an->d_parche_2;  an->d_parche_2 = aux;
+
+	tiempo_ini = padre->tiempo_act;
+	avanzarPasosSimulacion(padre, 1);
+	tiempo_fin = padre->tiempo_act;
+	copiarParcheDePadre(an, padre, an->d_parche_1, an->d_parche_2);
+	an->pasos++;
+
+	// Subpasos de la malla anidada. sim->delta_T es el delta T que permite su CFL
+	enlazarTexturasSimulacion(sim);
+	while (sim->tiempo_act < tiempo_fin) {
+		resto = tiempo_fin - sim->tiempo_act;
+		n = (long) ceil(resto/sim->delta_T);
+		sim->delta_T = (n > 1) ? resto/n : resto;
+		imponerMarcoAnidadaGPU<<<datos_SW_Cuda->blockGridEst, datos_SW_Cuda->threadBlockEst>>>(an->d_parche_ant_1,
+			an->d_parche_ant_2, an->d_parche_1, an->d_parche_2, an->nx_parche, malla->razon, malla->datos.num_volx,
+			malla->datos.num_voly, datos_SW_Cuda->fila_ini_gpu, (float) ((sim->tiempo_act - tiempo_ini)/(tiempo_fin - tiempo_ini)),
+			datos_SW_Cuda->d_bloquesActivos);
+		avanzarPasosSimulacion(sim, 1);
+		if (n <= 1)
+			sim->tiempo_act = tiempo_fin;
+		an->subpasos++;
+	}
+
+	// Sustituimos C por la media de sus volmenes finos y corregimos la masa en N
+	cudaMemset(an->d_masas, 0, 4*sizeof(float));
+	restringirMallaAnidadaGPU<<<an->blockGridParche, an->threadBlockParche>>>(an->d_parche_1, an->d_parche_2,
+		an->nx_parche, an->ny_parche, malla->razon, datos_SW_Cuda->fila_ini_gpu, an->d_masas);
+	corregirMasaAnidadaGPU<<<an->blockGridParche, an->threadBlockParche>>>(an->d_parche_1, an->d_parche_2,
+		an->nx_parche, an->ny_parche, an->d_masas, padre->datos_SW_Cuda.d_bloquesActivos,
+		padre->datos_SW_Cuda.blockGridEst.x, an->col_parche, an->fila_parche-1);
+	enlazarTexturasSimulacion(padre);
+	cudaMemcpy2DToArray(padre->datos_SW_Cuda.d_datosVolumenes_1, an->col_parche*sizeof(TEstadoGPU), an->fila_parche,
+		an->d_parche_1, ancho, ancho, an->ny_parche, cudaMemcpyDeviceToDevice);
+	cudaMemcpy2DToArray(padre->datos_SW_Cuda.d_datosVolumenes_2, an->col_parche*sizeof(TEstadoGPU), an->fila_parche,
+		an->d_parche_2, ancho, ancho, an->ny_parche, cudaMemcpyDeviceToDevice);
+}
+
+// Libera la memoria GPU de la malla anidada y vuelve a enlazar las texturas a la simulacin padre
+void liberarMallaAnidada(TSimulacionAnidada *an, TSimulacion *padre)
+{
+	cudaFree(an->d_parche_ant_1);
+	cudaFree(an->d_parche_ant_2);
+	cudaFree(an->d_parche_1);
+	cudaFree(an->d_parche_2);
+	cudaFree(an->d_masas);
+	liberarSimulacion(&(an->sim));
+	enlazarTexturasSimulacion(padre);
+}
+
+#endif
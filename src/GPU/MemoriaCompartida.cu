@@ -0,0 +1,109 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "MemoriaCompartida.hxx"
+
+// Segmento donde publica los campos este proceso (NULL si no se publican)
+TCabeceraMemoria *cabecera_memoria = NULL;
+
+// Crea el segmento donde el proceso id_hebra publica los campos de su cluster (ver
+// MemoriaCompartida.hxx). xmin, ymin, ancho_vol y alto_vol estn en metros.
+// Devuelve 0 si todo ha ido bien y 1 si no se ha podido crear
+int crearMemoriaCompartida(char *nombre, int id_hebra, int num_procs, int num_volx, int num_voly, int fila_ini,
+		int num_voly_total, double xmin, double ymin, double ancho_vol, double alto_vol)
+{
+	char nombre_seg[512];
+	size_t desp_datos, tam;
+	void *p;
+	int fd;
+
+	sprintf(nombre_seg, "%s.%d", nombre, id_hebra);
+	desp_datos = ((sizeof(TCabeceraMemoria) + ALINEAMIENTO_ARENA - 1)/ALINEAMIENTO_ARENA)*ALINEAMIENTO_ARENA;
+	tam = desp_datos + ((size_t) NUM_CAMPOS_MEMORIA)*num_volx*num_voly*sizeof(float);
+
+	if (nombre[0] == '/')
+		fd = shm_open(nombre_seg, O_CREAT | O_RDWR, 0644);
+	else
+		fd = open(nombre_seg, O_CREAT | O_RDWR, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Error en hebra %d: No se ha podido crear '%s'\n", id_hebra, nombre_seg);
+		return 1;
+	}
+	if (ftruncate(fd, tam) != 0) {
+		fprintf(stderr, "Error en hebra %d: No se ha podido reservar '%s'\n", id_hebra, nombre_seg);
+		close(fd);
+		return 1;
+	}
+	p = mmap(NULL, tam, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Error en hebra %d: No se ha podido proyectar '%s'\n", id_hebra, nombre_seg);
+		return 1;
+	}
+
+	cabecera_memoria = (TCabeceraMemoria *) p;
+	cabecera_memoria->magico = 0;
+	cabecera_memoria->version = VERSION_MEMORIA;
+	cabecera_memoria->secuencia = 0;
+	cabecera_memoria->terminado = 0;
+	cabecera_memoria->num_guardado = 0;
+	cabecera_memoria->tiempo = 0.0;
+	cabecera_memoria->num_campos = NUM_CAMPOS_MEMORIA;
+	cabecera_memoria->num_volx = num_volx;
+	cabecera_memoria->num_voly = num_voly;
+	cabecera_memoria->fila_ini = fila_ini;
+	cabecera_memoria->num_voly_total = num_voly_total;
+	cabecera_memoria->id_hebra = id_hebra;
+	cabecera_memoria->num_procs = num_procs;
+	cabecera_memoria->xmin = xmin;
+	cabecera_memoria->ymin = ymin;
+	cabecera_memoria->ancho_vol = ancho_vol;
+	cabecera_memoria->alto_vol = alto_vol;
+	cabecera_memoria->desp_datos = desp_datos;
+	cabecera_memoria->tam = tam;
+	__sync_synchronize();
+	cabecera_memoria->magico = MAGICO_MEMORIA;
+
+	return 0;
+}
+
+// Escribe los campos del estado actual en el segmento. datos_1, datos_2 y eta1_maxima son los
+// volmenes del cluster (sin las filas de comunicacin) en CPU y tiempo est en segundos.
+// Si terminado es 1, se marcan como los campos finales
+void publicarCamposMemoria(int num_volx, int num_voly, float4 *datos_1, float4 *datos_2, float2 *eta1_maxima,
+		float Hmin, float H, float Q, double tiempo, int terminado)
+{
+	int i;
+	int num_volumenes = num_volx*num_voly;
+	float *campos = (float *) (((char *) cabecera_memoria) + cabecera_memoria->desp_datos);
+	float *eta1 = campos + CAMPO_ETA1*num_volumenes;
+	float *q1x = campos + CAMPO_Q1X*num_volumenes;
+	float *q1y = campos + CAMPO_Q1Y*num_volumenes;
+	float *eta1_max = campos + CAMPO_ETA1_MAX*num_volumenes;
+
+	// Secuencia impar mientras se escriben los campos
+	cabecera_memoria->secuencia++;
+	__sync_synchronize();
+	for (i=0; i<num_volumenes; i++) {
+		eta1[i] = (datos_1[i].x + datos_2[i].x - datos_1[i].w - Hmin)*H;
+		q1x[i] = datos_1[i].y*Q;
+		q1y[i] = datos_1[i].z*Q;
+		eta1_max[i] = (eta1_maxima[i].x - Hmin)*H;
+	}
+	cabecera_memoria->tiempo = tiempo;
+	cabecera_memoria->num_guardado++;
+	cabecera_memoria->terminado = terminado;
+	__sync_synchronize();
+	cabecera_memoria->secuencia++;
+}
+
+// Deja de publicar campos. El segmento sigue existiendo para los lectores
+void cerrarMemoriaCompartida()
+{
+	if (cabecera_memoria != NULL) {
+		munmap((void *) cabecera_memoria, cabecera_memoria->tam);
+		cabecera_memoria = NULL;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef _MEMORIA_COMPARTIDA_H_
+#define _MEMORIA_COMPARTIDA_H_
+
+/*********************************************************/
+/* Formato de los campos publicados en memoria compartida */
+/*********************************************************/
+
+// Cada proceso publica los volmenes de su cluster en un segmento propio de nombre
+// "<nombre>.<proceso>". Si el nombre empieza por '/' es un segmento de memoria compartida
+// POSIX (shm_open, en Linux est en /dev/shm), y si no, un fichero proyectado en memoria.
+// El segmento empieza con un TCabeceraMemoria. A partir del byte desp_datos estn los
+// num_campos campos, en el orden de TCampoMemoria, cada uno con num_volx*num_voly floats
+// por filas. Los valores estn en unidades fsicas (m y m2/s). El segmento no se borra
+// al terminar la simulacin
+
+#define MAGICO_MEMORIA   0x5359484C  // "LHYS"
+#define VERSION_MEMORIA  1
+
+// Campos publicados
+enum TCampoMemoria {CAMPO_ETA1 = 0, CAMPO_Q1X, CAMPO_Q1Y, CAMPO_ETA1_MAX, NUM_CAMPOS_MEMORIA};
+
+typedef struct TCabeceraMemoria {
+	// MAGICO_MEMORIA y VERSION_MEMORIA. magico se escribe despus del resto de la cabecera
+	unsigned int magico, version;
+	// Nmero de secuencia. Es impar mientras se escriben los campos. Un lector debe leerlo,
+	// esperar a que sea par, leer los campos y volver a leerlo: si no ha cambiado, los campos
+	// que ha ledo son de un mismo guardado
+	volatile unsigned int secuencia;
+	// Vale 1 cuando la simulacin ha terminado y los campos son los finales
+	volatile int terminado;
+	// Nmero de guardados publicados y tiempo del ltimo (seg)
+	int num_guardado;
+	double tiempo;
+	int num_campos;
+	// Volmenes del cluster, fila global de su primera fila y filas de toda la malla
+	int num_volx, num_voly;
+	int fila_ini, num_voly_total;
+	int id_hebra, num_procs;
+	// Xmin e Ymin de la malla y tamao de los volmenes (m), como en los ficheros NetCDF
+	double xmin, ymin, ancho_vol, alto_vol;
+	// Desplazamiento del primer campo y tamao del segmento (bytes)
+	unsigned long long desp_datos, tam;
+} TCabeceraMemoria;
+
+#endif
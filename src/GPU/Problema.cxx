@@ -2,43 +2,479 @@
 #include <sys/stat.h> 
 #include <fstream>
 #include <cmath>
+#include <vector>
 #include "cond_ini.cxx"
 #include "mpi.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+#include "FicheroBinario.hxx"
+#include "ServidorES.hxx"
 
-int obtenerIndicePunto(float *longitud, float *latitud, float lon, float lat, int num_volx, int num_voly)
+// Devuelve el primer i (entre 0 y n-1) tal que ini + i*paso >= val, o n si no hay ninguno.
+// Hace una bsqueda binaria en las coordenadas uniformes ini + i*paso
+int buscarCoordenada(Scalar ini, Scalar paso, int n, Scalar val)
 {
-        int i, j;
-        int pos = -1;
-        bool encontrado;
-
-        // Buscamos el ?ndice en longitud
-        i = 0;
-        encontrado = false;
-
-        while ((i < num_volx) && (! encontrado))  {
-                if (longitud[i] >= lon) {
-                        encontrado = true;
-                        if (fabs(lon - longitud[max(i-1,0)]) < fabs(lon - longitud[i]))
-                                i = max(i-1,0);
-                }
-                else i++;
-        }
-        if (encontrado) {
-                // Si la longitud est? dentro del dominio, buscamos el ?ndice en latitud
-                j = 0;
-                encontrado = false;
-                while ((j < num_voly) && (! encontrado))  {
-                        if (latitud[j] >= lat) {
-                                encontrado = true;
-                                if (fabs(lat - latitud[max(j-1,0)]) < fabs(lat - latitud[j]))
-                                        j = max(j-1,0);
-                                pos = j*num_volx + i;
-                        }
-                        else j++;
-                }
-        }
+	int izq = 0;
+	int der = n;
+	int med;
+
+	while (izq < der) {
+		med = (izq + der)/2;
+		if (ini + med*paso >= val)
+			der = med;
+		else
+			izq = med+1;
+	}
+
+	return izq;
+}
+
+// Devuelve el ndice global del volumen ms cercano al punto (lon, lat) en la malla de
+// coordenadas x0 + i*dx, y0 + j*dy, o -1 si el punto est fuera de la malla
+int obtenerIndicePunto(Scalar x0, Scalar dx, Scalar y0, Scalar dy, Scalar lon, Scalar lat, int num_volx, int num_voly)
+{
+	int i, j;
+
+	i = buscarCoordenada(x0, dx, num_volx, lon);
+	if (i == num_volx)
+		return -1;
+	if (fabs(lon - (x0 + max(i-1,0)*dx)) < fabs(lon - (x0 + i*dx)))
+		i = max(i-1,0);
+
+	j = buscarCoordenada(y0, dy, num_voly, lat);
+	if (j == num_voly)
+		return -1;
+	if (fabs(lat - (y0 + max(j-1,0)*dy)) < fabs(lat - (y0 + j*dy)))
+		j = max(j-1,0);
+
+	return j*num_volx + i;
+}
+
+// Nombres de las variables de los ficheros NetCDF, en el orden de TOpciones::diezmado,
+// guardar_variable, intervalo_variable y precision_variable
+static const char *nombres_variables_nc[NUM_VARIABLES] = {"eta1", "q1x", "q1y", "eta2", "q2x", "q2y"};
+
+// Devuelve la posicin de la variable NetCDF nombre en nombres_variables_nc, o -1 si no existe
+int buscarVariableNC(string nombre)
+{
+	int i;
+
+	for (i=0; i<NUM_VARIABLES; i++) {
+		if (nombre == nombres_variables_nc[i])
+			return i;
+	}
+	return -1;
+}
+
+// Asigna los valores por defecto de las opciones adicionales
+void inicializarOpciones(TOpciones *opciones)
+{
+	int i;
+
+	opciones->memoria_compartida[0] = '\0';
+	opciones->intervalo_puntos = -1.0;
+	for (i=0; i<NUM_VARIABLES; i++) {
+		opciones->diezmado[i] = 1;
+		opciones->guardar_variable[i] = 1;
+		opciones->intervalo_variable[i] = -1.0;
+		opciones->precision_variable[i] = 0.0;
+	}
+	opciones->intervalo_diagnostico = -1.0;
+	opciones->parada_velocidad = 0.0;
+	opciones->parada_energia = 0.0;
+	opciones->parada_intervalo = -1.0;
+	opciones->parada_tiempo_minimo = 0.0;
+	opciones->num_regiones = 0;
+	opciones->malla_anidada[0] = '\0';
+	opciones->esponja = 0;
+	opciones->esponja_tiempo = 60.0;
+	opciones->recorte_margen = -1.0;
+}
+
+// Lee las opciones adicionales del final del fichero de datos (una por lnea con el formato
+// "nombre valor"). La opcin region tiene cinco valores. Devuelve 0 si todo ha ido bien y 1 si
+// hay alguna opcin desconocida o con valores no vlidos
+int leerOpciones(ifstream &fich, TOpciones *opciones)
+{
+	string nombre, valor;
+	TRegion *reg;
+	int i, n;
+	int err = 0;
+
+	inicializarOpciones(opciones);
+	while (fich >> nombre >> valor) {
+		if (nombre == "memoria_compartida") {
+			strncpy(opciones->memoria_compartida, valor.c_str(), TAM_OPCION-1);
+			opciones->memoria_compartida[TAM_OPCION-1] = '\0';
+		}
+		else if (nombre == "malla_anidada") {
+#ifdef PASO_TIEMPO_LOCAL
+			cerr << "Error: La opcion malla_anidada no se puede usar con PASO_TIEMPO_LOCAL" << endl;
+			err = 1;
+#else
+			strncpy(opciones->malla_anidada, valor.c_str(), TAM_OPCION-1);
+			opciones->malla_anidada[TAM_OPCION-1] = '\0';
+#endif
+		}
+		else if (nombre == "intervalo_puntos") {
+			opciones->intervalo_puntos = atof(valor.c_str());
+		}
+		else if (nombre == "intervalo_diagnostico") {
+			opciones->intervalo_diagnostico = atof(valor.c_str());
+		}
+		else if ((nombre == "esponja") || (nombre == "esponja_tiempo")) {
+			if (((nombre == "esponja") && (atoi(valor.c_str()) < 0)) ||
+					((nombre == "esponja_tiempo") && (atof(valor.c_str()) <= 0.0))) {
+				cerr << "Error: Opcion '" << nombre << " " << valor << "' no valida" << endl;
+				err = 1;
+			}
+			else if (nombre == "esponja")
+				opciones->esponja = atoi(valor.c_str());
+			else
+				opciones->esponja_tiempo = atof(valor.c_str());
+		}
+		else if (nombre == "recorte_margen") {
+			opciones->recorte_margen = atof(valor.c_str());
+		}
+		else if (nombre == "parada_velocidad") {
+			opciones->parada_velocidad = atof(valor.c_str());
+		}
+		else if (nombre == "parada_energia") {
+			opciones->parada_energia = atof(valor.c_str());
+		}
+		else if (nombre == "parada_intervalo") {
+			opciones->parada_intervalo = atof(valor.c_str());
+		}
+		else if (nombre == "parada_tiempo_minimo") {
+			opciones->parada_tiempo_minimo = atof(valor.c_str());
+		}
+		else if ((nombre == "diezmado") || (nombre.compare(0, 9, "diezmado_") == 0)) {
+			// diezmado se aplica a todas las variables y diezmado_<variable> slo a una
+			i = (nombre == "diezmado") ? NUM_VARIABLES : buscarVariableNC(nombre.substr(9));
+			n = atoi(valor.c_str());
+			if ((i < 0) || (n < 1)) {
+				cerr << "Error: Opcion '" << nombre << " " << valor << "' no valida" << endl;
+				err = 1;
+			}
+			else if (i == NUM_VARIABLES) {
+				for (i=0; i<NUM_VARIABLES; i++)
+					opciones->diezmado[i] = n;
+			}
+			else {
+				opciones->diezmado[i] = n;
+			}
+		}
+		else if ((nombre.compare(0, 8, "guardar_") == 0) && (buscarVariableNC(nombre.substr(8)) >= 0)) {
+			opciones->guardar_variable[buscarVariableNC(nombre.substr(8))] = (atoi(valor.c_str()) != 0);
+		}
+		else if ((nombre.compare(0, 10, "intervalo_") == 0) && (buscarVariableNC(nombre.substr(10)) >= 0)) {
+			opciones->intervalo_variable[buscarVariableNC(nombre.substr(10))] = atof(valor.c_str());
+		}
+		else if ((nombre == "precision") || (nombre.compare(0, 10, "precision_") == 0)) {
+			// precision se aplica a todas las variables y precision_<variable> slo a una
+			i = (nombre == "precision") ? NUM_VARIABLES : buscarVariableNC(nombre.substr(10));
+			if ((i < 0) || (atof(valor.c_str()) < 0.0)) {
+				cerr << "Error: Opcion '" << nombre << " " << valor << "' no valida" << endl;
+				err = 1;
+			}
+			else if (i == NUM_VARIABLES) {
+				for (i=0; i<NUM_VARIABLES; i++)
+					opciones->precision_variable[i] = atof(valor.c_str());
+			}
+			else {
+				opciones->precision_variable[i] = atof(valor.c_str());
+			}
+		}
+		else if (nombre == "region") {
+			if (opciones->num_regiones == MAX_REGIONES) {
+				cerr << "Error: Hay mas de " << MAX_REGIONES << " regiones" << endl;
+				return 1;
+			}
+			reg = opciones->regiones + opciones->num_regiones;
+			reg->xmin = atof(valor.c_str());
+			if (! (fich >> reg->xmax >> reg->ymin >> reg->ymax >> reg->intervalo)) {
+				cerr << "Error: La region " << opciones->num_regiones+1 << " debe tener el formato ";
+				cerr << "'region xmin xmax ymin ymax intervalo'" << endl;
+				return 1;
+			}
+			if ((reg->xmin > reg->xmax) || (reg->ymin > reg->ymax) || (reg->intervalo < 0.0)) {
+				cerr << "Error: La region " << opciones->num_regiones+1 << " no es valida" << endl;
+				err = 1;
+			}
+			opciones->num_regiones++;
+		}
+		else {
+			cerr << "Error: Opcion desconocida '" << nombre << "'" << endl;
+			err = 1;
+		}
+	}
+
+	return err;
+}
+
+// Lee la cabecera del fichero binario fich_bin (ver FicheroBinario.hxx).
+// Devuelve 0 si todo ha ido bien y 1 si no es un fichero binario vlido
+int leerCabeceraBinario(string fich_bin, TCabeceraBinario *cab)
+{
+	FILE *fp;
+	int err = 0;
 
-        return pos;
+	fp = fopen(fich_bin.c_str(), "rb");
+	if (fp == NULL)
+		return 1;
+	if (fread(cab, sizeof(TCabeceraBinario), 1, fp) != 1)
+		err = 1;
+	else if ((cab->magico != MAGICO_BINARIO) || (cab->version != VERSION_BINARIO) ||
+			(cab->num_variables != NUM_VARIABLES_BINARIO) || (cab->filas_bloque <= 0))
+		err = 1;
+	fclose(fp);
+
+	return err;
+}
+
+// Cierra el fichero binario abierto con abrirFicheroBinario y libera su ndice de bloques
+void cerrarFicheroBinario(int fd, unsigned long long *desp_bloques)
+{
+	free(desp_bloques);
+	close(fd);
+}
+
+// Abre el fichero binario fich_bin con cabecera cab para leer filas con leerFilasBinarioAbierto:
+// pone en fd su descriptor y en desp_bloques su ndice de bloques (hay que liberarlos con
+// cerrarFicheroBinario). Devuelve 0 si todo ha ido bien y 1 si ha habido algn error
+int abrirFicheroBinario(string fich_bin, TCabeceraBinario *cab, int *fd, unsigned long long **desp_bloques)
+{
+	size_t tam_indice = cab->num_bloques*sizeof(unsigned long long);
+
+	*fd = open(fich_bin.c_str(), O_RDONLY);
+	if (*fd == -1)
+		return 1;
+	*desp_bloques = (unsigned long long *) malloc(tam_indice);
+	if (*desp_bloques == NULL) {
+		cerr << "Error: No hay memoria CPU suficiente para el indice del fichero '" << fich_bin << "'" << endl;
+		close(*fd);
+		return 1;
+	}
+	if (pread(*fd, *desp_bloques, tam_indice, sizeof(TCabeceraBinario)) != (ssize_t) tam_indice) {
+		cerrarFicheroBinario(*fd, *desp_bloques);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Lee del fichero binario abierto con abrirFicheroBinario (descriptor fd e ndice de bloques
+// desp_bloques) los num_cols volmenes a partir de la columna col_ini de las num_filas filas de
+// la malla a partir de fila_ini y los pone adimensionalizados en datos_1 y datos_2. Slo se
+// proyectan en memoria los bloques que contienen esas filas. Pone en Hmin la profundidad mnima
+// de los volmenes ledos. No cierra el fichero.
+// Devuelve 0 si todo ha ido bien y 1 si ha habido algn error
+int leerFilasBinarioAbierto(int fd, unsigned long long *desp_bloques, TCabeceraBinario *cab, int fila_ini,
+			int num_filas, int col_ini, int num_cols, float4 *datos_1, float4 *datos_2, Scalar H, Scalar Q, Scalar *Hmin)
+{
+	int bloque, fila, fila_fin, i, j;
+	int num_volx = cab->num_volx;
+	int nvar = cab->num_variables;
+	size_t tam_pagina = sysconf(_SC_PAGESIZE);
+	size_t desp, desp_pagina, tam;
+	int fila_bloque, filas;
+	float *v;
+	char *p;
+	// Factores para pasar de los valores guardados a los adimensionalizados
+	Scalar fac_H = cab->escala_H/H;
+	Scalar fac_Q = cab->escala_Q/Q;
+	Scalar val;
+
+	*Hmin = 1e30;
+	fila_fin = fila_ini + num_filas;
+	for (bloque=fila_ini/cab->filas_bloque; bloque*cab->filas_bloque < fila_fin; bloque++) {
+		// Proyectamos el bloque (desde el principio de su pgina)
+		fila_bloque = bloque*cab->filas_bloque;
+		filas = min(cab->filas_bloque, cab->num_voly - fila_bloque);
+		desp = desp_bloques[bloque];
+		desp_pagina = desp - desp%tam_pagina;
+		tam = desp - desp_pagina + ((size_t) filas)*num_volx*nvar*sizeof(float);
+		p = (char *) mmap(NULL, tam, PROT_READ, MAP_PRIVATE, fd, desp_pagina);
+		if (p == MAP_FAILED)
+			return 1;
+		madvise(p, tam, MADV_SEQUENTIAL);
+
+		// Copiamos las filas del bloque que son del cluster
+		for (fila=max(fila_ini, fila_bloque); fila<min(fila_fin, fila_bloque+filas); fila++) {
+			v = (float *) (p + (desp - desp_pagina)) + (((size_t) (fila-fila_bloque))*num_volx + col_ini)*nvar;
+			for (i=0; i<num_cols; i++, v+=nvar) {
+				j = (fila-fila_ini)*num_cols + i;
+				val = v[VAR_H]*fac_H;
+				datos_1[j].w = datos_2[j].w = val;
+				if (val < *Hmin)
+					*Hmin = val;
+				datos_1[j].x = v[VAR_H1]*fac_H;
+				datos_1[j].y = v[VAR_Q1X]*fac_Q;
+				datos_1[j].z = v[VAR_Q1Y]*fac_Q;
+				datos_2[j].x = v[VAR_H2]*fac_H;
+				datos_2[j].y = v[VAR_Q2X]*fac_Q;
+				datos_2[j].z = v[VAR_Q2Y]*fac_Q;
+			}
+		}
+		munmap(p, tam);
+	}
+
+	return 0;
+}
+
+// Lee del fichero binario fich_bin las filas indicadas con leerFilasBinarioAbierto, abriendo y
+// cerrando el fichero. Devuelve 0 si todo ha ido bien y 1 si ha habido algn error
+int leerFilasBinario(string fich_bin, TCabeceraBinario *cab, int fila_ini, int num_filas, int col_ini, int num_cols,
+			float4 *datos_1, float4 *datos_2, Scalar H, Scalar Q, Scalar *Hmin)
+{
+	unsigned long long *desp_bloques;
+	int fd, err;
+
+	if (abrirFicheroBinario(fich_bin, cab, &fd, &desp_bloques) != 0)
+		return 1;
+	err = leerFilasBinarioAbierto(fd, desp_bloques, cab, fila_ini, num_filas, col_ini, num_cols,
+			datos_1, datos_2, H, Q, Hmin);
+	cerrarFicheroBinario(fd, desp_bloques);
+
+	return err;
+}
+
+// Obtiene en recorte el menor rectngulo de la malla del fichero binario fich_bin que contiene
+// todos los volmenes que se pueden mojar, ms un volumen en cada lado. Un volumen seco no se
+// puede mojar si su fondo est ms de margen (adimensionalizado) por encima de la mxima
+// superficie libre inicial de los volmenes mojados, o si no est conectado con los volmenes
+// mojados por volmenes que se pueden mojar. col_ini y fila_ini se redondean hacia abajo a
+// mltiplos de alineamiento. El fichero se abre una vez y se lee por bloques de filas en dos
+// pasadas. Si no hay volmenes mojados, no se recorta. Devuelve 0 si todo ha ido bien y 1 si no
+// se puede leer el fichero o no hay memoria suficiente
+int calcularRecorte(string fich_bin, TCabeceraBinario *cab, Scalar margen, int alineamiento, Scalar H, Scalar Q,
+			TRecorte *recorte)
+{
+	int num_volx = cab->num_volx;
+	int num_voly = cab->num_voly;
+	int filas = cab->filas_bloque;
+	float4 *datos_1, *datos_2;
+	// Estado de cada volumen: 0 si no se puede mojar, 1 si se puede mojar, 2 si est mojado
+	// y 3 si se puede mojar y est conectado con los mojados
+	unsigned char *estado;
+	vector<int> pila;
+	unsigned long long *desp_bloques;
+	Scalar eta_max, Hmin;
+	int fd, fila, n, i, j, k;
+	int col_min, col_max, fila_min, fila_max;
+
+	recorte->col_ini = recorte->fila_ini = 0;
+	recorte->num_volx = recorte->num_volx_orig = num_volx;
+	recorte->num_voly = recorte->num_voly_orig = num_voly;
+	datos_1 = (float4 *) malloc(2*((size_t) filas)*num_volx*sizeof(float4));
+	estado = (unsigned char *) malloc(((size_t) num_volx)*num_voly);
+	if ((datos_1 == NULL) || (estado == NULL)) {
+		cerr << "Error: No hay memoria CPU suficiente para obtener el recorte" << endl;
+		free(datos_1);
+		free(estado);
+		return 1;
+	}
+	datos_2 = datos_1 + ((size_t) filas)*num_volx;
+	if (abrirFicheroBinario(fich_bin, cab, &fd, &desp_bloques) != 0) {
+		cerr << "Error: No se ha podido leer el fichero '" << fich_bin << "'" << endl;
+		free(datos_1);
+		free(estado);
+		return 1;
+	}
+
+	// Primera pasada: mxima superficie libre inicial de los volmenes mojados
+	eta_max = -1e30;
+	for (fila=0; fila<num_voly; fila+=filas) {
+		n = min(filas, num_voly-fila);
+		if (leerFilasBinarioAbierto(fd, desp_bloques, cab, fila, n, 0, num_volx, datos_1, datos_2, H, Q, &Hmin) != 0) {
+			cerr << "Error: No se ha podido leer el fichero '" << fich_bin << "'" << endl;
+			cerrarFicheroBinario(fd, desp_bloques);
+			free(datos_1);
+			free(estado);
+			return 1;
+		}
+		for (i=0; i<n*num_volx; i++) {
+			if (datos_1[i].x + datos_2[i].x > 0.0)
+				eta_max = max(eta_max, (Scalar) (datos_1[i].x + datos_2[i].x - datos_1[i].w));
+		}
+	}
+	if (eta_max == -1e30) {
+		cerrarFicheroBinario(fd, desp_bloques);
+		free(datos_1);
+		free(estado);
+		return 0;
+	}
+
+	// Segunda pasada: estado de cada volumen. El fondo est a -H
+	for (fila=0; fila<num_voly; fila+=filas) {
+		n = min(filas, num_voly-fila);
+		if (leerFilasBinarioAbierto(fd, desp_bloques, cab, fila, n, 0, num_volx, datos_1, datos_2, H, Q, &Hmin) != 0) {
+			cerr << "Error: No se ha podido leer el fichero '" << fich_bin << "'" << endl;
+			cerrarFicheroBinario(fd, desp_bloques);
+			free(datos_1);
+			free(estado);
+			return 1;
+		}
+		for (i=0; i<n*num_volx; i++) {
+			k = fila*num_volx + i;
+			if (datos_1[i].x + datos_2[i].x > 0.0)
+				estado[k] = 2;
+			else
+				estado[k] = (-datos_1[i].w <= eta_max + margen) ? 1 : 0;
+		}
+	}
+	cerrarFicheroBinario(fd, desp_bloques);
+	free(datos_1);
+
+	// Recorremos desde los volmenes mojados los que se pueden mojar conectados con ellos
+	// (por sus cuatro aristas), y obtenemos el rectngulo que los contiene
+	col_min = num_volx;  col_max = -1;
+	fila_min = num_voly;  fila_max = -1;
+	for (k=0; k<num_volx*num_voly; k++) {
+		if (estado[k] == 2) {
+			estado[k] = 3;
+			pila.push_back(k);
+		}
+	}
+	while (! pila.empty()) {
+		k = pila.back();
+		pila.pop_back();
+		i = k % num_volx;
+		j = k / num_volx;
+		col_min = min(col_min, i);  col_max = max(col_max, i);
+		fila_min = min(fila_min, j);  fila_max = max(fila_max, j);
+		if ((i > 0) && (estado[k-1] != 0) && (estado[k-1] != 3)) {
+			estado[k-1] = 3;
+			pila.push_back(k-1);
+		}
+		if ((i < num_volx-1) && (estado[k+1] != 0) && (estado[k+1] != 3)) {
+			estado[k+1] = 3;
+			pila.push_back(k+1);
+		}
+		if ((j > 0) && (estado[k-num_volx] != 0) && (estado[k-num_volx] != 3)) {
+			estado[k-num_volx] = 3;
+			pila.push_back(k-num_volx);
+		}
+		if ((j < num_voly-1) && (estado[k+num_volx] != 0) && (estado[k+num_volx] != 3)) {
+			estado[k+num_volx] = 3;
+			pila.push_back(k+num_volx);
+		}
+	}
+	free(estado);
+
+	// Dejamos un volumen que nunca se moja en cada lado recortado
+	col_min = max(col_min-1, 0);
+	col_max = min(col_max+1, num_volx-1);
+	fila_min = max(fila_min-1, 0);
+	fila_max = min(fila_max+1, num_voly-1);
+	recorte->col_ini = (col_min/alineamiento)*alineamiento;
+	recorte->fila_ini = (fila_min/alineamiento)*alineamiento;
+	recorte->num_volx = col_max+1 - recorte->col_ini;
+	recorte->num_voly = fila_max+1 - recorte->fila_ini;
+
+	return 0;
 }
 
 // Devuelve true si existe el fichero, false en otro caso
@@ -64,6 +500,111 @@ bool existeFichero(char *fichero)
 	return existe;
 }
 
+// Redondea tam al mltiplo de ALINEAMIENTO_ARENA superior
+size_t alinearArena(size_t tam)
+{
+	return (tam + ALINEAMIENTO_ARENA - 1) & ~((size_t) ALINEAMIENTO_ARENA - 1);
+}
+
+// Reserva tam bytes de memoria de CPU bloqueada para la arena.
+// Devuelve 0 si todo ha ido bien y 1 si no hay memoria suficiente
+int inicializarArena(TArena *arena, size_t tam)
+{
+	arena->usado = 0;
+	if (cudaMallocHost((void **) &(arena->memoria), tam) != cudaSuccess) {
+		arena->memoria = NULL;
+		arena->tam = 0;
+		return 1;
+	}
+	arena->tam = tam;
+	return 0;
+}
+
+// Devuelve un puntero a tam bytes libres de la arena, alineado a ALINEAMIENTO_ARENA bytes,
+// o NULL si no caben. Si la arena slo mide (memoria == NULL), devuelve NULL y suma el tamao
+void *reservarEnArena(TArena *arena, size_t tam)
+{
+	void *p = NULL;
+
+	tam = alinearArena(tam);
+	if (arena->memoria != NULL) {
+		if (arena->usado + tam > arena->tam)
+			return NULL;
+		p = (void *) (arena->memoria + arena->usado);
+	}
+	arena->usado += tam;
+	return p;
+}
+
+// Marca toda la memoria de la arena como libre sin liberarla. Si despus se asignan los mismos
+// buffers en el mismo orden (ver reservarBuffersCluster), se obtienen los mismos punteros, por lo
+// que una ejecucin con la misma malla se puede repetir sin reservar memoria
+void reiniciarArena(TArena *arena)
+{
+	arena->usado = 0;
+}
+
+void liberarArena(TArena *arena)
+{
+	if (arena->memoria != NULL)
+		cudaFreeHost(arena->memoria);
+	arena->memoria = NULL;
+	arena->tam = arena->usado = 0;
+}
+
+// Asigna en la arena todos los buffers de CPU del cluster. num_volx y num_voly se refieren al
+// cluster. Si se leen puntos de guardado, tambin asigna el array de sus ndices
+void reservarBuffersCluster(TArena *arena, TDatoCluster *datos_cluster, int num_volx, int num_voly,
+				int leer_fichero_puntos, int num_puntos_guardar, int **indiceVolumenesGuardado)
+{
+	int num_volumenes = num_volx*num_voly;
+	int num_vols_array = num_volumenes + 2*num_volx;
+
+	datos_cluster->datosVolumenes_1 = (float4 *) reservarEnArena(arena, num_vols_array*sizeof(float4));
+	datos_cluster->datosVolumenes_2 = (float4 *) reservarEnArena(arena, num_vols_array*sizeof(float4));
+	datos_cluster->eta1_maxima = (float2 *) reservarEnArena(arena, num_volumenes*sizeof(float2));
+	datos_cluster->vec_guardado = (float *) reservarEnArena(arena, num_volumenes*sizeof(float));
+	datos_cluster->batimetria = (float *) reservarEnArena(arena, num_vols_array*sizeof(float));
+#ifdef ALMACENAMIENTO_HALF
+	datos_cluster->estadoHalf = (TEstadoGPU *) reservarEnArena(arena, num_vols_array*sizeof(TEstadoGPU));
+#endif
+#if PASOS_HALO > 1
+	datos_cluster->datosVolumenesCom = (float4 *) reservarEnArena(arena, 8*FILAS_HALO*num_volx*sizeof(float4));
+#endif
+	if (leer_fichero_puntos == 1)
+		*indiceVolumenesGuardado = (int *) reservarEnArena(arena, num_puntos_guardar*sizeof(int));
+	else
+		*indiceVolumenesGuardado = NULL;
+}
+
+// Asigna los punteros a los volmenes de comunicacin del cluster y de los clusters adyacentes,
+// una vez asignados los buffers con reservarBuffersCluster
+void asignarPunterosComunicacion(TDatoCluster *datos_cluster)
+{
+	int num_volx = datos_cluster->num_volx;
+	int num_volumenes = num_volx*datos_cluster->num_voly;
+
+	datos_cluster->puntero_datosVolumenesComClusterSup_1 = datos_cluster->datosVolumenes_1 + num_volx;
+	datos_cluster->puntero_datosVolumenesComClusterSup_2 = datos_cluster->datosVolumenes_2 + num_volx;
+	datos_cluster->puntero_datosVolumenesComClusterInf_1 = datos_cluster->datosVolumenes_1 + num_volumenes;
+	datos_cluster->puntero_datosVolumenesComClusterInf_2 = datos_cluster->datosVolumenes_2 + num_volumenes;
+	datos_cluster->puntero_datosVolumenesComOtroClusterSup_1 = datos_cluster->datosVolumenes_1 + num_volumenes + num_volx;
+	datos_cluster->puntero_datosVolumenesComOtroClusterSup_2 = datos_cluster->datosVolumenes_2 + num_volumenes + num_volx;
+	datos_cluster->puntero_datosVolumenesComOtroClusterInf_1 = datos_cluster->datosVolumenes_1;
+	datos_cluster->puntero_datosVolumenesComOtroClusterInf_2 = datos_cluster->datosVolumenes_2;
+#if PASOS_HALO > 1
+	// Con varias filas de comunicacin, cada grupo de volmenes de comunicacin tiene su bloque
+	datos_cluster->puntero_datosVolumenesComClusterSup_1 = datos_cluster->datosVolumenesCom;
+	datos_cluster->puntero_datosVolumenesComClusterSup_2 = datos_cluster->datosVolumenesCom + FILAS_HALO*num_volx;
+	datos_cluster->puntero_datosVolumenesComClusterInf_1 = datos_cluster->datosVolumenesCom + 2*FILAS_HALO*num_volx;
+	datos_cluster->puntero_datosVolumenesComClusterInf_2 = datos_cluster->datosVolumenesCom + 3*FILAS_HALO*num_volx;
+	datos_cluster->puntero_datosVolumenesComOtroClusterSup_1 = datos_cluster->datosVolumenesCom + 4*FILAS_HALO*num_volx;
+	datos_cluster->puntero_datosVolumenesComOtroClusterSup_2 = datos_cluster->datosVolumenesCom + 5*FILAS_HALO*num_volx;
+	datos_cluster->puntero_datosVolumenesComOtroClusterInf_1 = datos_cluster->datosVolumenesCom + 6*FILAS_HALO*num_volx;
+	datos_cluster->puntero_datosVolumenesComOtroClusterInf_2 = datos_cluster->datosVolumenesCom + 7*FILAS_HALO*num_volx;
+#endif
+}
+
 void asignarVariables(Scalar x, Scalar y, Scalar *prof, Scalar *h1, Scalar *q1x, Scalar *q1y, Scalar *h2,
 			Scalar *q2x, Scalar *q2y, Scalar L, Scalar H, Scalar Q)
 {
@@ -76,63 +617,83 @@ void asignarVariables(Scalar x, Scalar y, Scalar *prof, Scalar *h1, Scalar *q1x,
 	*q2y = cini_q2y(x, y, L, H, Q, *prof);
 }
 
-// num_volx y num_voly se refieren al cluster, no a toda la malla
-void setCondicionesIniciales(TDatoCluster *datos_cluster, Scalar xmin, Scalar xmax, Scalar ymin, Scalar ymax,
+#ifndef CINI_FILAS
+// Obtiene las condiciones iniciales de los n volmenes de una fila, con centros (x[i], y), llamando
+// a las funciones de cond_ini.cxx para cada volumen. Si cond_ini.cxx define CINI_FILAS, debe
+// definir su propia cini_fila, que puede calcular una sola vez por fila los trminos que slo
+// dependen de y. Se llama desde varias hebras de OpenMP a la vez
+void cini_fila(Scalar *x, Scalar y, int n, Scalar L, Scalar H, Scalar Q, Scalar *prof, Scalar *h1,
+			Scalar *q1x, Scalar *q1y, Scalar *h2, Scalar *q2x, Scalar *q2y)
+{
+	int i;
+
+	for (i=0; i<n; i++)
+		asignarVariables(x[i], y, prof+i, h1+i, q1x+i, q1y+i, h2+i, q2x+i, q2y+i, L, H, Q);
+}
+#endif
+
+// num_volx y num_voly se refieren al cluster, no a toda la malla.
+// Las filas se reparten entre las hebras de OpenMP (OMP_NUM_THREADS). Cada hebra obtiene las
+// condiciones iniciales de una fila completa con cini_fila y las escribe en datosVolumenes.
+// Devuelve 0 si todo ha ido bien y 1 si no hay memoria suficiente para los buffers de las filas
+int setCondicionesIniciales(TDatoCluster *datos_cluster, Scalar xmin, Scalar xmax, Scalar ymin, Scalar ymax,
 				Scalar ancho_vol, Scalar alto_vol, int num_volx, int num_voly, int num_vols_saltar,
 				int num_vols_leer, Scalar L, Scalar H, Scalar Q, int id_hebra)
 {
+	Scalar *buffer_filas;
 	int fila_inicial = num_vols_saltar/num_volx;
 	int num_filas_leer = num_vols_leer/num_volx;
-	int i, j, pos;
-	Scalar prof, h1, q1x, q1y, h2, q2x, q2y;
-	Scalar x, y;
-
-	if (id_hebra == 0) {
-		// La primera hebra no tiene cluster adyacente superior.
-		// No escribimos nada en la primera fila de datosVolumenes
-		pos = num_volx;
-		for (j=fila_inicial; j<fila_inicial+num_filas_leer; j++) {
-			for (i=0; i<num_volx; i++) {
-				x = xmin + (i+0.5)*ancho_vol;
-				y = ymin + (j+0.5)*alto_vol;
-				asignarVariables(x, y, &prof, &h1, &q1x, &q1y, &h2, &q2x, &q2y, L, H, Q);
-
-				datos_cluster->datosVolumenes_1[pos].x = h1;
-				datos_cluster->datosVolumenes_1[pos].y = q1x;
-				datos_cluster->datosVolumenes_1[pos].z = q1y;
-				datos_cluster->datosVolumenes_1[pos].w = prof;
-				datos_cluster->datosVolumenes_2[pos].x = h2;
-				datos_cluster->datosVolumenes_2[pos].y = q2x;
-				datos_cluster->datosVolumenes_2[pos].z = q2y;
-				datos_cluster->datosVolumenes_2[pos].w = prof;
-				pos++;
-			}
-		}
+	// La primera hebra no tiene cluster adyacente superior, y no escribimos nada en la primera
+	// fila de datosVolumenes. En el resto, los datos incluyen los volmenes de comunicacin
+	// inferiores del cluster adyacente superior (la primera fila de datosVolumenes)
+	int pos_inicial = (id_hebra == 0) ? num_volx : 0;
+	float4 *datos_1 = datos_cluster->datosVolumenes_1 + pos_inicial;
+	float4 *datos_2 = datos_cluster->datosVolumenes_2 + pos_inicial;
 
+	// Buffers de una fila para cada hebra de OpenMP: coordenadas x y variables
+	buffer_filas = (Scalar *) malloc(((size_t) omp_get_max_threads())*8*num_volx*sizeof(Scalar));
+	if (buffer_filas == NULL) {
+		cerr << "Error en hebra " << id_hebra << ": No hay memoria CPU suficiente para las condiciones iniciales" << endl;
+		return 1;
 	}
-	else {
-		// Hay cluster adyacente superior.
-		// Los datos incluyen los volmenes de comunicacin inferiores
-		// del cluster adyacente superior (la primera fila de datosVolumenes)
-		pos = 0;
-		for (j=fila_inicial; j<fila_inicial+num_filas_leer; j++) {
+
+	#pragma omp parallel
+	{
+		Scalar *x = buffer_filas + ((size_t) omp_get_thread_num())*8*num_volx;
+		Scalar *prof = x + num_volx;
+		Scalar *h1 = x + 2*num_volx;
+		Scalar *q1x = x + 3*num_volx;
+		Scalar *q1y = x + 4*num_volx;
+		Scalar *h2 = x + 5*num_volx;
+		Scalar *q2x = x + 6*num_volx;
+		Scalar *q2y = x + 7*num_volx;
+		Scalar y;
+		int i, j, pos;
+
+		for (i=0; i<num_volx; i++)
+			x[i] = xmin + (i+0.5)*ancho_vol;
+
+		#pragma omp for schedule(static)
+		for (j=0; j<num_filas_leer; j++) {
+			y = ymin + (fila_inicial+j+0.5)*alto_vol;
+			cini_fila(x, y, num_volx, L, H, Q, prof, h1, q1x, q1y, h2, q2x, q2y);
+
+			pos = j*num_volx;
 			for (i=0; i<num_volx; i++) {
-				x = xmin + (i+0.5)*ancho_vol;
-				y = ymin + (j+0.5)*alto_vol;
-				asignarVariables(x, y, &prof, &h1, &q1x, &q1y, &h2, &q2x, &q2y, L, H, Q);
-
-				datos_cluster->datosVolumenes_1[pos].x = h1;
-				datos_cluster->datosVolumenes_1[pos].y = q1x;
-				datos_cluster->datosVolumenes_1[pos].z = q1y;
-				datos_cluster->datosVolumenes_1[pos].w = prof;
-				datos_cluster->datosVolumenes_2[pos].x = h2;
-				datos_cluster->datosVolumenes_2[pos].y = q2x;
-				datos_cluster->datosVolumenes_2[pos].z = q2y;
-				datos_cluster->datosVolumenes_2[pos].w = prof;
-				pos++;
+				datos_1[pos+i].x = h1[i];
+				datos_1[pos+i].y = q1x[i];
+				datos_1[pos+i].z = q1y[i];
+				datos_1[pos+i].w = prof[i];
+				datos_2[pos+i].x = h2[i];
+				datos_2[pos+i].y = q2x[i];
+				datos_2[pos+i].z = q2y[i];
+				datos_2[pos+i].w = prof[i];
 			}
 		}
 	}
+	free(buffer_filas);
+
+	return 0;
 }
 
 // Devuelve 0 si todo ha ido bien, 1 si ha habido algn error (no existe algn fichero)
@@ -143,8 +704,8 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 				Scalar *CFL, Scalar *r, Scalar *angulo1, Scalar *angulo2, Scalar *angulo3, Scalar *angulo4,
 				Scalar *mfc, Scalar *mf0, Scalar *mfs, Scalar *vmax1, Scalar *vmax2, Scalar *gravedad,
 				Scalar *epsilon_h, Scalar *L, Scalar *H, Scalar *Q, Scalar *T, int num_procs, int id_hebra,
-				int *leer_fichero_puntos, int **indiceVolumenesGuardado, 
-				int **posicionesVolumenesGuardado, int *num_puntos_guardar)
+				int *leer_fichero_puntos, int **indiceVolumenesGuardado, int *num_puntos_guardar,
+				TOpciones *opciones, TRecorte *recorte)
 {
 	// num_voly_otros es el nmero de filas de volmenes de todos los procesos menos el ltimo
 	int i, indice1, num_vols_leer;
@@ -165,7 +726,17 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 	string directorio;
 	string fich_topo, fich_est;
 	string fich_puntos;
+	string fich_anidada;
 	Scalar W[6];
+	// Alineamiento del recorte (mnimo comn mltiplo de los diezmados) y auxiliares para obtenerlo
+	int alineamiento, a, b, c, err;
+	// Arena que slo mide el tamao de los buffers del cluster
+	TArena arena_medida;
+	// Cabecera del fichero binario (si leerDeFichero es 2)
+	TCabeceraBinario cab_bin;
+
+	datos_cluster->arena.memoria = NULL;
+	datos_cluster->arena.tam = datos_cluster->arena.usado = 0;
 
 	// Ponemos en directorio el directorio donde estn los ficheros de datos
 	i = fich_ent.find_last_of("/");
@@ -198,6 +769,27 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 		fich >> *num_voly_total;
 		datos_cluster->num_voly = *num_voly_total;
 	}
+	else if (leerDeFichero == 2) {
+		// Leemos la cabecera del fichero binario con la topografa y el estado inicial.
+		// Los datos se leern al final, cuando estn creados todos los volmenes
+		fich >> fich_topo;
+		fich_topo = directorio+fich_topo;
+		if (! existeFichero((char *) fich_topo.c_str())) {
+			cerr << "Error: No se ha encontrado el fichero '" << fich_topo << "'" << endl;
+			return 1;
+		}
+		if (leerCabeceraBinario(fich_topo, &cab_bin) != 0) {
+			cerr << "Error: El fichero '" << fich_topo << "' no tiene el formato binario" << endl;
+			return 1;
+		}
+		*xmin = cab_bin.xmin;
+		*xmax = cab_bin.xmax;
+		*ymin = cab_bin.ymin;
+		*ymax = cab_bin.ymax;
+		datos_cluster->num_volx = cab_bin.num_volx;
+		*num_voly_total = cab_bin.num_voly;
+		datos_cluster->num_voly = *num_voly_total;
+	}
 	else {
 		// Leemos el fichero con los datos de la topografa
 		fich >> fich_topo;
@@ -230,13 +822,14 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 	fich >> *tiempo_tot;
 	fich >> *tiempo_guardar;
 	fich >> *leer_fichero_puntos;
-	if (*leer_fichero_puntos == 1)
-                fich >> fich_puntos;
-	fich_puntos=directorio+fich_puntos;
-	if (! existeFichero((char *) fich_topo.c_str())) {
-                        cerr << "Error: No se ha encontrado el fichero '" << fich_puntos << "'" << endl;
-                        return 1;
-                }
+	if (*leer_fichero_puntos == 1) {
+		fich >> fich_puntos;
+		fich_puntos = directorio+fich_puntos;
+		if (! existeFichero((char *) fich_puntos.c_str())) {
+			cerr << "Error: No se ha encontrado el fichero '" << fich_puntos << "'" << endl;
+			return 1;
+		}
+	}
 	fich >> *CFL;
 	fich >> *r;
 #ifdef COULOMB
@@ -285,7 +878,21 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 	}
 	fich >> prefijo;
 	*epsilon_h = 5e-3/(*H);
+	if (leerOpciones(fich, opciones) != 0) {
+		fich.close();
+		return 1;
+	}
 	fich.close();
+	if (opciones->malla_anidada[0] != '\0') {
+		// El fichero de la malla anidada est en el directorio de los ficheros de datos
+		fich_anidada = directorio+opciones->malla_anidada;
+		if (! existeFichero((char *) fich_anidada.c_str())) {
+			cerr << "Error: No se ha encontrado el fichero '" << fich_anidada << "'" << endl;
+			return 1;
+		}
+		strncpy(opciones->malla_anidada, fich_anidada.c_str(), TAM_OPCION-1);
+		opciones->malla_anidada[TAM_OPCION-1] = '\0';
+	}
 
 
         // Obtenemos los par?metros comunes a todos los vol?menes
@@ -295,59 +902,65 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
         mitad_alto = 0.5*(*alto_vol);
         *area = (*ancho_vol)*(*alto_vol);
 
-        // Leemos los puntos de guardado
-        if (*leer_fichero_puntos == 1) {
+	// Recortamos la malla a los volmenes que se pueden mojar (ver TRecorte). El proceso 0 obtiene
+	// el recorte y lo enva al resto. Los bordes recortados pasan a ser pared, ya que sus
+	// volmenes nunca se mojan
+	recorte->col_ini = recorte->fila_ini = 0;
+	recorte->num_volx = recorte->num_volx_orig = datos_cluster->num_volx;
+	recorte->num_voly = recorte->num_voly_orig = *num_voly_total;
+	if (opciones->recorte_margen >= 0.0) {
+		if (leerDeFichero != 2) {
+			if (id_hebra == 0)
+				cerr << "Error: La opcion recorte_margen solo se puede usar con el fichero binario" << endl;
+			return 1;
+		}
+		alineamiento = 1;
+		for (i=0; i<NUM_VARIABLES; i++) {
+			a = alineamiento;
+			b = opciones->diezmado[i];
+			while (b != 0) {
+				c = a % b;
+				a = b;
+				b = c;
+			}
+			alineamiento = (alineamiento/a)*opciones->diezmado[i];
+		}
+		err = 0;
+		if (id_hebra == 0)
+			err = calcularRecorte(fich_topo, &cab_bin, opciones->recorte_margen/(*H), alineamiento, *H, *Q, recorte);
+		MPI_Bcast(&err, 1, MPI_INT, 0, comm_calculo);
+		if (err != 0)
+			return 1;
+		MPI_Bcast(recorte, sizeof(TRecorte), MPI_BYTE, 0, comm_calculo);
+		if (recorte->col_ini > 0)
+			*borde_izq = -1.0;
+		if (recorte->col_ini + recorte->num_volx < recorte->num_volx_orig)
+			*borde_der = -1.0;
+		if (recorte->fila_ini > 0)
+			*borde_sup = -1.0;
+		if (recorte->fila_ini + recorte->num_voly < recorte->num_voly_orig)
+			*borde_inf = -1.0;
+		*xmin += recorte->col_ini*(*ancho_vol);
+		*xmax = *xmin + recorte->num_volx*(*ancho_vol);
+		*ymin += recorte->fila_ini*(*alto_vol);
+		*ymax = *ymin + recorte->num_voly*(*alto_vol);
+		datos_cluster->num_volx = recorte->num_volx;
+		*num_voly_total = recorte->num_voly;
+		datos_cluster->num_voly = *num_voly_total;
+		if (id_hebra == 0) {
+			cout << "Recorte: " << recorte->num_volx << " x " << recorte->num_voly << " volumenes de " << recorte->num_volx_orig
+				<< " x " << recorte->num_voly_orig << " desde la columna " << recorte->col_ini << " y la fila "
+				<< recorte->fila_ini << endl;
+		}
+	}
 
-		*posicionesVolumenesGuardado = (int *) malloc(num_volumenes*sizeof(int));
-                for (i=0; i<num_volumenes; i++)
-                        (*posicionesVolumenesGuardado)[i] = -1;
+        // Leemos el nmero de puntos de guardado. Los puntos se leen cuando est reservada la memoria
+        *num_puntos_guardar = 0;
+        if (*leer_fichero_puntos == 1) {
                 fich.open(fich_puntos.c_str());
                 fich >> *num_puntos_guardar;
-
-                *indiceVolumenesGuardado = (int *) malloc((*num_puntos_guardar)*sizeof(int));
-                if (*indiceVolumenesGuardado == NULL) {
-                        cerr << "Error: Not enough CPU memory" << endl;
-                        return 1;
-                }
-
-		float X[datos_cluster->num_volx];
-		float Y[datos_cluster->num_voly];
-		for (i=0; i<datos_cluster->num_volx; i++)
-			X[i]=(*xmin+i*(*ancho_vol))*(*L);
-		for (i=0; i<datos_cluster->num_voly; i++)
-			Y[i]=(*ymin+i*(*alto_vol))*(*L);
-
-		float lon,lat;
-		int pos;
-
-                for (i=0; i<(*num_puntos_guardar); i++) {
-                        fich >> lon;
-                        fich >> lat;
-			lon = 63259*(lon+67.7)/0.6;
-			lat = 55604*(lat-18.3)/0.5;
-			//if((lon>=X[0]) && (lon<=X[datos_cluster->num_volx-1]) && (lat>=Y[0]) && (lat<=Y[datos_cluster->num_voly-1]))
-	                        pos = obtenerIndicePunto(X,Y,lon,lat,datos_cluster->num_volx,datos_cluster->num_voly);
-			//else
-			//	pos = -1;
-                        if (pos >= 0) {
-                                if ((*posicionesVolumenesGuardado)[pos] == -1) {
-                                        // Posici?n pos nueva
-                                        (*posicionesVolumenesGuardado)[pos] = i;
-                                        (*indiceVolumenesGuardado)[i] = pos;
-                                }
-                                else {
-                                        // Posici?n pos repetida
-                                        (*indiceVolumenesGuardado)[i] = (*posicionesVolumenesGuardado)[pos];
-                                }
-                        }
-                        else {
-                                (*indiceVolumenesGuardado)[i] = -1;
-                        }
-                }
-                fich.close();
         }
 
-
 	// Obtenemos las dimensiones del subproblema
 	num_volx = datos_cluster->num_volx;
 	// indice1: num_voly de todo el dominio
@@ -366,6 +979,13 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 	}
 	// num_volumenes = nmero de volmenes de la submalla asociada a la hebra
 	num_volumenes = datos_cluster->num_volx * datos_cluster->num_voly;
+#if PASOS_HALO > 1
+	// Cada cluster enva FILAS_HALO filas propias a sus clusters adyacentes
+	if ((num_procs > 1) && (datos_cluster->num_voly < FILAS_HALO)) {
+		cerr << "Error en hebra " << id_hebra << ": El cluster tiene menos de " << FILAS_HALO << " filas (ver PASOS_HALO)" << endl;
+		return 1;
+	}
+#endif
 
 	// Reservamos memoria para los datos de los volmenes.
 	// Para mantener la coherencia, todas las hebras reservan una fila de volmenes
@@ -374,20 +994,43 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 	// (al no tener cluster adyacente superior) y la ltima hebra no usar las
 	// ltimas filas (al no tener cluster adyacente inferior).
 	// En el procesamiento de las aristas, es necesario procesar estos volmenes
-	// adicionales debido a la positividad
-	datos_cluster->datosVolumenes_1 = new float4[num_volumenes + 2*num_volx];
-	datos_cluster->datosVolumenes_2 = new float4[num_volumenes + 2*num_volx];
-	datos_cluster->eta1_maxima = new float2[num_volumenes];
+	// adicionales debido a la positividad.
+	// Todos los buffers de CPU del cluster se reservan en su arena: primero se mide el tamao
+	// necesario, y despus se reserva la arena y se asignan los buffers. La memoria se reserva
+	// bloqueada (pinned) para que las copias con la GPU y los envos MPI de los volmenes de
+	// comunicacin no pasen por un buffer intermedio. Se reserva despus de asignar la GPU, por
+	// lo que queda en el nodo NUMA del proceso (ver AFINIDAD_GPU)
+	arena_medida.memoria = NULL;
+	arena_medida.tam = arena_medida.usado = 0;
+	reservarBuffersCluster(&arena_medida, datos_cluster, num_volx, datos_cluster->num_voly,
+		*leer_fichero_puntos, *num_puntos_guardar, indiceVolumenesGuardado);
+	if (inicializarArena(&(datos_cluster->arena), arena_medida.usado) != 0) {
+		cerr << "Error en hebra " << id_hebra << ": No hay memoria CPU suficiente" << endl;
+		return 1;
+	}
+	reservarBuffersCluster(&(datos_cluster->arena), datos_cluster, num_volx, datos_cluster->num_voly,
+		*leer_fichero_puntos, *num_puntos_guardar, indiceVolumenesGuardado);
 	// Asignamos los punteros a los volmenes de comunicacin del cluster
 	// y de los clusters adyacentes
-	datos_cluster->puntero_datosVolumenesComClusterSup_1 = datos_cluster->datosVolumenes_1 + num_volx;
-	datos_cluster->puntero_datosVolumenesComClusterSup_2 = datos_cluster->datosVolumenes_2 + num_volx;
-	datos_cluster->puntero_datosVolumenesComClusterInf_1 = datos_cluster->datosVolumenes_1 + num_volumenes;
-	datos_cluster->puntero_datosVolumenesComClusterInf_2 = datos_cluster->datosVolumenes_2 + num_volumenes;
-	datos_cluster->puntero_datosVolumenesComOtroClusterSup_1 = datos_cluster->datosVolumenes_1 + num_volumenes + num_volx;
-	datos_cluster->puntero_datosVolumenesComOtroClusterSup_2 = datos_cluster->datosVolumenes_2 + num_volumenes + num_volx;
-	datos_cluster->puntero_datosVolumenesComOtroClusterInf_1 = datos_cluster->datosVolumenes_1;
-	datos_cluster->puntero_datosVolumenesComOtroClusterInf_2 = datos_cluster->datosVolumenes_2;
+	asignarPunterosComunicacion(datos_cluster);
+
+	// Leemos los puntos de guardado y obtenemos el ndice global del volumen de cada uno
+	// (-1 si est fuera de la malla). Las coordenadas de los volmenes son xmin + i*ancho_vol
+	// e ymin + j*alto_vol
+	if (*leer_fichero_puntos == 1) {
+		float lon, lat;
+
+		for (i=0; i<(*num_puntos_guardar); i++) {
+			fich >> lon;
+			fich >> lat;
+			lon = 63259*(lon+67.7)/0.6;
+			lat = 55604*(lat-18.3)/0.5;
+			(*indiceVolumenesGuardado)[i] = obtenerIndicePunto((*xmin)*(*L), (*ancho_vol)*(*L), (*ymin)*(*L),
+				(*alto_vol)*(*L), lon, lat, num_volx, *num_voly_total);
+		}
+		fich.close();
+	}
+
 	// Ponemos en indice1 el ndice inicial de los volmenes que hay que leer en los ficheros de datos
 	// (considerando los volmenes de comunicacin inferiores del cluster adyacente superior, que tambin se almacenan).
 	// Ponemos en num_vols_leer el nmero de volmenes que hay que leer en los ficheros de datos.
@@ -418,46 +1061,60 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 	}
 
 	if (leerDeFichero == 0) {
-		setCondicionesIniciales(datos_cluster, *xmin, *xmax, *ymin, *ymax, *ancho_vol, *alto_vol,
-			datos_cluster->num_volx, datos_cluster->num_voly, indice1, num_vols_leer, *L, *H, *Q, id_hebra);
+		if (setCondicionesIniciales(datos_cluster, *xmin, *xmax, *ymin, *ymax, *ancho_vol, *alto_vol,
+				datos_cluster->num_volx, datos_cluster->num_voly, indice1, num_vols_leer, *L, *H, *Q, id_hebra) != 0)
+			return 1;
 		*Hmin_global = 0.0;
 	}
 	else {
-		// LECTURA DE DATOS DE LA TOPOGRAFIA
-		// Primero saltamos las profundidades de los volmenes de clusters anteriores a id_hebra,
-		// excepto los volmenes de comunicacin inferiores del cluster adyacente superior
-		for (i=0; i<indice1; i++)
-			fich2 >> val;
-		Hmin = 1e30;
-		if (id_hebra == 0) {
-			// La primera hebra no tiene cluster adyacente superior.
-			// No escribimos nada en la primera fila de datosVolumenes
-			for (i=num_volx; i<num_volx+num_vols_leer; i++) {
+		if (leerDeFichero == 1) {
+			// LECTURA DE DATOS DE LA TOPOGRAFIA
+			// Primero saltamos las profundidades de los volmenes de clusters anteriores a id_hebra,
+			// excepto los volmenes de comunicacin inferiores del cluster adyacente superior
+			for (i=0; i<indice1; i++)
 				fich2 >> val;
-				val /= *H;
-				datos_cluster->datosVolumenes_1[i].w = val;
-				datos_cluster->datosVolumenes_2[i].w = val;
-				if (val < Hmin)
-					Hmin = val;
+			Hmin = 1e30;
+			if (id_hebra == 0) {
+				// La primera hebra no tiene cluster adyacente superior.
+				// No escribimos nada en la primera fila de datosVolumenes
+				for (i=num_volx; i<num_volx+num_vols_leer; i++) {
+					fich2 >> val;
+					val /= *H;
+					datos_cluster->datosVolumenes_1[i].w = val;
+					datos_cluster->datosVolumenes_2[i].w = val;
+					if (val < Hmin)
+						Hmin = val;
+				}
 			}
+			else {
+				// Hay cluster adyacente superior.
+				// Los datos a leer del fichero incluyen los volmenes de comunicacin
+				// inferiores del cluster adyacente superior (la primera fila de datosVolumenes)
+				for (i=0; i<num_vols_leer; i++) {
+					fich2 >> val;
+					val /= *H;
+					datos_cluster->datosVolumenes_1[i].w = val;
+					datos_cluster->datosVolumenes_2[i].w = val;
+					if (val < Hmin)
+						Hmin = val;
+				}
+			}
+			fich2.close();
 		}
 		else {
-			// Hay cluster adyacente superior.
-			// Los datos a leer del fichero incluyen los volmenes de comunicacin
-			// inferiores del cluster adyacente superior (la primera fila de datosVolumenes)
-			for (i=0; i<num_vols_leer; i++) {
-				fich2 >> val;
-				val /= *H;
-				datos_cluster->datosVolumenes_1[i].w = val;
-				datos_cluster->datosVolumenes_2[i].w = val;
-				if (val < Hmin)
-					Hmin = val;
+			// LECTURA DE LA TOPOGRAFA Y EL ESTADO INICIAL DEL FICHERO BINARIO
+			// Igual que en los ficheros de texto, la primera hebra empieza a escribir en la segunda
+			// fila de datosVolumenes y el resto incluye la fila de comunicacin del cluster superior
+			i = (id_hebra == 0) ? num_volx : 0;
+			if (leerFilasBinario(fich_topo, &cab_bin, recorte->fila_ini + indice1/num_volx, num_vols_leer/num_volx,
+					recorte->col_ini, num_volx, datos_cluster->datosVolumenes_1 + i, datos_cluster->datosVolumenes_2 + i, *H, *Q, &Hmin) != 0) {
+				cerr << "Error en hebra " << id_hebra << ": No se ha podido leer el fichero '" << fich_topo << "'" << endl;
+				return 1;
 			}
 		}
-		fich2.close();
 
 		// Obtenemos el mnimo Hmin de todos los clusters por reduccin
-		MPI_Allreduce (&Hmin, Hmin_global, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+		MPI_Allreduce (&Hmin, Hmin_global, 1, MPI_DOUBLE, MPI_MIN, comm_calculo);
 
 		// Corregimos los valores de profundidad, si hay alguna negativa
 		if (*Hmin_global >= 0.0)
@@ -482,75 +1139,236 @@ int cargarDatosProblema(string fich_ent, TDatoCluster *datos_cluster, string &no
 
 		cout << "HMIN_GLOBAL = " << *Hmin_global << endl;
 
-		// LECTURA DE DATOS DEL ESTADO INICIAL
-		fich2.open(fich_est.c_str());
-		// Primero saltamos los estados de los volmenes de clusters anteriores a id_hebra,
-		// excepto los volmenes de comunicacin inferiores del cluster adyacente superior
-		for (i=0; i<indice1; i++) {
-			fich2 >> val;
-			fich2 >> val;
-			fich2 >> val;
-			fich2 >> val;
-			fich2 >> val;
-			fich2 >> val;
-		}
-		if (id_hebra == 0) {
-			// La primera hebra no tiene cluster adyacente superior.
-			// No escribimos nada en la primera fila de datosVolumenes
-			for (i=num_volx; i<num_volx+num_vols_leer; i++) {
-				fich2 >> W[0];  fich2 >> W[1];  fich2 >> W[2];
-				fich2 >> W[3];  fich2 >> W[4];  fich2 >> W[5];
-				W[0] /= *H;
-				W[1] /= *Q;
-				W[2] /= *Q;
-				W[3] /= *H;
-				W[4] /= *Q;
-				W[5] /= *Q;
-				datos_cluster->datosVolumenes_1[i].x = W[0];
-				datos_cluster->datosVolumenes_1[i].y = W[1];
-				datos_cluster->datosVolumenes_1[i].z = W[2];
-				datos_cluster->datosVolumenes_2[i].x = W[3];
-				datos_cluster->datosVolumenes_2[i].y = W[4];
-				datos_cluster->datosVolumenes_2[i].z = W[5];
+		if (leerDeFichero == 1) {
+			// LECTURA DE DATOS DEL ESTADO INICIAL
+			fich2.open(fich_est.c_str());
+			// Primero saltamos los estados de los volmenes de clusters anteriores a id_hebra,
+			// excepto los volmenes de comunicacin inferiores del cluster adyacente superior
+			for (i=0; i<indice1; i++) {
+				fich2 >> val;
+				fich2 >> val;
+				fich2 >> val;
+				fich2 >> val;
+				fich2 >> val;
+				fich2 >> val;
 			}
-		}
-		else {
-			// Hay cluster adyacente superior.
-			// Los datos a leer del fichero incluyen los volmenes de comunicacin
-			// inferiores del cluster adyacente superior (la primera fila de datosVolumenes)
-			for (i=0; i<num_vols_leer; i++) {
-				fich2 >> W[0];  fich2 >> W[1];  fich2 >> W[2];
-				fich2 >> W[3];  fich2 >> W[4];  fich2 >> W[5];
-				W[0] /= *H;
-				W[1] /= *Q;
-				W[2] /= *Q;
-				W[3] /= *H;
-				W[4] /= *Q;
-				W[5] /= *Q;
-				datos_cluster->datosVolumenes_1[i].x = W[0];
-				datos_cluster->datosVolumenes_1[i].y = W[1];
-				datos_cluster->datosVolumenes_1[i].z = W[2];
-				datos_cluster->datosVolumenes_2[i].x = W[3];
-				datos_cluster->datosVolumenes_2[i].y = W[4];
-				datos_cluster->datosVolumenes_2[i].z = W[5];
+			if (id_hebra == 0) {
+				// La primera hebra no tiene cluster adyacente superior.
+				// No escribimos nada en la primera fila de datosVolumenes
+				for (i=num_volx; i<num_volx+num_vols_leer; i++) {
+					fich2 >> W[0];  fich2 >> W[1];  fich2 >> W[2];
+					fich2 >> W[3];  fich2 >> W[4];  fich2 >> W[5];
+					W[0] /= *H;
+					W[1] /= *Q;
+					W[2] /= *Q;
+					W[3] /= *H;
+					W[4] /= *Q;
+					W[5] /= *Q;
+					datos_cluster->datosVolumenes_1[i].x = W[0];
+					datos_cluster->datosVolumenes_1[i].y = W[1];
+					datos_cluster->datosVolumenes_1[i].z = W[2];
+					datos_cluster->datosVolumenes_2[i].x = W[3];
+					datos_cluster->datosVolumenes_2[i].y = W[4];
+					datos_cluster->datosVolumenes_2[i].z = W[5];
+				}
 			}
+			else {
+				// Hay cluster adyacente superior.
+				// Los datos a leer del fichero incluyen los volmenes de comunicacin
+				// inferiores del cluster adyacente superior (la primera fila de datosVolumenes)
+				for (i=0; i<num_vols_leer; i++) {
+					fich2 >> W[0];  fich2 >> W[1];  fich2 >> W[2];
+					fich2 >> W[3];  fich2 >> W[4];  fich2 >> W[5];
+					W[0] /= *H;
+					W[1] /= *Q;
+					W[2] /= *Q;
+					W[3] /= *H;
+					W[4] /= *Q;
+					W[5] /= *Q;
+					datos_cluster->datosVolumenes_1[i].x = W[0];
+					datos_cluster->datosVolumenes_1[i].y = W[1];
+					datos_cluster->datosVolumenes_1[i].z = W[2];
+					datos_cluster->datosVolumenes_2[i].x = W[3];
+					datos_cluster->datosVolumenes_2[i].y = W[4];
+					datos_cluster->datosVolumenes_2[i].z = W[5];
+				}
+			}
+			fich2.close();
 		}
-		fich2.close();
 	}
 
 	// Asignamos los valores de eta1 mxima para cada volumen del cluster
+	#pragma omp parallel for
 	for (i=0; i<num_volumenes; i++) {
-		indice1 = num_volx+i;
-		datos_cluster->eta1_maxima[i].x = (datos_cluster->datosVolumenes_1[indice1].x + datos_cluster->datosVolumenes_2[indice1].x - datos_cluster->datosVolumenes_1[indice1].w);
+		int j = num_volx+i;
+		datos_cluster->eta1_maxima[i].x = (datos_cluster->datosVolumenes_1[j].x + datos_cluster->datosVolumenes_2[j].x - datos_cluster->datosVolumenes_1[j].w);
 		datos_cluster->eta1_maxima[i].y = 0.0;
 	}
 
 	return 0;
 }
 
+// Carga la malla anidada del fichero binario fich_bin (opcin malla_anidada, ver MallaAnidada.cu)
+// si est dentro del cluster, y en ese caso pone anidada->activa a 1. Se llama despus de
+// cargarDatosProblema, con sus resultados. La malla anidada tiene que cubrir un rectngulo de
+// volmenes completos de la malla padre, con volmenes razon veces ms pequeos en x e y (razon
+// entero mayor que 1), y dejar al menos un volumen de la malla padre hasta el borde de la malla.
+// Con el anillo de volmenes de la malla padre que la rodea, slo la tiene el proceso en cuyas
+// filas est, sin las FILAS_HALO-1 primeras y ltimas filas (que tambin calculan los clusters
+// adyacentes, ver PASOS_HALO). Los datos se guardan en anidada->datos con un marco de razon
+// volmenes en cada lado con el estado y la H de su volumen de la malla padre, y el estado y la
+// H de los volmenes de la malla padre que cubre pasan a ser la media de sus volmenes finos.
+// Las profundidades se corrigen con Hmin_global, igual que las de la malla padre.
+// Devuelve 0 si todo ha ido bien y 1 si ha habido algn error
+int cargarMallaAnidada(string fich_bin, TDatoCluster *datos_cluster, TMallaAnidada *anidada, int num_voly_otros,
+			int num_voly_total, Scalar xmin, Scalar ymin, Scalar ancho_vol, Scalar alto_vol, Scalar Hmin_global,
+			Scalar L, Scalar H, Scalar Q, int id_hebra)
+{
+	TCabeceraBinario cab;
+	TDatoCluster *datos = &(anidada->datos);
+	TArena arena_medida;
+	float4 *fino_1, *fino_2;
+	float4 *datos_1, *datos_2;
+	float4 *padre_1 = datos_cluster->datosVolumenes_1 + datos_cluster->num_volx;
+	float4 *padre_2 = datos_cluster->datosVolumenes_2 + datos_cluster->num_volx;
+	float4 suma_1, suma_2;
+	Scalar x0, y0, Hmin, fac;
+	int num_volx_padre = datos_cluster->num_volx;
+	int razon, fila_global, num_volx_fino, num_voly_fino, num_volx, num_voly;
+	int i, j, k, pos, pos_padre;
+	int *indice_aux;
+
+	anidada->activa = 0;
+	if (leerCabeceraBinario(fich_bin, &cab) != 0) {
+		if (id_hebra == 0)
+			cerr << "Error: El fichero '" << fich_bin << "' de la malla anidada no tiene el formato binario" << endl;
+		return 1;
+	}
+
+	// Comprobamos que los volmenes finos dividen volmenes completos de la malla padre
+	num_volx_fino = cab.num_volx;
+	num_voly_fino = cab.num_voly;
+	x0 = cab.xmin/L;
+	y0 = cab.ymin/L;
+	anidada->ancho_vol = (cab.xmax - cab.xmin)/(L*num_volx_fino);
+	anidada->alto_vol = (cab.ymax - cab.ymin)/(L*num_voly_fino);
+	razon = (int) floor(ancho_vol/anidada->ancho_vol + 0.5);
+	anidada->col_ini = (int) floor((x0 - xmin)/ancho_vol + 0.5);
+	fila_global = (int) floor((y0 - ymin)/alto_vol + 0.5);
+	if ((razon < 2) || (fabs(razon*anidada->ancho_vol - ancho_vol) > 1e-3*anidada->ancho_vol) ||
+			(fabs(razon*anidada->alto_vol - alto_vol) > 1e-3*anidada->alto_vol) ||
+			(num_volx_fino % razon != 0) || (num_voly_fino % razon != 0) ||
+			(fabs(x0 - xmin - anidada->col_ini*ancho_vol) > 1e-3*anidada->ancho_vol) ||
+			(fabs(y0 - ymin - fila_global*alto_vol) > 1e-3*anidada->alto_vol)) {
+		if (id_hebra == 0)
+			cerr << "Error: La malla anidada no cubre volumenes completos de la malla padre con una razon entera" << endl;
+		return 1;
+	}
+	anidada->razon = razon;
+	anidada->num_volx_padre = num_volx_fino/razon;
+	anidada->num_voly_padre = num_voly_fino/razon;
+	if ((anidada->col_ini < 1) || (anidada->col_ini + anidada->num_volx_padre > num_volx_padre-1) ||
+			(fila_global < 1) || (fila_global + anidada->num_voly_padre > num_voly_total-1)) {
+		if (id_hebra == 0)
+			cerr << "Error: La malla anidada debe estar al menos a un volumen del borde de la malla padre" << endl;
+		return 1;
+	}
+	anidada->fila_ini = fila_global - id_hebra*num_voly_otros;
+	if ((anidada->fila_ini-1 < FILAS_HALO-1) || (anidada->fila_ini + anidada->num_voly_padre + 1 > datos_cluster->num_voly - (FILAS_HALO-1)))
+		return 0;
+
+	// Reservamos los buffers de la malla anidada con el marco en su propia arena
+	num_volx = num_volx_fino + 2*razon;
+	num_voly = num_voly_fino + 2*razon;
+	datos->num_volx = num_volx;
+	datos->num_voly = num_voly;
+	datos->arena.memoria = NULL;
+	datos->arena.tam = datos->arena.usado = 0;
+	arena_medida.memoria = NULL;
+	arena_medida.tam = arena_medida.usado = 0;
+	reservarBuffersCluster(&arena_medida, datos, num_volx, num_voly, 0, 0, &indice_aux);
+	if (inicializarArena(&(datos->arena), arena_medida.usado) != 0) {
+		cerr << "Error en hebra " << id_hebra << ": No hay memoria CPU suficiente para la malla anidada" << endl;
+		return 1;
+	}
+	reservarBuffersCluster(&(datos->arena), datos, num_volx, num_voly, 0, 0, &indice_aux);
+	asignarPunterosComunicacion(datos);
+
+	// Leemos los volmenes finos
+	fino_1 = (float4 *) malloc(2*((size_t) num_volx_fino)*num_voly_fino*sizeof(float4));
+	if (fino_1 == NULL) {
+		cerr << "Error en hebra " << id_hebra << ": No hay memoria CPU suficiente para la malla anidada" << endl;
+		liberarArena(&(datos->arena));
+		return 1;
+	}
+	fino_2 = fino_1 + ((size_t) num_volx_fino)*num_voly_fino;
+	if (leerFilasBinario(fich_bin, &cab, 0, num_voly_fino, 0, num_volx_fino, fino_1, fino_2, H, Q, &Hmin) != 0) {
+		cerr << "Error en hebra " << id_hebra << ": No se ha podido leer el fichero '" << fich_bin << "'" << endl;
+		free(fino_1);
+		liberarArena(&(datos->arena));
+		return 1;
+	}
+	if (Hmin < Hmin_global) {
+		cerr << "Error en hebra " << id_hebra << ": La malla anidada tiene profundidades menores que la minima de la malla padre" << endl;
+		free(fino_1);
+		liberarArena(&(datos->arena));
+		return 1;
+	}
+
+	// Ponemos los volmenes finos dentro del marco, y en el marco el estado y la H de su volumen
+	// de la malla padre (la primera fila de datosVolumenes es de comunicacin)
+	datos_1 = datos->datosVolumenes_1 + num_volx;
+	datos_2 = datos->datosVolumenes_2 + num_volx;
+	for (j=0; j<num_voly; j++) {
+		for (i=0; i<num_volx; i++) {
+			pos = j*num_volx + i;
+			if ((i >= razon) && (i < num_volx-razon) && (j >= razon) && (j < num_voly-razon)) {
+				k = (j-razon)*num_volx_fino + i-razon;
+				datos_1[pos] = fino_1[k];
+				datos_2[pos] = fino_2[k];
+				datos_1[pos].w -= Hmin_global;
+				datos_2[pos].w -= Hmin_global;
+			}
+			else {
+				pos_padre = (anidada->fila_ini-1 + j/razon)*num_volx_padre + anidada->col_ini-1 + i/razon;
+				datos_1[pos] = padre_1[pos_padre];
+				datos_2[pos] = padre_2[pos_padre];
+			}
+			datos->eta1_maxima[pos].x = datos_1[pos].x + datos_2[pos].x - datos_1[pos].w;
+			datos->eta1_maxima[pos].y = 0.0;
+		}
+	}
+	free(fino_1);
+
+	// Los volmenes de la malla padre que cubre pasan a tener la media de sus volmenes finos
+	fac = 1.0/(razon*razon);
+	for (j=0; j<anidada->num_voly_padre; j++) {
+		for (i=0; i<anidada->num_volx_padre; i++) {
+			suma_1 = suma_2 = make_float4(0.0, 0.0, 0.0, 0.0);
+			for (k=0; k<razon*razon; k++) {
+				pos = ((j+1)*razon + k/razon)*num_volx + (i+1)*razon + k%razon;
+				suma_1.x += datos_1[pos].x;  suma_1.y += datos_1[pos].y;
+				suma_1.z += datos_1[pos].z;  suma_1.w += datos_1[pos].w;
+				suma_2.x += datos_2[pos].x;  suma_2.y += datos_2[pos].y;
+				suma_2.z += datos_2[pos].z;  suma_2.w += datos_2[pos].w;
+			}
+			pos_padre = (anidada->fila_ini + j)*num_volx_padre + anidada->col_ini + i;
+			padre_1[pos_padre] = make_float4(suma_1.x*fac, suma_1.y*fac, suma_1.z*fac, suma_1.w*fac);
+			padre_2[pos_padre] = make_float4(suma_2.x*fac, suma_2.y*fac, suma_2.z*fac, suma_2.w*fac);
+			datos_cluster->eta1_maxima[pos_padre].x = padre_1[pos_padre].x + padre_2[pos_padre].x - padre_1[pos_padre].w;
+			datos_cluster->eta1_maxima[pos_padre].y = 0.0;
+		}
+	}
+
+	cout << "Malla anidada en hebra " << id_hebra << ": " << num_volx_fino << " x " << num_voly_fino << " volumenes, razon "
+		<< razon << ", X: [" << cab.xmin << ", " << cab.xmax << "], Y: [" << cab.ymin << ", " << cab.ymax << "]" << endl;
+	anidada->activa = 1;
+
+	return 0;
+}
+
 void liberarMemoria(TDatoCluster *dc) {
-	delete [] (dc->datosVolumenes_1);
-	delete [] (dc->datosVolumenes_2);
+	liberarArena(&(dc->arena));
 }
 
 void mostrarDatosProblema(int num_volx, int num_voly, Scalar xmin, Scalar xmax, Scalar ymin, Scalar ymax, Scalar tiempo_tot,
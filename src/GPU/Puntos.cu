@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+/*******************************************/
+/* Series temporales en puntos de guardado */
+/*******************************************/
+
+// Si leer_fichero_puntos es 1, la eta1 de los puntos de guardado se escribe en el fichero
+// binario <prefijo>_puntos.bin, que slo escribe el proceso 0 (el servidor de E/S 0 si hay
+// servidores, ver PROCESOS_ES). Formato:
+// - Un TCabeceraPuntos.
+// - El ndice global del volumen de cada punto (num_puntos ints, -1 si est fuera de la malla).
+//   El volumen i + j*num_volx tiene coordenadas (xmin + i*ancho_vol, ymin + j*alto_vol).
+// - Un registro por muestra con el tiempo (double, seg) y la eta1 de los puntos (num_puntos
+//   floats, m, VALOR_FUERA_PUNTOS si el punto est fuera de la malla).
+// Cada proceso copia en cada muestra la eta1 de sus puntos a un buffer de GPU de
+// MUESTRAS_BLOQUE_PUNTOS muestras. Cuando se llena, se copia a CPU y se rene en el proceso 0,
+// que escribe todas sus muestras de una vez. Con servidores de E/S, cada proceso enva el bloque
+// a su servidor y los servidores lo renen en el servidor 0
+
+#define MAGICO_PUNTOS   0x5450484C  // "LHPT"
+#define VERSION_PUNTOS  1
+// Muestras que se acumulan en GPU antes de escribirlas
+#define MUESTRAS_BLOQUE_PUNTOS 256
+// Valor de los puntos que estn fuera de la malla
+#define VALOR_FUERA_PUNTOS  -999.0f
+
+typedef struct TCabeceraPuntos {
+	// MAGICO_PUNTOS y VERSION_PUNTOS
+	unsigned int magico, version;
+	int num_puntos;
+	// Malla completa (m)
+	int num_volx, num_voly;
+	double xmin, ymin, ancho_vol, alto_vol;
+} TCabeceraPuntos;
+
+typedef struct TPuntos {
+	int id_hebra, num_procs;
+	// Para pasar eta1 a metros
+	float Hmin, H;
+	// Puntos del cluster: ndice de su volumen en las filas del cluster (en GPU), y
+	// muestras del bloque actual en GPU y en CPU (punto ms rpido que muestra)
+	int num_puntos_locales;
+	int *d_indice;
+	float *d_muestras, *muestras;
+	// Tiempos de las muestras del bloque actual (seg) y nmero de muestras
+	double tiempos[MUESTRAS_BLOQUE_PUNTOS];
+	int num_muestras;
+
+	// Slo en el proceso que escribe el fichero (ver crearFicheroPuntos):
+	// Nmero de puntos de cada proceso y posicin de sus puntos en los datos recibidos
+	int num_puntos;
+	int *num_puntos_proc, *desp_proc;
+	// Nmero de punto de cada posicin de los datos recibidos
+	int *punto_recibido;
+	int *cont_recibidas, *desp_recibidas;
+	// Muestras recibidas de todos los procesos y registro de una muestra
+	float *recibidas, *registro;
+	FILE *fp;
+} TPuntos;
+
+// Crea el fichero de puntos y prepara la recepcin de las muestras de los num_procs procesos de
+// clculo, cuyos puntos se obtienen de los ndices globales. La llama el proceso que escribe el
+// fichero: el proceso 0 o el servidor de E/S 0 (ver PROCESOS_ES)
+void crearFicheroPuntos(TPuntos *pt, char *prefijo, int *indiceVolumenesGuardado, int num_puntos, int num_volx,
+		int num_voly_otros, int num_voly_total, int num_procs, double xmin, double ymin, double ancho_vol, double alto_vol)
+{
+	TCabeceraPuntos cab;
+	char nombre_fich[512];
+	int i, p;
+
+	pt->num_procs = num_procs;
+	pt->num_puntos = num_puntos;
+	// Obtenemos los puntos de cada proceso a partir de los ndices globales
+	pt->num_puntos_proc = (int *) calloc(num_procs, sizeof(int));
+	pt->desp_proc = (int *) malloc(num_procs*sizeof(int));
+	pt->cont_recibidas = (int *) malloc(num_procs*sizeof(int));
+	pt->desp_recibidas = (int *) malloc(num_procs*sizeof(int));
+	pt->punto_recibido = (int *) malloc(max(num_puntos,1)*sizeof(int));
+	for (i=0; i<num_puntos; i++) {
+		if (indiceVolumenesGuardado[i] >= 0)
+			pt->num_puntos_proc[min(indiceVolumenesGuardado[i]/num_volx/num_voly_otros, num_procs-1)]++;
+	}
+	pt->desp_proc[0] = 0;
+	for (p=1; p<num_procs; p++)
+		pt->desp_proc[p] = pt->desp_proc[p-1] + pt->num_puntos_proc[p-1];
+	for (p=0; p<num_procs; p++)
+		pt->cont_recibidas[p] = 0;
+	for (i=0; i<num_puntos; i++) {
+		if (indiceVolumenesGuardado[i] >= 0) {
+			p = min(indiceVolumenesGuardado[i]/num_volx/num_voly_otros, num_procs-1);
+			pt->punto_recibido[pt->desp_proc[p] + pt->cont_recibidas[p]++] = i;
+		}
+	}
+	pt->recibidas = (float *) malloc(max(num_puntos,1)*MUESTRAS_BLOQUE_PUNTOS*sizeof(float));
+	pt->registro = (float *) malloc(max(num_puntos,1)*sizeof(float));
+	for (i=0; i<num_puntos; i++)
+		pt->registro[i] = VALOR_FUERA_PUNTOS;
+
+	sprintf(nombre_fich, "%s_puntos.bin", prefijo);
+	pt->fp = fopen(nombre_fich, "wb");
+	if (pt->fp == NULL) {
+		fprintf(stderr, "Error: No se ha podido crear el fichero '%s'\n", nombre_fich);
+	}
+	else {
+		// Buffer grande para que cada bloque de muestras se escriba con pocas llamadas
+		setvbuf(pt->fp, NULL, _IOFBF, 1 << 20);
+		cab.magico = MAGICO_PUNTOS;
+		cab.version = VERSION_PUNTOS;
+		cab.num_puntos = num_puntos;
+		cab.num_volx = num_volx;
+		cab.num_voly = num_voly_total;
+		cab.xmin = xmin;
+		cab.ymin = ymin;
+		cab.ancho_vol = ancho_vol;
+		cab.alto_vol = alto_vol;
+		fwrite(&cab, sizeof(TCabeceraPuntos), 1, pt->fp);
+		fwrite(indiceVolumenesGuardado, sizeof(int), num_puntos, pt->fp);
+	}
+}
+
+// Inicializa el guardado de los num_puntos puntos cuyos volmenes son indiceVolumenesGuardado
+// (ndices globales). Cada proceso se queda con los puntos de sus filas. xmin, ymin, ancho_vol y
+// alto_vol estn en metros. Es una llamada colectiva de MPI.
+// Devuelve 0 si todo ha ido bien y 1 si no hay memoria GPU suficiente en algn proceso
+int inicializarPuntos(TPuntos *pt, char *prefijo, int *indiceVolumenesGuardado, int num_puntos, int num_volx,
+		int num_voly, int num_voly_otros, int num_voly_total, int id_hebra, int num_procs, double xmin,
+		double ymin, double ancho_vol, double alto_vol, float Hmin, float H)
+{
+	int *indice_local;
+	int fila_ini = id_hebra*num_voly_otros;
+	int i, p, err, err_total;
+	cudaError_t err1, err2;
+
+	pt->id_hebra = id_hebra;
+	pt->num_procs = num_procs;
+	pt->Hmin = Hmin;
+	pt->H = H;
+	pt->num_muestras = 0;
+	pt->num_puntos = num_puntos;
+
+	// Puntos del cluster, en orden de nmero de punto
+	indice_local = (int *) malloc(max(num_puntos,1)*sizeof(int));
+	pt->num_puntos_locales = 0;
+	for (i=0; i<num_puntos; i++) {
+		p = indiceVolumenesGuardado[i];
+		if ((p >= 0) && (p/num_volx >= fila_ini) && (p/num_volx < fila_ini+num_voly))
+			indice_local[pt->num_puntos_locales++] = p - fila_ini*num_volx;
+	}
+	err1 = cudaMalloc((void **) &(pt->d_indice), max(pt->num_puntos_locales,1)*sizeof(int));
+	err2 = cudaMalloc((void **) &(pt->d_muestras), max(pt->num_puntos_locales,1)*MUESTRAS_BLOQUE_PUNTOS*sizeof(float));
+	err = ((err1 != cudaSuccess) || (err2 != cudaSuccess)) ? 1 : 0;
+	MPI_Allreduce (&err, &err_total, 1, MPI_INT, MPI_MAX, comm_calculo);
+	if (err_total != 0) {
+		if (err1 == cudaSuccess)  cudaFree(pt->d_indice);
+		if (err2 == cudaSuccess)  cudaFree(pt->d_muestras);
+		free(indice_local);
+		return 1;
+	}
+	cudaMemcpy(pt->d_indice, indice_local, pt->num_puntos_locales*sizeof(int), cudaMemcpyHostToDevice);
+	cudaMallocHost((void **) &(pt->muestras), max(pt->num_puntos_locales,1)*MUESTRAS_BLOQUE_PUNTOS*sizeof(float));
+	free(indice_local);
+
+	pt->num_puntos_proc = pt->desp_proc = pt->punto_recibido = NULL;
+	pt->cont_recibidas = pt->desp_recibidas = NULL;
+	pt->recibidas = pt->registro = NULL;
+	pt->fp = NULL;
+#if PROCESOS_ES == 0
+	if (id_hebra == 0) {
+		crearFicheroPuntos(pt, prefijo, indiceVolumenesGuardado, num_puntos, num_volx, num_voly_otros, num_voly_total,
+			num_procs, xmin, ymin, ancho_vol, alto_vol);
+	}
+#endif
+
+	return 0;
+}
+
+// Escribe las nm muestras de todos los procesos que hay en pt->recibidas (los datos de cada
+// proceso ordenados por muestra y, dentro de cada muestra, por punto) con sus tiempos
+void escribirMuestrasPuntos(TPuntos *pt, double *tiempos, int nm)
+{
+	int i, m, p;
+	float *rec;
+
+	if (pt->fp == NULL)
+		return;
+	for (m=0; m<nm; m++) {
+		for (p=0; p<pt->num_procs; p++) {
+			rec = pt->recibidas + pt->desp_proc[p]*nm + m*pt->num_puntos_proc[p];
+			for (i=0; i<pt->num_puntos_proc[p]; i++)
+				pt->registro[pt->punto_recibido[pt->desp_proc[p]+i]] = rec[i];
+		}
+		fwrite(tiempos+m, sizeof(double), 1, pt->fp);
+		fwrite(pt->registro, sizeof(float), pt->num_puntos, pt->fp);
+	}
+}
+
+// Cierra el fichero de puntos y libera la memoria de crearFicheroPuntos (no hace nada en los
+// procesos que no escriben el fichero)
+void liberarFicheroPuntos(TPuntos *pt)
+{
+	if (pt->fp != NULL)
+		fclose(pt->fp);
+	free(pt->num_puntos_proc);
+	free(pt->desp_proc);
+	free(pt->cont_recibidas);
+	free(pt->desp_recibidas);
+	free(pt->punto_recibido);
+	free(pt->recibidas);
+	free(pt->registro);
+}
+
+// Copia a CPU las muestras del bloque actual, las rene en el proceso 0 y las escribe (o las
+// enva al servidor de E/S, ver PROCESOS_ES). Es una llamada colectiva de MPI (todos los procesos
+// tienen el mismo nmero de muestras)
+void escribirBloquePuntos(TPuntos *pt)
+{
+	int nl = pt->num_puntos_locales;
+	int nm = pt->num_muestras;
+	int i;
+#if PROCESOS_ES > 0
+	char *buf;
+#else
+	int p;
+#endif
+
+	if (nm == 0)
+		return;
+	cudaMemcpy(pt->muestras, pt->d_muestras, nl*nm*sizeof(float), cudaMemcpyDeviceToHost);
+	for (i=0; i<nl*nm; i++)
+		pt->muestras[i] = (pt->muestras[i] - pt->Hmin)*pt->H;
+
+#if PROCESOS_ES > 0
+	// El servidor de E/S rene las muestras (ver ServidorES.hxx)
+	buf = (char *) bufferES();
+	memcpy(buf, pt->tiempos, nm*sizeof(double));
+	memcpy(buf + nm*sizeof(double), pt->muestras, nl*nm*sizeof(float));
+	enviarES(ES_PUNTOS, 0, nm, 0.0, nm*sizeof(double) + nl*nm*sizeof(float));
+#else
+	if (pt->id_hebra == 0) {
+		for (p=0; p<pt->num_procs; p++) {
+			pt->cont_recibidas[p] = pt->num_puntos_proc[p]*nm;
+			pt->desp_recibidas[p] = pt->desp_proc[p]*nm;
+		}
+	}
+	MPI_Gatherv(pt->muestras, nl*nm, MPI_FLOAT, pt->recibidas, pt->cont_recibidas, pt->desp_recibidas,
+		MPI_FLOAT, 0, comm_calculo);
+
+	if (pt->id_hebra == 0)
+		escribirMuestrasPuntos(pt, pt->tiempos, nm);
+#endif
+	pt->num_muestras = 0;
+}
+
+// Toma en GPU una muestra de la eta1 de los puntos del cluster en el estado actual (tiempo en seg).
+// fila_ini es la primera fila de la textura con volmenes del cluster. Si se llena el bloque de
+// muestras, se escribe (llamada colectiva de MPI)
+void tomarMuestraPuntos(TPuntos *pt, int num_volx, int fila_ini, double tiempo)
+{
+	dim3 bloque(NUM_HEBRAS_VOL, 1);
+	dim3 grid(iDivUp(pt->num_puntos_locales, NUM_HEBRAS_VOL), 1);
+
+	if (pt->num_puntos_locales > 0) {
+		obtenerMuestrasPuntosGPU<<<grid, bloque>>>(pt->d_indice, pt->d_muestras + pt->num_muestras*pt->num_puntos_locales,
+			pt->num_puntos_locales, num_volx, fila_ini);
+	}
+	pt->tiempos[pt->num_muestras++] = tiempo;
+	if (pt->num_muestras == MUESTRAS_BLOQUE_PUNTOS)
+		escribirBloquePuntos(pt);
+}
+
+// Escribe las muestras pendientes, cierra el fichero y libera la memoria (llamada colectiva de MPI)
+void cerrarPuntos(TPuntos *pt)
+{
+	escribirBloquePuntos(pt);
+	cudaFree(pt->d_indice);
+	cudaFree(pt->d_muestras);
+	cudaFreeHost(pt->muestras);
+	liberarFicheroPuntos(pt);
+}
@@ -126,10 +126,12 @@ void getNumBlocksAndThreads(int n, int maxBlocks, int maxThreads, int &blocks, i
 	blocks = min(maxBlocks, blocks);
 }
 
+// Devuelve el mnimo de los size elementos de d_data sin modificarlos. d_parcial debe tener
+// MAX_BLOQUES_REDUCCION elementos para los resultados parciales de los bloques
 template <class T>
-T obtenerMinimoReduccion(T *d_data, int size)
+T obtenerMinimoReduccion(T *d_data, int size, T *d_parcial)
 {
-	int maxBlocks = 64, maxThreads = 128;
+	int maxBlocks = MAX_BLOQUES_REDUCCION, maxThreads = 128;
 	int numBlocks, numThreads;
 	int i;
 	T h_data[4096];
@@ -138,20 +140,20 @@ T obtenerMinimoReduccion(T *d_data, int size)
 	if (size > 4096) {
 		// Ejecutamos el kernel
 		getNumBlocksAndThreads(size, maxBlocks, maxThreads, numBlocks, numThreads);
-		reduce_min<T>(numBlocks, numThreads, d_data, d_data, size);
+		reduce_min<T>(numBlocks, numThreads, d_data, d_parcial, size);
 
 		// Obtenemos el mnimo de los resultados parciales de los bloques en GPU
 		// hasta que el nmero de elementos sea menor o igual que 4096
 		int s = numBlocks;
 		while (s > 4096) {
 			getNumBlocksAndThreads(s, maxBlocks, maxThreads, numBlocks, numThreads);
-			reduce_min<T>(numBlocks, numThreads, d_data, d_data, s);
+			reduce_min<T>(numBlocks, numThreads, d_parcial, d_parcial, s);
 			s = s / (numThreads*2);
 		}
 
 		// Copiamos los elementos que quedan de GPU a CPU y terminamos de
 		// procesarlos en CPU
-		cudaMemcpy(h_data, d_data, numBlocks*sizeof(T), cudaMemcpyDeviceToHost);
+		cudaMemcpy(h_data, d_parcial, numBlocks*sizeof(T), cudaMemcpyDeviceToHost);
 		minimo = (T) 1e30;
 		for (i=0; i<numBlocks; i++) {
 			if (h_data[i] < minimo)
@@ -171,4 +173,156 @@ T obtenerMinimoReduccion(T *d_data, int size)
 	return minimo;
 }
 
+// Cada bloque de NUM_HEBRAS_VOL hebras escribe en d_min_bloques y d_pos_bloques el mnimo de los
+// elementos de d_data que procesa y su posicin (la menor si hay empate)
+__global__ void reduccionMinimoPosGPU(float *d_data, int n, float *d_min_bloques, int *d_pos_bloques)
+{
+	__shared__ float min_bloque[NUM_HEBRAS_VOL];
+	__shared__ int pos_bloque[NUM_HEBRAS_VOL];
+	int tid = threadIdx.x;
+	int i, pos = n;
+	float minimo = FLT_MAX;
+
+	for (i=blockIdx.x*NUM_HEBRAS_VOL + tid; i<n; i+=NUM_HEBRAS_VOL*gridDim.x) {
+		if (d_data[i] < minimo) {
+			minimo = d_data[i];
+			pos = i;
+		}
+	}
+	min_bloque[tid] = minimo;
+	pos_bloque[tid] = pos;
+	__syncthreads();
+
+	for (i=NUM_HEBRAS_VOL/2; i>0; i>>=1) {
+		if ((tid < i) && ((min_bloque[tid+i] < min_bloque[tid]) ||
+				((min_bloque[tid+i] == min_bloque[tid]) && (pos_bloque[tid+i] < pos_bloque[tid])))) {
+			min_bloque[tid] = min_bloque[tid+i];
+			pos_bloque[tid] = pos_bloque[tid+i];
+		}
+		__syncthreads();
+	}
+	if (tid == 0) {
+		d_min_bloques[blockIdx.x] = min_bloque[0];
+		d_pos_bloques[blockIdx.x] = pos_bloque[0];
+	}
+}
+
+// Devuelve el mnimo de los size elementos de d_data y pone en pos su posicin, sin modificar
+// d_data. d_min_bloques y d_pos_bloques deben tener MAX_BLOQUES_REDUCCION elementos
+float obtenerMinimoPosReduccion(float *d_data, int size, float *d_min_bloques, int *d_pos_bloques, int *pos)
+{
+	float h_min[MAX_BLOQUES_REDUCCION];
+	int h_pos[MAX_BLOQUES_REDUCCION];
+	int num_bloques = min(MAX_BLOQUES_REDUCCION, iDivUp(size, NUM_HEBRAS_VOL));
+	float minimo = FLT_MAX;
+	int i;
+
+	reduccionMinimoPosGPU<<<num_bloques, NUM_HEBRAS_VOL>>>(d_data, size, d_min_bloques, d_pos_bloques);
+	cudaMemcpy(h_min, d_min_bloques, num_bloques*sizeof(float), cudaMemcpyDeviceToHost);
+	cudaMemcpy(h_pos, d_pos_bloques, num_bloques*sizeof(int), cudaMemcpyDeviceToHost);
+	*pos = 0;
+	for (i=0; i<num_bloques; i++) {
+		if ((h_min[i] < minimo) || ((h_min[i] == minimo) && (h_pos[i] < *pos))) {
+			minimo = h_min[i];
+			*pos = h_pos[i];
+		}
+	}
+
+	return minimo;
+}
+
+// Suma en d_histograma el nmero de elementos de d_data (delta T locales) en cada intervalo
+// [2^k*dt_min, 2^(k+1)*dt_min), con 0 <= k < NUM_INTERVALOS_HISTOGRAMA_DT. El ltimo intervalo
+// no tiene lmite superior, y en d_histograma[NUM_INTERVALOS_HISTOGRAMA_DT] se cuentan los
+// volmenes sin flujo (delta T 1e30)
+__global__ void histogramaDeltaTGPU(float *d_data, int n, float dt_min, int *d_histograma)
+{
+	__shared__ int hist_bloque[NUM_INTERVALOS_HISTOGRAMA_DT+1];
+	int tid = threadIdx.x;
+	int i, k;
+
+	if (tid <= NUM_INTERVALOS_HISTOGRAMA_DT)
+		hist_bloque[tid] = 0;
+	__syncthreads();
+
+	for (i=blockIdx.x*NUM_HEBRAS_VOL + tid; i<n; i+=NUM_HEBRAS_VOL*gridDim.x) {
+		if (d_data[i] >= 1e29f) {
+			k = NUM_INTERVALOS_HISTOGRAMA_DT;
+		}
+		else {
+			k = (int) floorf(log2f(d_data[i]/dt_min));
+			k = max(0, min(k, NUM_INTERVALOS_HISTOGRAMA_DT-1));
+		}
+		atomicAdd(hist_bloque+k, 1);
+	}
+	__syncthreads();
+
+	if (tid <= NUM_INTERVALOS_HISTOGRAMA_DT)
+		atomicAdd(d_histograma+tid, hist_bloque[tid]);
+}
+
+// Suma en energia h*|u|^2/2 y actualiza en vel_max el mximo de |u| con el estado datos de una
+// capa. La velocidad se obtiene con la misma desingularizacin que en el resto de kernels
+__device__ void acumularEnergiaVelocidad(float4 datos, float epsilon_h, float *energia, float *vel_max)
+{
+	float h, hm, u;
+
+	h = datos.x;
+	hm = sqrtf(powf(h,4.0) + powf(fmaxf(h,epsilon_h),4.0));
+	u = M_SQRT2*h*sqrtf(datos.y*datos.y + datos.z*datos.z)/hm;
+	*energia += 0.5f*h*u*u;
+	*vel_max = fmaxf(*vel_max, u);
+}
+
+// Cada bloque de NUM_HEBRAS_VOL hebras escribe en d_parcial la suma de h*|u|^2/2 (x) y el mximo
+// de |u| (y) de las dos capas en los volmenes del cluster que procesa. Lee el estado de las
+// texturas en una sola pasada. fila_ini es la primera fila de la textura con volmenes del cluster
+__global__ void reduccionEnergiaVelocidadGPU(int num_volx, int num_voly, int fila_ini, float epsilon_h, float2 *d_parcial)
+{
+	__shared__ float energia_bloque[NUM_HEBRAS_VOL];
+	__shared__ float vel_bloque[NUM_HEBRAS_VOL];
+	int tid = threadIdx.x;
+	int i, pos_x, pos_y;
+	float energia = 0.0f, vel_max = 0.0f;
+
+	for (i=blockIdx.x*NUM_HEBRAS_VOL + tid; i<num_volx*num_voly; i+=NUM_HEBRAS_VOL*gridDim.x) {
+		pos_x = i%num_volx;
+		pos_y = i/num_volx + fila_ini;
+		acumularEnergiaVelocidad(tex2D(texDatosVolumenes_1, pos_x, pos_y), epsilon_h, &energia, &vel_max);
+		acumularEnergiaVelocidad(tex2D(texDatosVolumenes_2, pos_x, pos_y), epsilon_h, &energia, &vel_max);
+	}
+	energia_bloque[tid] = energia;
+	vel_bloque[tid] = vel_max;
+	__syncthreads();
+
+	for (i=NUM_HEBRAS_VOL/2; i>0; i>>=1) {
+		if (tid < i) {
+			energia_bloque[tid] += energia_bloque[tid+i];
+			vel_bloque[tid] = fmaxf(vel_bloque[tid], vel_bloque[tid+i]);
+		}
+		__syncthreads();
+	}
+	if (tid == 0)
+		d_parcial[blockIdx.x] = make_float2(energia_bloque[0], vel_bloque[0]);
+}
+
+// Pone en energia la suma de h*|u|^2/2 y en vel_max el mximo de |u| de las dos capas en los
+// volmenes del cluster (adimensionalizados), que empiezan en la fila fila_ini de la textura.
+// d_parcial debe tener MAX_BLOQUES_REDUCCION elementos
+void obtenerEnergiaVelocidad(float2 *d_parcial, int num_volx, int num_voly, int fila_ini, float epsilon_h, double *energia, float *vel_max)
+{
+	float2 h_parcial[MAX_BLOQUES_REDUCCION];
+	int num_bloques = min(MAX_BLOQUES_REDUCCION, iDivUp(num_volx*num_voly, NUM_HEBRAS_VOL));
+	int i;
+
+	reduccionEnergiaVelocidadGPU<<<num_bloques, NUM_HEBRAS_VOL>>>(num_volx, num_voly, fila_ini, epsilon_h, d_parcial);
+	cudaMemcpy(h_parcial, d_parcial, num_bloques*sizeof(float2), cudaMemcpyDeviceToHost);
+	*energia = 0.0;
+	*vel_max = 0.0f;
+	for (i=0; i<num_bloques; i++) {
+		*energia += h_parcial[i].x;
+		*vel_max = fmaxf(*vel_max, h_parcial[i].y);
+	}
+}
+
 #endif
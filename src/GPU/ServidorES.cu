@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "ServidorES.hxx"
+
+/*********************/
+/* Servidores de E/S */
+/*********************/
+
+// Ver el protocolo en ServidorES.hxx
+
+MPI_Comm comm_calculo = MPI_COMM_WORLD;
+
+// Tamao mximo de un mensaje con cabecera para un cluster de num_volx*num_voly volmenes y
+// num_puntos puntos de guardado en total
+int tamMensajeES(int num_volx, int num_voly, int num_puntos)
+{
+	int tam = num_volx*num_voly*sizeof(float);
+
+	tam = max(tam, (int) (MUESTRAS_BLOQUE_PUNTOS*(sizeof(double) + num_puntos*sizeof(float))));
+	tam = max(tam, TAM_NOMBRE_ES);
+	return sizeof(TCabeceraES) + tam;
+}
+
+#if PROCESOS_ES > 0
+
+// Envos de un proceso de clculo a su servidor: nmero del servidor en MPI_COMM_WORLD, buffers
+// (cabecera y datos) y sus peticiones, siguiente buffer que se usa, y veces y tiempo (seg) que
+// se ha esperado a que terminara el envo de un buffer
+typedef struct TClienteES {
+	int servidor, tam_mensaje;
+	char *buffers[BUFFERS_ES];
+	MPI_Request peticiones[BUFFERS_ES];
+	int actual;
+	int num_esperas;
+	double tiempo_espera;
+} TClienteES;
+
+TClienteES cliente_es;
+
+// Prepara los envos al servidor de E/S del proceso de clculo id_hebra. El proceso 0 enva
+// par (y los ndices de los puntos, si se guardan) a los servidores
+void inicializarClienteES(TParametrosES *par, int *indiceVolumenesGuardado, int id_hebra)
+{
+	int num_procs = par->num_procs;
+	int i, s;
+
+	cliente_es.servidor = num_procs + id_hebra*PROCESOS_ES/num_procs;
+	cliente_es.tam_mensaje = par->tam_mensaje;
+	for (i=0; i<BUFFERS_ES; i++) {
+		cliente_es.buffers[i] = (char *) malloc(par->tam_mensaje);
+		cliente_es.peticiones[i] = MPI_REQUEST_NULL;
+	}
+	cliente_es.actual = 0;
+	cliente_es.num_esperas = 0;
+	cliente_es.tiempo_espera = 0.0;
+
+	if (id_hebra == 0) {
+		for (s=0; s<PROCESOS_ES; s++)
+			MPI_Send(par, sizeof(TParametrosES), MPI_BYTE, num_procs+s, TAG_PARAMETROS_ES, MPI_COMM_WORLD);
+		// Slo el servidor 0 escribe el fichero de puntos
+		if (par->leer_fichero_puntos == 1)
+			MPI_Send(indiceVolumenesGuardado, par->num_puntos, MPI_INT, num_procs, TAG_INDICES_ES, MPI_COMM_WORLD);
+	}
+}
+
+// Devuelve dnde hay que poner los datos del siguiente mensaje antes de llamar a enviarES. Si
+// su buffer todava se est enviando, espera a que termine. Slo ocurre si los servidores
+// escriben ms despacio de lo que se generan los datos y se han llenado los BUFFERS_ES buffers
+void *bufferES()
+{
+	int completado;
+	double t;
+
+	MPI_Test(cliente_es.peticiones + cliente_es.actual, &completado, MPI_STATUS_IGNORE);
+	if (! completado) {
+		t = MPI_Wtime();
+		MPI_Wait(cliente_es.peticiones + cliente_es.actual, MPI_STATUS_IGNORE);
+		cliente_es.tiempo_espera += MPI_Wtime() - t;
+		cliente_es.num_esperas++;
+	}
+	return cliente_es.buffers[cliente_es.actual] + sizeof(TCabeceraES);
+}
+
+// Enva al servidor, sin esperar, el mensaje del buffer obtenido con bufferES con tam bytes de datos
+void enviarES(int tipo, int nvar, int num, double tiempo, int tam)
+{
+	char *buf = cliente_es.buffers[cliente_es.actual];
+	TCabeceraES *cab = (TCabeceraES *) buf;
+
+	cab->tipo = tipo;
+	cab->nvar = nvar;
+	cab->num = num;
+	cab->tam = tam;
+	cab->tiempo = tiempo;
+	MPI_Isend(buf, sizeof(TCabeceraES) + tam, MPI_BYTE, cliente_es.servidor, TAG_ES, MPI_COMM_WORLD,
+		cliente_es.peticiones + cliente_es.actual);
+	cliente_es.actual = (cliente_es.actual + 1) % BUFFERS_ES;
+}
+
+// Enva ES_FIN, espera a que terminen todos los envos y muestra lo que han esperado los procesos
+// de clculo a los servidores (llamada colectiva de comm_calculo)
+void cerrarClienteES(int id_hebra)
+{
+	double t, espera_max;
+	int esperas_total, i;
+
+	bufferES();
+	enviarES(ES_FIN, 0, 0, 0.0, 0);
+	t = MPI_Wtime();
+	MPI_Waitall(BUFFERS_ES, cliente_es.peticiones, MPI_STATUSES_IGNORE);
+	cliente_es.tiempo_espera += MPI_Wtime() - t;
+	for (i=0; i<BUFFERS_ES; i++)
+		free(cliente_es.buffers[i]);
+
+	MPI_Reduce (&(cliente_es.tiempo_espera), &espera_max, 1, MPI_DOUBLE, MPI_MAX, 0, comm_calculo);
+	MPI_Reduce (&(cliente_es.num_esperas), &esperas_total, 1, MPI_INT, MPI_SUM, 0, comm_calculo);
+	if (id_hebra == 0) {
+		fprintf(stdout, "Espera a los servidores de E/S: %e seg maximo por proceso, %d envios con los buffers llenos\n",
+			espera_max, esperas_total);
+	}
+}
+
+#endif
+
+// Indica a los servidores de E/S que terminen sin guardar nada. La llama el proceso de clculo 0
+// cuando hay un error antes de empezar la simulacin
+extern "C" void cancelarServidoresES(int num_procs)
+{
+	TParametrosES par;
+	int s;
+
+	memset(&par, 0, sizeof(TParametrosES));
+	par.iniciar = 0;
+	for (s=0; s<PROCESOS_ES; s++)
+		MPI_Send(&par, sizeof(TParametrosES), MPI_BYTE, num_procs+s, TAG_PARAMETROS_ES, MPI_COMM_WORLD);
+}
+
+// Bucle de un servidor de E/S (ver ServidorES.hxx). comm_es es el comunicador de los servidores y
+// num_procs el nmero de procesos de clculo. Devuelve 0 si todo ha ido bien
+extern "C" int servidorES(MPI_Comm comm_es, int num_procs)
+{
+	TParametrosES par;
+	TCabeceraES *cab;
+	TPuntos puntos;
+	int id_es, num_es;
+	// Procesos de clculo del servidor (de p_ini a p_fin-1) y sus filas en la malla
+	int p_ini, p_fin, fila_ini, num_filas;
+	// Mensajes recibidos en la ronda actual y sus datos juntos
+	char **mensajes;
+	char *datos;
+	int n, desp, tam;
+	int nx_nc[NUM_VARIABLES], ny_nc[NUM_VARIABLES], iniy_nc[NUM_VARIABLES];
+	int *indices, *cont, *desp_es;
+	int p, s, pi, pf, nvar;
+	int terminar = 0;
+	double t, tiempo_escritura = 0.0, tiempo_max;
+
+	MPI_Comm_rank(comm_es, &id_es);
+	MPI_Comm_size(comm_es, &num_es);
+	MPI_Recv(&par, sizeof(TParametrosES), MPI_BYTE, 0, TAG_PARAMETROS_ES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	if (! par.iniciar)
+		return 0;
+
+	p_ini = (id_es*num_procs + num_es - 1)/num_es;
+	p_fin = ((id_es+1)*num_procs + num_es - 1)/num_es;
+	fila_ini = p_ini*par.num_voly_otros;
+	num_filas = ((p_fin == num_procs) ? par.num_voly_total : p_fin*par.num_voly_otros) - fila_ini;
+	mensajes = (char **) malloc((p_fin-p_ini)*sizeof(char *));
+	for (p=p_ini; p<p_fin; p++)
+		mensajes[p-p_ini] = (char *) malloc(par.tam_mensaje);
+	datos = (char *) malloc(((size_t) (p_fin-p_ini))*par.tam_mensaje);
+
+	puntos.num_puntos_proc = puntos.desp_proc = puntos.punto_recibido = NULL;
+	puntos.cont_recibidas = puntos.desp_recibidas = NULL;
+	puntos.recibidas = puntos.registro = NULL;
+	puntos.fp = NULL;
+	cont = desp_es = NULL;
+	if ((par.leer_fichero_puntos == 1) && (id_es == 0)) {
+		indices = (int *) malloc(max(par.num_puntos,1)*sizeof(int));
+		MPI_Recv(indices, par.num_puntos, MPI_INT, 0, TAG_INDICES_ES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		crearFicheroPuntos(&puntos, par.prefijo, indices, par.num_puntos, par.num_volx, par.num_voly_otros,
+			par.num_voly_total, num_procs, par.xmin, par.ymin, par.ancho_vol, par.alto_vol);
+		free(indices);
+		cont = (int *) malloc(num_es*sizeof(int));
+		desp_es = (int *) malloc(num_es*sizeof(int));
+	}
+
+	while (! terminar) {
+		// Recibimos un mensaje de cada proceso de clculo del servidor y juntamos sus datos. De las
+		// muestras de los puntos slo se juntan las eta1 (los tiempos son los mismos en todos)
+		n = 0;
+		for (p=p_ini; p<p_fin; p++) {
+			MPI_Recv(mensajes[p-p_ini], par.tam_mensaje, MPI_BYTE, p, TAG_ES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			cab = (TCabeceraES *) mensajes[p-p_ini];
+			desp = (cab->tipo == ES_PUNTOS) ? cab->num*sizeof(double) : 0;
+			tam = cab->tam - desp;
+			memcpy(datos + n, mensajes[p-p_ini] + sizeof(TCabeceraES) + desp, tam);
+			n += tam;
+		}
+		cab = (TCabeceraES *) mensajes[0];
+		nvar = cab->nvar;
+
+		t = MPI_Wtime();
+		switch (cab->tipo) {
+			case ES_BATIMETRIA:
+				initNC(comm_es, p_ini, par.nombre_bati, par.prefijo, par.num_volx, num_filas, par.num_voly_otros,
+					par.num_voly_total, par.guardar, par.precision, nx_nc, ny_nc, par.npics, par.xmin, par.ymin,
+					par.ancho_vol, par.alto_vol, par.tiempo_tot, par.CFL, par.r, par.angulo1, par.angulo2, par.angulo3,
+					par.angulo4, par.mfc, par.mf0, par.mfs, par.vmax1, par.vmax2, (float *) datos, &(par.recorte));
+				// Primera fila de cada variable en el fichero (ver shallowWater)
+				for (nvar=0; nvar<NUM_VARIABLES; nvar++)
+					iniy_nc[nvar] = (fila_ini + par.npics[nvar] - 1)/par.npics[nvar];
+				break;
+			case ES_VARIABLE:
+				writeVarNC(nvar, nx_nc[nvar], n/(nx_nc[nvar]*sizeof(float)), iniy_nc[nvar], cab->num, cab->tiempo,
+					(float *) datos);
+				break;
+			case ES_PUNTOS:
+				// Reunimos en el servidor 0 las muestras de todos los procesos, en orden de proceso
+				if (id_es == 0) {
+					for (s=0; s<num_es; s++) {
+						pi = (s*num_procs + num_es - 1)/num_es;
+						pf = ((s+1)*num_procs + num_es - 1)/num_es;
+						desp_es[s] = puntos.desp_proc[pi]*cab->num;
+						cont[s] = (puntos.desp_proc[pf-1] + puntos.num_puntos_proc[pf-1] - puntos.desp_proc[pi])*cab->num;
+					}
+				}
+				MPI_Gatherv(datos, n/sizeof(float), MPI_FLOAT, puntos.recibidas, cont, desp_es, MPI_FLOAT, 0, comm_es);
+				if (id_es == 0)
+					escribirMuestrasPuntos(&puntos, (double *) (mensajes[0] + sizeof(TCabeceraES)), cab->num);
+				break;
+			case ES_PARADA:
+				escribirParadaNC(datos, cab->tiempo);
+				break;
+			case ES_ETA1_MAXIMA:
+				closeNC(nx_nc[0], n/(nx_nc[0]*sizeof(float)), iniy_nc[0], (float *) datos);
+				break;
+			case ES_FIN:
+				terminar = 1;
+				break;
+		}
+		tiempo_escritura += MPI_Wtime() - t;
+	}
+
+	liberarFicheroPuntos(&puntos);
+	free(cont);
+	free(desp_es);
+	for (p=p_ini; p<p_fin; p++)
+		free(mensajes[p-p_ini]);
+	free(mensajes);
+	free(datos);
+
+	MPI_Reduce (&tiempo_escritura, &tiempo_max, 1, MPI_DOUBLE, MPI_MAX, 0, comm_es);
+	if (id_es == 0) {
+		fprintf(stdout, "Servidores de E/S: %d para %d procesos de calculo, %e seg escribiendo como maximo\n",
+			num_es, num_procs, tiempo_max);
+	}
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef _SERVIDOR_ES_H_
+#define _SERVIDOR_ES_H_
+
+#include <mpi.h>
+#include "Constantes.hxx"
+
+/**************************************************************/
+/* Protocolo entre los procesos de clculo y los servidores de E/S */
+/**************************************************************/
+
+// Con PROCESOS_ES > 0 (ver Constantes.hxx), los ltimos PROCESOS_ES procesos de MPI_COMM_WORLD
+// son servidores de E/S y el resto (comm_calculo) hace la simulacin, con los mismos nmeros de
+// proceso. El proceso de clculo p de num_procs se asigna al servidor p*PROCESOS_ES/num_procs,
+// por lo que cada servidor atiende a procesos consecutivos cuyas filas forman un bloque contiguo
+// de la malla.
+// - Al empezar, el proceso de clculo 0 enva a cada servidor un TParametrosES (TAG_PARAMETROS_ES)
+//   y, si hay puntos de guardado, sus ndices globales (TAG_INDICES_ES). Si iniciar es 0 (ha habido
+//   un error en los procesos de clculo), los servidores terminan sin crear ningn fichero.
+// - Despus, cada proceso de clculo enva a su servidor una secuencia de mensajes (TAG_ES), cada
+//   uno con un TCabeceraES seguido de tam bytes de datos. Todos los procesos de clculo envan la
+//   misma secuencia de tipos, as que el servidor los procesa por rondas: recibe un mensaje de
+//   cada uno de sus procesos, junta los datos por orden de proceso (es decir, de filas) y los
+//   escribe con una llamada colectiva entre todos los servidores.
+// Los mensajes no superan tam_mensaje bytes (ver tamMensajeES)
+
+#define TAG_PARAMETROS_ES  40
+#define TAG_INDICES_ES     41
+#define TAG_ES             42
+// Tamao de las cadenas de TParametrosES
+#define TAM_NOMBRE_ES      256
+
+// Tipos de mensaje y sus datos:
+// - ES_BATIMETRIA: batimetra (m) de las num_voly filas del cluster. Es el primero si se guarda
+//   en NetCDF; el servidor crea los ficheros.
+// - ES_VARIABLE: estado num de la variable nvar en el tiempo tiempo (seg), empaquetado con su
+//   diezmado (ver empaquetarVariableNC).
+// - ES_PUNTOS: num muestras de los puntos del cluster: sus tiempos (num doubles, seg) y su eta1
+//   (num*num_puntos_locales floats, m, ordenados por muestra y despus por punto).
+// - ES_PARADA: motivo por el que se ha detenido la simulacin (cadena) y tiempo (seg).
+// - ES_ETA1_MAXIMA: eta1 mxima empaquetada con el diezmado de eta1. El servidor la guarda y
+//   cierra los ficheros NetCDF.
+// - ES_FIN: sin datos. Es el ltimo; el servidor cierra el fichero de puntos y termina
+enum TTipoMensajeES {ES_BATIMETRIA = 0, ES_VARIABLE, ES_PUNTOS, ES_PARADA, ES_ETA1_MAXIMA, ES_FIN};
+
+typedef struct TCabeceraES {
+	int tipo, nvar, num;
+	// Bytes de datos que siguen a la cabecera
+	int tam;
+	double tiempo;
+} TCabeceraES;
+
+typedef struct TParametrosES {
+	// 1 si empieza la simulacin, 0 si los servidores deben terminar sin guardar nada
+	int iniciar;
+	// Procesos de clculo y malla completa
+	int num_procs, num_volx, num_voly_otros, num_voly_total;
+	// Recorte de la malla (los ficheros NetCDF tienen la malla original, ver initNC)
+	TRecorte recorte;
+	// Tamao mximo de un mensaje, cabecera incluida
+	int tam_mensaje;
+	// Si leer_fichero_puntos es 0 se guarda en NetCDF, y si es 1 en el fichero de puntos
+	int leer_fichero_puntos, num_puntos;
+	// Variables NetCDF que se guardan, su diezmado y su precisin (ver initNC)
+	int guardar[NUM_VARIABLES], npics[NUM_VARIABLES];
+	double precision[NUM_VARIABLES];
+	// Atributos de los ficheros NetCDF y de puntos, ya en metros, segundos y grados
+	float xmin, ymin, ancho_vol, alto_vol, tiempo_tot, CFL, r;
+	float angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2;
+	char nombre_bati[TAM_NOMBRE_ES], prefijo[TAM_NOMBRE_ES];
+} TParametrosES;
+
+// Comunicador de los procesos de clculo (MPI_COMM_WORLD si PROCESOS_ES es 0)
+extern MPI_Comm comm_calculo;
+
+int tamMensajeES(int num_volx, int num_voly, int num_puntos);
+void inicializarClienteES(TParametrosES *par, int *indiceVolumenesGuardado, int id_hebra);
+void *bufferES();
+void enviarES(int tipo, int nvar, int num, double tiempo, int tam);
+void cerrarClienteES(int id_hebra);
+
+#endif
@@ -1,34 +1,183 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <fstream>
 #include <mpi.h>
 #include "Arista_kernel.cu"
 #include "Reduccion_kernel.cu"
 #include "Volumen_kernel.cu"
+#include "ServidorES.hxx"
 #include "netcdf.cu"
+#include "MemoriaCompartida.cu"
+#include "Puntos.cu"
+#include "ServidorES.cu"
+#include "Simulacion.hxx"
+#include "MallaAnidada.cu"
 
 using namespace std;
 
-// Devuelve 0 si todo ha ido bien, 1 si no hay memoria GPU suficiente.
-int inicializarDatosCuda(TDatoCluster *datos_cluster, TSW_Cuda *datos_SW_Cuda, int id_hebra)
+#ifdef ALMACENAMIENTO_HALF
+
+// Convierte un float a half (redondeo al ms cercano, al par en caso de empate)
+unsigned short floatAHalf(float f)
+{
+	unsigned int x, signo, mant, h, resto, mitad;
+	int exp, desp;
+
+	memcpy(&x, &f, sizeof(float));
+	signo = (x >> 16) & 0x8000;
+	mant = x & 0x7fffff;
+	if (((x >> 23) & 0xff) == 0xff) {
+		// Infinito o NaN
+		return (unsigned short) (signo | 0x7c00 | (mant ? 0x200 : 0));
+	}
+	exp = (int) ((x >> 23) & 0xff) - 127 + 15;
+	if (exp >= 31) {
+		// Desbordamiento
+		return (unsigned short) (signo | 0x7c00);
+	}
+	if (exp <= 0) {
+		// Subnormal en half
+		if (exp < -10)
+			return (unsigned short) signo;
+		mant |= 0x800000;
+		desp = 14 - exp;
+		h = mant >> desp;
+		resto = mant & ((1u << desp) - 1);
+		mitad = 1u << (desp - 1);
+	}
+	else {
+		h = (exp << 10) | (mant >> 13);
+		resto = mant & 0x1fff;
+		mitad = 0x1000;
+	}
+	if ((resto > mitad) || ((resto == mitad) && (h & 1)))
+		h++;
+	return (unsigned short) (signo | h);
+}
+
+// Convierte un half a float
+float halfAFloat(unsigned short h)
+{
+	unsigned int signo = ((unsigned int) (h & 0x8000)) << 16;
+	unsigned int exp = (h >> 10) & 0x1f;
+	unsigned int mant = h & 0x3ff;
+	unsigned int x;
+	float f;
+
+	if (exp == 0x1f)
+		x = signo | 0x7f800000 | (mant << 13);
+	else if (exp != 0)
+		x = signo | ((exp + 127 - 15) << 23) | (mant << 13);
+	else if (mant == 0)
+		x = signo;
+	else {
+		// Subnormal en half: normalizamos
+		exp = 127 - 14;
+		while ((mant & 0x400) == 0) {
+			mant <<= 1;
+			exp--;
+		}
+		x = signo | (exp << 23) | ((mant & 0x3ff) << 13);
+	}
+	memcpy(&f, &x, sizeof(float));
+	return f;
+}
+
+#endif
+
+// Copia num_filas filas de datos al array d_array de la GPU, empezando en la fila fila_ini
+// del array. En modo half, el estado se convierte a half en CPU antes de copiarlo
+void copiarEstadoCPUAGPU(TSW_Cuda *datos_SW_Cuda, cudaArray *d_array, float4 *datos, int fila_ini,
+		int num_filas, int num_volx)
+{
+	int n = num_filas*num_volx;
+#ifdef ALMACENAMIENTO_HALF
+	TEstadoGPU *estado = datos_SW_Cuda->estadoHalf;
+	int i;
+
+	for (i=0; i<n; i++) {
+		estado[i].x = floatAHalf(datos[i].x);
+		estado[i].y = floatAHalf(datos[i].y);
+		estado[i].z = floatAHalf(datos[i].z);
+		estado[i].w = 0;
+	}
+	cudaMemcpyToArray(d_array, 0, fila_ini, estado, n*sizeof(TEstadoGPU), cudaMemcpyHostToDevice);
+#else
+	cudaMemcpyToArray(d_array, 0, fila_ini, datos, n*sizeof(float4), cudaMemcpyHostToDevice);
+#endif
+}
+
+// Copia en datos num_filas filas del array d_array de la GPU, empezando en la fila fila_ini
+// del array. En la componente w se pone H de la copia en CPU de la batimetra, cuya primera fila
+// es la fila fila_ini_gpu-1 de la GPU (en GPU la componente w del estado no se usa). En modo half,
+// el estado se convierte a float en CPU
+void copiarEstadoGPUACPU(TSW_Cuda *datos_SW_Cuda, cudaArray *d_array, float4 *datos, int fila_ini,
+		int num_filas, int num_volx)
+{
+	int n = num_filas*num_volx;
+	float *bati = datos_SW_Cuda->batimetria + (fila_ini - (datos_SW_Cuda->fila_ini_gpu-1))*num_volx;
+	int i;
+#ifdef ALMACENAMIENTO_HALF
+	TEstadoGPU *estado = datos_SW_Cuda->estadoHalf;
+
+	cudaMemcpyFromArray(estado, d_array, 0, fila_ini, n*sizeof(TEstadoGPU), cudaMemcpyDeviceToHost);
+	for (i=0; i<n; i++) {
+		datos[i].x = halfAFloat(estado[i].x);
+		datos[i].y = halfAFloat(estado[i].y);
+		datos[i].z = halfAFloat(estado[i].z);
+		datos[i].w = bati[i];
+	}
+#else
+	cudaMemcpyFromArray(datos, d_array, 0, fila_ini, n*sizeof(float4), cudaMemcpyDeviceToHost);
+	for (i=0; i<n; i++)
+		datos[i].w = bati[i];
+#endif
+}
+
+// Copia en eta1_maxima la eta1 mxima de los volmenes del cluster (sin las filas fantasma de la
+// GPU, ver PASOS_HALO)
+void copiarEta1MaximaACPU(TSW_Cuda *datos_SW_Cuda, float2 *eta1_maxima, int num_volx, int num_voly)
+{
+	cudaMemcpy(eta1_maxima, datos_SW_Cuda->d_eta1_maxima + (datos_SW_Cuda->fila_ini_gpu-1)*num_volx,
+		num_volx*num_voly*sizeof(float2), cudaMemcpyDeviceToHost);
+}
+
+// Devuelve 0 si todo ha ido bien, 1 si no hay memoria GPU suficiente. Con PASOS_HALO > 1, las
+// filas fantasma de la GPU se rellenan despus (ver inicializarFilasFantasma)
+int inicializarDatosCuda(TDatoCluster *datos_cluster, TSW_Cuda *datos_SW_Cuda, int id_hebra, int ultima_hebra)
 {
 	int num_aristas_ver1, num_aristas_ver2;
 	int num_aristas_hor1, num_aristas_hor2;
 	int num_volx = datos_cluster->num_volx;
-	int num_voly = datos_cluster->num_voly;
+	// Filas fantasma del cluster superior y filas del cluster en GPU, incluyendo las fantasma
+	// de los dos clusters adyacentes (ver PASOS_HALO)
+	int filas_fantasma_sup = (id_hebra != 0) ? FILAS_HALO-1 : 0;
+	int num_voly = datos_cluster->num_voly + filas_fantasma_sup + (ultima_hebra ? 0 : FILAS_HALO-1);
 	int num_volumenes = num_volx*num_voly;
 	int tam_datosVolumenes = num_volumenes * sizeof(float4);
-	int tam_datosVolComFloat4 = num_volx * sizeof(float4);
 	int tam_datosEta1 = num_volumenes * sizeof(float2);
 	int tam_datosDeltaT = num_volumenes * sizeof(float);
+	// Volmenes de datosVolumenes_1 y datosVolumenes_2 de CPU (con las filas de comunicacin)
+	int num_vols_array = (datos_cluster->num_voly + 2)*num_volx;
+	int i;
+#ifdef ALMACENAMIENTO_HALF
+	// Las texturas devuelven float al leer de arrays half
+	cudaChannelFormatDesc float4Tex_1 = cudaCreateChannelDescHalf4();
+	cudaChannelFormatDesc float4Tex_2 = cudaCreateChannelDescHalf4();
+#else
 	cudaChannelFormatDesc float4Tex_1 = cudaCreateChannelDesc<float4>();
 	cudaChannelFormatDesc float4Tex_2 = cudaCreateChannelDesc<float4>();
+#endif
+	cudaChannelFormatDesc floatTex = cudaCreateChannelDesc<float>();
+#ifdef ARISTAS_PRECALCULADAS
+	dim3 blockGridDifHVer(iDivUp(num_volx+1, NUM_HEBRAS_ANCHO_ARI), iDivUp(num_voly, NUM_HEBRAS_ALTO_ARI));
+	dim3 blockGridDifHHor(iDivUp(num_volx, NUM_HEBRAS_ANCHO_ARI), iDivUp(num_voly+1, NUM_HEBRAS_ALTO_ARI));
+#endif
 	cudaError_t err_cuda;
 
-	// Asignamos la GPU
-//	cudaSetDevice(0);
-	cudaSetDevice(id_hebra%2);
+	// La GPU ya se ha asignado en main (ver asignarGPU)
 
 	// Nmero de aristas verticales y horizontales
 	num_aristas_ver1 = (num_volx/2 + 1)*num_voly;
@@ -39,9 +188,43 @@ int inicializarDatosCuda(TDatoCluster *datos_cluster, TSW_Cuda *datos_SW_Cuda, i
 	// Reservamos memoria en GPU para los acumuladores, los datos de los volmenes
 	// y el array de los delta T de los volmenes.
 	// Datos de los volmenes
-	cudaMallocArray(&(datos_SW_Cuda->d_datosVolumenes_1), &float4Tex_1, num_volx, num_voly+2);
-	cudaMallocArray(&(datos_SW_Cuda->d_datosVolumenes_2), &float4Tex_2, num_volx, num_voly+2);
+	// El kernel de actualizacin del estado escribe en los arrays mediante surfaces
+	cudaMallocArray(&(datos_SW_Cuda->d_datosVolumenes_1), &float4Tex_1, num_volx, num_voly+2, cudaArraySurfaceLoadStore);
+	cudaMallocArray(&(datos_SW_Cuda->d_datosVolumenes_2), &float4Tex_2, num_volx, num_voly+2, cudaArraySurfaceLoadStore);
+#ifdef ALMACENAMIENTO_HALF
+	cudaMalloc( (void **)&datos_SW_Cuda->d_errorMasa, sizeof(float));
+#else
+	datos_SW_Cuda->d_errorMasa = NULL;
+#endif
+	cudaMallocArray(&(datos_SW_Cuda->d_batimetria), &floatTex, num_volx, num_voly+2);
+#ifdef ARISTAS_PRECALCULADAS
+	cudaMalloc( (void **)&datos_SW_Cuda->d_difHAristasVer, (num_volx+1)*num_voly*sizeof(float2));
+	cudaMalloc( (void **)&datos_SW_Cuda->d_difHAristasHor, num_volx*(num_voly+1)*sizeof(float2));
+#else
+	datos_SW_Cuda->d_difHAristasVer = NULL;
+	datos_SW_Cuda->d_difHAristasHor = NULL;
+#endif
+#ifdef OMITIR_BLOQUES_SECOS
+	cudaMalloc( (void **)&datos_SW_Cuda->d_bloquesActivos, iDivUp(num_volx, NUM_HEBRAS_ANCHO_EST)*
+		iDivUp(num_voly, NUM_HEBRAS_ALTO_EST)*sizeof(int));
+	cudaMalloc( (void **)&datos_SW_Cuda->d_numBloquesActivos, sizeof(int));
+#else
+	datos_SW_Cuda->d_bloquesActivos = NULL;
+	datos_SW_Cuda->d_numBloquesActivos = NULL;
+#endif
+#ifdef PASO_TIEMPO_LOCAL
+	cudaMalloc( (void **)&datos_SW_Cuda->d_clasesBloques, 2*iDivUp(num_volx, NUM_HEBRAS_ANCHO_EST)*
+		iDivUp(num_voly, NUM_HEBRAS_ALTO_EST)*sizeof(int));
+#else
+	datos_SW_Cuda->d_clasesBloques = NULL;
+#endif
+	cudaMalloc( (void **)&datos_SW_Cuda->d_minimosBloques, MAX_BLOQUES_REDUCCION*sizeof(float));
+	cudaMalloc( (void **)&datos_SW_Cuda->d_posMinimosBloques, MAX_BLOQUES_REDUCCION*sizeof(int));
+	cudaMalloc( (void **)&datos_SW_Cuda->d_histogramaDeltaT, (NUM_INTERVALOS_HISTOGRAMA_DT+1)*sizeof(int));
+	cudaMalloc( (void **)&datos_SW_Cuda->d_energiaBloques, MAX_BLOQUES_REDUCCION*sizeof(float2));
 	cudaMalloc( (void **)&datos_SW_Cuda->d_eta1_maxima, tam_datosEta1);
+	// El estado de referencia de la capa de absorcin se reserva en inicializarSimulacion
+	datos_SW_Cuda->d_estadoReferencia = NULL;
 	// Delta T de los volmenes
 	cudaMalloc( (void **)&datos_SW_Cuda->d_deltaTVolumenes, tam_datosDeltaT);
 	// Acumuladores
@@ -53,6 +236,17 @@ int inicializarDatosCuda(TDatoCluster *datos_cluster, TSW_Cuda *datos_SW_Cuda, i
 		cudaFree(datos_SW_Cuda->d_datosVolumenes_1);
 		cudaFree(datos_SW_Cuda->d_datosVolumenes_2);
 		cudaFree(datos_SW_Cuda->d_eta1_maxima);
+		cudaFreeArray(datos_SW_Cuda->d_batimetria);
+		cudaFree(datos_SW_Cuda->d_difHAristasVer);
+		cudaFree(datos_SW_Cuda->d_difHAristasHor);
+		cudaFree(datos_SW_Cuda->d_bloquesActivos);
+		cudaFree(datos_SW_Cuda->d_numBloquesActivos);
+		cudaFree(datos_SW_Cuda->d_clasesBloques);
+		cudaFree(datos_SW_Cuda->d_minimosBloques);
+		cudaFree(datos_SW_Cuda->d_posMinimosBloques);
+		cudaFree(datos_SW_Cuda->d_histogramaDeltaT);
+		cudaFree(datos_SW_Cuda->d_energiaBloques);
+		cudaFree(datos_SW_Cuda->d_errorMasa);
 		return 1;
 	}
 
@@ -93,22 +287,84 @@ int inicializarDatosCuda(TDatoCluster *datos_cluster, TSW_Cuda *datos_SW_Cuda, i
 	datos_SW_Cuda->threadBlockEst.x = NUM_HEBRAS_ANCHO_EST;
 	datos_SW_Cuda->threadBlockEst.y = NUM_HEBRAS_ALTO_EST;
 
+	datos_SW_Cuda->num_voly_gpu = num_voly;
+	datos_SW_Cuda->fila_ini_gpu = filas_fantasma_sup + 1;
+
+	// H de todos los volmenes, incluyendo los de comunicacin de otros clusters.
+	// Slo se copia una vez porque no cambia
+	datos_SW_Cuda->batimetria = datos_cluster->batimetria;
+	for (i=0; i<num_vols_array; i++)
+		datos_SW_Cuda->batimetria[i] = datos_cluster->datosVolumenes_1[i].w;
+	cudaMemcpyToArray(datos_SW_Cuda->d_batimetria, 0, filas_fantasma_sup, datos_SW_Cuda->batimetria, num_vols_array*sizeof(float),
+		cudaMemcpyHostToDevice);
+	cudaBindTextureToArray(texBatimetria, datos_SW_Cuda->d_batimetria);
+#ifdef ARISTAS_PRECALCULADAS
+	// Calculamos H0-Hm y H1-Hm de todas las aristas
+	calcularDifHAristasGPU<<<blockGridDifHVer, datos_SW_Cuda->threadBlockAri>>>(datos_SW_Cuda->d_difHAristasVer,
+		num_volx, num_voly, 1);
+	calcularDifHAristasGPU<<<blockGridDifHHor, datos_SW_Cuda->threadBlockAri>>>(datos_SW_Cuda->d_difHAristasHor,
+		num_volx, num_voly, 3);
+#endif
+#ifdef ALMACENAMIENTO_HALF
+	// Buffer de CPU para la conversin del estado entre float y half
+	datos_SW_Cuda->estadoHalf = datos_cluster->estadoHalf;
+	cudaMemset(datos_SW_Cuda->d_errorMasa, 0, sizeof(float));
+#endif
+
 	// Copiamos los datos de los volmenes de CPU a GPU
 	// Hay fila de volmenes de comunicacin de otro cluster en la parte superior
-	cudaMemcpyToArray(datos_SW_Cuda->d_datosVolumenes_1, 0, 0, datos_cluster->datosVolumenes_1, tam_datosVolumenes + 2*tam_datosVolComFloat4,
-		cudaMemcpyHostToDevice);
-	cudaMemcpyToArray(datos_SW_Cuda->d_datosVolumenes_2, 0, 0, datos_cluster->datosVolumenes_2, tam_datosVolumenes + 2*tam_datosVolComFloat4,
-		cudaMemcpyHostToDevice);
+	copiarEstadoCPUAGPU(datos_SW_Cuda, datos_SW_Cuda->d_datosVolumenes_1, datos_cluster->datosVolumenes_1, filas_fantasma_sup,
+		datos_cluster->num_voly+2, num_volx);
+	copiarEstadoCPUAGPU(datos_SW_Cuda, datos_SW_Cuda->d_datosVolumenes_2, datos_cluster->datosVolumenes_2, filas_fantasma_sup,
+		datos_cluster->num_voly+2, num_volx);
 	cudaBindTextureToArray(texDatosVolumenes_1, datos_SW_Cuda->d_datosVolumenes_1);
 	cudaBindTextureToArray(texDatosVolumenes_2, datos_SW_Cuda->d_datosVolumenes_2);
-	cudaMemcpy(datos_SW_Cuda->d_eta1_maxima, datos_cluster->eta1_maxima, tam_datosEta1, cudaMemcpyHostToDevice);
+	cudaBindSurfaceToArray(surfDatosVolumenes_1, datos_SW_Cuda->d_datosVolumenes_1);
+	cudaBindSurfaceToArray(surfDatosVolumenes_2, datos_SW_Cuda->d_datosVolumenes_2);
+	cudaMemset(datos_SW_Cuda->d_eta1_maxima, 0, tam_datosEta1);
+	cudaMemcpy(datos_SW_Cuda->d_eta1_maxima + filas_fantasma_sup*num_volx, datos_cluster->eta1_maxima,
+		num_volx*datos_cluster->num_voly*sizeof(float2), cudaMemcpyHostToDevice);
 	// Inicializamos los acumuladores
 	cudaMemset(datos_SW_Cuda->d_acumulador1, 0, tam_datosVolumenes);
 	cudaMemset(datos_SW_Cuda->d_acumulador2, 0, tam_datosVolumenes);
+#ifdef OMITIR_BLOQUES_SECOS
+	// En el primer paso se procesan todas las aristas (cualquier valor distinto de 0 indica bloque activo)
+	cudaMemset(datos_SW_Cuda->d_bloquesActivos, 1, datos_SW_Cuda->blockGridEst.x*datos_SW_Cuda->blockGridEst.y*sizeof(int));
+	cudaMemset(datos_SW_Cuda->d_numBloquesActivos, 0, sizeof(int));
+#endif
 
 	return 0;
 }
 
+// Muestra la memoria GPU que ocupa cada volumen y la total del problema
+void mostrarMemoriaGPU(int num_volx, int num_voly_total, int num_procs)
+{
+	// Estado (texturas de las capas 1 y 2 y H), acumuladores, eta1 maxima y delta T
+	int tam_estado = 2*sizeof(TEstadoGPU) + sizeof(float);
+	int tam_acumuladores = 2*sizeof(float4);
+#ifdef ARISTAS_PRECALCULADAS
+	// H0-Hm y H1-Hm de una arista vertical y una horizontal por volumen
+	int tam_aristas = 2*sizeof(float2);
+#else
+	int tam_aristas = 0;
+#endif
+	int tam_volumen = tam_estado + tam_acumuladores + sizeof(float2) + sizeof(float) + tam_aristas;
+	// Cada cluster almacena ademas dos filas de volumenes de comunicacion
+	double tam_total = ((double) num_volx)*num_voly_total*tam_volumen + 2.0*num_procs*num_volx*tam_estado;
+
+#ifdef PRECISION_MIXTA
+	fprintf(stdout, "Precision: mixta (estado y acumuladores en float, tiempo en double)\n");
+#else
+	fprintf(stdout, "Precision: simple (estado, acumuladores y tiempo en float)\n");
+#endif
+#ifdef ALMACENAMIENTO_HALF
+	fprintf(stdout, "Almacenamiento del estado: half (H en float)\n");
+#endif
+	fprintf(stdout, "Memoria GPU por volumen: %d bytes (estado: %d, acumuladores: %d, eta1 maxima: %d, delta T: %d, aristas: %d)\n",
+		tam_volumen, tam_estado, tam_acumuladores, (int) sizeof(float2), (int) sizeof(float), tam_aristas);
+	fprintf(stdout, "Memoria GPU total: %.2f MB\n", tam_total/(1024.0*1024.0));
+}
+
 void liberarSWCuda(TSW_Cuda *datos_SW_Cuda)
 {
 	cudaUnbindTexture(texDatosVolumenes_1);
@@ -116,366 +372,1393 @@ void liberarSWCuda(TSW_Cuda *datos_SW_Cuda)
 	cudaFree(datos_SW_Cuda->d_acumulador1);
 	cudaFree(datos_SW_Cuda->d_acumulador2);
 	cudaFree(datos_SW_Cuda->d_eta1_maxima);
+	cudaFree(datos_SW_Cuda->d_estadoReferencia);
 	cudaFree(datos_SW_Cuda->d_deltaTVolumenes);
 	cudaFreeArray(datos_SW_Cuda->d_datosVolumenes_1);
 	cudaFreeArray(datos_SW_Cuda->d_datosVolumenes_2);
+	cudaUnbindTexture(texBatimetria);
+	cudaFreeArray(datos_SW_Cuda->d_batimetria);
+	cudaFree(datos_SW_Cuda->d_difHAristasVer);
+	cudaFree(datos_SW_Cuda->d_difHAristasHor);
+	cudaFree(datos_SW_Cuda->d_bloquesActivos);
+	cudaFree(datos_SW_Cuda->d_numBloquesActivos);
+	cudaFree(datos_SW_Cuda->d_clasesBloques);
+	cudaFree(datos_SW_Cuda->d_minimosBloques);
+	cudaFree(datos_SW_Cuda->d_posMinimosBloques);
+	cudaFree(datos_SW_Cuda->d_histogramaDeltaT);
+	cudaFree(datos_SW_Cuda->d_energiaBloques);
+	cudaFree(datos_SW_Cuda->d_errorMasa);
+}
+
+/***************************************/
+/* Interfaz de la simulacin (biblioteca) */
+/***************************************/
+
+#if PASOS_HALO > 1
+// Rellena las filas de comunicacin y fantasma de la GPU (ver PASOS_HALO) con las FILAS_HALO filas
+// adyacentes de los clusters superior e inferior: el estado completo de las dos capas y H (que no
+// se envan en cada intercambio). Usa como buffers los volmenes de comunicacin de datos_cluster,
+// por lo que hay que llamarla antes de inicializarHalosCompartidos. Es una llamada colectiva de MPI
+static void inicializarFilasFantasma(TSimulacion *sim)
+{
+	TDatoCluster *datos_cluster = sim->datos_cluster;
+	TSW_Cuda *datos_SW_Cuda = &(sim->datos_SW_Cuda);
+	int num_volx = datos_cluster->num_volx;
+	int id_hebra = sim->param.id_hebra;
+	int hebra_ant = (id_hebra != 0) ? id_hebra-1 : MPI_PROC_NULL;
+	int hebra_sig = (id_hebra != sim->param.num_procs-1) ? id_hebra+1 : MPI_PROC_NULL;
+	// Filas de la textura donde empiezan las primeras y las ltimas FILAS_HALO filas del cluster,
+	// y las filas del cluster inferior
+	int fila_com_sup = datos_SW_Cuda->fila_ini_gpu;
+	int fila_com_inf = datos_SW_Cuda->fila_ini_gpu + datos_cluster->num_voly - FILAS_HALO;
+	int fila_otro_inf = datos_SW_Cuda->fila_ini_gpu + datos_cluster->num_voly;
+	// Arrays que se intercambian y tamao de sus elementos
+	cudaArray *arrays[3] = { datos_SW_Cuda->d_datosVolumenes_1, datos_SW_Cuda->d_datosVolumenes_2, datos_SW_Cuda->d_batimetria };
+	int tam_elem[3] = { sizeof(TEstadoGPU), sizeof(TEstadoGPU), sizeof(float) };
+	int k, tam;
+#ifdef ARISTAS_PRECALCULADAS
+	dim3 blockGridDifHVer(iDivUp(num_volx+1, NUM_HEBRAS_ANCHO_ARI), iDivUp(datos_SW_Cuda->num_voly_gpu, NUM_HEBRAS_ALTO_ARI));
+	dim3 blockGridDifHHor(iDivUp(num_volx, NUM_HEBRAS_ANCHO_ARI), iDivUp(datos_SW_Cuda->num_voly_gpu+1, NUM_HEBRAS_ALTO_ARI));
+#endif
+
+	for (k=0; k<3; k++) {
+		tam = FILAS_HALO*num_volx*tam_elem[k];
+		cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterSup_1, arrays[k], 0, fila_com_sup, tam,
+			cudaMemcpyDeviceToHost);
+		cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterInf_1, arrays[k], 0, fila_com_inf, tam,
+			cudaMemcpyDeviceToHost);
+		// Enviamos las primeras filas al cluster superior y recibimos las del cluster inferior, y al revs
+		MPI_Sendrecv(datos_cluster->puntero_datosVolumenesComClusterSup_1, tam, MPI_BYTE, hebra_ant, 24,
+			datos_cluster->puntero_datosVolumenesComOtroClusterSup_1, tam, MPI_BYTE, hebra_sig, 24,
+			sim->param.comm, MPI_STATUS_IGNORE);
+		MPI_Sendrecv(datos_cluster->puntero_datosVolumenesComClusterInf_1, tam, MPI_BYTE, hebra_sig, 25,
+			datos_cluster->puntero_datosVolumenesComOtroClusterInf_1, tam, MPI_BYTE, hebra_ant, 25,
+			sim->param.comm, MPI_STATUS_IGNORE);
+		if (hebra_ant != MPI_PROC_NULL)
+			cudaMemcpyToArray(arrays[k], 0, 0, datos_cluster->puntero_datosVolumenesComOtroClusterInf_1, tam,
+				cudaMemcpyHostToDevice);
+		if (hebra_sig != MPI_PROC_NULL)
+			cudaMemcpyToArray(arrays[k], 0, fila_otro_inf, datos_cluster->puntero_datosVolumenesComOtroClusterSup_1, tam,
+				cudaMemcpyHostToDevice);
+	}
+#ifdef ARISTAS_PRECALCULADAS
+	// Recalculamos H0-Hm y H1-Hm de las aristas con la H de las filas fantasma
+	calcularDifHAristasGPU<<<blockGridDifHVer, datos_SW_Cuda->threadBlockAri>>>(datos_SW_Cuda->d_difHAristasVer,
+		num_volx, datos_SW_Cuda->num_voly_gpu, 1);
+	calcularDifHAristasGPU<<<blockGridDifHHor, datos_SW_Cuda->threadBlockAri>>>(datos_SW_Cuda->d_difHAristasHor,
+		num_volx, datos_SW_Cuda->num_voly_gpu, 3);
+#endif
+}
+#endif
+
+#ifdef HALOS_MEMORIA_COMPARTIDA
+// Espera a que *contador, que modifica otro proceso del nodo, sea mayor o igual que valor
+static inline void esperarContadorHalos(volatile long *contador, long valor, MPI_Win ventana)
+{
+	while (*contador < valor)
+		MPI_Win_sync(ventana);
+}
+
+// Crea la ventana de memoria compartida con los volmenes de comunicacin de los procesos del nodo.
+// El segmento de cada proceso tiene sus contadores (TSincronizacionHalos) y las filas superior e
+// inferior de su cluster de las capas 1 y 2, y los punteros puntero_datosVolumenesComCluster* de
+// datos_cluster pasan a apuntar a l. Si el cluster superior (inferior) est en el mismo nodo,
+// puntero_datosVolumenesComOtroClusterInf* (Sup*) pasan a apuntar a sus filas inferiores
+// (superiores) en su segmento. Es una llamada colectiva de MPI
+static void inicializarHalosCompartidos(TSimulacion *sim)
+{
+	TDatoCluster *datos_cluster = sim->datos_cluster;
+	int id_hebra = sim->param.id_hebra;
+	// Tamao de los contadores y de un grupo de volmenes de comunicacin (FILAS_HALO filas), alineados
+	MPI_Aint tam_cab = iAlignUp((MPI_Aint) sizeof(TSincronizacionHalos), ALINEAMIENTO_ARENA);
+	MPI_Aint tam_fila = iAlignUp((MPI_Aint) (FILAS_HALO*datos_cluster->num_volx*sizeof(TEstadoGPU)), ALINEAMIENTO_ARENA);
+	MPI_Aint tam;
+	MPI_Group grupo, grupo_nodo;
+	int vecinos[2], vecinos_nodo[2];
+	int disp, num_procs_nodo;
+	char *base, *base_vecino;
+
+	sim->punteros_com[0] = datos_cluster->puntero_datosVolumenesComClusterSup_1;
+	sim->punteros_com[1] = datos_cluster->puntero_datosVolumenesComClusterSup_2;
+	sim->punteros_com[2] = datos_cluster->puntero_datosVolumenesComClusterInf_1;
+	sim->punteros_com[3] = datos_cluster->puntero_datosVolumenesComClusterInf_2;
+	sim->punteros_com[4] = datos_cluster->puntero_datosVolumenesComOtroClusterSup_1;
+	sim->punteros_com[5] = datos_cluster->puntero_datosVolumenesComOtroClusterSup_2;
+	sim->punteros_com[6] = datos_cluster->puntero_datosVolumenesComOtroClusterInf_1;
+	sim->punteros_com[7] = datos_cluster->puntero_datosVolumenesComOtroClusterInf_2;
+
+	MPI_Comm_split_type(sim->param.comm, MPI_COMM_TYPE_SHARED, id_hebra, MPI_INFO_NULL, &(sim->comm_nodo));
+	MPI_Comm_size(sim->comm_nodo, &num_procs_nodo);
+	MPI_Win_allocate_shared(tam_cab + 4*tam_fila, 1, MPI_INFO_NULL, sim->comm_nodo, &base, &(sim->ventana_halos));
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, sim->ventana_halos);
+	sim->sinc = (TSincronizacionHalos *) base;
+	sim->sinc->publicado = sim->sinc->leido_ant = sim->sinc->leido_sig = 0;
+	datos_cluster->puntero_datosVolumenesComClusterSup_1 = (float4 *) (base + tam_cab);
+	datos_cluster->puntero_datosVolumenesComClusterSup_2 = (float4 *) (base + tam_cab + tam_fila);
+	datos_cluster->puntero_datosVolumenesComClusterInf_1 = (float4 *) (base + tam_cab + 2*tam_fila);
+	datos_cluster->puntero_datosVolumenesComClusterInf_2 = (float4 *) (base + tam_cab + 3*tam_fila);
+
+	// Buscamos los clusters adyacentes en el comunicador del nodo
+	vecinos[0] = (id_hebra != 0) ? id_hebra-1 : MPI_PROC_NULL;
+	vecinos[1] = (id_hebra != sim->param.num_procs-1) ? id_hebra+1 : MPI_PROC_NULL;
+	MPI_Comm_group(sim->param.comm, &grupo);
+	MPI_Comm_group(sim->comm_nodo, &grupo_nodo);
+	MPI_Group_translate_ranks(grupo, 2, vecinos, grupo_nodo, vecinos_nodo);
+	MPI_Group_free(&grupo);
+	MPI_Group_free(&grupo_nodo);
+	sim->sinc_ant = sim->sinc_sig = NULL;
+	if ((vecinos_nodo[0] != MPI_UNDEFINED) && (vecinos_nodo[0] != MPI_PROC_NULL)) {
+		MPI_Win_shared_query(sim->ventana_halos, vecinos_nodo[0], &tam, &disp, &base_vecino);
+		sim->sinc_ant = (TSincronizacionHalos *) base_vecino;
+		datos_cluster->puntero_datosVolumenesComOtroClusterInf_1 = (float4 *) (base_vecino + tam_cab + 2*tam_fila);
+		datos_cluster->puntero_datosVolumenesComOtroClusterInf_2 = (float4 *) (base_vecino + tam_cab + 3*tam_fila);
+	}
+	if ((vecinos_nodo[1] != MPI_UNDEFINED) && (vecinos_nodo[1] != MPI_PROC_NULL)) {
+		MPI_Win_shared_query(sim->ventana_halos, vecinos_nodo[1], &tam, &disp, &base_vecino);
+		sim->sinc_sig = (TSincronizacionHalos *) base_vecino;
+		datos_cluster->puntero_datosVolumenesComOtroClusterSup_1 = (float4 *) (base_vecino + tam_cab);
+		datos_cluster->puntero_datosVolumenesComOtroClusterSup_2 = (float4 *) (base_vecino + tam_cab + tam_fila);
+	}
+
+	// Registramos en Cuda la ventana completa (es contigua) para que las copias con la GPU no
+	// pasen por un buffer intermedio. Si no se puede, las copias funcionan igual
+	MPI_Win_shared_query(sim->ventana_halos, 0, &tam, &disp, &base);
+	sim->base_nodo = base;
+	if (cudaHostRegister(base, num_procs_nodo*(tam_cab + 4*tam_fila), cudaHostRegisterPortable) != cudaSuccess) {
+		cudaGetLastError();
+		sim->base_nodo = NULL;
+	}
+
+	// Los contadores de todos los procesos del nodo deben estar a 0 antes del primer paso
+	MPI_Win_sync(sim->ventana_halos);
+	MPI_Barrier(sim->comm_nodo);
+}
+
+// Libera la ventana de memoria compartida y restaura los punteros a los volmenes de comunicacin
+// de datos_cluster. Es una llamada colectiva de MPI
+static void liberarHalosCompartidos(TSimulacion *sim)
+{
+	TDatoCluster *datos_cluster = sim->datos_cluster;
+
+	if (sim->base_nodo != NULL)
+		cudaHostUnregister(sim->base_nodo);
+	MPI_Win_unlock_all(sim->ventana_halos);
+	MPI_Win_free(&(sim->ventana_halos));
+	MPI_Comm_free(&(sim->comm_nodo));
+	datos_cluster->puntero_datosVolumenesComClusterSup_1 = sim->punteros_com[0];
+	datos_cluster->puntero_datosVolumenesComClusterSup_2 = sim->punteros_com[1];
+	datos_cluster->puntero_datosVolumenesComClusterInf_1 = sim->punteros_com[2];
+	datos_cluster->puntero_datosVolumenesComClusterInf_2 = sim->punteros_com[3];
+	datos_cluster->puntero_datosVolumenesComOtroClusterSup_1 = sim->punteros_com[4];
+	datos_cluster->puntero_datosVolumenesComOtroClusterSup_2 = sim->punteros_com[5];
+	datos_cluster->puntero_datosVolumenesComOtroClusterInf_1 = sim->punteros_com[6];
+	datos_cluster->puntero_datosVolumenesComOtroClusterInf_2 = sim->punteros_com[7];
+}
+#endif
+
+#ifdef HEBRA_COMUNICACION
+// Funcin de la hebra de comunicacin. Por cada paso que pide la hebra principal, recibe los
+// volmenes de comunicacin de los clusters adyacentes y les enva los del cluster, que la hebra
+// principal ya ha copiado a memoria CPU. Mientras espera una peticin no llama a MPI
+static void *hebraComunicacion(void *arg)
+{
+	TSimulacion *sim = (TSimulacion *) arg;
+	THebraComunicacion *hc = &(sim->hebra_com);
+	TDatoCluster *datos_cluster = sim->datos_cluster;
+	MPI_Datatype tipo_estado = sim->tipo_estado;
+	MPI_Request peticiones_rec[4], peticiones_env[4];
+	int num_volsCom = FILAS_HALO*datos_cluster->num_volx;
+	int hebra_ant = sim->param.id_hebra-1;
+	int hebra_sig = sim->param.id_hebra+1;
+	int num_rec, num_env;
+	long paso;
+
+	pthread_mutex_lock(&(hc->mutex));
+	while (1) {
+		while ((hc->pedido <= hc->enviado) && (! hc->terminar))
+			pthread_cond_wait(&(hc->cond), &(hc->mutex));
+		if (hc->terminar)
+			break;
+		paso = hc->pedido;
+		pthread_mutex_unlock(&(hc->mutex));
+
+		num_rec = num_env = 0;
+		if (hc->mensajes_ant) {
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterInf_1, num_volsCom, tipo_estado, hebra_ant, 22,
+				sim->param.comm, peticiones_rec + num_rec++);
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterInf_2, num_volsCom, tipo_estado, hebra_ant, 23,
+				sim->param.comm, peticiones_rec + num_rec++);
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterSup_1, num_volsCom, tipo_estado, hebra_ant, 22,
+				sim->param.comm, peticiones_env + num_env++);
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterSup_2, num_volsCom, tipo_estado, hebra_ant, 23,
+				sim->param.comm, peticiones_env + num_env++);
+		}
+		if (hc->mensajes_sig) {
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterSup_1, num_volsCom, tipo_estado, hebra_sig, 22,
+				sim->param.comm, peticiones_rec + num_rec++);
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterSup_2, num_volsCom, tipo_estado, hebra_sig, 23,
+				sim->param.comm, peticiones_rec + num_rec++);
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterInf_1, num_volsCom, tipo_estado, hebra_sig, 22,
+				sim->param.comm, peticiones_env + num_env++);
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterInf_2, num_volsCom, tipo_estado, hebra_sig, 23,
+				sim->param.comm, peticiones_env + num_env++);
+		}
+		MPI_Waitall(num_rec, peticiones_rec, MPI_STATUSES_IGNORE);
+		pthread_mutex_lock(&(hc->mutex));
+		hc->recibido = paso;
+		pthread_cond_broadcast(&(hc->cond));
+		pthread_mutex_unlock(&(hc->mutex));
+
+		MPI_Waitall(num_env, peticiones_env, MPI_STATUSES_IGNORE);
+		pthread_mutex_lock(&(hc->mutex));
+		hc->enviado = paso;
+		pthread_cond_broadcast(&(hc->cond));
+	}
+	pthread_mutex_unlock(&(hc->mutex));
+
+	return NULL;
+}
+
+// Pide a la hebra de comunicacin el intercambio de los volmenes de comunicacin del paso
+static void pedirIntercambioHalos(THebraComunicacion *hc, long paso)
+{
+	pthread_mutex_lock(&(hc->mutex));
+	hc->pedido = paso;
+	pthread_cond_broadcast(&(hc->cond));
+	pthread_mutex_unlock(&(hc->mutex));
+}
+
+// Espera a que *contador (hc->recibido o hc->enviado) sea mayor o igual que paso
+static void esperarHebraComunicacion(THebraComunicacion *hc, long *contador, long paso)
+{
+	pthread_mutex_lock(&(hc->mutex));
+	while (*contador < paso)
+		pthread_cond_wait(&(hc->cond), &(hc->mutex));
+	pthread_mutex_unlock(&(hc->mutex));
+}
+
+// Crea la hebra de comunicacin si MPI da el nivel de hebras NIVEL_HEBRAS_MPI. Si no, los
+// mensajes los enva la hebra principal
+static void inicializarHebraComunicacion(TSimulacion *sim)
+{
+	THebraComunicacion *hc = &(sim->hebra_com);
+	int nivel;
+
+	hc->activa = 0;
+	hc->mensajes_ant = (sim->param.id_hebra != 0);
+	hc->mensajes_sig = (sim->param.id_hebra != sim->param.num_procs-1);
+#ifdef HALOS_MEMORIA_COMPARTIDA
+	hc->mensajes_ant = hc->mensajes_ant && (sim->sinc_ant == NULL);
+	hc->mensajes_sig = hc->mensajes_sig && (sim->sinc_sig == NULL);
+#endif
+	hc->pedido = hc->recibido = hc->enviado = sim->iter;
+	hc->terminar = 0;
+
+	// Sin mensajes que intercambiar (un solo proceso o la malla anidada) no hace falta la hebra
+	if ((! hc->mensajes_ant) && (! hc->mensajes_sig))
+		return;
+	MPI_Query_thread(&nivel);
+	if (nivel < NIVEL_HEBRAS_MPI) {
+		if (sim->param.id_hebra == 0)
+			fprintf(stderr, "Aviso: MPI no permite el nivel de hebras pedido. No se usa la hebra de comunicacion\n");
+		return;
+	}
+	pthread_mutex_init(&(hc->mutex), NULL);
+	pthread_cond_init(&(hc->cond), NULL);
+	if (pthread_create(&(hc->hebra), NULL, hebraComunicacion, sim) == 0)
+		hc->activa = 1;
+	else {
+		pthread_cond_destroy(&(hc->cond));
+		pthread_mutex_destroy(&(hc->mutex));
+	}
+}
+
+// Termina la hebra de comunicacin
+static void liberarHebraComunicacion(TSimulacion *sim)
+{
+	THebraComunicacion *hc = &(sim->hebra_com);
+
+	if (hc->activa) {
+		pthread_mutex_lock(&(hc->mutex));
+		hc->terminar = 1;
+		pthread_cond_broadcast(&(hc->cond));
+		pthread_mutex_unlock(&(hc->mutex));
+		pthread_join(hc->hebra, NULL);
+		pthread_cond_destroy(&(hc->cond));
+		pthread_mutex_destroy(&(hc->mutex));
+		hc->activa = 0;
+	}
+}
+#endif
+
+// Inicializa la simulacin sim del cluster datos_cluster con los parmetros param: reserva la
+// memoria GPU, copia el estado inicial y calcula el delta T inicial. Tras llamarla, el resto de
+// campos de sim se pueden leer, y se pueden asignar sim->funcion_paso y sim->datos_usuario.
+// Es una llamada colectiva de MPI. Devuelve 0 si todo ha ido bien y 1 si no hay memoria GPU
+// suficiente en algn proceso (en ese caso no hay que llamar a liberarSimulacion)
+extern "C" int inicializarSimulacion(TSimulacion *sim, TDatoCluster *datos_cluster, TParametrosSW *param)
+{
+	TSW_Cuda *datos_SW_Cuda = &(sim->datos_SW_Cuda);
+	MPI_Datatype tipo_aux;
+	TTiempo dT_min;
+	int err, err_total;
+	int num_volx = datos_cluster->num_volx;
+	int num_voly, num_volumenes;
+	int id_hebra = param->id_hebra;
+	int ultima_hebra = (id_hebra == param->num_procs-1) ? 1 : 0;
+
+	sim->datos_cluster = datos_cluster;
+	sim->param = *param;
+	sim->tiempo_act = 0.0;
+	sim->iter = 0;
+	sim->paso_local = 0;
+	sim->pasos_bloques = 0;
+	sim->funcion_paso = NULL;
+	sim->datos_usuario = NULL;
+
+	// Tipo tipo_estado: componentes x, y, z de un TEstadoGPU (en modo half se envan sin
+	// convertir). La componente w no se enva porque H no cambia y est en texBatimetria
+#ifdef ALMACENAMIENTO_HALF
+	MPI_Type_contiguous(3, MPI_UNSIGNED_SHORT, &tipo_aux);
+#else
+	MPI_Type_contiguous(3, MPI_FLOAT, &tipo_aux);
+#endif
+	MPI_Type_create_resized(tipo_aux, 0, sizeof(TEstadoGPU), &(sim->tipo_estado));
+	MPI_Type_commit(&(sim->tipo_estado));
+	MPI_Type_free(&tipo_aux);
+
+	// Inicializamos los datos en cada GPU
+	err = inicializarDatosCuda(datos_cluster, datos_SW_Cuda, id_hebra, ultima_hebra);
+	if ((err == 0) && (param->esponja > 0)) {
+		// Estado de referencia de la capa de absorcin (se guarda ms abajo, con las filas fantasma)
+		if (cudaMalloc((void **) &(datos_SW_Cuda->d_estadoReferencia), num_volx*datos_SW_Cuda->num_voly_gpu*sizeof(float2)) != cudaSuccess) {
+			datos_SW_Cuda->d_estadoReferencia = NULL;
+			liberarSWCuda(datos_SW_Cuda);
+			err = 1;
+		}
+	}
+
+	// Comprobamos si se ha producido un error en algn proceso
+	MPI_Allreduce (&err, &err_total, 1, MPI_INT, MPI_MAX, sim->param.comm);
+	if (err_total != 0) {
+		if (err == 0)
+			liberarSWCuda(datos_SW_Cuda);
+		MPI_Type_free(&(sim->tipo_estado));
+		return 1;
+	}
+	if (id_hebra == 0)
+		mostrarMemoriaGPU(num_volx, param->num_voly_total, param->num_procs);
+	// Filas del cluster en GPU, incluyendo las fantasma (ver PASOS_HALO)
+	num_voly = datos_SW_Cuda->num_voly_gpu;
+	num_volumenes = num_volx*num_voly;
+#if PASOS_HALO > 1
+	inicializarFilasFantasma(sim);
+#endif
+#ifdef HALOS_MEMORIA_COMPARTIDA
+	inicializarHalosCompartidos(sim);
+#endif
+#ifdef HEBRA_COMUNICACION
+	inicializarHebraComunicacion(sim);
+#endif
+	if (param->esponja > 0) {
+		inicializarEsponjaGPU<<<datos_SW_Cuda->blockGridEst, datos_SW_Cuda->threadBlockEst>>>(datos_SW_Cuda->d_estadoReferencia,
+			num_volx, num_voly);
+	}
+
+	// Fijamos los tamaos relativos de la cach L1 y la memoria compartida
+	cudaFuncSetCacheConfig(procesarAristasGPU, cudaFuncCachePreferL1);
+
+	// CLCULO DEL DELTA_T INICIAL
+	// Procesamos las aristas horizontales
+	procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda->blockGridHor1, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly, num_volumenes,
+		param->borde_sup, param->borde_inf, param->ancho_vol, param->r, datos_SW_Cuda->d_acumulador1, param->gravedad,
+		param->epsilon_h, 3, id_hebra, ultima_hebra);
+	procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda->blockGridHor2, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly, num_volumenes,
+		param->borde_sup, param->borde_inf, param->ancho_vol, param->r, datos_SW_Cuda->d_acumulador1, param->gravedad,
+		param->epsilon_h, 4, id_hebra, ultima_hebra);
+
+	// Procesamos las aristas verticales
+	procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda->blockGridVer1, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly, num_volumenes,
+		param->borde_izq, param->borde_der, param->alto_vol, param->r, datos_SW_Cuda->d_acumulador1, param->gravedad,
+		param->epsilon_h, 1, id_hebra, ultima_hebra);
+	procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda->blockGridVer2, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly, num_volumenes,
+		param->borde_izq, param->borde_der, param->alto_vol, param->r, datos_SW_Cuda->d_acumulador1, param->gravedad,
+		param->epsilon_h, 2, id_hebra, ultima_hebra);
+
+	// Obtenemos el delta T local de cada volumen
+	obtenerDeltaTVolumenesGPU<<<datos_SW_Cuda->blockGridDeltaT, datos_SW_Cuda->threadBlockDeltaT>>>(datos_SW_Cuda->d_acumulador1,
+		datos_SW_Cuda->d_deltaTVolumenes, num_volumenes, param->area, param->CFL);
+
+	// Obtenemos el mnimo delta T del cluster aplicando un algoritmo de reduccin (slo en sus
+	// volmenes, sin las filas fantasma)
+	dT_min = obtenerMinimoReduccion<float>(datos_SW_Cuda->d_deltaTVolumenes + (datos_SW_Cuda->fila_ini_gpu-1)*num_volx,
+		num_volx*datos_cluster->num_voly, datos_SW_Cuda->d_minimosBloques);
+
+	// Obtenemos el mnimo delta T de todos los clusters por reduccin
+	MPI_Allreduce (&dT_min, &(sim->delta_T), 1, MPI_TIEMPO, MPI_MIN, sim->param.comm);
+//sim->delta_T=5e-4/param->T;
+	if (id_hebra == 0)
+		fprintf(stdout, "deltaT inicial = %e seg\n", sim->delta_T*param->T);
+
+	// Reinicializamos el acumulador1
+	cudaMemset(datos_SW_Cuda->d_acumulador1, 0, num_volumenes*sizeof(float4));
+
+	return 0;
+}
+
+// Avanza num_pasos pasos de tiempo la simulacin. Despus de cada paso llama a sim->funcion_paso,
+// si no es NULL. No reserva memoria. Es una llamada colectiva de MPI
+extern "C" void avanzarPasosSimulacion(TSimulacion *sim, int num_pasos)
+{
+	TDatoCluster *datos_cluster = sim->datos_cluster;
+	TSW_Cuda *datos_SW_Cuda = &(sim->datos_SW_Cuda);
+	TParametrosSW *p = &(sim->param);
+	MPI_Status estados[4];
+	TTiempo tiempo_act, delta_T, dT_min;
+	// Nmero de recepciones y envos pendientes en sim->peticiones_rec y sim->peticiones_env
+	int num_rec, num_env;
+	// Indican si se intercambian mensajes con el cluster superior e inferior (con
+	// HALOS_MEMORIA_COMPARTIDA, no si estn en el mismo nodo)
+	int mensajes_ant, mensajes_sig;
+	// Indica si en el paso se intercambian los volmenes de comunicacin (ver PASOS_HALO), y
+	// nmero del intercambio (desde 1)
+	int intercambiar;
+	long num_intercambio;
+	// Indica si al final del paso se recalcula el delta T (ver PASO_TIEMPO_LOCAL)
+	int recalcular_dT;
+	int paso;
+#ifdef PASO_TIEMPO_LOCAL
+	int *d_clases, *d_clases_sig;
+	int num_bloques = datos_SW_Cuda->blockGridEst.x*datos_SW_Cuda->blockGridEst.y;
+	int i;
+#endif
+
+	int num_volx = datos_cluster->num_volx;
+	// Filas del cluster en GPU, incluyendo las fantasma (ver PASOS_HALO)
+	int num_voly = datos_SW_Cuda->num_voly_gpu;
+	int num_volumenes = num_volx*num_voly;
+	// Volmenes de comunicacin que se intercambian con cada cluster adyacente (FILAS_HALO filas)
+	int num_volsCom = FILAS_HALO*num_volx;
+	int tam_datosVolCom = num_volsCom * sizeof(TEstadoGPU);
+	// Filas de la textura donde empiezan las primeras y las ltimas FILAS_HALO filas del cluster,
+	// y los volmenes de comunicacin del cluster inferior
+	int fila_com_sup = datos_SW_Cuda->fila_ini_gpu;
+	int fila_com_inf = datos_SW_Cuda->fila_ini_gpu + datos_cluster->num_voly - FILAS_HALO;
+	int fila_otro_inf = datos_SW_Cuda->fila_ini_gpu + datos_cluster->num_voly;
+	int id_hebra = p->id_hebra;
+	int hebra_ant = id_hebra-1;
+	int hebra_sig = id_hebra+1;
+	int ultima_hebra = (id_hebra == p->num_procs-1) ? 1 : 0;
+	MPI_Datatype tipo_estado = sim->tipo_estado;
+	float borde_sup = p->borde_sup, borde_inf = p->borde_inf;
+	float borde_izq = p->borde_izq, borde_der = p->borde_der;
+	float ancho_vol = p->ancho_vol, alto_vol = p->alto_vol, area = p->area;
+	float CFL = p->CFL, r = p->r, peso = p->peso, beta = p->beta;
+	float angulo1 = p->angulo1, angulo2 = p->angulo2, angulo3 = p->angulo3, angulo4 = p->angulo4;
+	float mfc = p->mfc, mf0 = p->mf0, mfs = p->mfs, vmax1 = p->vmax1, vmax2 = p->vmax2;
+	float gravedad = p->gravedad, epsilon_h = p->epsilon_h, L = p->L, H = p->H;
+
+	mensajes_ant = (id_hebra != 0);
+	mensajes_sig = (! ultima_hebra);
+#ifdef HALOS_MEMORIA_COMPARTIDA
+	mensajes_ant = mensajes_ant && (sim->sinc_ant == NULL);
+	mensajes_sig = mensajes_sig && (sim->sinc_sig == NULL);
+#endif
+#ifdef HEBRA_COMUNICACION
+	// Con la hebra de comunicacin, los mensajes los enva y recibe ella
+	if (sim->hebra_com.activa)
+		mensajes_ant = mensajes_sig = 0;
+#endif
+
+	for (paso=0; paso<num_pasos; paso++) {
+		tiempo_act = sim->tiempo_act;
+		delta_T = sim->delta_T;
+		num_rec = num_env = 0;
+		intercambiar = ((sim->iter % PASOS_HALO) == 0);
+		num_intercambio = sim->iter/PASOS_HALO + 1;
+
+#ifdef PASO_TIEMPO_LOCAL
+		if (sim->paso_local == 0) {
+			// Al principio de cada macropaso obtenemos la clase de cada bloque con el delta T local
+			// de sus volmenes y la suavizamos en NIVELES_PASO_LOCAL-1 pasadas que alternan entre los
+			// dos arrays de d_clasesBloques. Empezamos en el array con el que el resultado final
+			// queda en el primero, que es el que leen los kernels
+			d_clases = datos_SW_Cuda->d_clasesBloques + ((NIVELES_PASO_LOCAL-1)%2)*num_bloques;
+			clasificarBloquesGPU<<<datos_SW_Cuda->blockGridEst, datos_SW_Cuda->threadBlockEst>>>(datos_SW_Cuda->d_deltaTVolumenes,
+				d_clases, num_volx, num_voly, delta_T, (id_hebra != 0), (! ultima_hebra));
+			for (i=0; i<NIVELES_PASO_LOCAL-1; i++) {
+				d_clases_sig = (d_clases == datos_SW_Cuda->d_clasesBloques) ? d_clases + num_bloques : datos_SW_Cuda->d_clasesBloques;
+				suavizarClasesBloquesGPU<<<iDivUp(num_bloques, NUM_HEBRAS_VOL), NUM_HEBRAS_VOL>>>(d_clases, d_clases_sig,
+					datos_SW_Cuda->blockGridEst.x, datos_SW_Cuda->blockGridEst.y);
+				d_clases = d_clases_sig;
+			}
+		}
+#endif
+
+		// SOLAPAMIENTO MPI-cudaMemcpy-computacin
+		// Recibimos de los clusters adyacentes sus volmenes de comunicacin adyacentes a nuestro cluster.
+		if (intercambiar && mensajes_ant) {
+			// Es una hebra distinta de la primera.
+			// Recibimos los volmenes de comunicacin inferiores del cluster superior
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterInf_1, num_volsCom, tipo_estado, hebra_ant, 22,
+				sim->param.comm, sim->peticiones_rec + num_rec++);
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterInf_2, num_volsCom, tipo_estado, hebra_ant, 23,
+				sim->param.comm, sim->peticiones_rec + num_rec++);
+		}
+		if (intercambiar && mensajes_sig) {
+			// Es una hebra distinta de la ltima.
+			// Recibimos los volmenes de comunicacin superiores del cluster inferior
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterSup_1, num_volsCom, tipo_estado, hebra_sig, 22,
+				sim->param.comm, sim->peticiones_rec + num_rec++);
+			MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterSup_2, num_volsCom, tipo_estado, hebra_sig, 23,
+				sim->param.comm, sim->peticiones_rec + num_rec++);
+		}
+#ifdef HALOS_MEMORIA_COMPARTIDA
+		// Esperamos a que los clusters del nodo hayan copiado los volmenes de comunicacin
+		// del paso anterior, ya que se van a sobrescribir
+		if (intercambiar && (sim->sinc_ant != NULL))
+			esperarContadorHalos(&(sim->sinc->leido_ant), num_intercambio-1, sim->ventana_halos);
+		if (intercambiar && (sim->sinc_sig != NULL))
+			esperarContadorHalos(&(sim->sinc->leido_sig), num_intercambio-1, sim->ventana_halos);
+#endif
+		if (intercambiar) {
+			// Copiamos los volmenes de comunicacin del cluster a memoria CPU
+			// Volmenes de comunicacin superiores
+			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterSup_1, datos_SW_Cuda->d_datosVolumenes_1, 0, fila_com_sup,
+				tam_datosVolCom, cudaMemcpyDeviceToHost);
+			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterSup_2, datos_SW_Cuda->d_datosVolumenes_2, 0, fila_com_sup,
+				tam_datosVolCom, cudaMemcpyDeviceToHost);
+			// Volmenes de comunicacin inferiores
+			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterInf_1, datos_SW_Cuda->d_datosVolumenes_1, 0, fila_com_inf,
+				tam_datosVolCom, cudaMemcpyDeviceToHost);
+			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterInf_2, datos_SW_Cuda->d_datosVolumenes_2, 0, fila_com_inf,
+				tam_datosVolCom, cudaMemcpyDeviceToHost);
+
+#ifdef HALOS_MEMORIA_COMPARTIDA
+			// Indicamos a los clusters del nodo que los volmenes de comunicacin de este paso estn
+			// en el segmento
+			MPI_Win_sync(sim->ventana_halos);
+			sim->sinc->publicado = num_intercambio;
+			MPI_Win_sync(sim->ventana_halos);
+#endif
+		}
+
+		// Enviamos a los procesos asociados a los clusters adyacentes a nuestro cluster
+		// los volmenes de comunicacin correspondientes de nuestro cluster.
+		if (intercambiar && mensajes_sig) {
+			// Es una hebra distinta de la ltima.
+			// Enviamos los volmenes de comunicacin inferiores al cluster inferior
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterInf_1, num_volsCom, tipo_estado, hebra_sig, 22,
+				sim->param.comm, sim->peticiones_env + num_env++);
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterInf_2, num_volsCom, tipo_estado, hebra_sig, 23,
+				sim->param.comm, sim->peticiones_env + num_env++);
+		}
+		if (intercambiar && mensajes_ant) {
+			// Es una hebra distinta de la primera.
+			// Enviamos los volmenes de comunicacin superiores al cluster superior
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterSup_1, num_volsCom, tipo_estado, hebra_ant, 22,
+				sim->param.comm, sim->peticiones_env + num_env++);
+			MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterSup_2, num_volsCom, tipo_estado, hebra_ant, 23,
+				sim->param.comm, sim->peticiones_env + num_env++);
+		}
+#ifdef HEBRA_COMUNICACION
+		if (intercambiar && sim->hebra_com.activa)
+			pedirIntercambioHalos(&(sim->hebra_com), num_intercambio);
+#endif
+
+		// Procesamos las aristas de Hor1 que no son de comunicacin
+		procesarAristasNoComGPU<<<datos_SW_Cuda->blockGridHor1, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly,
+			num_volumenes, borde_sup, borde_inf, ancho_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
+			datos_SW_Cuda->d_acumulador1, datos_SW_Cuda->d_acumulador2, datos_SW_Cuda->d_difHAristasHor,
+			datos_SW_Cuda->d_bloquesActivos, datos_SW_Cuda->d_clasesBloques, sim->paso_local, gravedad, epsilon_h,
+			L, H, 3, id_hebra, ultima_hebra);
+
+		// Esperamos a que hayamos recibido los volmenes de comunicacin de todos los clusters adyacentes
+		MPI_Waitall(num_rec, sim->peticiones_rec, estados);
+#ifdef HEBRA_COMUNICACION
+		if (intercambiar && sim->hebra_com.activa)
+			esperarHebraComunicacion(&(sim->hebra_com), &(sim->hebra_com.recibido), num_intercambio);
+#endif
+#ifdef HALOS_MEMORIA_COMPARTIDA
+		if (intercambiar && (sim->sinc_ant != NULL))
+			esperarContadorHalos(&(sim->sinc_ant->publicado), num_intercambio, sim->ventana_halos);
+		if (intercambiar && (sim->sinc_sig != NULL))
+			esperarContadorHalos(&(sim->sinc_sig->publicado), num_intercambio, sim->ventana_halos);
+#endif
+
+		if (intercambiar) {
+			// Copiamos los volmenes de comunicacin recibidos a memoria GPU
+			// Volmenes de comunicacin inferiores del cluster superior
+			cudaMemcpyToArray(datos_SW_Cuda->d_datosVolumenes_1, 0, 0, datos_cluster->puntero_datosVolumenesComOtroClusterInf_1,
+				tam_datosVolCom, cudaMemcpyHostToDevice);
+			cudaMemcpyToArray(datos_SW_Cuda->d_datosVolumenes_2, 0, 0, datos_cluster->puntero_datosVolumenesComOtroClusterInf_2,
+				tam_datosVolCom, cudaMemcpyHostToDevice);
+			// Volmenes de comunicacin superiores del cluster inferior
+			cudaMemcpyToArray(datos_SW_Cuda->d_datosVolumenes_1, 0, fila_otro_inf, datos_cluster->puntero_datosVolumenesComOtroClusterSup_1,
+				tam_datosVolCom, cudaMemcpyHostToDevice);
+			cudaMemcpyToArray(datos_SW_Cuda->d_datosVolumenes_2, 0, fila_otro_inf, datos_cluster->puntero_datosVolumenesComOtroClusterSup_2,
+				tam_datosVolCom, cudaMemcpyHostToDevice);
+#ifdef HALOS_MEMORIA_COMPARTIDA
+			// Indicamos a los clusters del nodo que ya hemos copiado sus volmenes de comunicacin
+			if (sim->sinc_ant != NULL)
+				sim->sinc_ant->leido_sig = num_intercambio;
+			if (sim->sinc_sig != NULL)
+				sim->sinc_sig->leido_ant = num_intercambio;
+			MPI_Win_sync(sim->ventana_halos);
+#endif
+		}
+
+		// Procesamos las aristas horizontales (en el caso de Hor1 slo las de comunicacin)
+		procesarAristasComGPU<<<datos_SW_Cuda->blockGridHorCom, datos_SW_Cuda->threadBlockAriCom>>>(num_volx, num_voly,
+			num_volumenes, borde_sup, borde_inf, ancho_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
+			datos_SW_Cuda->d_acumulador1, datos_SW_Cuda->d_acumulador2, datos_SW_Cuda->d_difHAristasHor,
+			gravedad, epsilon_h, L, H, 3, id_hebra, ultima_hebra);
+		procesarAristasGPU<<<datos_SW_Cuda->blockGridHor2, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly, num_volumenes,
+			borde_sup, borde_inf, ancho_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
+			datos_SW_Cuda->d_acumulador1, datos_SW_Cuda->d_acumulador2, datos_SW_Cuda->d_difHAristasHor,
+			datos_SW_Cuda->d_bloquesActivos, datos_SW_Cuda->d_clasesBloques, sim->paso_local, gravedad, epsilon_h,
+			L, H, 4, id_hebra, ultima_hebra);
+
+		// Procesamos las aristas verticales
+		procesarAristasGPU<<<datos_SW_Cuda->blockGridVer1, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly, num_volumenes,
+			borde_izq, borde_der, alto_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
+			datos_SW_Cuda->d_acumulador1, datos_SW_Cuda->d_acumulador2, datos_SW_Cuda->d_difHAristasVer,
+			datos_SW_Cuda->d_bloquesActivos, datos_SW_Cuda->d_clasesBloques, sim->paso_local, gravedad, epsilon_h,
+			L, H, 1, id_hebra, ultima_hebra);
+		procesarAristasGPU<<<datos_SW_Cuda->blockGridVer2, datos_SW_Cuda->threadBlockAri>>>(num_volx, num_voly, num_volumenes,
+			borde_izq, borde_der, alto_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
+			datos_SW_Cuda->d_acumulador1, datos_SW_Cuda->d_acumulador2, datos_SW_Cuda->d_difHAristasVer,
+			datos_SW_Cuda->d_bloquesActivos, datos_SW_Cuda->d_clasesBloques, sim->paso_local, gravedad, epsilon_h,
+			L, H, 2, id_hebra, ultima_hebra);
+
+		// Actualizamos texDatosVolumenes con el nuevo estado de cada volumen y obtenemos
+		// el delta T local de cada volumen. En la misma pasada se inicializan los acumuladores
+		// para la siguiente iteracin y se actualizan los valores mximos de eta1 y sus
+		// tiempos asociados y los bloques activos. Con PASO_TIEMPO_LOCAL slo se actualizan los
+		// bloques que terminan su paso en este subpaso
+		obtenerEstadoYDeltaTVolumenesGPU<<<datos_SW_Cuda->blockGridEst, datos_SW_Cuda->threadBlockEst>>>(datos_SW_Cuda->d_acumulador1,
+			datos_SW_Cuda->d_acumulador2, datos_SW_Cuda->d_deltaTVolumenes, datos_SW_Cuda->d_eta1_maxima,
+			datos_SW_Cuda->d_errorMasa, datos_SW_Cuda->d_bloquesActivos, datos_SW_Cuda->d_numBloquesActivos,
+			datos_SW_Cuda->d_clasesBloques, sim->paso_local, num_volx, num_voly, area, CFL, r, delta_T, tiempo_act+delta_T,
+			angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, gravedad, epsilon_h, L, H,
+			datos_SW_Cuda->d_estadoReferencia, p->esponja, p->esponja_coef, p->fila_ini_global-(fila_com_sup-1),
+			p->num_voly_total, borde_sup, borde_inf, borde_izq, borde_der);
+
+		// Actualizamos el tiempo actual
+		sim->tiempo_act = tiempo_act + delta_T;
+		sim->iter++;
+#ifdef OMITIR_BLOQUES_SECOS
+		sim->pasos_bloques++;
+#endif
+
+		recalcular_dT = 1;
+#ifdef PASO_TIEMPO_LOCAL
+		// El delta T slo se recalcula al final del macropaso, cuando se han actualizado todos los bloques
+		sim->paso_local = (sim->paso_local + 1) % SUBPASOS_PASO_LOCAL;
+		recalcular_dT = (sim->paso_local == 0);
+#endif
+
+#ifdef HEBRA_COMUNICACION
+		// La hebra de comunicacin tiene que haber terminado antes de que la hebra principal vuelva
+		// a llamar a MPI
+		if (sim->hebra_com.activa)
+			esperarHebraComunicacion(&(sim->hebra_com), &(sim->hebra_com.enviado), num_intercambio);
+#endif
+		if (recalcular_dT) {
+			// Obtenemos el mnimo delta T aplicando un algoritmo de reduccin (slo en los volmenes
+			// del cluster, sin las filas fantasma)
+			dT_min = obtenerMinimoReduccion<float>(datos_SW_Cuda->d_deltaTVolumenes + (fila_com_sup-1)*num_volx,
+				num_volx*datos_cluster->num_voly, datos_SW_Cuda->d_minimosBloques);
+
+			// Obtenemos el mnimo delta T de todos los clusters por reduccin
+			MPI_Allreduce (&dT_min, &(sim->delta_T), 1, MPI_TIEMPO, MPI_MIN, sim->param.comm);
+		}
+//sim->delta_T=5e-4/p->T;
+
+		// Esperamos a que se hayan enviado los volmenes de comunicacin, ya que en el siguiente
+		// paso se sobrescriben
+		MPI_Waitall(num_env, sim->peticiones_env, estados);
+
+		if (sim->funcion_paso != NULL)
+			sim->funcion_paso(sim, sim->datos_usuario);
+	}
+}
+
+// Avanza la simulacin hasta que el tiempo actual sea mayor o igual que tiempo (adimensionalizado).
+// Los pasos no se recortan para llegar exactamente a tiempo. Con PASO_TIEMPO_LOCAL se termina el
+// macropaso en curso, para que todos los volmenes estn en el mismo tiempo. Es una llamada
+// colectiva de MPI
+extern "C" void avanzarSimulacionHasta(TSimulacion *sim, TTiempo tiempo)
+{
+	while ((sim->tiempo_act < tiempo) || (sim->paso_local != 0))
+		avanzarPasosSimulacion(sim, 1);
+}
+
+// Copia el estado actual y la eta1 mxima de la GPU a datos_cluster->datosVolumenes_1,
+// datos_cluster->datosVolumenes_2 (filas 1 a num_voly) y datos_cluster->eta1_maxima, que se pueden
+// leer directamente despus (los volmenes del cluster empiezan en la posicin 0, sin las filas
+// de comunicacin). En modo half, el estado se convierte a float
+extern "C" void copiarEstadoSimulacionACPU(TSimulacion *sim)
+{
+	TDatoCluster *datos_cluster = sim->datos_cluster;
+	int num_volx = datos_cluster->num_volx;
+	int num_voly = datos_cluster->num_voly;
+
+	int fila_ini_gpu = sim->datos_SW_Cuda.fila_ini_gpu;
+
+	copiarEstadoGPUACPU(&(sim->datos_SW_Cuda), sim->datos_SW_Cuda.d_datosVolumenes_1, datos_cluster->datosVolumenes_1, fila_ini_gpu, num_voly, num_volx);
+	copiarEstadoGPUACPU(&(sim->datos_SW_Cuda), sim->datos_SW_Cuda.d_datosVolumenes_2, datos_cluster->datosVolumenes_2, fila_ini_gpu, num_voly, num_volx);
+	copiarEta1MaximaACPU(&(sim->datos_SW_Cuda), datos_cluster->eta1_maxima, num_volx, num_voly);
+}
+
+// Libera la memoria GPU y el tipo MPI de la simulacin. La memoria de CPU es de datos_cluster
+extern "C" void liberarSimulacion(TSimulacion *sim)
+{
+#ifdef HEBRA_COMUNICACION
+	liberarHebraComunicacion(sim);
+#endif
+#ifdef HALOS_MEMORIA_COMPARTIDA
+	liberarHalosCompartidos(sim);
+#endif
+	liberarSWCuda(&(sim->datos_SW_Cuda));
+	MPI_Type_free(&(sim->tipo_estado));
+}
+
+/************************************/
+/* Programa (simulacin con guardado) */
+/************************************/
+
+// Muestra el paso dado (se asigna a sim->funcion_paso)
+void mostrarPaso(TSimulacion *sim, void *datos_usuario)
+{
+	if (sim->param.id_hebra == 0) {
+		fprintf(stdout, "Iteracion %3d, deltaT = %e seg, ", sim->iter, sim->delta_T*sim->param.T);
+		fprintf(stdout, "Tiempo = %g seg\n", sim->tiempo_act*sim->param.T);
+	}
+}
+
+// Crea el fichero <prefijo>_diagnostico.txt de los diagnsticos del delta T y escribe su cabecera.
+// Devuelve NULL si no se ha podido crear
+FILE *abrirDiagnosticoDeltaT(char *prefijo)
+{
+	char nombre[512];
+	FILE *fp;
+
+	sprintf(nombre, "%s_diagnostico.txt", prefijo);
+	fp = fopen(nombre, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Aviso: No se ha podido crear el fichero '%s'\n", nombre);
+		return NULL;
+	}
+	fprintf(fp, "# Columnas: tiempo (s), delta T (s), y proceso, i, j, x, y, h1 (m), h2 (m), |u1| (m/s) y autovalor\n");
+	fprintf(fp, "# (m/s) del volumen que limita el delta T. Despues, numero de volumenes con delta T local en\n");
+	fprintf(fp, "# [2^k, 2^(k+1)) veces el delta T, para k = 0..%d (el ultimo sin limite superior), y numero de\n",
+		NUM_INTERVALOS_HISTOGRAMA_DT-1);
+	fprintf(fp, "# volumenes sin flujo\n");
+	fflush(fp);
+
+	return fp;
+}
+
+// Obtiene el volumen que limita el delta T global (su proceso, sus coordenadas (i,j) en la malla, su
+// posicin, h1, h2, |u1| y el autovalor con el que las cuatro aristas del volumen daran su delta T
+// local) y el histograma de los delta T locales de todos los volmenes. El proceso 0 escribe una
+// lnea en fp, si no es NULL (no muestra nada, porque se puede llamar en cada paso). Se ejecuta
+// entre dos pasos, con el delta T local de cada volumen en d_deltaTVolumenes. Es una llamada
+// colectiva de MPI
+void diagnosticarDeltaT(TSimulacion *sim, FILE *fp, int fila_ini, float xmin, float ymin)
+{
+	TDatoCluster *datos_cluster = sim->datos_cluster;
+	TSW_Cuda *datos_SW_Cuda = &(sim->datos_SW_Cuda);
+	TParametrosSW *p = &(sim->param);
+	int num_volx = datos_cluster->num_volx;
+	int num_volumenes = num_volx*datos_cluster->num_voly;
+	// Delta T mnimo y proceso que lo tiene (para MPI_MINLOC)
+	struct { float valor; int proceso; } min_local, min_global;
+	// i, j, h1, h2, |u1| y autovalor del volumen que limita el delta T
+	double datos_vol[6];
+	int histograma[NUM_INTERVALOS_HISTOGRAMA_DT+1];
+	int histograma_total[NUM_INTERVALOS_HISTOGRAMA_DT+1];
+	float4 datos1, datos2;
+	int pos, i, j, k;
+
+	// Delta T local de los volmenes del cluster, sin las filas fantasma (ver PASOS_HALO)
+	float *d_deltaT = datos_SW_Cuda->d_deltaTVolumenes + (datos_SW_Cuda->fila_ini_gpu-1)*num_volx;
+
+	min_local.valor = obtenerMinimoPosReduccion(d_deltaT, num_volumenes,
+		datos_SW_Cuda->d_minimosBloques, datos_SW_Cuda->d_posMinimosBloques, &pos);
+	min_local.proceso = p->id_hebra;
+	MPI_Allreduce (&min_local, &min_global, 1, MPI_FLOAT_INT, MPI_MINLOC, p->comm);
+
+	// El proceso que tiene el volumen lee su fila de la GPU y enva sus datos al proceso 0
+	if (p->id_hebra == min_global.proceso) {
+		i = pos%num_volx;
+		j = pos/num_volx;
+		copiarEstadoGPUACPU(datos_SW_Cuda, datos_SW_Cuda->d_datosVolumenes_1, datos_cluster->datosVolumenes_1 + j*num_volx,
+			j + datos_SW_Cuda->fila_ini_gpu, 1, num_volx);
+		copiarEstadoGPUACPU(datos_SW_Cuda, datos_SW_Cuda->d_datosVolumenes_2, datos_cluster->datosVolumenes_2 + j*num_volx,
+			j + datos_SW_Cuda->fila_ini_gpu, 1, num_volx);
+		datos1 = datos_cluster->datosVolumenes_1[pos];
+		datos2 = datos_cluster->datosVolumenes_2[pos];
+		datos_vol[0] = i;
+		datos_vol[1] = fila_ini + j;
+		datos_vol[2] = datos1.x*p->H;
+		datos_vol[3] = datos2.x*p->H;
+		datos_vol[4] = (datos1.x > p->epsilon_h) ? sqrt(datos1.y*datos1.y + datos1.z*datos1.z)/datos1.x*p->Q/p->H : 0.0;
+		datos_vol[5] = p->CFL*p->area*p->peso/(min_global.valor*(p->ancho_vol + p->alto_vol))*p->L/p->T;
+		if (p->id_hebra != 0)
+			MPI_Send(datos_vol, 6, MPI_DOUBLE, 0, 30, p->comm);
+	}
+	if ((p->id_hebra == 0) && (min_global.proceso != 0))
+		MPI_Recv(datos_vol, 6, MPI_DOUBLE, min_global.proceso, 30, p->comm, MPI_STATUS_IGNORE);
+
+	// Histograma de los delta T locales respecto al delta T global
+	cudaMemset(datos_SW_Cuda->d_histogramaDeltaT, 0, (NUM_INTERVALOS_HISTOGRAMA_DT+1)*sizeof(int));
+	histogramaDeltaTGPU<<<min(MAX_BLOQUES_REDUCCION, iDivUp(num_volumenes, NUM_HEBRAS_VOL)), NUM_HEBRAS_VOL>>>(d_deltaT,
+		num_volumenes, min_global.valor, datos_SW_Cuda->d_histogramaDeltaT);
+	cudaMemcpy(histograma, datos_SW_Cuda->d_histogramaDeltaT, (NUM_INTERVALOS_HISTOGRAMA_DT+1)*sizeof(int), cudaMemcpyDeviceToHost);
+	MPI_Reduce (histograma, histograma_total, NUM_INTERVALOS_HISTOGRAMA_DT+1, MPI_INT, MPI_SUM, 0, p->comm);
+
+	if ((p->id_hebra == 0) && (fp != NULL)) {
+		fprintf(fp, "%.6f %e %d %d %d %.6f %.6f %e %e %e %e", sim->tiempo_act*p->T, min_global.valor*p->T,
+			min_global.proceso, (int) datos_vol[0], (int) datos_vol[1], (xmin + (datos_vol[0] + 0.5)*p->ancho_vol)*p->L,
+			(ymin + (datos_vol[1] + 0.5)*p->alto_vol)*p->L, datos_vol[2], datos_vol[3], datos_vol[4], datos_vol[5]);
+		for (k=0; k<=NUM_INTERVALOS_HISTOGRAMA_DT; k++)
+			fprintf(fp, " %d", histograma_total[k]);
+		fprintf(fp, "\n");
+		fflush(fp);
+	}
+}
+
+// Comprueba si el flujo se ha detenido con los umbrales de parada de opciones: obtiene la energa
+// cintica y la velocidad mxima de las dos capas en todos los procesos y las muestra. en_movimiento
+// indica si el flujo ha superado alguna vez los umbrales (se actualiza aqu), para no terminar si
+// empieza en reposo. Devuelve 1 y pone en motivo la causa si hay que terminar, y 0 si no.
+// Es una llamada colectiva de MPI
+int comprobarParada(TSimulacion *sim, TOpciones *opciones, int *en_movimiento, char *motivo)
+{
+	TParametrosSW *p = &(sim->param);
+	double energia_local, energia;
+	float vel_local, vel_max;
+	int reposo;
+
+	obtenerEnergiaVelocidad(sim->datos_SW_Cuda.d_energiaBloques, sim->datos_cluster->num_volx,
+		sim->datos_cluster->num_voly, sim->datos_SW_Cuda.fila_ini_gpu, p->epsilon_h, &energia_local, &vel_local);
+	MPI_Allreduce (&energia_local, &energia, 1, MPI_DOUBLE, MPI_SUM, p->comm);
+	MPI_Allreduce (&vel_local, &vel_max, 1, MPI_FLOAT, MPI_MAX, p->comm);
+	// Dimensionalizamos: h*|u|^2/2 por el rea del volumen
+	energia *= ((double) p->area)*p->L*p->L*p->Q*p->Q/p->H;
+	vel_max *= p->Q/p->H;
+	if (p->id_hebra == 0)
+		fprintf(stdout, "Energia cinetica = %e m5/s2, velocidad maxima = %g m/s\n", energia, vel_max);
+
+	reposo = ((opciones->parada_velocidad <= 0.0) || (vel_max < opciones->parada_velocidad)) &&
+			((opciones->parada_energia <= 0.0) || (energia < opciones->parada_energia));
+	if (! reposo) {
+		*en_movimiento = 1;
+		return 0;
+	}
+	if ((! *en_movimiento) || (sim->tiempo_act*p->T < opciones->parada_tiempo_minimo))
+		return 0;
+	sprintf(motivo, "Flow at rest: max speed %g m/s, kinetic energy %e m5/s2", vel_max, energia);
+
+	return 1;
+}
+
+// Valor dimensionalizado de la variable nvar de los ficheros NetCDF (en el orden eta1, q1x, q1y,
+// eta2, q2x, q2y) de un volumen con datos datos1 y datos2 de las capas 1 y 2
+static inline float valorVariableNC(int nvar, float4 datos1, float4 datos2, float Hmin, float H, float Q)
+{
+	switch (nvar) {
+		case 0:  return (datos1.x + datos2.x - datos1.w - Hmin)*H;
+		case 1:  return datos1.y*Q;
+		case 2:  return datos1.z*Q;
+		case 3:  return datos2.x*H;  //(datos2.x - datos2.w - Hmin)*H;
+		case 4:  return datos2.y*Q;
+		default: return datos2.z*Q;
+	}
+}
+
+// Pone en vec la variable nvar de los volmenes (inix + i*npics, iniy + j*npics) de datos_1 y
+// datos_2, con 0 <= i < nx y 0 <= j < ny (iniy es una fila local al cluster)
+void empaquetarVariableNC(int nvar, float4 *datos_1, float4 *datos_2, int num_volx, int inix, int nx,
+		int iniy, int ny, int npics, float Hmin, float H, float Q, float *vec)
+{
+	int i, j, pos;
+
+	for (j=0; j<ny; j++) {
+		pos = (iniy + j*npics)*num_volx + inix;
+		for (i=0; i<nx; i++)
+			vec[j*nx + i] = valorVariableNC(nvar, datos_1[pos + i*npics], datos_2[pos + i*npics], Hmin, H, Q);
+	}
 }
 
 // Devuelve 0 si todo ha ido bien, 1 si no hay memoria GPU suficiente, y 2 si no hay memoria CPU suficiente
 extern "C" int shallowWater(TDatoCluster *datos_cluster, float xmin, float ymin, float Hmin, char *nombre_bati,
 		char * prefijo, int num_voly_otros, int num_voly_total, float borde_sup, float borde_inf, float borde_izq,
-		float borde_der, float ancho_vol, float alto_vol, float area, float tiempo_tot, float tiempo_guardar,
+		float borde_der, float ancho_vol, float alto_vol, float area, TTiempo tiempo_tot, TTiempo tiempo_guardar,
 		float CFL, float r, float angulo1, float angulo2, float angulo3, float angulo4, float peso, float beta,
 		float mfc, float mf0, float mfs, float vmax1, float vmax2, float gravedad, float epsilon_h, float L,
 		float H, float Q, float T, int num_procs, int id_hebra, double *tiempo, int leer_fichero_puntos, 
-		int *indiceVolumenesGuardado, int *posicionesVolumenesGuardado, int num_puntos_guardar)
+		int *indiceVolumenesGuardado, int num_puntos_guardar, TOpciones *opciones, TRecorte *recorte,
+		TMallaAnidada *anidada)
 {
-	double tiempo_ini, tiempo_fin;
-	int err, err_total;
-	MPI_Request request_1[2], request_2[2];
-	MPI_Request request2;
-	MPI_Status status[2];
+	double tiempo_ini = 0.0, tiempo_fin = 0.0;
+	int err, err_anidada;
 	float *vec;
-	float4 datos1, datos2;
-	// Tipos para transmitir datos en MPI
-	MPI_Datatype tipo_float4;
-	MPI_Datatype tipo[4];
-	int blocklen[4] = {1, 1, 1, 1};
-	MPI_Aint disp[4];
-	// Datos utilizados en Cuda por el cluster (punteros a memoria global
-	// y tamao de bloques)
-	TSW_Cuda datos_SW_Cuda;
-	int i, j, pos;
-	// Nmero del estado que se va guardando
-	int num = 0;
+	float4 datos1;
+	// Simulacin del cluster y sus parmetros
+	TSimulacion sim;
+	TParametrosSW param;
+	// Simulacin de la malla anidada, si este proceso la tiene (ver MallaAnidada.cu)
+	TSimulacionAnidada sim_anidada;
+	int i, j, pos, k, nvar;
+	// Para cada variable NetCDF: si se guarda, nmero del estado que se va guardando,
+	// tiempo entre guardados y tiempo del siguiente guardado
+	int guardar[NUM_VARIABLES];
+	int num[NUM_VARIABLES];
+	TTiempo intervalo_var[NUM_VARIABLES];
+	TTiempo sig_tiempo_var[NUM_VARIABLES];
+	// Indican si ya se ha copiado a CPU el estado de la capa 1 y de la capa 2 en el paso actual
+	int copiado_1, copiado_2;
+#if PASOS_HALO > 1
+	// Intercambios de volmenes de comunicacin hechos (ver PASOS_HALO)
+	long num_intercambios;
+#endif
 
 	int num_volx = datos_cluster->num_volx;
 	int num_voly = datos_cluster->num_voly;
-	int hebra_ant = id_hebra-1;
-	int hebra_sig = id_hebra+1;
-	int ultima_hebra = (id_hebra == num_procs-1) ? 1 : 0;
 	int num_volumenes = num_volx*num_voly;
-	// nvolx y nvoly que se guardan en NetCDF
-	int nx_nc, ny_nc;
-	// iniy: coordenada y local a datosVolumenes a partir de la que se guardarn puntos
-	int iniy, iniy_nc;
-	int npics = 1;
-	char nombre_fich[512];
-	int tam_datosVolumenes = num_volumenes * sizeof(float4);
-	int tam_datosVolComFloat4 = num_volx * sizeof(float4);
-	int tam_datosEta1 = num_volumenes * sizeof(float2);
-	int tam_datosVolGuardadoFloat4 = num_puntos_guardar*sizeof(float4);
-	float tiempo_act, delta_T, dT_min;
-	float sig_tiempo_guardar = 0.0;
-	int iter;
-
-	int *d_posicionesVolumenesGuardado;
-        float4 *d_datosVolumenesGuardado_1;
+	// Para cada variable NetCDF: diezmado, nvolx y nvoly que se guardan, fila local a datosVolumenes
+	// a partir de la que se guarda (iniy) y su posicin en el fichero (iniy_nc)
+	int npics[NUM_VARIABLES];
+	int nx_nc[NUM_VARIABLES], ny_nc[NUM_VARIABLES];
+	int iniy[NUM_VARIABLES], iniy_nc[NUM_VARIABLES];
+	// Primera fila del cluster en la malla
+	int fila_ini = id_hebra*num_voly_otros;
+	// Regiones de inters (ver TRegionNC en netcdf.cu)
+	TRegionNC regiones[MAX_REGIONES];
+	TRegionNC *reg;
+	int num_regiones = opciones->num_regiones;
+	// Los tiempos de guardado son de tipo TTiempo (ver PRECISION_MIXTA)
+	TTiempo sig_tiempo_guardar = 0.0;
+	// Puntos de guardado y tiempo entre sus muestras (ver Puntos.cu)
+	TPuntos puntos;
+	TTiempo sig_tiempo_puntos = 0.0;
+	TTiempo intervalo_puntos;
+	// Diagnsticos del delta T: fichero (slo en el proceso 0), tiempo entre diagnsticos
+	// (negativo si no se hacen) y tiempo del siguiente
+	FILE *fp_diagnostico = NULL;
+	TTiempo intervalo_diagnostico;
+	TTiempo sig_tiempo_diagnostico = 0.0;
+	// Parada cuando el flujo se detiene: si se comprueba, tiempo entre comprobaciones y de la
+	// siguiente, si el flujo se ha movido, si hay que terminar y su motivo
+	int comprobar_parada;
+	TTiempo intervalo_parada;
+	TTiempo sig_tiempo_parada = 0.0;
+	int en_movimiento = 0;
+	int parada = 0;
+	char motivo_parada[256];
+#ifdef ALMACENAMIENTO_HALF
+	// Error de masa acumulado por el almacenamiento en half
+	float err_masa;
+	double err_masa_acum = 0.0;
+	double err_masa_total;
+#endif
+#ifdef OMITIR_BLOQUES_SECOS
+	// Bloques activos acumulados en los pasos desde el ltimo guardado, y media
+	// por paso de este proceso, del mximo de todos los procesos y de su suma
+	int num_bloques_activos;
+	double bloques_medios, bloques_max, bloques_suma;
+#endif
 
-	FILE *fp;
+	// Indica si se publican los campos en memoria compartida (ver MemoriaCompartida.hxx)
+	int publicar_memoria = 0;
+#if PROCESOS_ES > 0
+	// Datos para los servidores de E/S y buffer donde se empaqueta cada mensaje (ver ServidorES.hxx)
+	TParametrosES par_es;
+	float *vec_es;
+#endif
 
-	// Tipo tipo_float4
-	tipo[0] = MPI_FLOAT;
-	tipo[1] = MPI_FLOAT;
-	tipo[2] = MPI_FLOAT;
-	tipo[3] = MPI_FLOAT;
-	disp[0] = 0;
-	disp[1] = sizeof(float);
-	disp[2] = 2*sizeof(float);
-	disp[3] = 3*sizeof(float);
+	// Parmetros de la simulacin
+	param.borde_sup = borde_sup;  param.borde_inf = borde_inf;
+	param.borde_izq = borde_izq;  param.borde_der = borde_der;
+	param.ancho_vol = ancho_vol;  param.alto_vol = alto_vol;  param.area = area;
+	param.CFL = CFL;  param.r = r;  param.peso = peso;  param.beta = beta;
+	param.angulo1 = angulo1;  param.angulo2 = angulo2;  param.angulo3 = angulo3;  param.angulo4 = angulo4;
+	param.mfc = mfc;  param.mf0 = mf0;  param.mfs = mfs;  param.vmax1 = vmax1;  param.vmax2 = vmax2;
+	param.gravedad = gravedad;  param.epsilon_h = epsilon_h;
+	param.L = L;  param.H = H;  param.Q = Q;  param.T = T;
+	param.num_voly_total = num_voly_total;
+	param.num_procs = num_procs;
+	param.id_hebra = id_hebra;
+	param.comm = comm_calculo;
+	param.esponja = opciones->esponja;
+	param.esponja_coef = (float) (T/opciones->esponja_tiempo);
+	param.fila_ini_global = fila_ini;
 
-	MPI_Type_struct(4, blocklen, disp, tipo, &tipo_float4);
-	MPI_Type_commit(&tipo_float4);
+	// Inicializamos la simulacin (datos en GPU y delta T inicial)
+	err = inicializarSimulacion(&sim, datos_cluster, &param);
 
-	// Inicializamos los datos en cada GPU
-	err = inicializarDatosCuda(datos_cluster, &datos_SW_Cuda, id_hebra);
+	// Inicializamos la malla anidada en el proceso que la tiene
+	if (err == 0) {
+		err_anidada = anidada->activa ? inicializarMallaAnidada(&sim_anidada, anidada, &sim) : 0;
+		MPI_Allreduce (&err_anidada, &err, 1, MPI_INT, MPI_MAX, comm_calculo);
+		if (err != 0) {
+			if (anidada->activa && (err_anidada == 0))
+				liberarMallaAnidada(&sim_anidada, &sim);
+			liberarSimulacion(&sim);
+		}
+	}
 
-	// Comprobamos si se ha producido un error en algn proceso
-	MPI_Allreduce (&err, &err_total, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	if ((err == 0) && (leer_fichero_puntos == 1)) {
+		err = inicializarPuntos(&puntos, prefijo, indiceVolumenesGuardado, num_puntos_guardar, num_volx, num_voly,
+			num_voly_otros, num_voly_total, id_hebra, num_procs, xmin*L, ymin*L, ancho_vol*L, alto_vol*L, Hmin, H);
+		if (err != 0) {
+			if (anidada->activa)
+				liberarMallaAnidada(&sim_anidada, &sim);
+			liberarSimulacion(&sim);
+		}
+		intervalo_puntos = (opciones->intervalo_puntos < 0.0) ? tiempo_guardar : (TTiempo) (opciones->intervalo_puntos/T);
+	}
 
-	// Fijamos los tamaos relativos de la cach L1 y la memoria compartida
-	cudaFuncSetCacheConfig(procesarAristasGPU, cudaFuncCachePreferL1);
+#if PROCESOS_ES > 0
+	// Enviamos a los servidores de E/S los datos para crear los ficheros, o que terminen si ha
+	// habido algn error
+	if (err == 0) {
+		double fac = (Q/H)*sqrt(L)/pow((double) H, (double) 7.0/6.0);
 
-	if (leer_fichero_puntos == 1) {
-                cudaMalloc((void **)&d_posicionesVolumenesGuardado, num_volumenes*sizeof(int));
-                cudaMalloc((void **)&d_datosVolumenesGuardado_1, tam_datosVolGuardadoFloat4);
+		par_es.iniciar = 1;
+		par_es.num_procs = num_procs;
+		par_es.num_volx = num_volx;
+		par_es.num_voly_otros = num_voly_otros;
+		par_es.num_voly_total = num_voly_total;
+		par_es.recorte = *recorte;
+		par_es.leer_fichero_puntos = leer_fichero_puntos;
+		par_es.num_puntos = (leer_fichero_puntos == 1) ? num_puntos_guardar : 0;
+		// En el mensaje tienen que caber las filas del cluster con ms filas. num_voly_otros est
+		// redondeado hacia arriba (y a par), por lo que normalmente el ltimo cluster tiene menos
+		par_es.tam_mensaje = tamMensajeES(num_volx, max(num_voly_otros, num_voly_total - (num_procs-1)*num_voly_otros),
+			par_es.num_puntos);
+		for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+			par_es.guardar[nvar] = opciones->guardar_variable[nvar];
+			par_es.npics[nvar] = opciones->diezmado[nvar];
+			par_es.precision[nvar] = opciones->precision_variable[nvar];
+		}
+		par_es.xmin = xmin*L;  par_es.ymin = ymin*L;  par_es.ancho_vol = ancho_vol*L;  par_es.alto_vol = alto_vol*L;
+		par_es.tiempo_tot = tiempo_tot*T;  par_es.CFL = CFL;  par_es.r = r;
+		par_es.angulo1 = angulo1*180.0/M_PI;  par_es.angulo2 = angulo2*180.0/M_PI;
+		par_es.angulo3 = angulo3*180.0/M_PI;  par_es.angulo4 = angulo4*180.0/M_PI;
+		par_es.mfc = mfc/L;  par_es.mf0 = mf0/fac;  par_es.mfs = mfs/fac;
+		par_es.vmax1 = vmax1*Q/H;  par_es.vmax2 = vmax2*Q/H;
+		strncpy(par_es.nombre_bati, nombre_bati, TAM_NOMBRE_ES-1);
+		par_es.nombre_bati[TAM_NOMBRE_ES-1] = '\0';
+		strncpy(par_es.prefijo, prefijo, TAM_NOMBRE_ES-1);
+		par_es.prefijo[TAM_NOMBRE_ES-1] = '\0';
+		inicializarClienteES(&par_es, indiceVolumenesGuardado, id_hebra);
+	}
+	else if (id_hebra == 0) {
+		cancelarServidoresES(num_procs);
 	}
-	
-	if (leer_fichero_puntos == 1)
-                cudaMemcpy(d_posicionesVolumenesGuardado, posicionesVolumenesGuardado, num_volumenes*sizeof(int), cudaMemcpyHostToDevice);
+#endif
 
-	if (err_total != 1) {
-		MPI_Barrier(MPI_COMM_WORLD);
+	if (err == 0) {
+		sim.funcion_paso = mostrarPaso;
 
 		// Inicio NetCDF
+		vec = datos_cluster->vec_guardado;
+		for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+			guardar[nvar] = opciones->guardar_variable[nvar];
+			num[nvar] = 0;
+			intervalo_var[nvar] = (opciones->intervalo_variable[nvar] < 0.0) ? tiempo_guardar :
+				(TTiempo) (opciones->intervalo_variable[nvar]/T);
+			sig_tiempo_var[nvar] = 0.0;
+		}
 		if(leer_fichero_puntos==0) {
-			vec = (float *) malloc(num_volumenes*sizeof(float));
-			if (vec == NULL) {
-				liberarSWCuda(&datos_SW_Cuda);
-				return 2;
+			for (nvar=0; nvar<NUM_VARIABLES; nvar++)
+				npics[nvar] = opciones->diezmado[nvar];
+#if PROCESOS_ES > 0
+			// Los servidores de E/S crean los ficheros con la batimetra de cada proceso
+			vec_es = (float *) bufferES();
+			for (i=0; i<num_volumenes; i++) {
+				datos1 = datos_cluster->datosVolumenes_1[num_volx+i];
+				vec_es[i] = (datos1.w + Hmin)*H;
 			}
+			enviarES(ES_BATIMETRIA, 0, 0, 0.0, num_volumenes*sizeof(float));
+			for (nvar=0; nvar<NUM_VARIABLES; nvar++)
+				nx_nc[nvar] = (num_volx-1)/npics[nvar] + 1;
+#else
 			for (i=0; i<num_volumenes; i++) {
 				datos1 = datos_cluster->datosVolumenes_1[num_volx+i];
 				vec[i] = (datos1.w + Hmin)*H;
 			}
 			double fac = (Q/H)*sqrt(L)/pow((double) H, (double) 7.0/6.0);
-			initNC(id_hebra, nombre_bati, prefijo, num_volx, num_voly, num_voly_otros, num_voly_total, &nx_nc, &ny_nc,
-				npics, xmin*L, ymin*L, ancho_vol*L, alto_vol*L, tiempo_tot*T, CFL, r, angulo1*180.0/M_PI, angulo2*180.0/M_PI,
-				angulo3*180.0/M_PI, angulo4*180.0/M_PI, mfc/L, mf0/fac, mfs/fac, vmax1*Q/H, vmax2*Q/H, vec);
-			// Reasignamos ny_nc para que sea local al cluster
-			for (iniy=id_hebra*num_voly_otros; iniy%npics != 0; iniy++);
-			iniy = iniy - id_hebra*num_voly_otros;
-			iniy_nc = (id_hebra*num_voly_otros-1)/npics + 1;
-			ny_nc = (num_voly-1-iniy)/npics + 1;
-		}else{
-			sprintf(nombre_fich, "%s_eta_puntos.txt", prefijo);
-                	fp = fopen(nombre_fich, "wt");
+			initNC(comm_calculo, id_hebra, nombre_bati, prefijo, num_volx, num_voly, num_voly_otros, num_voly_total, guardar,
+				opciones->precision_variable, nx_nc, ny_nc, npics, xmin*L, ymin*L, ancho_vol*L, alto_vol*L, tiempo_tot*T,
+				CFL, r, angulo1*180.0/M_PI, angulo2*180.0/M_PI, angulo3*180.0/M_PI, angulo4*180.0/M_PI, mfc/L, mf0/fac,
+				mfs/fac, vmax1*Q/H, vmax2*Q/H, vec, recorte);
+#endif
+			// Reasignamos ny_nc para que sea local al cluster. iniy_nc es la primera fila mltiplo
+			// del diezmado a partir de fila_ini (dividida por el diezmado)
+			for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+				iniy_nc[nvar] = (fila_ini + npics[nvar] - 1)/npics[nvar];
+				iniy[nvar] = iniy_nc[nvar]*npics[nvar] - fila_ini;
+				ny_nc[nvar] = (iniy[nvar] < num_voly) ? (num_voly-1-iniy[nvar])/npics[nvar] + 1 : 0;
+			}
+		}
+		for (k=0; k<num_regiones; k++) {
+			initRegionNC(k, opciones->regiones+k, regiones+k, prefijo, guardar, opciones->precision_variable, id_hebra,
+				num_volx, num_voly, fila_ini, num_voly_total, xmin*L, ymin*L, ancho_vol*L, alto_vol*L, (TTiempo) (opciones->regiones[k].intervalo/T));
 		}
 		// Fin NetCDF
 
-		// CLCULO DEL DELTA_T INICIAL
-		// Procesamos las aristas horizontales
-		procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda.blockGridHor1, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly, num_volumenes,
-			borde_sup, borde_inf, ancho_vol, r, datos_SW_Cuda.d_acumulador1, gravedad, epsilon_h, 3, id_hebra, ultima_hebra);
-		procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda.blockGridHor2, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly, num_volumenes,
-			borde_sup, borde_inf, ancho_vol, r, datos_SW_Cuda.d_acumulador1, gravedad, epsilon_h, 4, id_hebra, ultima_hebra);
-
-		// Procesamos las aristas verticales
-		procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda.blockGridVer1, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly, num_volumenes,
-			borde_izq, borde_der, alto_vol, r, datos_SW_Cuda.d_acumulador1, gravedad, epsilon_h, 1, id_hebra, ultima_hebra);
-		procesarAristasDeltaTInicialGPU<<<datos_SW_Cuda.blockGridVer2, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly, num_volumenes,
-			borde_izq, borde_der, alto_vol, r, datos_SW_Cuda.d_acumulador1, gravedad, epsilon_h, 2, id_hebra, ultima_hebra);
-
-		// Obtenemos el delta T local de cada volumen
-		obtenerDeltaTVolumenesGPU<<<datos_SW_Cuda.blockGridDeltaT, datos_SW_Cuda.threadBlockDeltaT>>>(datos_SW_Cuda.d_acumulador1,
-			datos_SW_Cuda.d_deltaTVolumenes, num_volumenes, area, CFL);
+		intervalo_diagnostico = (opciones->intervalo_diagnostico < 0.0) ? -1.0 : (TTiempo) (opciones->intervalo_diagnostico/T);
+		if ((intervalo_diagnostico >= 0.0) && (id_hebra == 0))
+			fp_diagnostico = abrirDiagnosticoDeltaT(prefijo);
+		comprobar_parada = ((opciones->parada_velocidad > 0.0) || (opciones->parada_energia > 0.0));
+		if (opciones->parada_intervalo >= 0.0)
+			intervalo_parada = (TTiempo) (opciones->parada_intervalo/T);
+		else
+			intervalo_parada = (tiempo_guardar >= 0.0) ? tiempo_guardar : 0.0;
 
-		// Obtenemos el mnimo delta T del cluster aplicando un algoritmo de reduccin
-		dT_min = obtenerMinimoReduccion<float>(datos_SW_Cuda.d_deltaTVolumenes, num_volumenes);
+		if (opciones->memoria_compartida[0] != '\0') {
+			// Si no se puede crear el segmento, la simulacin contina sin publicar los campos
+			if (crearMemoriaCompartida(opciones->memoria_compartida, id_hebra, num_procs, num_volx, num_voly,
+					id_hebra*num_voly_otros, num_voly_total, xmin*L, ymin*L, ancho_vol*L, alto_vol*L) == 0)
+				publicar_memoria = 1;
+		}
 
-		// Obtenemos el mnimo delta T de todos los clusters por reduccin
-		MPI_Allreduce (&dT_min, &delta_T, 1, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
-//delta_T=5e-4/T;
-		if (id_hebra == 0)
-			fprintf(stdout, "deltaT inicial = %e seg\n", delta_T*T);
+		MPI_Barrier(comm_calculo);
+		tiempo_ini = MPI_Wtime();
+		while (sim.tiempo_act < tiempo_tot) {
+			copiado_1 = copiado_2 = 0;
 
-		// Reinicializamos el acumulador1
-		cudaMemset(datos_SW_Cuda.d_acumulador1, 0, tam_datosVolumenes);
+			// Comprobamos si el flujo se ha detenido, si procede. En ese caso, en este paso se guardan
+			// todas las salidas y despus se termina
+			if (comprobar_parada && (sim.tiempo_act >= sig_tiempo_parada)) {
+				parada = comprobarParada(&sim, opciones, &en_movimiento, motivo_parada);
+				sig_tiempo_parada += intervalo_parada;
+				if (parada) {
+					if (id_hebra == 0)
+						fprintf(stdout, "Simulacion detenida en t = %g seg. %s\n", sim.tiempo_act*T, motivo_parada);
+					for (nvar=0; nvar<NUM_VARIABLES; nvar++)
+						sig_tiempo_var[nvar] = sim.tiempo_act;
+					for (k=0; k<num_regiones; k++)
+						regiones[k].sig_tiempo = sim.tiempo_act;
+					sig_tiempo_guardar = sig_tiempo_puntos = sim.tiempo_act;
+				}
+			}
 
-		MPI_Barrier(MPI_COMM_WORLD);
-		iter = 1;
-		tiempo_ini = MPI_Wtime();
-		tiempo_act = 0.0;
-		while (tiempo_act < tiempo_tot) {
-			// Guardamos el estado actual, si procede
+			// Guardamos en NetCDF las variables a las que les toca, si procede. Slo se copian de la
+			// GPU las capas que necesitan: eta1 las dos, q1x y q1y la capa 1, y eta2, q2x y q2y la capa 2
 			// Inicio NetCDF
-			if ((tiempo_guardar >= 0.0) && (tiempo_act >= sig_tiempo_guardar)) {
-			if(leer_fichero_puntos == 0) {
-				cudaMemcpyFromArray(datos_cluster->datosVolumenes_1, datos_SW_Cuda.d_datosVolumenes_1, 0, 1, tam_datosVolumenes, cudaMemcpyDeviceToHost);
-				cudaMemcpyFromArray(datos_cluster->datosVolumenes_2, datos_SW_Cuda.d_datosVolumenes_2, 0, 1, tam_datosVolumenes, cudaMemcpyDeviceToHost);
-				for (j=0; j<ny_nc; j++) {
-					pos = (iniy + j*npics)*num_volx;
-					for (i=0; i<nx_nc; i++) {
-						datos1 = datos_cluster->datosVolumenes_1[pos + i*npics];
-						datos2 = datos_cluster->datosVolumenes_2[pos + i*npics];
-						vec[j*nx_nc + i] = (datos1.x + datos2.x - datos1.w - Hmin)*H;
+			if (leer_fichero_puntos == 0) {
+				for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+					if ((! guardar[nvar]) || (intervalo_var[nvar] < 0.0) || (sim.tiempo_act < sig_tiempo_var[nvar]))
+						continue;
+					if ((nvar <= 2) && (! copiado_1)) {
+						copiarEstadoGPUACPU(&(sim.datos_SW_Cuda), sim.datos_SW_Cuda.d_datosVolumenes_1, datos_cluster->datosVolumenes_1,
+							sim.datos_SW_Cuda.fila_ini_gpu, num_voly, num_volx);
+						copiado_1 = 1;
 					}
-				}
-				writeEta1NC(nx_nc, ny_nc, iniy_nc, num, tiempo_act*T, vec);
-				for (j=0; j<ny_nc; j++) {
-					pos = (iniy + j*npics)*num_volx;
-					for (i=0; i<nx_nc; i++)
-						vec[j*nx_nc + i] = (datos_cluster->datosVolumenes_1[pos + i*npics].y)*Q;
-				}
-				writeQ1xNC(nx_nc, ny_nc, iniy_nc, num, tiempo_act*T, vec);
-				for (j=0; j<ny_nc; j++) {
-					pos = (iniy + j*npics)*num_volx;
-					for (i=0; i<nx_nc; i++)
-						vec[j*nx_nc + i] = (datos_cluster->datosVolumenes_1[pos + i*npics].z)*Q;
-				}
-				writeQ1yNC(nx_nc, ny_nc, iniy_nc, num, tiempo_act*T, vec);
-				for (j=0; j<ny_nc; j++) {
-					pos = (iniy + j*npics)*num_volx;
-					for (i=0; i<nx_nc; i++) {
-						datos2 = datos_cluster->datosVolumenes_2[pos + i*npics];
-						vec[j*nx_nc + i] = (datos2.x)*H;//(datos2.x - datos2.w - Hmin)*H;
+					if (((nvar == 0) || (nvar >= 3)) && (! copiado_2)) {
+						copiarEstadoGPUACPU(&(sim.datos_SW_Cuda), sim.datos_SW_Cuda.d_datosVolumenes_2, datos_cluster->datosVolumenes_2,
+							sim.datos_SW_Cuda.fila_ini_gpu, num_voly, num_volx);
+						copiado_2 = 1;
 					}
+#if PROCESOS_ES > 0
+					// La guarda el servidor de E/S
+					vec_es = (float *) bufferES();
+					empaquetarVariableNC(nvar, datos_cluster->datosVolumenes_1, datos_cluster->datosVolumenes_2, num_volx,
+						0, nx_nc[nvar], iniy[nvar], ny_nc[nvar], npics[nvar], Hmin, H, Q, vec_es);
+					enviarES(ES_VARIABLE, nvar, num[nvar], sim.tiempo_act*T, nx_nc[nvar]*ny_nc[nvar]*sizeof(float));
+#else
+					empaquetarVariableNC(nvar, datos_cluster->datosVolumenes_1, datos_cluster->datosVolumenes_2, num_volx,
+						0, nx_nc[nvar], iniy[nvar], ny_nc[nvar], npics[nvar], Hmin, H, Q, vec);
+					writeVarNC(nvar, nx_nc[nvar], ny_nc[nvar], iniy_nc[nvar], num[nvar], sim.tiempo_act*T, vec);
+#endif
+					num[nvar]++;
+					sig_tiempo_var[nvar] += intervalo_var[nvar];
 				}
-				writeEta2NC(nx_nc, ny_nc, iniy_nc, num, tiempo_act*T, vec);
-				for (j=0; j<ny_nc; j++) {
-					pos = (iniy + j*npics)*num_volx;
-					for (i=0; i<nx_nc; i++)
-						vec[j*nx_nc + i] = (datos_cluster->datosVolumenes_2[pos + i*npics].y)*Q;
+			}
+			// Fin NetCDF
+
+			// Mostramos los diagnsticos y publicamos los campos, si procede
+			if ((tiempo_guardar >= 0.0) && (sim.tiempo_act >= sig_tiempo_guardar)) {
+#ifdef ALMACENAMIENTO_HALF
+				// Mostramos el error de masa acumulado por el almacenamiento en half
+				cudaMemcpy(&err_masa, sim.datos_SW_Cuda.d_errorMasa, sizeof(float), cudaMemcpyDeviceToHost);
+				cudaMemset(sim.datos_SW_Cuda.d_errorMasa, 0, sizeof(float));
+				err_masa_acum += err_masa;
+				MPI_Reduce (&err_masa_acum, &err_masa_total, 1, MPI_DOUBLE, MPI_SUM, 0, comm_calculo);
+				if (id_hebra == 0)
+					fprintf(stdout, "Error de masa por almacenamiento half: %e m3\n", err_masa_total*area*L*L*H);
+#endif
+#ifdef OMITIR_BLOQUES_SECOS
+				// Mostramos el nmero medio de bloques activos por paso y el desequilibrio entre procesos
+				// (mximo entre media). Todos los procesos dan el mismo nmero de pasos
+				if (sim.pasos_bloques > 0) {
+					cudaMemcpy(&num_bloques_activos, sim.datos_SW_Cuda.d_numBloquesActivos, sizeof(int), cudaMemcpyDeviceToHost);
+					cudaMemset(sim.datos_SW_Cuda.d_numBloquesActivos, 0, sizeof(int));
+					bloques_medios = ((double) num_bloques_activos)/sim.pasos_bloques;
+					MPI_Reduce (&bloques_medios, &bloques_max, 1, MPI_DOUBLE, MPI_MAX, 0, comm_calculo);
+					MPI_Reduce (&bloques_medios, &bloques_suma, 1, MPI_DOUBLE, MPI_SUM, 0, comm_calculo);
+					if (id_hebra == 0) {
+						fprintf(stdout, "Bloques activos por paso y proceso: media %.1f, maximo %.1f, desequilibrio %.2f\n",
+							bloques_suma/num_procs, bloques_max, (bloques_suma > 0.0) ? bloques_max*num_procs/bloques_suma : 1.0);
+					}
+					sim.pasos_bloques = 0;
 				}
-				writeQ2xNC(nx_nc, ny_nc, iniy_nc, num, tiempo_act*T, vec);
-				for (j=0; j<ny_nc; j++) {
-					pos = (iniy + j*npics)*num_volx;
-					for (i=0; i<nx_nc; i++)
-						vec[j*nx_nc + i] = (datos_cluster->datosVolumenes_2[pos + i*npics].z)*Q;
+#endif
+				if (publicar_memoria) {
+					// Copiamos las capas que no se hayan copiado al guardar en NetCDF
+					if (! copiado_1) {
+						copiarEstadoGPUACPU(&(sim.datos_SW_Cuda), sim.datos_SW_Cuda.d_datosVolumenes_1, datos_cluster->datosVolumenes_1,
+								sim.datos_SW_Cuda.fila_ini_gpu, num_voly, num_volx);
+						copiado_1 = 1;
+					}
+					if (! copiado_2) {
+						copiarEstadoGPUACPU(&(sim.datos_SW_Cuda), sim.datos_SW_Cuda.d_datosVolumenes_2, datos_cluster->datosVolumenes_2,
+								sim.datos_SW_Cuda.fila_ini_gpu, num_voly, num_volx);
+						copiado_2 = 1;
+					}
+					copiarEta1MaximaACPU(&(sim.datos_SW_Cuda), datos_cluster->eta1_maxima, num_volx, num_voly);
+					publicarCamposMemoria(num_volx, num_voly, datos_cluster->datosVolumenes_1, datos_cluster->datosVolumenes_2,
+						datos_cluster->eta1_maxima, Hmin, H, Q, sim.tiempo_act*T, 0);
 				}
-				writeQ2yNC(nx_nc, ny_nc, iniy_nc, num, tiempo_act*T, vec);
-				num++;
-			} else {
-
-				cudaMemcpyFromArray(datos_cluster->datosVolumenes_1, datos_SW_Cuda.d_datosVolumenes_1, 0, 1, tam_datosVolumenes, cudaMemcpyDeviceToHost);
-                                fprintf(fp, "%e", tiempo_act*T);
-                                for (i=0; i<num_puntos_guardar; i++) {
-                                        if (indiceVolumenesGuardado[i] != -1) {
-                                                j = indiceVolumenesGuardado[i];
-                                                fprintf(fp, " %.8e", (datos_cluster->datosVolumenes_1[j].x - datos_cluster->datosVolumenes_1[j].w - Hmin)*H);
-                                        }
-                                        else
-                                                fprintf(fp, " -999");   
-                                }
-                                fprintf(fp, "\n");
-
+				sig_tiempo_guardar += tiempo_guardar;
 			}
-			sig_tiempo_guardar += tiempo_guardar;
+
+			// Guardamos las regiones de inters, si procede. Slo se copian de la GPU
+			// las filas de la regin, si no se ha copiado ya el estado completo
+			// Inicio NetCDF
+			for (k=0; k<num_regiones; k++) {
+				reg = regiones + k;
+				if (sim.tiempo_act < reg->sig_tiempo)
+					continue;
+				if (reg->comm != MPI_COMM_NULL) {
+					pos = reg->iniy_local*num_volx;
+					if (! copiado_1) {
+						copiarEstadoGPUACPU(&(sim.datos_SW_Cuda), sim.datos_SW_Cuda.d_datosVolumenes_1, datos_cluster->datosVolumenes_1 + pos,
+							reg->iniy_local + sim.datos_SW_Cuda.fila_ini_gpu, reg->ny_local, num_volx);
+					}
+					if (! copiado_2) {
+						copiarEstadoGPUACPU(&(sim.datos_SW_Cuda), sim.datos_SW_Cuda.d_datosVolumenes_2, datos_cluster->datosVolumenes_2 + pos,
+							reg->iniy_local + sim.datos_SW_Cuda.fila_ini_gpu, reg->ny_local, num_volx);
+					}
+					for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+						if (! guardar[nvar])
+							continue;
+						empaquetarVariableNC(nvar, datos_cluster->datosVolumenes_1, datos_cluster->datosVolumenes_2, num_volx,
+							reg->inix, reg->nx, reg->iniy_local, reg->ny_local, 1, Hmin, H, Q, vec);
+						writeVarRegionNC(reg, nvar, vec);
+					}
+					writeTiempoRegionNC(reg, sim.tiempo_act*T);
+				}
+				reg->sig_tiempo += reg->intervalo;
 			}
 			// Fin NetCDF
 
-			// Actualizamos los valores mximos de eta1 y sus tiempos asociados
-			actualizarEta1MaximaGPU<<<datos_SW_Cuda.blockGridEst, datos_SW_Cuda.threadBlockEst>>>(datos_SW_Cuda.d_eta1_maxima,
-				num_volx, num_voly, tiempo_act);
-
-			// SOLAPAMIENTO MPI-cudaMemcpy-computacin
-			// Recibimos de los clusters adyacentes sus volmenes de comunicacin adyacentes a nuestro cluster.
-			if (id_hebra != 0) {
-				// Es una hebra distinta de la primera.
-				// Recibimos los volmenes de comunicacin inferiores del cluster superior
-				MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterInf_1, num_volx, tipo_float4, hebra_ant, 22,
-					MPI_COMM_WORLD, request_1);
-				MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterInf_2, num_volx, tipo_float4, hebra_ant, 23,
-					MPI_COMM_WORLD, request_1+1);
-			}
-			if (! ultima_hebra) {
-				// Es una hebra distinta de la ltima.
-				// Recibimos los volmenes de comunicacin superiores del cluster inferior
-				MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterSup_1, num_volx, tipo_float4, hebra_sig, 22,
-					MPI_COMM_WORLD, request_2);
-				MPI_Irecv(datos_cluster->puntero_datosVolumenesComOtroClusterSup_2, num_volx, tipo_float4, hebra_sig, 23,
-					MPI_COMM_WORLD, request_2+1);
-			}
-			// Copiamos los volmenes de comunicacin del cluster a memoria CPU
-			// Volmenes de comunicacin superiores
-			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterSup_1, datos_SW_Cuda.d_datosVolumenes_1, 0, 1,
-				tam_datosVolComFloat4, cudaMemcpyDeviceToHost);
-			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterSup_2, datos_SW_Cuda.d_datosVolumenes_2, 0, 1,
-				tam_datosVolComFloat4, cudaMemcpyDeviceToHost);
-			// Volmenes de comunicacin inferiores
-			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterInf_1, datos_SW_Cuda.d_datosVolumenes_1, 0, num_voly,
-				tam_datosVolComFloat4, cudaMemcpyDeviceToHost);
-			cudaMemcpyFromArray(datos_cluster->puntero_datosVolumenesComClusterInf_2, datos_SW_Cuda.d_datosVolumenes_2, 0, num_voly,
-				tam_datosVolComFloat4, cudaMemcpyDeviceToHost);
-
-			// Enviamos a los procesos asociados a los clusters adyacentes a nuestro cluster
-			// los volmenes de comunicacin correspondientes de nuestro cluster.
-			if (! ultima_hebra) {
-				// Es una hebra distinta de la ltima.
-				// Enviamos los volmenes de comunicacin inferiores al cluster inferior
-				MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterInf_1, num_volx, tipo_float4, hebra_sig, 22,
-					MPI_COMM_WORLD, &request2);
-				MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterInf_2, num_volx, tipo_float4, hebra_sig, 23,
-					MPI_COMM_WORLD, &request2);
-			}
-			if (id_hebra != 0) {
-				// Es una hebra distinta de la primera.
-				// Enviamos los volmenes de comunicacin superiores al cluster superior
-				MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterSup_1, num_volx, tipo_float4, hebra_ant, 22,
-					MPI_COMM_WORLD, &request2);
-				MPI_Isend(datos_cluster->puntero_datosVolumenesComClusterSup_2, num_volx, tipo_float4, hebra_ant, 23,
-					MPI_COMM_WORLD, &request2);
+			// Tomamos una muestra de los puntos de guardado, si procede
+			if ((leer_fichero_puntos == 1) && (intervalo_puntos >= 0.0) && (sim.tiempo_act >= sig_tiempo_puntos)) {
+				tomarMuestraPuntos(&puntos, num_volx, sim.datos_SW_Cuda.fila_ini_gpu, sim.tiempo_act*T);
+				sig_tiempo_puntos += intervalo_puntos;
 			}
 
-			// Procesamos las aristas de Hor1 que no son de comunicacin
-			procesarAristasNoComGPU<<<datos_SW_Cuda.blockGridHor1, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly,
-				num_volumenes, borde_sup, borde_inf, ancho_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
-				datos_SW_Cuda.d_acumulador1, datos_SW_Cuda.d_acumulador2, gravedad, epsilon_h, L, H, 3, id_hebra, ultima_hebra);
+			// Obtenemos el volumen que limita el delta T y el histograma de los delta T locales, si procede
+			if ((intervalo_diagnostico >= 0.0) && (sim.tiempo_act >= sig_tiempo_diagnostico)) {
+				diagnosticarDeltaT(&sim, fp_diagnostico, fila_ini, xmin, ymin);
+				sig_tiempo_diagnostico += intervalo_diagnostico;
+			}
 
-			// Esperamos a que hayamos recibido los volmenes de comunicacin de todos los clusters adyacentes
-			if (id_hebra != 0)
-				MPI_Waitall(2, request_1, status);
-			if (! ultima_hebra)
-				MPI_Waitall(2, request_2, status);
+			if (parada)
+				break;
 
-			// Copiamos los volmenes de comunicacin recibidos a memoria GPU
-			// Volmenes de comunicacin inferiores del cluster superior
-			cudaMemcpyToArray(datos_SW_Cuda.d_datosVolumenes_1, 0, 0, datos_cluster->puntero_datosVolumenesComOtroClusterInf_1,
-				tam_datosVolComFloat4, cudaMemcpyHostToDevice);
-			cudaMemcpyToArray(datos_SW_Cuda.d_datosVolumenes_2, 0, 0, datos_cluster->puntero_datosVolumenesComOtroClusterInf_2,
-				tam_datosVolComFloat4, cudaMemcpyHostToDevice);
-			// Volmenes de comunicacin superiores del cluster inferior
-			cudaMemcpyToArray(datos_SW_Cuda.d_datosVolumenes_1, 0, num_voly+1, datos_cluster->puntero_datosVolumenesComOtroClusterSup_1,
-				tam_datosVolComFloat4, cudaMemcpyHostToDevice);
-			cudaMemcpyToArray(datos_SW_Cuda.d_datosVolumenes_2, 0, num_voly+1, datos_cluster->puntero_datosVolumenesComOtroClusterSup_2,
-				tam_datosVolComFloat4, cudaMemcpyHostToDevice);
-
-			// Procesamos las aristas horizontales (en el caso de Hor1 slo las de comunicacin)
-			procesarAristasComGPU<<<datos_SW_Cuda.blockGridHorCom, datos_SW_Cuda.threadBlockAriCom>>>(num_volx, num_voly,
-				num_volumenes, borde_sup, borde_inf, ancho_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
-				datos_SW_Cuda.d_acumulador1, datos_SW_Cuda.d_acumulador2, gravedad, epsilon_h, L, H, 3, id_hebra, ultima_hebra);
-			procesarAristasGPU<<<datos_SW_Cuda.blockGridHor2, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly, num_volumenes,
-				borde_sup, borde_inf, ancho_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
-				datos_SW_Cuda.d_acumulador1, datos_SW_Cuda.d_acumulador2, gravedad, epsilon_h, L, H, 4, id_hebra, ultima_hebra);
-
-			// Procesamos las aristas verticales
-			procesarAristasGPU<<<datos_SW_Cuda.blockGridVer1, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly, num_volumenes,
-				borde_izq, borde_der, alto_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
-				datos_SW_Cuda.d_acumulador1, datos_SW_Cuda.d_acumulador2, gravedad, epsilon_h, L, H, 1, id_hebra, ultima_hebra);
-			procesarAristasGPU<<<datos_SW_Cuda.blockGridVer2, datos_SW_Cuda.threadBlockAri>>>(num_volx, num_voly, num_volumenes,
-				borde_izq, borde_der, alto_vol, area, r, delta_T, angulo1, angulo2, angulo3, angulo4, peso, beta,
-				datos_SW_Cuda.d_acumulador1, datos_SW_Cuda.d_acumulador2, gravedad, epsilon_h, L, H, 2, id_hebra, ultima_hebra);
-
-			// Actualizamos en d_acumulador_1 y d_acumulador_2 el estado de cada volumen
-			// Obtenemos tambin el delta T local de cada volumen
-			obtenerEstadoYDeltaTVolumenesGPU<<<datos_SW_Cuda.blockGridEst, datos_SW_Cuda.threadBlockEst>>>(datos_SW_Cuda.d_acumulador1,
-				datos_SW_Cuda.d_acumulador2, datos_SW_Cuda.d_deltaTVolumenes, num_volx, num_voly, area, CFL, r, delta_T,
-				angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, gravedad, epsilon_h, L, H);
-
-			// Actualizamos el tiempo actual
-			tiempo_act += delta_T;
-
-			// Obtenemos el mnimo delta T aplicando un algoritmo de reduccin
-			dT_min = obtenerMinimoReduccion<float>(datos_SW_Cuda.d_deltaTVolumenes, num_volumenes);
-
-			// Obtenemos el mnimo delta T de todos los clusters por reduccin
-			MPI_Allreduce (&dT_min, &delta_T, 1, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
-//delta_T=5e-4/T;
-
-			// Actualizamos texDatosVolumenes. Dado que los kernels no pueden escribir
-			// en texturas, esta copia es inevitable
-			cudaMemcpyToArray(datos_SW_Cuda.d_datosVolumenes_1, 0, 1, datos_SW_Cuda.d_acumulador1, tam_datosVolumenes,
-				cudaMemcpyDeviceToDevice);
-			cudaMemcpyToArray(datos_SW_Cuda.d_datosVolumenes_2, 0, 1, datos_SW_Cuda.d_acumulador2, tam_datosVolumenes,
-				cudaMemcpyDeviceToDevice);
-
-			// Inicializamos los acumuladores para la siguiente iteracin
-			cudaMemset(datos_SW_Cuda.d_acumulador1, 0, tam_datosVolumenes);
-			cudaMemset(datos_SW_Cuda.d_acumulador2, 0, tam_datosVolumenes);
-
-			if (id_hebra == 0) {
-				fprintf(stdout, "Iteracion %3d, deltaT = %e seg, ", iter, delta_T*T);
-				fprintf(stdout, "Tiempo = %g seg\n", tiempo_act*T);
-				iter++;
-			}
+#ifdef PASO_TIEMPO_LOCAL
+			// Avanzamos hasta el final del macropaso para que, al guardar, todos los volmenes
+			// estn en el mismo tiempo
+			avanzarPasosSimulacion(&sim, SUBPASOS_PASO_LOCAL - sim.paso_local);
+#else
+			if (anidada->activa)
+				avanzarMallaAnidada(&sim_anidada, &sim);
+			else
+				avanzarPasosSimulacion(&sim, 1);
+#endif
 		}
 		tiempo_fin = MPI_Wtime();
+		if (id_hebra == 0) {
+			fprintf(stdout, "Volumenes actualizados por segundo: %e\n",
+				((double) num_volx)*num_voly_total*sim.iter/(tiempo_fin - tiempo_ini));
+		}
+		if (anidada->activa) {
+			fprintf(stdout, "Malla anidada: %ld subpasos en %ld pasos de la malla padre (%.2f por paso)\n",
+				sim_anidada.subpasos, sim_anidada.pasos, (sim_anidada.pasos > 0) ? ((double) sim_anidada.subpasos)/sim_anidada.pasos : 0.0);
+		}
+#if PASOS_HALO > 1
+		if (id_hebra == 0) {
+			// Mensajes ahorrados (en cada frontera entre clusters se envan 4 mensajes por intercambio)
+			// y volmenes calculados de forma redundante (2*(FILAS_HALO-1) filas por frontera)
+			num_intercambios = (sim.iter + PASOS_HALO - 1)/PASOS_HALO;
+			fprintf(stdout, "Halos de %d filas cada %d pasos: %ld intercambios en %d pasos (%ld mensajes menos), ",
+				FILAS_HALO, PASOS_HALO, num_intercambios, sim.iter, 4L*(num_procs-1)*(sim.iter - num_intercambios));
+			fprintf(stdout, "%.2f%% de volumenes calculados de forma redundante\n",
+				100.0*2*(num_procs-1)*(FILAS_HALO-1)/num_voly_total);
+		}
+#endif
 
 		// Inicio NetCDF
 		if(leer_fichero_puntos == 0) {
-		cudaMemcpy(datos_cluster->eta1_maxima, datos_SW_Cuda.d_eta1_maxima, tam_datosEta1, cudaMemcpyDeviceToHost);
-		for (j=0; j<ny_nc; j++) {
-			pos = (iniy + j*npics)*num_volx;
-			for (i=0; i<nx_nc; i++)
-				vec[j*nx_nc + i] = (datos_cluster->eta1_maxima[pos + i*npics].x - Hmin)*H;
+#if PROCESOS_ES > 0
+		if (parada) {
+			vec_es = (float *) bufferES();
+			strcpy((char *) vec_es, motivo_parada);
+			enviarES(ES_PARADA, 0, 0, sim.tiempo_act*T, strlen(motivo_parada)+1);
+		}
+		// El servidor de E/S guarda la eta1 mxima y cierra los ficheros
+		vec = (float *) bufferES();
+#else
+		if (parada)
+			escribirParadaNC(motivo_parada, sim.tiempo_act*T);
+#endif
+		// La eta1 mxima se guarda en el fichero de eta1
+		if (guardar[0]) {
+			copiarEta1MaximaACPU(&(sim.datos_SW_Cuda), datos_cluster->eta1_maxima, num_volx, num_voly);
+			for (j=0; j<ny_nc[0]; j++) {
+				pos = (iniy[0] + j*npics[0])*num_volx;
+				for (i=0; i<nx_nc[0]; i++)
+					vec[j*nx_nc[0] + i] = (datos_cluster->eta1_maxima[pos + i*npics[0]].x - Hmin)*H;
+			}
 		}
-		closeNC(nx_nc, ny_nc, iniy_nc, vec);
-		free(vec);
+#if PROCESOS_ES > 0
+		enviarES(ES_ETA1_MAXIMA, 0, 0, 0.0, guardar[0] ? nx_nc[0]*ny_nc[0]*sizeof(float) : 0);
+#else
+		closeNC(nx_nc[0], ny_nc[0], iniy_nc[0], vec);
+#endif
 		}
+		for (k=0; k<num_regiones; k++)
+			closeRegionNC(regiones+k);
 		// Fin NetCDF
 
+		if (leer_fichero_puntos == 1)
+			cerrarPuntos(&puntos);
+#if PROCESOS_ES > 0
+		cerrarClienteES(id_hebra);
+#endif
+		if (fp_diagnostico != NULL)
+			fclose(fp_diagnostico);
+
+		// Publicamos los campos finales
+		if (publicar_memoria) {
+			copiarEstadoSimulacionACPU(&sim);
+			publicarCamposMemoria(num_volx, num_voly, datos_cluster->datosVolumenes_1, datos_cluster->datosVolumenes_2,
+				datos_cluster->eta1_maxima, Hmin, H, Q, sim.tiempo_act*T, 1);
+			cerrarMemoriaCompartida();
+		}
+
 		// Liberamos la memoria de GPU
-		liberarSWCuda(&datos_SW_Cuda);
+		if (anidada->activa)
+			liberarMallaAnidada(&sim_anidada, &sim);
+		liberarSimulacion(&sim);
 	}
 	// Si err == 1, no hay memoria GPU suficiente y la hebra termina
 	// (no se puede hacer un return porque estamos en una hebra de MPI)
@@ -484,4 +1767,3 @@ extern "C" int shallowWater(TDatoCluster *datos_cluster, float xmin, float ymin,
 
 	return err;
 }
-
@@ -0,0 +1,130 @@
+#ifndef _SIMULACION_H_
+#define _SIMULACION_H_
+
+/*******************************************************/
+/* Interfaz para usar el simulador desde otro programa */
+/*******************************************************/
+
+// Uso tpico (todas las funciones son colectivas de MPI en param.comm):
+//   inicializarSimulacion(&sim, &datos_cluster, &param);
+//   sim.funcion_paso = ...;  // opcional
+//   avanzarSimulacionHasta(&sim, t);  // o avanzarPasosSimulacion(&sim, n)
+//   copiarEstadoSimulacionACPU(&sim);  // lee datos_cluster.datosVolumenes_1, ...
+//   liberarSimulacion(&sim);
+// datos_cluster se rellena con cargarDatosProblema. Todos los tiempos y parmetros
+// estn adimensionalizados (ver main.cxx)
+
+#include <mpi.h>
+#include "Constantes.hxx"
+#ifdef HEBRA_COMUNICACION
+#include <pthread.h>
+#endif
+
+struct TSimulacion;
+
+// Contadores de sincronizacin del segmento de un proceso en la ventana de volmenes de
+// comunicacin (ver HALOS_MEMORIA_COMPARTIDA). Los pasos se numeran desde 1
+typedef struct TSincronizacionHalos {
+	// ltimo paso cuyos volmenes de comunicacin estn en el segmento
+	volatile long publicado;
+	// ltimo paso cuyos volmenes de comunicacin han copiado el cluster superior e inferior
+	volatile long leido_ant, leido_sig;
+} TSincronizacionHalos;
+
+#ifdef HEBRA_COMUNICACION
+// Hebra de comunicacin de los volmenes de comunicacin (ver HEBRA_COMUNICACION). Los pasos
+// se numeran desde 1. Los contadores se protegen con mutex
+typedef struct THebraComunicacion {
+	pthread_t hebra;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// Indica si se ha creado la hebra (si MPI da el nivel de hebras NIVEL_HEBRAS_MPI)
+	int activa;
+	// Indican si se intercambian mensajes con el cluster superior e inferior
+	int mensajes_ant, mensajes_sig;
+	// ltimo paso pedido por la hebra principal, y ltimos pasos cuyos volmenes de comunicacin
+	// se han recibido y enviado
+	long pedido, recibido, enviado;
+	// Indica a la hebra que termine
+	int terminar;
+} THebraComunicacion;
+#endif
+
+// Funcin a la que se llama despus de cada paso de tiempo
+typedef void (*TFuncionPaso)(struct TSimulacion *sim, void *datos_usuario);
+
+// Parmetros de la simulacin (los mismos que recibe shallowWater)
+typedef struct TParametrosSW {
+	float borde_sup, borde_inf, borde_izq, borde_der;
+	float ancho_vol, alto_vol, area;
+	float CFL, r;
+	float angulo1, angulo2, angulo3, angulo4;
+	float peso, beta;
+	float mfc, mf0, mfs, vmax1, vmax2;
+	float gravedad, epsilon_h;
+	// Valores para adimensionalizar
+	float L, H, Q, T;
+	int num_voly_total;
+	int num_procs, id_hebra;
+	// Comunicador de los procesos de la simulacin (comm_calculo, o MPI_COMM_SELF en la malla
+	// anidada, que slo simula un proceso)
+	MPI_Comm comm;
+	// Capa de absorcin de los bordes abiertos (ver relajarEsponja): ancho en volmenes (0 si no
+	// hay), coeficiente de relajacin en el borde (adimensionalizado) y fila global de la primera
+	// fila del cluster
+	int esponja;
+	float esponja_coef;
+	int fila_ini_global;
+} TParametrosSW;
+
+// Estado de una simulacin en un proceso
+typedef struct TSimulacion {
+	// Datos de CPU del cluster (el estado en CPU slo se actualiza con copiarEstadoSimulacionACPU)
+	TDatoCluster *datos_cluster;
+	TParametrosSW param;
+	// Datos utilizados en Cuda por el cluster. d_datosVolumenes_1 y d_datosVolumenes_2
+	// tienen el estado actual en GPU (filas 1 a num_voly)
+	TSW_Cuda datos_SW_Cuda;
+	// Tipo MPI de un volumen del estado en GPU (TEstadoGPU)
+	MPI_Datatype tipo_estado;
+	// Peticiones de las recepciones y los envos de los volmenes de comunicacin
+	MPI_Request peticiones_rec[4], peticiones_env[4];
+	// Tiempo actual y delta T del siguiente paso
+	TTiempo tiempo_act, delta_T;
+	// Nmero de pasos dados
+	int iter;
+	// Subpaso actual dentro del macropaso (ver PASO_TIEMPO_LOCAL). Si es distinto de 0, los
+	// bloques de clase mayor que 0 pueden no estar actualizados hasta tiempo_act. Siempre es 0
+	// si no se define PASO_TIEMPO_LOCAL
+	int paso_local;
+	// Pasos dados desde la ltima lectura de los bloques activos (ver OMITIR_BLOQUES_SECOS)
+	int pasos_bloques;
+	// Si no es NULL, se llama despus de cada paso con datos_usuario
+	TFuncionPaso funcion_paso;
+	void *datos_usuario;
+#ifdef HALOS_MEMORIA_COMPARTIDA
+	// Comunicador de los procesos del nodo y ventana de memoria compartida con sus volmenes de
+	// comunicacin. base_nodo es el principio de la ventana (NULL si no se ha podido registrar en Cuda)
+	MPI_Comm comm_nodo;
+	MPI_Win ventana_halos;
+	void *base_nodo;
+	// Contadores del segmento de este proceso y de los de los clusters superior e inferior
+	// (NULL si no estn en el mismo nodo)
+	TSincronizacionHalos *sinc, *sinc_ant, *sinc_sig;
+	// Punteros originales a los volmenes de comunicacin de datos_cluster, en el orden
+	// ComClusterSup_1, ComClusterSup_2, ComClusterInf_1, ComClusterInf_2, ComOtroClusterSup_1,
+	// ComOtroClusterSup_2, ComOtroClusterInf_1 y ComOtroClusterInf_2
+	float4 *punteros_com[8];
+#endif
+#ifdef HEBRA_COMUNICACION
+	THebraComunicacion hebra_com;
+#endif
+} TSimulacion;
+
+extern "C" int inicializarSimulacion(TSimulacion *sim, TDatoCluster *datos_cluster, TParametrosSW *param);
+extern "C" void avanzarPasosSimulacion(TSimulacion *sim, int num_pasos);
+extern "C" void avanzarSimulacionHasta(TSimulacion *sim, TTiempo tiempo);
+extern "C" void copiarEstadoSimulacionACPU(TSimulacion *sim);
+extern "C" void liberarSimulacion(TSimulacion *sim);
+
+#endif
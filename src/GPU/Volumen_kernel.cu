@@ -179,37 +179,19 @@ cf = 0.0;
 	}
 }
 
-__global__ void actualizarEta1MaximaGPU(float2 *d_eta1_maxima, int num_volx, int num_voly, float tiempo_act)
+// Capa de absorcin: relaja el estado de las dos capas hacia el estado de referencia ref (h1 y h2
+// iniciales, sin velocidad) con coeficiente coef. Es implcita, por lo que es estable con cualquier
+// delta T, y las alturas no se hacen negativas
+__device__ void relajarEsponja(float4 *acum1, float4 *acum2, float2 ref, float coef, float delta_T)
 {
-	float4 Wact1, Wact2;
-	float2 val_eta1;
-	float val;
-	int pos, pos_x_hebra, pos_y_hebra;
-
-	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
-	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_EST + threadIdx.y;
-
-	// Comprobamos si la hebra est dentro de los lmites de la malla
-	if ((pos_x_hebra < num_volx) && (pos_y_hebra < num_voly)) {
-		// pos = posicin en el vector d_eta1_maxima
-		pos = pos_y_hebra*num_volx + pos_x_hebra;
-		// Sumamos 1 a la coordenada y de la textura porque la primera
-		// fila de la textura corresponde a volmenes de comunicacin
-		// de otro cluster
-		pos_y_hebra++;
-
-		// Actualizamos la eta1 mxima, si procede
-		val_eta1 = d_eta1_maxima[pos];
-		Wact1 = tex2D(texDatosVolumenes_1, pos_x_hebra, pos_y_hebra);
-		Wact2 = tex2D(texDatosVolumenes_2, pos_x_hebra, pos_y_hebra);
-		//val = Wact1.x + Wact2.x - Wact1.w;
-		val = Wact1.x - Wact1.w;
-		if (val > val_eta1.x) {
-			val_eta1.x = val;
-			val_eta1.y = tiempo_act;
-			d_eta1_maxima[pos] = val_eta1;
-		}
-	}
+	float f = expf(-coef*delta_T);
+
+	acum1->x = ref.x + (acum1->x - ref.x)*f;
+	acum1->y *= f;
+	acum1->z *= f;
+	acum2->x = ref.y + (acum2->x - ref.y)*f;
+	acum2->y *= f;
+	acum2->z *= f;
 }
 
 __global__ void obtenerDeltaTVolumenesGPU(float4 *d_acumulador_1, float *d_deltaTVolumenes,
@@ -228,15 +210,57 @@ __global__ void obtenerDeltaTVolumenesGPU(float4 *d_acumulador_1, float *d_delta
 	}
 }
 
+// Obtiene el nuevo estado de cada volumen a partir de las contribuciones de las aristas
+// (d_acumulador_1 y d_acumulador_2) y el delta T local de cada volumen. En la misma pasada,
+// mientras los datos del volumen estn en registros:
+// - Escribe el nuevo estado en los arrays de las texturas mediante surfaces. Cada hebra slo
+//   lee de la textura su propio volumen, por lo que puede escribirlo en el mismo kernel.
+// - Pone a cero los acumuladores del volumen para la siguiente iteracin.
+// - Actualiza la eta1 mxima del volumen con el nuevo estado (tiempo_nuevo es su tiempo).
+// - En modo half, suma en d_errorMasa el error de redondeo de h1+h2 de los volmenes del bloque.
+// - Si OMITIR_BLOQUES_SECOS est definido, indica en d_bloquesActivos si el bloque tiene algn
+//   volumen con h1 o h2 mayor o igual que EPSILON, y suma 1 a d_numBloquesActivos si es as.
+// - Si esponja > 0, relaja los volmenes a menos de esponja volmenes de un borde abierto hacia
+//   d_estadoReferencia (ver relajarEsponja). fila_global es la fila global de la primera fila
+//   de los acumuladores.
+// Si PASO_TIEMPO_LOCAL est definido, slo se actualizan los bloques cuya clase k (en
+// d_clasesBloques) termina su paso de 2^k*delta_T en el subpaso paso_local, con los flujos que
+// han acumulado las aristas (ya multiplicados por su paso de tiempo)
 __global__ void obtenerEstadoYDeltaTVolumenesGPU(float4 *d_acumulador_1, float4 *d_acumulador_2,
-			float *d_deltaTVolumenes, int num_volx, int num_voly, float area, float CFL, float r,
-			float delta_T, float angulo1, float angulo2, float angulo3, float angulo4, float mfc,
-			float mf0, float mfs, float vmax1, float vmax2, float gravedad, float epsilon_h, float L, float H)
+			float *d_deltaTVolumenes, float2 *d_eta1_maxima, float *d_errorMasa, int *d_bloquesActivos,
+			int *d_numBloquesActivos, int *d_clasesBloques, int paso_local, int num_volx, int num_voly,
+			float area, float CFL, float r, float delta_T, float tiempo_nuevo, float angulo1, float angulo2,
+			float angulo3, float angulo4, float mfc, float mf0, float mfs, float vmax1, float vmax2,
+			float gravedad, float epsilon_h, float L, float H, float2 *d_estadoReferencia, int esponja,
+			float esponja_coef, int fila_global, int num_voly_total, float borde_sup, float borde_inf,
+			float borde_izq, float borde_der)
 {
 	float4 Want1, Want2;
 	float4 acum1, acum2;
+	float2 val_eta1;
 	float val, paso;
 	int pos, pos_x_hebra, pos_y_hebra;
+	int dist, fila;
+#ifdef ALMACENAMIENTO_HALF
+	__shared__ float err_bloque[NUM_HEBRAS_ANCHO_EST*NUM_HEBRAS_ALTO_EST];
+	ushort4 est1, est2;
+	float err = 0.0;
+	int tid = threadIdx.y*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
+	int i;
+#else
+	float4 est1, est2;
+#endif
+#ifdef OMITIR_BLOQUES_SECOS
+	int activo = 0;
+#endif
+#ifdef PASO_TIEMPO_LOCAL
+	int clase = d_clasesBloques[blockIdx.y*gridDim.x + blockIdx.x];
+
+	// Todas las hebras del bloque salen a la vez, por lo que no afecta a las sincronizaciones
+	if (((paso_local+1) & ((1 << clase) - 1)) != 0)
+		return;
+	delta_T = (1 << clase)*delta_T;
+#endif
 
 	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
 	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_EST + threadIdx.y;
@@ -249,12 +273,21 @@ __global__ void obtenerEstadoYDeltaTVolumenesGPU(float4 *d_acumulador_1, float4
 		// fila de la textura corresponde a volmenes de comunicacin
 		// de otro cluster
 		pos_y_hebra++;
+#ifdef PASO_TIEMPO_LOCAL
+		// Los acumuladores tienen los flujos y la contribucin al delta T multiplicados por el
+		// paso de cada arista, cuya suma en el paso del bloque es delta_T
+		val = 1.0 / area;
+		acum1 = d_acumulador_1[pos];
+		paso = ((acum1.w < EPSILON*delta_T) ? 1e30 : (2.0*CFL*area*delta_T)/acum1.w);
+		d_deltaTVolumenes[pos] = paso;
+#else
 		val = delta_T / area;
 
 		// Contribucin al delta T
 		acum1 = d_acumulador_1[pos];
 		paso = ((acum1.w < EPSILON) ? 1e30 : (2.0*CFL*area)/acum1.w);
 		d_deltaTVolumenes[pos] = paso;
+#endif
 
 		// Actualizamos la capa 1
 		Want1 = tex2D(texDatosVolumenes_1, pos_x_hebra, pos_y_hebra);
@@ -262,7 +295,7 @@ __global__ void obtenerEstadoYDeltaTVolumenesGPU(float4 *d_acumulador_1, float4
 		acum1.x = Want1.x + val*acum1.x;
 		acum1.y = Want1.y + val*acum1.y;
 		acum1.z = Want1.z + val*acum1.z;
-		acum1.w = Want1.w;
+		// La componente w no se actualiza porque H est en texBatimetria
 
 		// Actualizamos la capa 2
 		acum2 = d_acumulador_2[pos];
@@ -271,17 +304,179 @@ __global__ void obtenerEstadoYDeltaTVolumenesGPU(float4 *d_acumulador_1, float4
 		acum2.x = Want2.x + val*acum2.x;
 		acum2.y = Want2.y + val*acum2.y;
 		acum2.z = Want2.z + val*acum2.z;
-		acum2.w = Want2.w;
 
 		filtroEstado(&acum1, &acum2, r, vmax1, vmax2, delta_T, gravedad, epsilon_h);
 		disImplicita(Want1, Want2, &acum1, &acum2, r, delta_T, mfc, mf0, mfs, gravedad, epsilon_h);
 		coulomb(&acum1, &acum2, r, angulo1, angulo2, angulo3, angulo4, delta_T, 1.0, gravedad,
 			epsilon_h, L, H);
 
-		d_acumulador_1[pos] = acum1;
-		d_acumulador_2[pos] = acum2;
+		// Capa de absorcin: el coeficiente crece cuadrticamente desde 0 en el interior de la
+		// capa hasta esponja_coef en los volmenes del borde
+		if (esponja > 0) {
+			fila = fila_global + pos_y_hebra - 1;
+			dist = esponja;
+			if (borde_izq > 0.0)  dist = min(dist, pos_x_hebra);
+			if (borde_der > 0.0)  dist = min(dist, num_volx-1-pos_x_hebra);
+			if (borde_sup > 0.0)  dist = min(dist, fila);
+			if (borde_inf > 0.0)  dist = min(dist, num_voly_total-1-fila);
+			if (dist < esponja) {
+				val = ((float) (esponja - dist))/esponja;
+				relajarEsponja(&acum1, &acum2, d_estadoReferencia[pos], esponja_coef*val*val, delta_T);
+			}
+		}
+
+		// Escribimos el nuevo estado en los arrays de las texturas. La componente w no se usa
+#ifdef ALMACENAMIENTO_HALF
+		est1 = make_ushort4(__float2half_rn(acum1.x), __float2half_rn(acum1.y), __float2half_rn(acum1.z), 0);
+		est2 = make_ushort4(__float2half_rn(acum2.x), __float2half_rn(acum2.y), __float2half_rn(acum2.z), 0);
+		err = (__half2float(est1.x) - acum1.x) + (__half2float(est2.x) - acum2.x);
+#else
+		est1 = make_float4(acum1.x, acum1.y, acum1.z, 0.0f);
+		est2 = make_float4(acum2.x, acum2.y, acum2.z, 0.0f);
+#endif
+		surf2Dwrite(est1, surfDatosVolumenes_1, pos_x_hebra*sizeof(TEstadoGPU), pos_y_hebra);
+		surf2Dwrite(est2, surfDatosVolumenes_2, pos_x_hebra*sizeof(TEstadoGPU), pos_y_hebra);
+
+		// Inicializamos los acumuladores para la siguiente iteracin
+		d_acumulador_1[pos] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+		d_acumulador_2[pos] = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+
+		// Actualizamos la eta1 mxima, si procede
+		val_eta1 = d_eta1_maxima[pos];
+		//val = acum1.x + acum2.x - tex2D(texBatimetria, pos_x_hebra, pos_y_hebra);
+		val = acum1.x - tex2D(texBatimetria, pos_x_hebra, pos_y_hebra);
+		if (val > val_eta1.x) {
+			val_eta1.x = val;
+			val_eta1.y = tiempo_nuevo;
+			d_eta1_maxima[pos] = val_eta1;
+		}
+#ifdef OMITIR_BLOQUES_SECOS
+		activo = ((acum1.x >= EPSILON) || (acum2.x >= EPSILON));
+#endif
+	}
+
+#ifdef OMITIR_BLOQUES_SECOS
+	// El bloque est activo si alguno de sus volmenes lo est
+	activo = __syncthreads_or(activo);
+	if ((threadIdx.x == 0) && (threadIdx.y == 0)) {
+		d_bloquesActivos[blockIdx.y*gridDim.x + blockIdx.x] = activo;
+		if (activo)
+			atomicAdd(d_numBloquesActivos, 1);
+	}
+#endif
+
+#ifdef ALMACENAMIENTO_HALF
+	// Reduccin del error de masa en el bloque
+	err_bloque[tid] = err;
+	__syncthreads();
+	for (i=NUM_HEBRAS_ANCHO_EST*NUM_HEBRAS_ALTO_EST/2; i>0; i>>=1) {
+		if (tid < i)
+			err_bloque[tid] += err_bloque[tid+i];
+		__syncthreads();
+	}
+	if (tid == 0)
+		atomicAdd(d_errorMasa, err_bloque[0]);
+#endif
+}
+
+// Guarda en d_estadoReferencia h1 y h2 de cada volumen del cluster en GPU, incluyendo las filas
+// fantasma (se lanza con blockGridEst y threadBlockEst al inicializar la simulacin con capa de
+// absorcin, ver relajarEsponja)
+__global__ void inicializarEsponjaGPU(float2 *d_estadoReferencia, int num_volx, int num_voly)
+{
+	float4 W1, W2;
+	int pos_x_hebra, pos_y_hebra;
+
+	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
+	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_EST + threadIdx.y;
+
+	if ((pos_x_hebra < num_volx) && (pos_y_hebra < num_voly)) {
+		// La primera fila de la textura es de volmenes de comunicacin
+		W1 = tex2D(texDatosVolumenes_1, pos_x_hebra, pos_y_hebra+1);
+		W2 = tex2D(texDatosVolumenes_2, pos_x_hebra, pos_y_hebra+1);
+		d_estadoReferencia[pos_y_hebra*num_volx + pos_x_hebra] = make_float2(W1.x, W2.x);
+	}
+}
+
+#ifdef PASO_TIEMPO_LOCAL
+// Obtiene en d_clases la clase de paso de tiempo de cada bloque de NUM_HEBRAS_ANCHO_EST x
+// NUM_HEBRAS_ALTO_EST volmenes (se lanza con blockGridEst y threadBlockEst): la mayor
+// k < NIVELES_PASO_LOCAL tal que 2^k*delta_T no supera el mnimo delta T local de los volmenes
+// del bloque. Si fila_sup_com (fila_inf_com) es 1, la primera (ltima) fila de bloques tiene
+// clase 0 porque comunica con el cluster superior (inferior)
+__global__ void clasificarBloquesGPU(float *d_deltaTVolumenes, int *d_clases, int num_volx, int num_voly,
+			float delta_T, int fila_sup_com, int fila_inf_com)
+{
+	__shared__ float dt_bloque[NUM_HEBRAS_ANCHO_EST*NUM_HEBRAS_ALTO_EST];
+	int tid = threadIdx.y*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
+	int pos_x_hebra, pos_y_hebra;
+	int i, clase;
+
+	pos_x_hebra = blockIdx.x*NUM_HEBRAS_ANCHO_EST + threadIdx.x;
+	pos_y_hebra = blockIdx.y*NUM_HEBRAS_ALTO_EST + threadIdx.y;
+	if ((pos_x_hebra < num_volx) && (pos_y_hebra < num_voly))
+		dt_bloque[tid] = d_deltaTVolumenes[pos_y_hebra*num_volx + pos_x_hebra];
+	else
+		dt_bloque[tid] = 1e30;
+	__syncthreads();
+
+	// Reduccin del mnimo delta T en el bloque
+	for (i=NUM_HEBRAS_ANCHO_EST*NUM_HEBRAS_ALTO_EST/2; i>0; i>>=1) {
+		if (tid < i)
+			dt_bloque[tid] = fminf(dt_bloque[tid], dt_bloque[tid+i]);
+		__syncthreads();
+	}
+
+	if (tid == 0) {
+		clase = 0;
+		while ((clase < NIVELES_PASO_LOCAL-1) && ((2 << clase)*delta_T <= dt_bloque[0]))
+			clase++;
+		if ((fila_sup_com && (blockIdx.y == 0)) || (fila_inf_com && (blockIdx.y == gridDim.y-1)))
+			clase = 0;
+		d_clases[blockIdx.y*gridDim.x + blockIdx.x] = clase;
 	}
 }
 
+// Limita la clase de cada bloque a la menor clase de sus 8 bloques vecinos ms 1, para que los
+// pasos de tiempo de bloques adyacentes se diferencien como mucho en un factor 2. Lee las
+// clases de d_clases_ant y escribe las nuevas en d_clases
+__global__ void suavizarClasesBloquesGPU(int *d_clases_ant, int *d_clases, int num_bloques_x, int num_bloques_y)
+{
+	int pos_hebra, bx, by, i, j, x, y;
+	int clase;
+
+	pos_hebra = blockIdx.x*NUM_HEBRAS_VOL + threadIdx.x;
+	if (pos_hebra < num_bloques_x*num_bloques_y) {
+		bx = pos_hebra%num_bloques_x;
+		by = pos_hebra/num_bloques_x;
+		clase = d_clases_ant[pos_hebra];
+		for (j=-1; j<=1; j++) {
+			for (i=-1; i<=1; i++) {
+				x = bx+i;
+				y = by+j;
+				if ((x >= 0) && (x < num_bloques_x) && (y >= 0) && (y < num_bloques_y))
+					clase = min(clase, d_clases_ant[y*num_bloques_x + x] + 1);
+			}
+		}
+		d_clases[pos_hebra] = clase;
+	}
+}
+#endif
+
+// Copia en d_muestras la eta1 (h1-H, como la eta1 mxima) de los num_puntos volmenes d_indice
+// de los puntos de guardado del cluster (ndices en las filas del cluster, que empiezan en la fila
+// fila_ini de la textura)
+__global__ void obtenerMuestrasPuntosGPU(int *d_indice, float *d_muestras, int num_puntos, int num_volx, int fila_ini)
+{
+	int i, pos, pos_x, pos_y;
+
+	i = blockIdx.x*NUM_HEBRAS_VOL + threadIdx.x;
+	if (i < num_puntos) {
+		pos = d_indice[i];
+		pos_x = pos%num_volx;
+		pos_y = pos/num_volx + fila_ini;
+		d_muestras[i] = tex2D(texDatosVolumenes_1, pos_x, pos_y).x - tex2D(texBatimetria, pos_x, pos_y);
+	}
+}
 
 #endif
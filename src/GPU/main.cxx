@@ -9,13 +9,17 @@
 /*****************/
 
 extern "C" int comprobarSoporteCUDA();
+extern "C" void asignarGPU(int id_hebra_nodo, int *dev, char *pci_bus_id, int *nodo_numa);
 extern "C" int shallowWater(TDatoCluster *datos_cluster, float xmin, float ymin, float HMin, char *nombre_bati,
 		char *prefijo, int num_voly_otros, int num_voly_total, float borde_sup, float borde_inf, float borde_izq,
-		float borde_der, float ancho_vol, float alto_vol, float area, float tiempo_tot, float tiempo_guardar,
+		float borde_der, float ancho_vol, float alto_vol, float area, TTiempo tiempo_tot, TTiempo tiempo_guardar,
 		float CFL, float r, float angulo1, float angulo2, float angulo3, float angulo4, float peso, float beta,
 		float mfc, float mf0, float mfs, float vmax1, float vmax2, float gravedad, float epsilon_h, float L, float H,
 		float Q, float T, int num_procs, int id_hebra, double *tiempo, int leer_fichero_puntos, 
-		int *indiceVolumenesGuardado, int *posicionesVolumenesGuardado, int num_puntos_guardar);
+		int *indiceVolumenesGuardado, int num_puntos_guardar, TOpciones *opciones, TRecorte *recorte,
+		TMallaAnidada *anidada);
+extern "C" int servidorES(MPI_Comm comm_es, int num_procs);
+extern "C" void cancelarServidoresES(int num_procs);
 
 /*********************/
 /* Fin funciones GPU */
@@ -27,7 +31,7 @@ void mostrarFormatoPrograma(char *argv[])
 	cerr << argv[0] << " ficheroDatos" << endl << endl; 
 	cerr << "Formato de ficheroDatos:" << endl;
 	cerr << "\tNombre de la batimetria" << endl;
-	cerr << "\tLeer condiciones iniciales de fichero (0|1)" << endl;
+	cerr << "\tLeer condiciones iniciales de fichero (0|1|2)" << endl;
 	cerr << "\tSi 0:" << endl;
 	cerr << "\t\tXmin" << endl;
 	cerr << "\t\tXmax" << endl;
@@ -38,6 +42,8 @@ void mostrarFormatoPrograma(char *argv[])
 	cerr << "\tSi 1:" << endl;
 	cerr << "\t\tFichero de topografia" << endl;
 	cerr << "\t\tFichero de estado inicial" << endl;
+	cerr << "\tSi 2:" << endl;
+	cerr << "\t\tFichero binario de topografia y estado inicial (generado con convertir_binario)" << endl;
 	cerr << "\tBorde superior  (1: abierto, 0 o -1: pared)" << endl;
 	cerr << "\tBorde inferior  (1: abierto, 0 o -1: pared)" << endl;
 	cerr << "\tBorde izquierdo (1: abierto, 0 o -1: pared)" << endl;
@@ -57,11 +63,58 @@ void mostrarFormatoPrograma(char *argv[])
 	cerr << "\t\tL" << endl;
 	cerr << "\t\tH" << endl;
 	cerr << "\tPrefijo de los ficheros de guardado" << endl;
+	cerr << "\tOpciones (opcionales, una por linea con el formato 'nombre valor'):" << endl;
+	cerr << "\t\tmemoria_compartida nombre  Publicar los campos en cada guardado en el segmento de" << endl;
+	cerr << "\t\t                           memoria compartida /nombre.<proceso> o en el fichero nombre.<proceso>" << endl;
+	cerr << "\t\tintervalo_puntos t         Guardar los puntos cada t segundos (0: en cada paso). Por defecto," << endl;
+	cerr << "\t\t                           el tiempo de guardado" << endl;
+	cerr << "\t\tdiezmado n                 Guardar en NetCDF uno de cada n volumenes en x e y (por defecto 1)" << endl;
+	cerr << "\t\tdiezmado_<var> n           Diezmado de una variable (eta1, q1x, q1y, eta2, q2x o q2y)" << endl;
+	cerr << "\t\tguardar_<var> 0|1          Guardar o no una variable en NetCDF (por defecto 1). Si no se" << endl;
+	cerr << "\t\t                           guarda eta1, tampoco se guardan la batimetria ni la eta1 maxima" << endl;
+	cerr << "\t\tintervalo_<var> t          Guardar una variable cada t segundos (0: en cada paso). Por" << endl;
+	cerr << "\t\t                           defecto, el tiempo de guardado" << endl;
+	cerr << "\t\tprecision p                Guardar en NetCDF las variables cuantizadas con precision absoluta p" << endl;
+	cerr << "\t\t                           en enteros de 16 bits (0: en float, por defecto). Los valores fuera" << endl;
+	cerr << "\t\t                           de +-32767*p se saturan" << endl;
+	cerr << "\t\tprecision_<var> p          Precision de una variable" << endl;
+	cerr << "\t\tintervalo_diagnostico t    Escribir cada t segundos (0: en cada paso) en prefijo_diagnostico.txt" << endl;
+	cerr << "\t\t                           el volumen que limita el delta T y el histograma de los delta T" << endl;
+	cerr << "\t\t                           locales. Por defecto no se escribe" << endl;
+	cerr << "\t\tparada_velocidad v         Terminar cuando, despues de haberse movido, la velocidad maxima" << endl;
+	cerr << "\t\t                           de las dos capas sea menor que v m/s (por defecto no se comprueba)" << endl;
+	cerr << "\t\tparada_energia e           Terminar cuando, despues de haberse movido, la energia cinetica de" << endl;
+	cerr << "\t\t                           las dos capas por unidad de densidad sea menor que e m5/s2. Si hay" << endl;
+	cerr << "\t\t                           dos umbrales, se tienen que cumplir los dos" << endl;
+	cerr << "\t\tparada_intervalo t         Comprobar la parada cada t segundos. Por defecto, el tiempo de" << endl;
+	cerr << "\t\t                           guardado" << endl;
+	cerr << "\t\tparada_tiempo_minimo t     No terminar antes de t segundos (por defecto 0)" << endl;
+	cerr << "\t\tregion x0 x1 y0 y1 t       Guardar a resolucion completa los volumenes de [x0,x1] x [y0,y1]" << endl;
+	cerr << "\t\t                           cada t segundos (0: en cada paso) en prefijo_region<k>.nc." << endl;
+	cerr << "\t\t                           Puede haber hasta " << MAX_REGIONES << " regiones" << endl;
+	cerr << "\t\tmalla_anidada fichero      Anidar en la malla la malla del fichero binario (generado con" << endl;
+	cerr << "\t\t                           convertir_binario), con volumenes un numero entero de veces mas" << endl;
+	cerr << "\t\t                           pequenos que cubren volumenes completos de la malla" << endl;
+	cerr << "\t\tesponja n                  Capa de absorcion de n volumenes en los bordes abiertos, donde las" << endl;
+	cerr << "\t\t                           dos capas se relajan hacia su estado inicial sin velocidad (por" << endl;
+	cerr << "\t\t                           defecto 0: sin capa)" << endl;
+	cerr << "\t\tesponja_tiempo t           Tiempo de relajacion en el borde de la capa de absorcion (por" << endl;
+	cerr << "\t\t                           defecto 60 seg). Crece cuadraticamente hacia el interior" << endl;
+	cerr << "\t\trecorte_margen m           Quitar de la malla las filas y columnas de los bordes que nunca se" << endl;
+	cerr << "\t\t                           pueden mojar (fondo a mas de m metros por encima de la maxima" << endl;
+	cerr << "\t\t                           superficie libre inicial, o no conectado con el agua). Solo con" << endl;
+	cerr << "\t\t                           el fichero binario. Los ficheros NetCDF tienen la malla completa" << endl;
 }
 
 int main(int argc, char *argv[])
 {
 	TDatoCluster datos_cluster;
+	TOpciones opciones;
+	// Recorte de la malla del fichero (ver TRecorte)
+	TRecorte recorte;
+	// Malla anidada (ver MallaAnidada.cu) y nmero de procesos que la tienen
+	TMallaAnidada anidada;
+	int num_anidadas;
 	char fich_ent[256];
 	int iter, soporteCUDA, err, err2 = 1;
 	double tiempo_gpu, tiempo_multigpu;
@@ -80,16 +133,53 @@ int main(int argc, char *argv[])
 	string nombre_bati, prefijo;
 	// Variables para MPI
 	MPI_Status status;
+	MPI_Comm comm_nodo;
 	int id_hebra, num_procs;
+	// Nmero del proceso dentro de su nodo, GPU asignada y nodo NUMA de la GPU
+	int id_hebra_nodo, dev, nodo_numa;
+	char nombre_nodo[MPI_MAX_PROCESSOR_NAME];
+	char pci_bus_id[32];
+	int long_nombre;
+	// Nivel de hebras que da MPI
+	int nivel_hebras;
+#if PROCESOS_ES > 0
+	// Indica si el proceso es un servidor de E/S, y comunicador de los servidores o de los
+	// procesos de clculo
+	int servidor_es;
+	MPI_Comm comm_grupo;
+#endif
+	// Memoria de CPU de la arena de cada proceso, mxima y total (en MB)
+	double tam_arena, tam_arena_max, tam_arena_total;
 	int ultima_hebra;
 	int *indiceVolumenesGuardado = NULL;
-        int *posicionesVolumenesGuardado = NULL;
         int leer_fichero_puntos, num_puntos_guardar;
 
-	MPI_Init(&argc, &argv);
+	// Slo la hebra principal llama a MPI, salvo con HEBRA_COMUNICACION (ver Constantes.hxx)
+	MPI_Init_thread(&argc, &argv, NIVEL_HEBRAS_MPI, &nivel_hebras);
 	MPI_Comm_rank(MPI_COMM_WORLD, &id_hebra);
 	MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
+#if PROCESOS_ES > 0
+	// Los ltimos PROCESOS_ES procesos son servidores de E/S (ver ServidorES.hxx). El resto
+	// hace la simulacin en comm_calculo con los mismos nmeros de proceso
+	if (num_procs < 2*PROCESOS_ES) {
+		if (id_hebra == 0)
+			cerr << "Error: Hacen falta al menos " << 2*PROCESOS_ES << " procesos con " << PROCESOS_ES << " servidores de E/S" << endl;
+		MPI_Finalize();
+		return 1;
+	}
+	servidor_es = (id_hebra >= num_procs-PROCESOS_ES) ? 1 : 0;
+	MPI_Comm_split(MPI_COMM_WORLD, servidor_es, id_hebra, &comm_grupo);
+	if (servidor_es) {
+		err = servidorES(comm_grupo, num_procs-PROCESOS_ES);
+		MPI_Comm_free(&comm_grupo);
+		MPI_Finalize();
+		return err;
+	}
+	comm_calculo = comm_grupo;
+	num_procs -= PROCESOS_ES;
+#endif
 	ultima_hebra = (id_hebra == num_procs-1) ? 1 : 0;
+	anidada.activa = 0;
 
 	if (id_hebra == 0) {
 		// El proceso 0 lee los datos de entrada
@@ -109,14 +199,20 @@ int main(int argc, char *argv[])
 	}
 
 	// El proceso 0 enva err y fich_prob al resto de procesos
-	MPI_Bcast (&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
-	MPI_Bcast (fich_ent, 256, MPI_CHAR, 0, MPI_COMM_WORLD);
+	MPI_Bcast (&err, 1, MPI_INT, 0, comm_calculo);
+	MPI_Bcast (fich_ent, 256, MPI_CHAR, 0, comm_calculo);
 	string str_fich_ent(fich_ent);
 
 	if (err == 0) {
 		// No ha habido error
 		// Todos los procesos ejecutan esto
 
+		// Obtenemos el nmero del proceso dentro de su nodo
+		MPI_Comm_split_type(comm_calculo, MPI_COMM_TYPE_SHARED, id_hebra, MPI_INFO_NULL, &comm_nodo);
+		MPI_Comm_rank(comm_nodo, &id_hebra_nodo);
+		MPI_Comm_free(&comm_nodo);
+		MPI_Get_processor_name(nombre_nodo, &long_nombre);
+
 		// Comprobamos si la tarjeta grfica soporta CUDA
 		soporteCUDA = comprobarSoporteCUDA();
 		if (soporteCUDA == 1) {
@@ -127,6 +223,13 @@ int main(int argc, char *argv[])
 				cerr << "Error en hebra " << id_hebra << ": No hay ninguna tarjeta grafica que soporte CUDA" << endl;
 				err = 1;
 		}
+		else {
+			// Asignamos la GPU antes de reservar memoria para que la memoria de CPU quede
+			// en el nodo NUMA de la GPU
+			asignarGPU(id_hebra_nodo, &dev, pci_bus_id, &nodo_numa);
+			cout << "Hebra " << id_hebra << " en " << nombre_nodo << ": GPU " << dev << " (PCI " << pci_bus_id
+				<< ", nodo NUMA " << nodo_numa << ")" << endl;
+		}
 
 		cout << "Hebra " << id_hebra << " cargando datos" << endl;
 		// Creamos una instancia de Problema
@@ -134,16 +237,39 @@ int main(int argc, char *argv[])
 				&xmin, &xmax, &ymin, &ymax, &Hmin, &borde_sup, &borde_inf, &borde_izq, &borde_der, &ancho_vol, &alto_vol,
 				&area, &tiempo_tot, &tiempo_guardar, &CFL, &r, &angulo1, &angulo2, &angulo3, &angulo4, &mfc, &mf0, &mfs,
 				&vmax1, &vmax2, &gravedad, &epsilon_h, &L, &H, &Q, &T, num_procs, id_hebra, &leer_fichero_puntos, 
-				&indiceVolumenesGuardado, &posicionesVolumenesGuardado,
-                        	&num_puntos_guardar);
+				&indiceVolumenesGuardado, &num_puntos_guardar, &opciones, &recorte);
 
 		// Comprobamos si ha habido error en algn proceso
-		MPI_Allreduce(&err, &err2, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+		MPI_Allreduce(&err, &err2, 1, MPI_INT, MPI_MAX, comm_calculo);
+
+		// Cargamos la malla anidada en el proceso que la tiene entera en sus filas
+		if ((err2 == 0) && (opciones.malla_anidada[0] != '\0')) {
+			err = cargarMallaAnidada(string(opciones.malla_anidada), &datos_cluster, &anidada, num_voly_otros,
+					num_voly_total, xmin, ymin, ancho_vol, alto_vol, Hmin, L, H, Q, id_hebra);
+			MPI_Allreduce(&err, &err2, 1, MPI_INT, MPI_MAX, comm_calculo);
+			MPI_Allreduce(&(anidada.activa), &num_anidadas, 1, MPI_INT, MPI_SUM, comm_calculo);
+			if ((err2 == 0) && (num_anidadas == 0)) {
+				if (id_hebra == 0)
+					cerr << "Error: La malla anidada no cabe en las filas de ningun proceso. Pruebe con menos procesos" << endl;
+				err2 = 1;
+			}
+		}
 
 		if (id_hebra == 0) {
 			mostrarDatosProblema(datos_cluster.num_volx, num_voly_total, xmin, xmax, ymin, ymax, tiempo_tot,
 				CFL, r, angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, L, H, Q, T);
 		}
+
+		// Mostramos la memoria de CPU reservada en las arenas de los procesos
+		if (err2 == 0) {
+			tam_arena = datos_cluster.arena.tam/(1024.0*1024.0);
+			MPI_Reduce (&tam_arena, &tam_arena_max, 1, MPI_DOUBLE, MPI_MAX, 0, comm_calculo);
+			MPI_Reduce (&tam_arena, &tam_arena_total, 1, MPI_DOUBLE, MPI_SUM, 0, comm_calculo);
+			if (id_hebra == 0) {
+				cout << "Memoria CPU: " << tam_arena_max << " MB maximo por proceso, " << tam_arena_total
+					<< " MB total (alineamiento " << ALINEAMIENTO_ARENA << " bytes)" << endl;
+			}
+		}
 	}
 
 	cout << scientific;
@@ -156,12 +282,12 @@ int main(int argc, char *argv[])
 		}
 		err = shallowWater(&datos_cluster, (float) xmin, (float) ymin, (float) Hmin, (char *) nombre_bati.c_str(),
 				(char *) prefijo.c_str(), num_voly_otros, num_voly_total, (float) borde_sup, (float) borde_inf,
-				(float) borde_izq, (float) borde_der, (float) ancho_vol, (float) alto_vol, (float) area, (float) tiempo_tot,
-				(float) tiempo_guardar, (float) CFL, (float) r, (float) angulo1, (float) angulo2, (float) angulo3,
+				(float) borde_izq, (float) borde_der, (float) ancho_vol, (float) alto_vol, (float) area, (TTiempo) tiempo_tot,
+				(TTiempo) tiempo_guardar, (float) CFL, (float) r, (float) angulo1, (float) angulo2, (float) angulo3,
 				(float) angulo4, (float) 1.0, (float) 1.0, (float) mfc, (float) mf0, (float) mfs, (float) vmax1,
 				(float) vmax2, (float) gravedad, (float) epsilon_h, (float) L, (float) H, (float) Q, (float) T,
-				num_procs, id_hebra, &tiempo_gpu, leer_fichero_puntos, indiceVolumenesGuardado, posicionesVolumenesGuardado,
-                        	num_puntos_guardar);
+				num_procs, id_hebra, &tiempo_gpu, leer_fichero_puntos, indiceVolumenesGuardado, num_puntos_guardar,
+				&opciones, &recorte, &anidada);
 		if (err > 0) {
 			if (err == 1)
 				cerr << "Error: No hay memoria GPU suficiente" << endl;
@@ -171,10 +297,20 @@ int main(int argc, char *argv[])
 		}
 
 		// El tiempo total es el mximo de los tiempos locales
-		MPI_Reduce (&tiempo_gpu, &tiempo_multigpu, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+		MPI_Reduce (&tiempo_gpu, &tiempo_multigpu, 1, MPI_DOUBLE, MPI_MAX, 0, comm_calculo);
 		if (id_hebra == 0)
 			cout << endl << "Tiempo: " << tiempo_multigpu << " seg" << endl;
+
+		liberarMemoria(&datos_cluster);
+		if (anidada.activa)
+			liberarMemoria(&(anidada.datos));
+	}
+#if PROCESOS_ES > 0
+	else if (id_hebra == 0) {
+		// Los servidores de E/S terminan sin guardar nada
+		cancelarServidoresES(num_procs);
 	}
+#endif
 
 	MPI_Finalize();
 
@@ -5,18 +5,66 @@
 #include <netcdf.h>
 #include "pnetcdf.h"
 
+// Tipo NetCDF del eje temporal (ver PRECISION_MIXTA en Constantes.hxx)
+#ifdef PRECISION_MIXTA
+#define NC_TIEMPO  NC_DOUBLE
+#define ncmpi_put_vara_tiempo_all  ncmpi_put_vara_double_all
+#else
+#define NC_TIEMPO  NC_FLOAT
+#define ncmpi_put_vara_tiempo_all  ncmpi_put_vara_float_all
+#endif
+
 bool ErrorEnNetCDF;
-// Ids de ficheros
-int ncid_eta1, ncid_q1x, ncid_q1y;
-int ncid_eta2, ncid_q2x, ncid_q2y;
-// Ids de variables
-int time_eta1_id, eta1_id;
-int time_q1x_id, q1x_id;
-int time_q1y_id, q1y_id;
-int time_eta2_id, eta2_id;
-int time_q2x_id, q2x_id;
-int time_q2y_id, q2y_id;
+// Ids de ficheros y de variables, en el orden eta1, q1x, q1y, eta2, q2x, q2y
+int ncid_vars[NUM_VARIABLES];
+// Indica si se guarda cada variable (sólo se crean los ficheros de las que se guardan)
+int guardar_vars[NUM_VARIABLES];
+int time_ids[NUM_VARIABLES], var_ids[NUM_VARIABLES];
 int eta1_max_id;
+// Precisión de cada variable si se guarda cuantizada, o 0 si se guarda en float
+float precision_vars[NUM_VARIABLES];
+
+// Las variables cuantizadas se guardan en enteros de 16 bits como round(v/precision), saturados a
+// +-MAX_CUANTIZADO. FILL_CUANTIZADO es su valor de relleno (y el de los valores no numéricos)
+#define MAX_CUANTIZADO   32767
+#define FILL_CUANTIZADO  ((short) -32768)
+// Buffer donde se cuantizan las variables antes de guardarlas (crece según se necesita)
+short *buffer_cuantizado = NULL;
+int tam_buffer_cuantizado = 0;
+
+// Recorte de la malla (ver TRecorte). Si hay recorte, los ficheros tienen la malla original y los
+// volúmenes que no se simulan tienen el valor de relleno. Para cada variable, primera columna y
+// fila de la malla recortada en el fichero, y volúmenes en x e y de la malla recortada (en todos
+// los procesos) y de la malla original
+bool hay_recorte_nc = false;
+int desp_x_nc[NUM_VARIABLES], desp_y_nc[NUM_VARIABLES];
+int nx_rec_nc[NUM_VARIABLES], ny_rec_nc[NUM_VARIABLES];
+int nx_orig_nc[NUM_VARIABLES], ny_orig_nc[NUM_VARIABLES];
+
+// Nombres, unidades y descripciones de las variables (en el mismo orden)
+static const char *nombres_nc[NUM_VARIABLES] = {"eta1", "q1x", "q1y", "eta2", "q2x", "q2y"};
+static const char *unidades_nc[NUM_VARIABLES] = {"meters", "meters/second", "meters/second",
+	"meters", "meters/second", "meters/second"};
+static const char *descripciones_nc[NUM_VARIABLES] = {"Wave amplitude", "Mass flow of water along x",
+	"Mass flow of water along y", "Sediments", "Mass flow of sediments along x", "Mass flow of sediments along y"};
+
+// Región de interés que se guarda a resolución completa en el fichero <prefijo>_region<k>.nc
+// con las variables i con guardar[i] != 0 (cuantizadas si precision[i] > 0). Sólo los procesos cuyas filas solapan la región forman parte de comm
+// y participan en sus escrituras (en el resto comm es MPI_COMM_NULL)
+typedef struct TRegionNC {
+	MPI_Comm comm;
+	int ncid, time_id, var_id[NUM_VARIABLES];
+	int guardar[NUM_VARIABLES];
+	float precision[NUM_VARIABLES];
+	// Primer volumen y número de volúmenes de la región en x e y (en toda la malla)
+	int inix, nx, iniy, ny;
+	// Primera fila local al cluster y número de filas de la región en este proceso,
+	// y posición de la primera fila en el fichero
+	int iniy_local, ny_local, iniy_nc;
+	// Número del siguiente estado que se guarda, tiempo entre guardados y tiempo del siguiente
+	int num;
+	TTiempo intervalo, sig_tiempo;
+} TRegionNC;
 
 void check_err(int iret)
 {
@@ -26,11 +74,122 @@ void check_err(int iret)
 	}
 }
 
-void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char *nombre_bati, char *prefijo, int nvar,
-			int *p_ncid, int *time_id, int *var_id, int nx_nc, int ny_nc, int num_volx, int num_voly, int num_voly_otros,
+// Pone los atributos de relleno de la variable var_id. Si precision > 0, la variable es de
+// tipo NC_SHORT y además pone scale_factor y add_offset para que se lea como float
+void definirAtributosValorNC(int ncid, int var_id, float precision)
+{
+	int iret;
+	float fill_float = -1e+30;
+	short fill_short = FILL_CUANTIZADO;
+	float desp = 0.0;
+
+	if (precision > 0.0) {
+		iret = ncmpi_put_att_float(ncid, var_id, "scale_factor", NC_FLOAT, 1, &precision);
+		check_err(iret);
+		iret = ncmpi_put_att_float(ncid, var_id, "add_offset", NC_FLOAT, 1, &desp);
+		check_err(iret);
+		iret = ncmpi_put_att_short(ncid, var_id, "missing_value", NC_SHORT, 1, &fill_short);
+		check_err(iret);
+		iret = ncmpi_put_att_short(ncid, var_id, "_FillValue", NC_SHORT, 1, &fill_short);
+		check_err(iret);
+	}
+	else {
+		iret = ncmpi_put_att_float(ncid, var_id, "missing_value", NC_FLOAT, 1, &fill_float);
+		check_err(iret);
+		iret = ncmpi_put_att_float(ncid, var_id, "_FillValue", NC_FLOAT, 1, &fill_float);
+		check_err(iret);
+	}
+}
+
+// Guarda en la variable var_id los valores de var en la posición start con tamaño count (en
+// todos los procesos del fichero). Si precision > 0, los cuantiza antes en buffer_cuantizado
+void ponerVariableNC(int ncid, int var_id, MPI_Offset *start, MPI_Offset *count, float precision, float *var)
+{
+	int i, n, iret;
+	float v, inv;
+
+	if (precision > 0.0) {
+		n = (int) (count[0]*count[1]*count[2]);
+		if (n > tam_buffer_cuantizado) {
+			free(buffer_cuantizado);
+			buffer_cuantizado = (short *) malloc(n*sizeof(short));
+			tam_buffer_cuantizado = n;
+		}
+		inv = 1.0f/precision;
+		for (i=0; i<n; i++) {
+			v = rintf(var[i]*inv);
+			if (v != v)
+				buffer_cuantizado[i] = FILL_CUANTIZADO;
+			else
+				buffer_cuantizado[i] = (short) fminf(fmaxf(v, -MAX_CUANTIZADO), MAX_CUANTIZADO);
+		}
+		iret = ncmpi_put_vara_short_all(ncid, var_id, start, count, buffer_cuantizado);
+	}
+	else {
+		iret = ncmpi_put_vara_float_all(ncid, var_id, start, count, var);
+	}
+	check_err(iret);
+}
+
+// Pone el valor de relleno en las filas [fila, fila+nf) y las columnas [col, col+nc) de la
+// variable var_id, en el estado num si num >= 0 (el rectángulo puede estar vacío). Es colectiva
+// en los procesos del fichero
+void rellenarRectanguloNC(int ncid, int var_id, MPI_Offset num, int fila, int nf, int col, int nc, float precision)
+{
+	MPI_Offset start[3], count[3];
+	float *fill_float;
+	short *fill_short;
+	int i, d, n, iret;
+
+	n = nf*nc;
+	if (n <= 0)
+		n = fila = nf = col = nc = 0;
+	d = 0;
+	if (num >= 0) {
+		start[0] = num;
+		count[0] = 1;
+		d = 1;
+	}
+	start[d] = fila;    count[d] = nf;
+	start[d+1] = col;   count[d+1] = nc;
+	if (precision > 0.0) {
+		fill_short = (short *) malloc(max(n,1)*sizeof(short));
+		for (i=0; i<n; i++)
+			fill_short[i] = FILL_CUANTIZADO;
+		iret = ncmpi_put_vara_short_all(ncid, var_id, start, count, fill_short);
+		free(fill_short);
+	}
+	else {
+		fill_float = (float *) malloc(max(n,1)*sizeof(float));
+		for (i=0; i<n; i++)
+			fill_float[i] = -1e+30;
+		iret = ncmpi_put_vara_float_all(ncid, var_id, start, count, fill_float);
+		free(fill_float);
+	}
+	check_err(iret);
+}
+
+// Pone el valor de relleno en los volúmenes de la malla original de la variable var_id que no
+// están en la malla recortada y le tocan a este proceso: los de sus filas a los lados de la malla
+// recortada y, si tiene la primera (última) fila de la malla recortada, las filas de encima
+// (debajo). El proceso escribe las filas [iniy, iniy+ny) de la malla recortada, que tiene nx x
+// ny_total volúmenes y empieza en la columna desp_x y la fila desp_y de la malla original de
+// nx_orig x ny_orig volúmenes. Es colectiva en los procesos del fichero
+void rellenarRecorteNC(int ncid, int var_id, MPI_Offset num, float precision, int iniy, int ny, int nx, int ny_total,
+			int desp_x, int desp_y, int nx_orig, int ny_orig)
+{
+	rellenarRectanguloNC(ncid, var_id, num, 0, (iniy == 0) ? desp_y : 0, 0, nx_orig, precision);
+	rellenarRectanguloNC(ncid, var_id, num, desp_y+ny_total, (iniy+ny == ny_total) ? ny_orig-desp_y-ny_total : 0,
+		0, nx_orig, precision);
+	rellenarRectanguloNC(ncid, var_id, num, desp_y+iniy, ny, 0, desp_x, precision);
+	rellenarRectanguloNC(ncid, var_id, num, desp_y+iniy, ny, desp_x+nx, nx_orig-desp_x-nx, precision);
+}
+
+void fgennc(MPI_Comm comm, int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char *nombre_bati, char *prefijo, int nvar,
+			int *p_ncid, int *time_id, int *var_id, float precision, int nx_nc, int ny_nc, int num_volx, int num_voly, int num_voly_otros,
 			int num_voly_total, float xmin, float ymin, float ancho_vol, float alto_vol, float tiempo_tot, float CFL,
 			float r, float angulo1, float angulo2, float angulo3, float angulo4, float mfc, float mf0, float mfs,
-			float vmax1, float vmax2, float *bati)
+			float vmax1, float vmax2, float *bati, TRecorte *recorte)
 {
 	char nombre_fich[256];
 	char cadena[256];
@@ -42,6 +201,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 	int time_dim;
 	// Ids
 	int ncid;
+	nc_type tipo_var = (precision > 0.0) ? NC_SHORT : NC_FLOAT;
 	int grid_id, grid_x_id, grid_y_id;
 	int x_id, y_id;
 	float val_float, fill_float;
@@ -57,7 +217,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 	else if (nvar == 4)  sprintf(nombre_fich, "%s_eta2.nc", prefijo);
 	else if (nvar == 5)  sprintf(nombre_fich, "%s_q2x.nc", prefijo);
 	else if (nvar == 6)  sprintf(nombre_fich, "%s_q2y.nc", prefijo);
-	iret = ncmpi_create(MPI_COMM_WORLD, nombre_fich, NC_CLOBBER, MPI_INFO_NULL, p_ncid);
+	iret = ncmpi_create(comm, nombre_fich, NC_CLOBBER, MPI_INFO_NULL, p_ncid);
 	check_err(iret);
 	ncid = *p_ncid;
 
@@ -67,9 +227,9 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 	iret = ncmpi_def_dim(ncid, "lat", ny_nc, &y_dim);
 	check_err(iret);
 	if (nvar == 1) {
-		iret = ncmpi_def_dim(ncid, "grid_x", num_volx, &grid_x_dim);
+		iret = ncmpi_def_dim(ncid, "grid_x", recorte->num_volx_orig, &grid_x_dim);
 		check_err(iret);
-		iret = ncmpi_def_dim(ncid, "grid_y", num_voly_total, &grid_y_dim);
+		iret = ncmpi_def_dim(ncid, "grid_y", recorte->num_voly_orig, &grid_y_dim);
 		check_err(iret);
 	}
 	iret = ncmpi_def_dim(ncid, "time", NC_UNLIMITED, &time_dim);
@@ -96,12 +256,12 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 	// Nota: reutilizamos el array grid_dims
 	grid_dims[0] = y_dim;
 	grid_dims[1] = x_dim;
-	iret = ncmpi_def_var(ncid, "time", NC_FLOAT, 1, &time_dim, time_id);
+	iret = ncmpi_def_var(ncid, "time", NC_TIEMPO, 1, &time_dim, time_id);
 	check_err(iret);
 	if (nvar == 1) {
 		iret = ncmpi_def_var(ncid, "max_height", NC_FLOAT, 2, grid_dims, &eta1_max_id);
 		check_err(iret);
-		iret = ncmpi_def_var(ncid, "eta1", NC_FLOAT, 3, var_dims, var_id);
+		iret = ncmpi_def_var(ncid, "eta1", tipo_var, 3, var_dims, var_id);
 		check_err(iret);
 		iret = ncmpi_put_att_text(ncid, *var_id, "units", 6, "meters");
 		check_err(iret);
@@ -109,7 +269,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 		check_err(iret);
 	}
 	else if (nvar == 2) {
-		iret = ncmpi_def_var(ncid, "q1x", NC_FLOAT, 3, var_dims, var_id);
+		iret = ncmpi_def_var(ncid, "q1x", tipo_var, 3, var_dims, var_id);
 		check_err(iret);
 		iret = ncmpi_put_att_text(ncid, *var_id, "units", 13, "meters/second");
 		check_err(iret);
@@ -117,7 +277,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 		check_err(iret);
 	}
 	else if (nvar == 3) {
-		iret = ncmpi_def_var(ncid, "q1y", NC_FLOAT, 3, var_dims, var_id);
+		iret = ncmpi_def_var(ncid, "q1y", tipo_var, 3, var_dims, var_id);
 		check_err(iret);
 		iret = ncmpi_put_att_text(ncid, *var_id, "units", 13, "meters/second");
 		check_err(iret);
@@ -125,7 +285,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 		check_err(iret);
 	}
 	else if (nvar == 4) {
-		iret = ncmpi_def_var(ncid, "eta2", NC_FLOAT, 3, var_dims, var_id);
+		iret = ncmpi_def_var(ncid, "eta2", tipo_var, 3, var_dims, var_id);
 		check_err(iret);
 		iret = ncmpi_put_att_text(ncid, *var_id, "units", 6, "meters");
 		check_err(iret);
@@ -133,7 +293,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 		check_err(iret);
 	}
 	else if (nvar == 5) {
-		iret = ncmpi_def_var(ncid, "q2x", NC_FLOAT, 3, var_dims, var_id);
+		iret = ncmpi_def_var(ncid, "q2x", tipo_var, 3, var_dims, var_id);
 		check_err(iret);
 		iret = ncmpi_put_att_text(ncid, *var_id, "units", 13, "meters/second");
 		check_err(iret);
@@ -141,7 +301,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 		check_err(iret);
 	}
 	else if (nvar == 6) {
-		iret = ncmpi_def_var(ncid, "q2y", NC_FLOAT, 3, var_dims, var_id);
+		iret = ncmpi_def_var(ncid, "q2y", tipo_var, 3, var_dims, var_id);
 		check_err(iret);
 		iret = ncmpi_put_att_text(ncid, *var_id, "units", 13, "meters/second");
 		check_err(iret);
@@ -196,10 +356,7 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 	check_err(iret);
 	iret = ncmpi_put_att_text(ncid, *time_id, "units", 24, "seconds since 1970-01-01");
 	check_err(iret);
-	iret = ncmpi_put_att_float(ncid, *var_id, "missing_value", NC_FLOAT, 1, &fill_float);
-	check_err(iret);
-	iret = ncmpi_put_att_float(ncid, *var_id, "_FillValue", NC_FLOAT, 1, &fill_float);
-	check_err(iret);
+	definirAtributosValorNC(ncid, *var_id, precision);
 
 	// Atributos globales
 	iret = ncmpi_put_att_text(ncid, NC_GLOBAL, "Conventions", 6, "CF-1.0");
@@ -270,9 +427,9 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 	iret = ncmpi_put_var_float_all(ncid, y_id, y);
 	check_err(iret);
 
-	// Guardamos la batimetría
+	// Guardamos la batimetría (en la malla original, si hay recorte)
 	if (nvar == 1) {
-		MPI_Offset start[] = {id_hebra*num_voly_otros, 0};
+		MPI_Offset start[] = {recorte->fila_ini + id_hebra*num_voly_otros, recorte->col_ini};
 		MPI_Offset count[] = {num_voly, num_volx};
 		iret = ncmpi_put_var_float_all(ncid, grid_x_id, x_grid);
 		check_err(iret);
@@ -280,53 +437,70 @@ void fgennc(int id_hebra, float *x_grid, float *y_grid, float *x, float *y, char
 		check_err(iret);
 		iret = ncmpi_put_vara_float_all(ncid, grid_id, start, count, bati);
 		check_err(iret);
+		if (hay_recorte_nc) {
+			rellenarRecorteNC(ncid, grid_id, -1, 0.0, id_hebra*num_voly_otros, num_voly, num_volx, num_voly_total,
+				recorte->col_ini, recorte->fila_ini, recorte->num_volx_orig, recorte->num_voly_orig);
+		}
 	}
 }
 
-void initNC(int id_hebra, char *nombre_bati, char *prefijo, int num_volx, int num_voly, int num_voly_otros,
-			int num_voly_total, int *nx_nc, int *ny_nc, int npics, float xmin, float ymin, float ancho_vol,
+// Crea los ficheros NetCDF de las variables i con guardar[i] != 0. npics[i] es el diezmado de la
+// variable i y precision[i] su precisión si se guarda cuantizada (0 si se guarda en float). En
+// nx_nc[i] y ny_nc[i] se devuelve su número de volúmenes en x e y en el fichero. Es colectiva en
+// comm (los procesos que escriben los ficheros); bati tiene las num_voly filas de la batimetría
+// a partir de la fila id_hebra*num_voly_otros. Si hay recorte (ver TRecorte), xmin, ymin y los
+// volúmenes son los de la malla recortada, que se guarda dentro de la malla original; nx_nc y
+// ny_nc son los de la malla recortada
+void initNC(MPI_Comm comm, int id_hebra, char *nombre_bati, char *prefijo, int num_volx, int num_voly, int num_voly_otros,
+			int num_voly_total, int *guardar, double *precision, int *nx_nc, int *ny_nc, int *npics, float xmin, float ymin, float ancho_vol,
 			float alto_vol, float tiempo_tot, float CFL, float r, float angulo1, float angulo2, float angulo3,
-			float angulo4, float mfc, float mf0, float mfs, float vmax1, float vmax2, float *bati)
+			float angulo4, float mfc, float mf0, float mfs, float vmax1, float vmax2, float *bati, TRecorte *recorte)
 {
 	float *x_grid, *y_grid;
 	float *x, *y;
-	int i;
+	// Esquina de la malla original
+	float xmin_orig = xmin - recorte->col_ini*ancho_vol;
+	float ymin_orig = ymin - recorte->fila_ini*alto_vol;
+	int i, nvar;
 
 	ErrorEnNetCDF = false;
-	*nx_nc = (num_volx-1)/npics + 1;
-	*ny_nc = (num_voly_total-1)/npics + 1;
-	x_grid = (float *) malloc(num_volx*sizeof(float));
-	y_grid = (float *) malloc(num_voly_total*sizeof(float));
-	x = (float *) malloc((*nx_nc)*sizeof(float));
-	y = (float *) malloc((*ny_nc)*sizeof(float));
-
-	for (i=0; i<num_volx; i++)
-		x_grid[i] = xmin + (i + 0.5)*ancho_vol;
-	for (i=0; i<num_voly_total; i++)
-		y_grid[i] = ymin + (i + 0.5)*alto_vol;
-	for (i=0; i<(*nx_nc); i++)
-		x[i] = xmin + (i*npics + 0.5)*ancho_vol;
-	for (i=0; i<(*ny_nc); i++)
-		y[i] = ymin + (i*npics + 0.5)*alto_vol;
-
-	fgennc(id_hebra, x_grid, y_grid, x, y, nombre_bati, prefijo, 1, &ncid_eta1, &time_eta1_id, &eta1_id, *nx_nc,
-		*ny_nc, num_volx, num_voly, num_voly_otros, num_voly_total, xmin, ymin, ancho_vol, alto_vol, tiempo_tot,
-		CFL, r, angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, bati);
-	fgennc(id_hebra, x_grid, y_grid, x, y, nombre_bati, prefijo, 2, &ncid_q1x, &time_q1x_id, &q1x_id, *nx_nc,
-		*ny_nc, num_volx, num_voly, num_voly_otros, num_voly_total, xmin, ymin, ancho_vol, alto_vol, tiempo_tot,
-		CFL, r, angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, bati);
-	fgennc(id_hebra, x_grid, y_grid, x, y, nombre_bati, prefijo, 3, &ncid_q1y, &time_q1y_id, &q1y_id, *nx_nc,
-		*ny_nc, num_volx, num_voly, num_voly_otros, num_voly_total, xmin, ymin, ancho_vol, alto_vol, tiempo_tot,
-		CFL, r, angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, bati);
-	fgennc(id_hebra, x_grid, y_grid, x, y, nombre_bati, prefijo, 4, &ncid_eta2, &time_eta2_id, &eta2_id, *nx_nc,
-		*ny_nc, num_volx, num_voly, num_voly_otros, num_voly_total, xmin, ymin, ancho_vol, alto_vol, tiempo_tot,
-		CFL, r, angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, bati);
-	fgennc(id_hebra, x_grid, y_grid, x, y, nombre_bati, prefijo, 5, &ncid_q2x, &time_q2x_id, &q2x_id, *nx_nc,
-		*ny_nc, num_volx, num_voly, num_voly_otros, num_voly_total, xmin, ymin, ancho_vol, alto_vol, tiempo_tot,
-		CFL, r, angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, bati);
-	fgennc(id_hebra, x_grid, y_grid, x, y, nombre_bati, prefijo, 6, &ncid_q2y, &time_q2y_id, &q2y_id, *nx_nc,
-		*ny_nc, num_volx, num_voly, num_voly_otros, num_voly_total, xmin, ymin, ancho_vol, alto_vol, tiempo_tot,
-		CFL, r, angulo1, angulo2, angulo3, angulo4, mfc, mf0, mfs, vmax1, vmax2, bati);
+	hay_recorte_nc = (recorte->col_ini > 0) || (recorte->fila_ini > 0) || (recorte->num_volx_orig != num_volx) ||
+		(recorte->num_voly_orig != num_voly_total);
+	x_grid = (float *) malloc(recorte->num_volx_orig*sizeof(float));
+	y_grid = (float *) malloc(recorte->num_voly_orig*sizeof(float));
+	x = (float *) malloc(recorte->num_volx_orig*sizeof(float));
+	y = (float *) malloc(recorte->num_voly_orig*sizeof(float));
+
+	for (i=0; i<recorte->num_volx_orig; i++)
+		x_grid[i] = xmin_orig + (i + 0.5)*ancho_vol;
+	for (i=0; i<recorte->num_voly_orig; i++)
+		y_grid[i] = ymin_orig + (i + 0.5)*alto_vol;
+
+	for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+		nx_nc[nvar] = (num_volx-1)/npics[nvar] + 1;
+		ny_nc[nvar] = (num_voly_total-1)/npics[nvar] + 1;
+		// El recorte empieza en un volumen que se guarda (ver TRecorte)
+		nx_rec_nc[nvar] = nx_nc[nvar];
+		ny_rec_nc[nvar] = ny_nc[nvar];
+		nx_orig_nc[nvar] = (recorte->num_volx_orig-1)/npics[nvar] + 1;
+		ny_orig_nc[nvar] = (recorte->num_voly_orig-1)/npics[nvar] + 1;
+		desp_x_nc[nvar] = recorte->col_ini/npics[nvar];
+		desp_y_nc[nvar] = recorte->fila_ini/npics[nvar];
+		guardar_vars[nvar] = guardar[nvar];
+		precision_vars[nvar] = (float) precision[nvar];
+		if (! guardar[nvar])
+			continue;
+		for (i=0; i<nx_orig_nc[nvar]; i++)
+			x[i] = xmin_orig + (i*npics[nvar] + 0.5)*ancho_vol;
+		for (i=0; i<ny_orig_nc[nvar]; i++)
+			y[i] = ymin_orig + (i*npics[nvar] + 0.5)*alto_vol;
+
+		// En fgennc las variables se numeran desde 1
+		fgennc(comm, id_hebra, x_grid, y_grid, x, y, nombre_bati, prefijo, nvar+1, ncid_vars+nvar, time_ids+nvar,
+			var_ids+nvar, precision_vars[nvar], nx_orig_nc[nvar], ny_orig_nc[nvar], num_volx, num_voly, num_voly_otros,
+			num_voly_total, xmin, ymin, ancho_vol, alto_vol, tiempo_tot, CFL, r, angulo1, angulo2, angulo3, angulo4,
+			mfc, mf0, mfs, vmax1, vmax2, bati, recorte);
+	}
 
 	free(x_grid);
 	free(y_grid);
@@ -334,79 +508,237 @@ void initNC(int id_hebra, char *nombre_bati, char *prefijo, int num_volx, int nu
 	free(y);
 }
 
-void writerecs(int nx_nc, int ny_nc, int iniy_nc, int ncid, int time_id, int var_id, int paso,
-				float tiempo_act, float *var)
+void writerecs(int nvar, int nx_nc, int ny_nc, int iniy_nc, int ncid, int time_id, int var_id, int paso,
+				TTiempo tiempo_act, float precision, float *var)
 {
 	int iret;
-	float t_act = tiempo_act;
+	TTiempo t_act = tiempo_act;
 	MPI_Offset num = paso;
 	MPI_Offset uno = 1;
-	MPI_Offset start[] = {num, iniy_nc, 0};
+	MPI_Offset start[] = {num, iniy_nc + desp_y_nc[nvar], desp_x_nc[nvar]};
 	MPI_Offset count[] = {1, ny_nc, nx_nc};
 
 	// Guardamos el tiempo
-	iret = ncmpi_put_vara_float_all(ncid, time_id, &num, &uno, &t_act);
+	iret = ncmpi_put_vara_tiempo_all(ncid, time_id, &num, &uno, &t_act);
 	check_err(iret);
 
 	// Guardamos la variable var
-	iret = ncmpi_put_vara_float_all(ncid, var_id, start, count, var);
-	check_err(iret);
+	ponerVariableNC(ncid, var_id, start, count, precision, var);
+	if (hay_recorte_nc) {
+		rellenarRecorteNC(ncid, var_id, num, precision, iniy_nc, ny_nc, nx_rec_nc[nvar], ny_rec_nc[nvar],
+			desp_x_nc[nvar], desp_y_nc[nvar], nx_orig_nc[nvar], ny_orig_nc[nvar]);
+	}
 
 	iret = ncmpi_sync(ncid);
 	check_err(iret);
 }
 
-void writeEta1NC(int nx_nc, int ny_nc, int iniy_nc, int num, float tiempo_act, float *eta1)
+// Guarda el estado num de la variable nvar (en el orden eta1, q1x, q1y, eta2, q2x, q2y)
+void writeVarNC(int nvar, int nx_nc, int ny_nc, int iniy_nc, int num, TTiempo tiempo_act, float *var)
 {
-	writerecs(nx_nc, ny_nc, iniy_nc, ncid_eta1, time_eta1_id, eta1_id, num, tiempo_act, eta1);
+	writerecs(nvar, nx_nc, ny_nc, iniy_nc, ncid_vars[nvar], time_ids[nvar], var_ids[nvar], num, tiempo_act,
+		precision_vars[nvar], var);
 }
 
-void writeQ1xNC(int nx_nc, int ny_nc, int iniy_nc, int num, float tiempo_act, float *q1x)
+void closeNC(int nx_nc, int ny_nc, int iniy_nc, float *eta1_max)
 {
-	writerecs(nx_nc, ny_nc, iniy_nc, ncid_q1x, time_q1x_id, q1x_id, num, tiempo_act, q1x);
-}
+	MPI_Offset start[] = {iniy_nc + desp_y_nc[0], desp_x_nc[0]};
+	MPI_Offset count[] = {ny_nc, nx_nc};
+	int iret, nvar;
 
-void writeQ1yNC(int nx_nc, int ny_nc, int iniy_nc, int num, float tiempo_act, float *q1y)
-{
-	writerecs(nx_nc, ny_nc, iniy_nc, ncid_q1y, time_q1y_id, q1y_id, num, tiempo_act, q1y);
+	// Guardamos eta1 máxima (con el diezmado de eta1), si se guarda eta1
+	if (guardar_vars[0]) {
+		iret = ncmpi_put_vara_float_all(ncid_vars[0], eta1_max_id, start, count, eta1_max);
+		check_err(iret);
+		if (hay_recorte_nc) {
+			rellenarRecorteNC(ncid_vars[0], eta1_max_id, -1, 0.0, iniy_nc, ny_nc, nx_rec_nc[0], ny_rec_nc[0],
+				desp_x_nc[0], desp_y_nc[0], nx_orig_nc[0], ny_orig_nc[0]);
+		}
+	}
+	// Cerramos los ficheros
+	for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+		if (guardar_vars[nvar]) {
+			iret = ncmpi_close(ncid_vars[nvar]);
+			check_err(iret);
+		}
+	}
+	free(buffer_cuantizado);
+	buffer_cuantizado = NULL;
+	tam_buffer_cuantizado = 0;
 }
 
-void writeEta2NC(int nx_nc, int ny_nc, int iniy_nc, int num, float tiempo_act, float *eta2)
+// Añade a los ficheros de las variables guardadas los atributos globales stop_reason y stop_time
+// (seg), cuando la simulación termina antes del tiempo final (ver la opción parada_velocidad)
+void escribirParadaNC(char *motivo, TTiempo tiempo)
 {
-	writerecs(nx_nc, ny_nc, iniy_nc, ncid_eta2, time_eta2_id, eta2_id, num, tiempo_act, eta2);
-}
+	double val_double = tiempo;
+	int iret, nvar;
 
-void writeQ2xNC(int nx_nc, int ny_nc, int iniy_nc, int num, float tiempo_act, float *q2x)
-{
-	writerecs(nx_nc, ny_nc, iniy_nc, ncid_q2x, time_q2x_id, q2x_id, num, tiempo_act, q2x);
+	for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+		if (! guardar_vars[nvar])
+			continue;
+		iret = ncmpi_redef(ncid_vars[nvar]);
+		check_err(iret);
+		iret = ncmpi_put_att_text(ncid_vars[nvar], NC_GLOBAL, "stop_reason", strlen(motivo), motivo);
+		check_err(iret);
+		iret = ncmpi_put_att_double(ncid_vars[nvar], NC_GLOBAL, "stop_time", NC_DOUBLE, 1, &val_double);
+		check_err(iret);
+		iret = ncmpi_enddef(ncid_vars[nvar]);
+		check_err(iret);
+	}
 }
 
-void writeQ2yNC(int nx_nc, int ny_nc, int iniy_nc, int num, float tiempo_act, float *q2y)
+// Inicializa la región de interés k (numerada desde 0) a partir de reg, cuyos límites están en las
+// mismas unidades que xmin, ymin, ancho_vol y alto_vol. fila_ini es la primera fila del cluster en
+// la malla. Es colectiva: todos los procesos deben llamarla. Si ningún volumen tiene el centro
+// dentro de la región, no se crea el fichero y comm es MPI_COMM_NULL en todos los procesos
+void initRegionNC(int k, TRegion *reg, TRegionNC *rnc, char *prefijo, int *guardar, double *precision, int id_hebra, int num_volx,
+			int num_voly, int fila_ini, int num_voly_total, float xmin, float ymin, float ancho_vol, float alto_vol, TTiempo intervalo)
 {
-	writerecs(nx_nc, ny_nc, iniy_nc, ncid_q2y, time_q2y_id, q2y_id, num, tiempo_act, q2y);
-}
+	char nombre_fich[256];
+	char cadena[256];
+	int x_dim, y_dim, time_dim;
+	int var_dims[3];
+	int x_id, y_id;
+	int finx, finy, fin_local;
+	int i, nvar, iret;
+	float *x, *y;
 
-void closeNC(int nx_nc, int ny_nc, int iniy_nc, float *eta1_max)
-{
-	MPI_Offset start[] = {iniy_nc, 0};
-	MPI_Offset count[] = {ny_nc, nx_nc};
-	int iret;
+	// Volúmenes cuyo centro está dentro de la región
+	rnc->inix = max(0, (int) ceil((reg->xmin - xmin)/ancho_vol - 0.5));
+	finx = min(num_volx-1, (int) floor((reg->xmax - xmin)/ancho_vol - 0.5));
+	rnc->iniy = max(0, (int) ceil((reg->ymin - ymin)/alto_vol - 0.5));
+	finy = min(num_voly_total-1, (int) floor((reg->ymax - ymin)/alto_vol - 0.5));
+	rnc->nx = max(0, finx - rnc->inix + 1);
+	rnc->ny = max(0, finy - rnc->iniy + 1);
+
+	// Filas de la región en este proceso
+	rnc->iniy_local = max(rnc->iniy, fila_ini) - fila_ini;
+	fin_local = min(finy, fila_ini + num_voly - 1) - fila_ini;
+	rnc->ny_local = ((rnc->nx > 0) && (fin_local >= rnc->iniy_local)) ? fin_local - rnc->iniy_local + 1 : 0;
+	rnc->iniy_nc = fila_ini + rnc->iniy_local - rnc->iniy;
+	rnc->num = 0;
+	rnc->intervalo = intervalo;
+	rnc->sig_tiempo = 0.0;
+	for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+		rnc->guardar[nvar] = guardar[nvar];
+		rnc->precision[nvar] = (float) precision[nvar];
+	}
 
-	// Guardamos eta1 máxima
-	iret = ncmpi_put_vara_float_all(ncid_eta1, eta1_max_id, start, count, eta1_max);
+	MPI_Comm_split(comm_calculo, (rnc->ny_local > 0) ? 1 : MPI_UNDEFINED, id_hebra, &(rnc->comm));
+	if ((id_hebra == 0) && ((rnc->nx == 0) || (rnc->ny == 0)))
+		fprintf(stderr, "Aviso: La region %d no contiene ningun volumen y no se guardara\n", k+1);
+	if (rnc->comm == MPI_COMM_NULL)
+		return;
+
+	sprintf(nombre_fich, "%s_region%d.nc", prefijo, k+1);
+	iret = ncmpi_create(rnc->comm, nombre_fich, NC_CLOBBER, MPI_INFO_NULL, &(rnc->ncid));
 	check_err(iret);
-	// Cerramos los ficheros
-	iret = ncmpi_close(ncid_eta1);
+
+	// Dimensiones y variables
+	iret = ncmpi_def_dim(rnc->ncid, "lon", rnc->nx, &x_dim);
+	check_err(iret);
+	iret = ncmpi_def_dim(rnc->ncid, "lat", rnc->ny, &y_dim);
+	check_err(iret);
+	iret = ncmpi_def_dim(rnc->ncid, "time", NC_UNLIMITED, &time_dim);
+	check_err(iret);
+	iret = ncmpi_def_var(rnc->ncid, "lon", NC_FLOAT, 1, &x_dim, &x_id);
+	check_err(iret);
+	iret = ncmpi_def_var(rnc->ncid, "lat", NC_FLOAT, 1, &y_dim, &y_id);
+	check_err(iret);
+	iret = ncmpi_def_var(rnc->ncid, "time", NC_TIEMPO, 1, &time_dim, &(rnc->time_id));
+	check_err(iret);
+	var_dims[0] = time_dim;
+	var_dims[1] = y_dim;
+	var_dims[2] = x_dim;
+	for (nvar=0; nvar<NUM_VARIABLES; nvar++) {
+		if (! guardar[nvar])
+			continue;
+		iret = ncmpi_def_var(rnc->ncid, nombres_nc[nvar], (rnc->precision[nvar] > 0.0) ? NC_SHORT : NC_FLOAT, 3,
+					var_dims, rnc->var_id+nvar);
+		check_err(iret);
+		iret = ncmpi_put_att_text(rnc->ncid, rnc->var_id[nvar], "units", strlen(unidades_nc[nvar]), unidades_nc[nvar]);
+		check_err(iret);
+		iret = ncmpi_put_att_text(rnc->ncid, rnc->var_id[nvar], "long_name", strlen(descripciones_nc[nvar]),
+					descripciones_nc[nvar]);
+		check_err(iret);
+		definirAtributosValorNC(rnc->ncid, rnc->var_id[nvar], rnc->precision[nvar]);
+	}
+
+	// Atributos
+	iret = ncmpi_put_att_text(rnc->ncid, x_id, "long_name", 6, "x axis");
+	check_err(iret);
+	iret = ncmpi_put_att_text(rnc->ncid, x_id, "units", 6, "meters");
 	check_err(iret);
-	iret = ncmpi_close(ncid_q1x);
+	iret = ncmpi_put_att_text(rnc->ncid, y_id, "long_name", 6, "y axis");
 	check_err(iret);
-	iret = ncmpi_close(ncid_q1y);
+	iret = ncmpi_put_att_text(rnc->ncid, y_id, "units", 6, "meters");
 	check_err(iret);
-	iret = ncmpi_close(ncid_eta2);
+	iret = ncmpi_put_att_text(rnc->ncid, rnc->time_id, "long_name", 4, "Time");
 	check_err(iret);
-	iret = ncmpi_close(ncid_q2x);
+	iret = ncmpi_put_att_text(rnc->ncid, rnc->time_id, "units", 24, "seconds since 1970-01-01");
 	check_err(iret);
-	iret = ncmpi_close(ncid_q2y);
+	iret = ncmpi_put_att_text(rnc->ncid, NC_GLOBAL, "Conventions", 6, "CF-1.0");
 	check_err(iret);
+	iret = ncmpi_put_att_text(rnc->ncid, NC_GLOBAL, "title", 25, "TsunamiHySEA model output");
+	check_err(iret);
+	sprintf(cadena, "%f, %f, %f, %f", reg->xmin, reg->xmax, reg->ymin, reg->ymax);
+	iret = ncmpi_put_att_text(rnc->ncid, NC_GLOBAL, "region", strlen(cadena), cadena);
+	check_err(iret);
+	iret = ncmpi_enddef(rnc->ncid);
+	check_err(iret);
+
+	// Guardamos x e y
+	x = (float *) malloc(rnc->nx*sizeof(float));
+	y = (float *) malloc(rnc->ny*sizeof(float));
+	for (i=0; i<rnc->nx; i++)
+		x[i] = xmin + (rnc->inix + i + 0.5)*ancho_vol;
+	for (i=0; i<rnc->ny; i++)
+		y[i] = ymin + (rnc->iniy + i + 0.5)*alto_vol;
+	iret = ncmpi_put_var_float_all(rnc->ncid, x_id, x);
+	check_err(iret);
+	iret = ncmpi_put_var_float_all(rnc->ncid, y_id, y);
+	check_err(iret);
+	free(x);
+	free(y);
+}
+
+// Guarda la variable nvar del estado actual de la región (debe ser una de las que se guardan).
+// var contiene las ny_local filas de nx volúmenes de la región en este proceso. Sólo la llaman
+// los procesos de rnc->comm
+void writeVarRegionNC(TRegionNC *rnc, int nvar, float *var)
+{
+	MPI_Offset start[] = {rnc->num, rnc->iniy_nc, 0};
+	MPI_Offset count[] = {1, rnc->ny_local, rnc->nx};
+
+	ponerVariableNC(rnc->ncid, rnc->var_id[nvar], start, count, rnc->precision[nvar], var);
+}
+
+// Guarda el tiempo del estado actual de la región y pasa al siguiente estado. Se llama después
+// de guardar las variables. Sólo la llaman los procesos de rnc->comm
+void writeTiempoRegionNC(TRegionNC *rnc, TTiempo tiempo_act)
+{
+	TTiempo t_act = tiempo_act;
+	MPI_Offset num = rnc->num;
+	MPI_Offset uno = 1;
+	int iret;
+
+	iret = ncmpi_put_vara_tiempo_all(rnc->ncid, rnc->time_id, &num, &uno, &t_act);
+	check_err(iret);
+	iret = ncmpi_sync(rnc->ncid);
+	check_err(iret);
+	rnc->num++;
+}
+
+// Cierra el fichero de la región y libera su comunicador
+void closeRegionNC(TRegionNC *rnc)
+{
+	int iret;
+
+	if (rnc->comm != MPI_COMM_NULL) {
+		iret = ncmpi_close(rnc->ncid);
+		check_err(iret);
+		MPI_Comm_free(&(rnc->comm));
+	}
 }
 
@@ -0,0 +1,148 @@
+// Consumidor de prueba de los campos publicados en memoria compartida (opcin memoria_compartida,
+// ver GPU/MemoriaCompartida.hxx). Se ejecuta en el mismo nodo que la simulacin, proyecta los
+// segmentos de todos los procesos y muestra, en cada guardado, los mximos de los campos sin
+// copiarlos. Termina cuando la simulacin ha publicado los campos finales
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "GPU/MemoriaCompartida.hxx"
+
+// Proyecta en memoria (slo lectura) el segmento del proceso id_hebra. Espera a que exista y
+// tenga la cabecera escrita. Devuelve NULL si no es un segmento vlido
+TCabeceraMemoria *abrirSegmento(char *nombre, int id_hebra)
+{
+	char nombre_seg[512];
+	struct stat st;
+	void *p;
+	TCabeceraMemoria *cab;
+	int fd;
+
+	sprintf(nombre_seg, "%s.%d", nombre, id_hebra);
+	do {
+		fd = (nombre[0] == '/') ? shm_open(nombre_seg, O_RDONLY, 0) : open(nombre_seg, O_RDONLY);
+		if (fd == -1)
+			usleep(100000);
+	} while (fd == -1);
+	do {
+		fstat(fd, &st);
+		if (st.st_size < (off_t) sizeof(TCabeceraMemoria))
+			usleep(100000);
+	} while (st.st_size < (off_t) sizeof(TCabeceraMemoria));
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Error: No se ha podido proyectar '%s'\n", nombre_seg);
+		return NULL;
+	}
+	cab = (TCabeceraMemoria *) p;
+	while (cab->magico != MAGICO_MEMORIA)
+		usleep(100000);
+	__sync_synchronize();
+	if ((cab->version != VERSION_MEMORIA) || (cab->num_campos != NUM_CAMPOS_MEMORIA) ||
+		(cab->tam > (unsigned long long) st.st_size)) {
+		fprintf(stderr, "Error: '%s' no es valido (version %u, se esperaba %d)\n", nombre_seg, cab->version, VERSION_MEMORIA);
+		return NULL;
+	}
+
+	return cab;
+}
+
+// Lee los campos del segmento cab sin copiarlos y acumula en val_max los mximos de eta1, |q1|
+// y eta1 mxima. Repite la lectura si el proceso ha escrito mientras tanto. Devuelve el nmero
+// de guardado ledo y pone en tiempo su tiempo y en terminado si es el final
+int leerSegmento(TCabeceraMemoria *cab, float *val_max, double *tiempo, int *terminado)
+{
+	unsigned int sec;
+	int i, num_guardado;
+	int num_volumenes = cab->num_volx*cab->num_voly;
+	float *campos = (float *) (((char *) cab) + cab->desp_datos);
+	float *eta1 = campos + CAMPO_ETA1*num_volumenes;
+	float *q1x = campos + CAMPO_Q1X*num_volumenes;
+	float *q1y = campos + CAMPO_Q1Y*num_volumenes;
+	float *eta1_max = campos + CAMPO_ETA1_MAX*num_volumenes;
+	float m[3];
+
+	do {
+		while ((sec = cab->secuencia) % 2 != 0)
+			usleep(1000);
+		__sync_synchronize();
+		m[0] = m[1] = m[2] = -1e30f;
+		for (i=0; i<num_volumenes; i++) {
+			m[0] = fmaxf(m[0], eta1[i]);
+			m[1] = fmaxf(m[1], sqrtf(q1x[i]*q1x[i] + q1y[i]*q1y[i]));
+			m[2] = fmaxf(m[2], eta1_max[i]);
+		}
+		num_guardado = cab->num_guardado;
+		*tiempo = cab->tiempo;
+		*terminado = cab->terminado;
+		__sync_synchronize();
+	} while (cab->secuencia != sec);
+
+	for (i=0; i<3; i++)
+		val_max[i] = fmaxf(val_max[i], m[i]);
+
+	return num_guardado;
+}
+
+int main(int argc, char *argv[])
+{
+	TCabeceraMemoria **cab;
+	int i, num_procs;
+	int num_guardado, ultimo_guardado = 0;
+	int terminado, todos_terminados = 0;
+	double tiempo = 0.0, tiempo_proc;
+	float val_max[3];
+
+	if (argc < 2) {
+		fprintf(stderr, "Uso: %s nombre\n", argv[0]);
+		fprintf(stderr, "\tnombre: el valor de la opcion memoria_compartida de la simulacion\n");
+		return 1;
+	}
+
+	cab = (TCabeceraMemoria **) malloc(sizeof(TCabeceraMemoria *));
+	cab[0] = abrirSegmento(argv[1], 0);
+	if (cab[0] == NULL)
+		return 1;
+	num_procs = cab[0]->num_procs;
+	cab = (TCabeceraMemoria **) realloc(cab, num_procs*sizeof(TCabeceraMemoria *));
+	for (i=1; i<num_procs; i++) {
+		cab[i] = abrirSegmento(argv[1], i);
+		if (cab[i] == NULL)
+			return 1;
+	}
+	printf("Malla de %d x %d volumenes en %d procesos\n", cab[0]->num_volx, cab[0]->num_voly_total, num_procs);
+
+	while (! todos_terminados) {
+		// Esperamos a que todos los procesos hayan publicado un guardado nuevo
+		num_guardado = ultimo_guardado+1;
+		for (i=0; i<num_procs; i++) {
+			while ((cab[i]->num_guardado < num_guardado) && (! cab[i]->terminado))
+				usleep(10000);
+		}
+
+		val_max[0] = val_max[1] = val_max[2] = -1e30f;
+		todos_terminados = 1;
+		for (i=0; i<num_procs; i++) {
+			num_guardado = leerSegmento(cab[i], val_max, &tiempo_proc, &terminado);
+			if (i == 0) {
+				ultimo_guardado = num_guardado;
+				tiempo = tiempo_proc;
+			}
+			todos_terminados = todos_terminados && terminado;
+		}
+		printf("Guardado %d%s, tiempo %g seg: eta1 maxima %e m, |q1| maximo %e m2/s, eta1 maxima acumulada %e m\n",
+			ultimo_guardado, todos_terminados ? " (final)" : "", tiempo, val_max[0], val_max[1], val_max[2]);
+	}
+
+	for (i=0; i<num_procs; i++)
+		munmap((void *) cab[i], cab[i]->tam);
+	free(cab);
+
+	return 0;
+}
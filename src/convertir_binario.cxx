@@ -0,0 +1,104 @@
+// Convierte los ficheros de texto de topografa y estado inicial al formato binario por bloques
+// de filas (ver GPU/FicheroBinario.hxx), que se usa poniendo 2 en "Leer condiciones iniciales
+// de fichero". Slo mantiene en memoria un bloque de filas
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <iostream>
+#include "GPU/FicheroBinario.hxx"
+
+using namespace std;
+
+// Filas por bloque por defecto
+#define FILAS_BLOQUE 64
+
+int main(int argc, char *argv[])
+{
+	TCabeceraBinario cab;
+	ifstream fich_topo, fich_est;
+	FILE *fp;
+	unsigned long long *desp_bloques;
+	unsigned long long desp;
+	float *bloque;
+	double val;
+	int b, i, j, filas, num_vols;
+
+	if (argc < 4) {
+		cerr << "Uso: " << argv[0] << " ficheroTopografia ficheroEstadoInicial ficheroBinario [filasBloque]" << endl;
+		cerr << "\tfilasBloque: filas de la malla por bloque (por defecto " << FILAS_BLOQUE << ")" << endl;
+		return 1;
+	}
+
+	fich_topo.open(argv[1]);
+	fich_est.open(argv[2]);
+	if ((! fich_topo.is_open()) || (! fich_est.is_open())) {
+		cerr << "Error: No se han podido abrir los ficheros de entrada" << endl;
+		return 1;
+	}
+	cab.magico = MAGICO_BINARIO;
+	cab.version = VERSION_BINARIO;
+	fich_topo >> cab.xmin;
+	fich_topo >> cab.xmax;
+	fich_topo >> cab.ymin;
+	fich_topo >> cab.ymax;
+	fich_topo >> cab.num_volx;
+	fich_topo >> cab.num_voly;
+	cab.filas_bloque = (argc > 4) ? atoi(argv[4]) : FILAS_BLOQUE;
+	if (cab.filas_bloque <= 0)
+		cab.filas_bloque = FILAS_BLOQUE;
+	cab.num_bloques = (cab.num_voly + cab.filas_bloque - 1)/cab.filas_bloque;
+	cab.num_variables = NUM_VARIABLES_BINARIO;
+	cab.escala_H = cab.escala_Q = 1.0;
+
+	fp = fopen(argv[3], "wb");
+	if (fp == NULL) {
+		cerr << "Error: No se ha podido crear el fichero '" << argv[3] << "'" << endl;
+		return 1;
+	}
+	desp_bloques = (unsigned long long *) malloc(cab.num_bloques*sizeof(unsigned long long));
+	bloque = (float *) malloc(((size_t) cab.filas_bloque)*cab.num_volx*NUM_VARIABLES_BINARIO*sizeof(float));
+	if ((desp_bloques == NULL) || (bloque == NULL)) {
+		cerr << "Error: No hay memoria suficiente" << endl;
+		return 1;
+	}
+
+	// La cabecera y el ndice se escriben al final, cuando se conocen los desplazamientos
+	desp = sizeof(TCabeceraBinario) + cab.num_bloques*sizeof(unsigned long long);
+	fseeko(fp, desp, SEEK_SET);
+	for (b=0; b<cab.num_bloques; b++) {
+		filas = min(cab.filas_bloque, cab.num_voly - b*cab.filas_bloque);
+		num_vols = filas*cab.num_volx;
+		for (i=0; i<num_vols; i++) {
+			fich_topo >> val;
+			bloque[i*NUM_VARIABLES_BINARIO + VAR_H] = (float) val;
+			for (j=VAR_H1; j<NUM_VARIABLES_BINARIO; j++) {
+				fich_est >> val;
+				bloque[i*NUM_VARIABLES_BINARIO + j] = (float) val;
+			}
+		}
+		if ((! fich_topo) || (! fich_est)) {
+			cerr << "Error: Faltan datos en los ficheros de entrada" << endl;
+			return 1;
+		}
+		desp_bloques[b] = desp;
+		fwrite(bloque, sizeof(float), ((size_t) num_vols)*NUM_VARIABLES_BINARIO, fp);
+		desp += ((unsigned long long) num_vols)*NUM_VARIABLES_BINARIO*sizeof(float);
+	}
+	fseeko(fp, 0, SEEK_SET);
+	fwrite(&cab, sizeof(TCabeceraBinario), 1, fp);
+	fwrite(desp_bloques, sizeof(unsigned long long), cab.num_bloques, fp);
+	if (fclose(fp) != 0) {
+		cerr << "Error: No se ha podido escribir el fichero '" << argv[3] << "'" << endl;
+		return 1;
+	}
+	fich_topo.close();
+	fich_est.close();
+
+	cout << "Malla de " << cab.num_volx << " x " << cab.num_voly << " volumenes en " << cab.num_bloques
+		<< " bloques de " << cab.filas_bloque << " filas" << endl;
+	free(desp_bloques);
+	free(bloque);
+
+	return 0;
+}